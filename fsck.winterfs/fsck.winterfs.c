@@ -0,0 +1,3262 @@
+#define _GNU_SOURCE // O_DIRECT
+
+#include <byteswap.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WINTERFS_BLOCK_SIZE		4096
+#define WINTERFS_MIN_BLOCK_SIZE		4096
+#define WINTERFS_MAX_BLOCK_SIZE		65536
+
+#define WINTERFS_SUPERBLOCK_BLOCK_ADDR	0
+#define WINTERFS_INODES_BLOCK_ADDR	1
+#define WINTERFS_ROOT_INODE		1
+
+#define WINTERFS_INODE_DIRECT_BLOCKS	8
+#define WINTERFS_INODE_SIZE		128
+#define WINTERFS_INODE_SIZE_MAX		1024
+
+#define WINTERFS_REVISION_V1		1
+#define WINTERFS_REVISION_V2		2
+
+#define WINTERFS_FEATURE_DIR_INDEX	0x0001
+#define WINTERFS_FEATURE_DIRENT2	0x0002
+#define WINTERFS_FEATURE_UNWRITTEN	0x0004
+#define WINTERFS_FEATURE_LARGE_INODE	0x0008
+#define WINTERFS_FEATURE_INLINE_DATA	0x0010
+#define WINTERFS_FEATURE_BLOCK_SIZE	0x0020
+#define WINTERFS_FEATURE_LAZY_ITABLE	0x0040
+#define WINTERFS_FEATURE_RESERVED	0x0080
+#define WINTERFS_FEATURE_SUPPORTED	0x00ff
+
+#define WINTERFS_INODE_INDEX_FL		0x0001
+#define WINTERFS_INODE_INLINE_FL	0x0002
+
+#define WINTERFS_STATE_CLEAN		0x0001
+
+#define WINTERFS_EXTENT_MAGIC		0x5745
+#define WINTERFS_INODE_EXTENTS		3
+#define WINTERFS_EXTENT_MAX_DEPTH	3
+#define WINTERFS_EXTENT_MAX_LEN		0x7fffffff
+#define WINTERFS_EXTENT_UNWRITTEN	0x80000000
+
+#define WINTERFS_FILENAME_MAX_LEN	256
+#define WINTERFS_FILES_PER_DIR_BLOCK	(WINTERFS_MIN_BLOCK_SIZE / WINTERFS_FILENAME_MAX_LEN - 1)
+#define WINTERFS_DIRENT_LEN(name_len)	((sizeof(struct winterfs_dirent) + (name_len) + 3) & ~3u)
+
+#define WINTERFS_DX_MAGIC		0x5844
+#define WINTERFS_DX_MAX_LEVELS		1
+#define WINTERFS_DX_CONT		1 // key bit, the block continues the hash before it
+
+#define WINTERFS_FT_REG_FILE		1
+#define WINTERFS_FT_DIR			2
+
+// exit codes, as fsck(8) expects them
+#define FSCK_OK				0
+#define FSCK_NONDESTRUCT		1 // errors were corrected
+#define FSCK_UNCORRECTED		4 // errors were left uncorrected
+#define FSCK_ERROR			8 // operational error
+
+// bytes of inode table, or of a directory, read in one go by a worker
+#define FSCK_CHUNK_SIZE			(4 << 20)
+#define FSCK_THREADS_MIN		4
+#define FSCK_THREADS_MAX		64
+
+#define DIV_ROUND_UP(n, d)		(((n) + (d) - 1) / (d))
+#define MIN(a, b)			((a) < (b) ? (a) : (b))
+
+bool host_is_le()
+{
+	int x = 1;
+	return *(char *)&x == 1;
+}
+
+uint16_t le16(uint16_t val)
+{
+	if (!host_is_le()) {
+		return bswap_16(val);
+	}
+	return val;
+}
+
+uint32_t le32(uint32_t val)
+{
+	if (!host_is_le()) {
+		return bswap_32(val);
+	}
+	return val;
+}
+
+uint64_t le64(uint64_t val)
+{
+	if (!host_is_le()) {
+		return bswap_64(val);
+	}
+	return val;
+}
+
+struct winterfs_superblock {
+	uint8_t magic[4];
+	uint32_t num_inodes;
+	uint32_t num_blocks;
+	uint32_t free_inode_bitset_idx;
+	uint32_t free_block_bitset_idx;
+	uint32_t bad_block_bitset_idx;
+	uint32_t data_blocks_idx;
+	uint32_t revision;
+	uint32_t features;
+	uint32_t free_blocks;
+	uint32_t free_inodes;
+	uint32_t state;
+	uint32_t inode_size;
+	uint32_t block_size;
+	uint32_t reserved_blocks;
+	uint32_t hash_key[4];
+} __attribute__((packed));
+
+struct winterfs_extent_header {
+	uint16_t magic;
+	uint16_t entries;
+	uint16_t max;
+	uint16_t depth;
+} __attribute__((packed));
+
+struct winterfs_extent {
+	uint32_t block;
+	uint32_t len;
+	uint32_t start;
+} __attribute__((packed));
+
+struct winterfs_extent_idx {
+	uint32_t block;
+	uint32_t child;
+	uint32_t reserved;
+} __attribute__((packed));
+
+struct winterfs_extent_root {
+	struct winterfs_extent_header header;
+	struct winterfs_extent extents[WINTERFS_INODE_EXTENTS];
+} __attribute__((packed));
+
+struct winterfs_inode {
+	uint64_t size;
+	uint16_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint64_t create_time;
+	uint64_t modify_time;
+	uint64_t access_time;
+	uint32_t dir_block;
+	uint32_t dir_block_off;
+	uint32_t num_children; // only applicable for dirs
+	uint32_t flags;
+	uint8_t pad[26]; // reserved for metadata
+	union {
+		struct {
+			uint32_t direct_blocks[WINTERFS_INODE_DIRECT_BLOCKS];
+			uint32_t indirect_primary;
+			uint32_t indirect_secondary;
+			uint32_t indirect_tertiary;
+		} __attribute__((packed));
+		struct winterfs_extent_root extent_root;
+	};
+} __attribute__((packed));
+
+struct winterfs_filename {
+	uint8_t name[WINTERFS_FILENAME_MAX_LEN];
+} __attribute__((packed));
+
+// entry block used without the dirent2 feature
+struct winterfs_dir_block {
+	uint32_t inode_list[WINTERFS_FILES_PER_DIR_BLOCK];
+	uint8_t pad[WINTERFS_FILENAME_MAX_LEN - (sizeof(uint32_t) * WINTERFS_FILES_PER_DIR_BLOCK)];
+	struct winterfs_filename files[WINTERFS_FILES_PER_DIR_BLOCK];
+} __attribute__((packed));
+
+struct winterfs_dirent {
+	uint32_t inode;
+	uint16_t rec_len;
+	uint8_t name_len;
+	uint8_t file_type;
+	char name[];
+} __attribute__((packed));
+
+struct winterfs_dx_header {
+	uint16_t magic;
+	uint16_t levels; // root only
+	uint16_t count;
+	uint16_t limit;
+} __attribute__((packed));
+
+struct winterfs_dx_entry {
+	uint32_t hash;
+	uint32_t block;
+} __attribute__((packed));
+
+struct winterfs_dx_node {
+	struct winterfs_dx_header header;
+	struct winterfs_dx_entry entries[];
+} __attribute__((packed));
+
+// the low bits of rec_len hold bits 16 & 17, for records of a whole 64K block
+uint32_t rec_len_from_disk(uint16_t dlen)
+{
+	uint32_t len = le16(dlen);
+
+	return (len & 0xfffc) | ((len & 3) << 16);
+}
+
+uint16_t rec_len_to_disk(uint32_t len)
+{
+	return le16((len & 0xfffc) | ((len >> 16) & 3));
+}
+
+#define ROTL64(x, b)	(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND(v0, v1, v2, v3) do { \
+	v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+	v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+	v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+	v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+} while (0)
+
+// SipHash-2-4, as the kernel's siphash()
+uint64_t siphash(const void *data, size_t len, const uint64_t key[2])
+{
+	size_t i;
+	uint64_t m;
+	const uint8_t *p = data;
+	uint64_t v0 = 0x736f6d6570736575ULL ^ key[0];
+	uint64_t v1 = 0x646f72616e646f6dULL ^ key[1];
+	uint64_t v2 = 0x6c7967656e657261ULL ^ key[0];
+	uint64_t v3 = 0x7465646279746573ULL ^ key[1];
+	uint64_t b = (uint64_t)len << 56;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		for (m = 0, i = 0; i < 8; i++) {
+			m |= (uint64_t)p[i] << (i * 8);
+		}
+		v3 ^= m;
+		SIPROUND(v0, v1, v2, v3);
+		SIPROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+	for (i = 0; i < len; i++) {
+		b |= (uint64_t)p[i] << (i * 8);
+	}
+
+	v3 ^= b;
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	v0 ^= b;
+	v2 ^= 0xff;
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+bool test_bit_le(const uint8_t *bitset, uint32_t bit)
+{
+	return (bitset[bit / 8] >> (bit % 8)) & 1;
+}
+
+bool test_bit64(const uint64_t *map, uint32_t bit)
+{
+	return (map[bit / 64] >> (bit % 64)) & 1;
+}
+
+void set_bit64(uint64_t *map, uint32_t bit)
+{
+	map[bit / 64] |= 1ULL << (bit % 64);
+}
+
+void *xrealloc(void *ptr, size_t len)
+{
+	ptr = realloc(ptr, len ? len : 1);
+	if (!ptr) {
+		printf("Out of memory\n");
+		exit(FSCK_ERROR);
+	}
+
+	return ptr;
+}
+
+void *xcalloc(size_t count, size_t size)
+{
+	void *ptr = calloc(count ? count : 1, size);
+
+	if (!ptr) {
+		printf("Out of memory\n");
+		exit(FSCK_ERROR);
+	}
+
+	return ptr;
+}
+
+// a zeroed buffer of len bytes, aligned for direct I/O
+void *alloc_buffer(size_t len)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, WINTERFS_MIN_BLOCK_SIZE, len)) {
+		printf("Out of memory\n");
+		exit(FSCK_ERROR);
+	}
+	memset(buf, 0, len);
+
+	return buf;
+}
+
+// growable array of fixed size items
+struct vec {
+	void *data;
+	size_t count;
+	size_t capacity;
+	size_t size;
+};
+
+#define VEC_INIT(type)		{ NULL, 0, 0, sizeof(type) }
+#define VEC_AT(v, type, i)	(((type *)(v)->data)[i])
+
+void *vec_push(struct vec *v)
+{
+	void *item;
+
+	if (v->count == v->capacity) {
+		v->capacity = v->capacity ? v->capacity * 2 : 64;
+		v->data = xrealloc(v->data, v->capacity * v->size);
+	}
+	item = (uint8_t *)v->data + v->count++ * v->size;
+	memset(item, 0, v->size);
+
+	return item;
+}
+
+void vec_free(struct vec *v)
+{
+	free(v->data);
+	v->data = NULL;
+	v->count = 0;
+	v->capacity = 0;
+}
+
+int read_at(int fd, void *buf, size_t len, uint64_t off)
+{
+	while (len) {
+		ssize_t n = pread(fd, buf, len, off);
+
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno;
+		}
+		if (n == 0) {
+			return EIO;
+		}
+		buf = (uint8_t *)buf + n;
+		len -= n;
+		off += n;
+	}
+
+	return 0;
+}
+
+int write_at(int fd, const void *buf, size_t len, uint64_t off)
+{
+	while (len) {
+		ssize_t n = pwrite(fd, buf, len, off);
+
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno;
+		}
+		buf = (const uint8_t *)buf + n;
+		len -= n;
+		off += n;
+	}
+
+	return 0;
+}
+
+double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// run of data blocks owned by an inode
+struct fsck_range {
+	uint32_t start;
+	uint32_t len;
+};
+
+// file blocks of a directory and the data blocks they map to
+struct fsck_extent {
+	uint32_t block;
+	uint32_t start;
+	uint32_t len;
+};
+
+struct fsck_dir {
+	uint32_t num_blocks;
+	uint32_t num_children; // as recorded in the inode
+	uint32_t children; // live entries found
+	uint32_t count;
+	struct fsck_extent *ext;
+	uint8_t *inline_data;
+};
+
+// inode states
+#define FSCK_INODE_DIR		0x0001
+#define FSCK_INODE_BAD		0x0002 // being cleared, entries naming it are removed
+#define FSCK_INODE_LINKED	0x0004 // named by a directory entry
+#define FSCK_INODE_MARKED	0x0008 // blocks marked in use
+#define FSCK_INODE_SHARED	0x0010 // claims blocks another inode claims too
+#define FSCK_INODE_REACHABLE	0x0020
+#define FSCK_INODE_ORPHAN	0x0040 // cut off from the root
+#define FSCK_INODE_VISITING	0x0080
+
+// an inode in use, as found in the inode table
+struct fsck_inode {
+	uint32_t ino;
+	uint32_t flags;
+	uint32_t dir_block;
+	uint32_t dir_block_off;
+	uint32_t parent; // directory whose entry names it
+	uint32_t state; // FSCK_INODE_*, changed atomically while workers run
+	uint64_t mtime;
+	struct fsck_dir *dir;
+};
+
+// inodes in use within one FSCK_CHUNK_SIZE piece of the inode table, by ino
+struct fsck_chunk {
+	struct fsck_inode *inodes;
+	uint32_t count;
+};
+
+// changes to inode table slots, applied once every pass has run
+enum fsck_fix_kind {
+	FSCK_FIX_BACKPTR, // a = dir_block, b = dir_block_off
+	FSCK_FIX_CHILDREN, // a = num_children
+	FSCK_FIX_FLAGS, // a = flags to clear
+	FSCK_FIX_INLINE, // data = new inline data
+};
+
+struct fsck_fix {
+	uint32_t ino;
+	uint32_t kind;
+	uint32_t a;
+	uint32_t b;
+	uint8_t *data;
+	size_t seq; // order pushed, a later fix of the same kind wins
+};
+
+// an inode holding duplicate blocks, and every range it holds
+struct fsck_shared {
+	struct fsck_inode *inode;
+	struct fsck_range *ranges;
+	size_t count;
+};
+
+struct fsck_worker;
+typedef void (*fsck_work_fn)(struct fsck_worker *w, uint64_t item);
+
+struct fsck {
+	int fd;
+	const char *device;
+	bool repair;
+	bool preen; // only make the repairs that lose nothing
+	bool force;
+	bool progress;
+	uint32_t threads;
+
+	uint8_t *sb_block;
+	struct winterfs_superblock *sb;
+	uint32_t block_size;
+	uint32_t block_bits;
+	uint32_t inode_size;
+	uint32_t inline_size;
+	uint32_t num_inodes; // bits of the inode bitset in use
+	uint32_t num_blocks;
+	uint32_t num_data_blocks;
+	uint32_t free_inode_bitset_idx;
+	uint32_t free_block_bitset_idx;
+	uint32_t bad_block_bitset_idx;
+	uint32_t data_blocks_idx;
+	uint32_t revision;
+	uint32_t features;
+	uint64_t hash_key[2];
+	uint32_t state;
+
+	// bitsets as read from disk, and the blocks found in use
+	uint8_t *inode_bitset;
+	uint8_t *block_bitset;
+	uint64_t *inodes_used;
+	uint64_t *blocks_used;
+
+	struct fsck_chunk *chunks;
+	uint32_t num_chunks;
+	uint32_t chunk_inodes;
+
+	pthread_mutex_t lock; // guards the lists below
+	struct vec dirs; // struct fsck_inode *, every directory to walk
+	struct vec adopted; // struct fsck_inode *, in use but marked free
+	struct vec pending; // adopted directories not walked yet
+	struct vec fixes; // struct fsck_fix
+	struct vec dups; // struct fsck_range, blocks claimed twice
+	struct vec shared; // struct fsck_shared
+	bool writing;
+
+	// the pass being run
+	fsck_work_fn fn;
+	struct fsck_inode **work;
+	uint64_t next;
+	uint64_t total;
+	uint64_t done;
+	uint64_t bytes;
+	uint64_t items;
+	uint32_t running;
+	bool failed;
+	bool halted; // preening met a problem it may not repair
+	struct fsck_worker *main_worker; // for work done on the main thread
+
+	uint64_t problems;
+	uint64_t fixed;
+	uint64_t stale;
+};
+
+struct fsck_worker {
+	struct fsck *fsck;
+	pthread_t thread;
+	uint8_t *buf; // FSCK_CHUNK_SIZE
+	uint8_t *nodes[WINTERFS_EXTENT_MAX_DEPTH]; // a block per tree level
+	uint8_t *slot; // a block of the inode table
+	struct vec ranges; // struct fsck_range
+	struct vec extents; // struct fsck_extent, directories only
+	struct vec dups; // struct fsck_range
+	uint32_t dir_blocks; // file blocks of the directory being walked
+	bool quiet;
+};
+
+// repairs a preen makes, none of which loses a name or a block
+const char *const fsck_preen_actions[] = {
+	"fixed",
+	"rebuilt",
+	"index rebuilt",
+	"marked in use",
+	"flag cleared",
+	NULL,
+};
+
+bool fsck_preen_ok(const char *action)
+{
+	uint32_t i;
+
+	for (i = 0; fsck_preen_actions[i]; i++) {
+		if (!strcmp(action, fsck_preen_actions[i])) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Report a problem. 'action' says what repairing it does, and is NULL
+ * for problems left as they are. Lines start over any progress shown.
+ * A preen stops at the first problem it may not repair, and writes
+ * nothing more, leaving the volume to be checked by hand.
+ */
+void fsck_problem(struct fsck *fsck, const char *action, const char *fmt, ...)
+{
+	char msg[512];
+	va_list args;
+	bool fixing = action && fsck->repair;
+	bool halt = fixing && fsck->preen && !fsck_preen_ok(action);
+
+	if (halt) {
+		fixing = false;
+	}
+
+	va_start(args, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, args);
+	va_end(args);
+
+	__atomic_add_fetch(&fsck->problems, 1, __ATOMIC_RELAXED);
+	if (fixing) {
+		__atomic_add_fetch(&fsck->fixed, 1, __ATOMIC_RELAXED);
+	}
+	printf("%s%s%s%s\n", fsck->progress ? "\r\033[K" : "", msg,
+		fixing ? ", " : "", fixing ? action : "");
+	if (halt && !__atomic_exchange_n(&fsck->halted, true, __ATOMIC_RELAXED)) {
+		printf("%s: UNEXPECTED INCONSISTENCY; run fsck.winterfs without -a or -p\n",
+			fsck->device);
+		__atomic_store_n(&fsck->failed, true, __ATOMIC_RELAXED);
+	}
+}
+
+void fsck_worker_problem(struct fsck_worker *w, const char *action, const char *fmt, ...)
+{
+	char msg[512];
+	va_list args;
+
+	if (w->quiet) {
+		return;
+	}
+	va_start(args, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, args);
+	va_end(args);
+	fsck_problem(w->fsck, action, "%s", msg);
+}
+
+// printable copy of an entry name
+void fsck_name(char *out, const char *name, uint32_t len)
+{
+	uint32_t i;
+
+	for (i = 0; i < len && i < WINTERFS_FILENAME_MAX_LEN - 1; i++) {
+		out[i] = (name[i] >= 0x20 && name[i] < 0x7f) ? name[i] : '?';
+	}
+	out[i] = '\0';
+}
+
+// read errors leave nothing safe to repair from, so any stops the check
+int fsck_read(struct fsck *fsck, void *buf, size_t len, uint64_t off)
+{
+	int err = read_at(fsck->fd, buf, len, off);
+
+	if (err) {
+		if (!__atomic_exchange_n(&fsck->failed, true, __ATOMIC_RELAXED)) {
+			printf("Error reading block %llu: os error %d\n",
+				(unsigned long long)(off >> fsck->block_bits), err);
+		}
+		return err;
+	}
+	__atomic_add_fetch(&fsck->bytes, len, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+int fsck_write_super(struct fsck *fsck)
+{
+	int err = write_at(fsck->fd, fsck->sb_block, fsck->block_size, 0);
+
+	if (!err && fsync(fsck->fd)) {
+		err = errno;
+	}
+	if (err) {
+		printf("Failed writing superblock: os error %d\n", err);
+	}
+
+	return err;
+}
+
+/*
+ * The first write of a repair marks the volume as not clean, so a check
+ * interrupted part way is run again in full. Nothing is written once a
+ * preen has halted.
+ */
+int fsck_write(struct fsck *fsck, const void *buf, size_t len, uint64_t off)
+{
+	int err = 0;
+
+	if (__atomic_load_n(&fsck->halted, __ATOMIC_RELAXED)) {
+		return ECANCELED;
+	}
+
+	pthread_mutex_lock(&fsck->lock);
+	if (!fsck->writing) {
+		fsck->writing = true;
+		if (le32(fsck->sb->state) & WINTERFS_STATE_CLEAN) {
+			fsck->sb->state = le32(le32(fsck->sb->state) & ~WINTERFS_STATE_CLEAN);
+			err = fsck_write_super(fsck);
+		}
+	}
+	pthread_mutex_unlock(&fsck->lock);
+
+	if (!err) {
+		err = write_at(fsck->fd, buf, len, off);
+	}
+	if (err) {
+		if (!__atomic_exchange_n(&fsck->failed, true, __ATOMIC_RELAXED)) {
+			printf("Error writing block %llu: os error %d\n",
+				(unsigned long long)(off >> fsck->block_bits), err);
+		}
+	}
+
+	return err;
+}
+
+void fsck_push_fix(struct fsck *fsck, uint32_t ino, uint32_t kind, uint32_t a, uint32_t b,
+	uint8_t *data)
+{
+	struct fsck_fix *fix;
+
+	if (!fsck->repair) {
+		free(data);
+		return;
+	}
+	pthread_mutex_lock(&fsck->lock);
+	fix = vec_push(&fsck->fixes);
+	fix->seq = fsck->fixes.count;
+	fix->ino = ino;
+	fix->kind = kind;
+	fix->a = a;
+	fix->b = b;
+	fix->data = data;
+	pthread_mutex_unlock(&fsck->lock);
+}
+
+void *fsck_worker_main(void *arg)
+{
+	uint64_t item;
+	struct fsck_worker *w = arg;
+	struct fsck *fsck = w->fsck;
+
+	while (!__atomic_load_n(&fsck->failed, __ATOMIC_RELAXED)
+			&& (item = __atomic_fetch_add(&fsck->next, 1, __ATOMIC_RELAXED)) < fsck->total) {
+		fsck->fn(w, item);
+		__atomic_add_fetch(&fsck->done, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_sub_fetch(&fsck->running, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+/*
+ * Hand 'total' work items to the worker pool and wait for them, showing
+ * how far the pass has got and the rate the device is being read at.
+ */
+int fsck_run_pass(struct fsck *fsck, struct fsck_worker *workers, const char *name,
+	fsck_work_fn fn, uint64_t total)
+{
+	uint32_t i;
+	double start = now();
+	double shown = start;
+	struct timespec tick = { 0, 100 * 1000 * 1000 };
+
+	fsck->fn = fn;
+	fsck->next = 0;
+	fsck->total = total;
+	fsck->done = 0;
+	fsck->running = fsck->threads;
+
+	for (i = 0; i < fsck->threads; i++) {
+		if (pthread_create(&workers[i].thread, NULL, fsck_worker_main, &workers[i])) {
+			printf("Error starting worker thread\n");
+			exit(FSCK_ERROR);
+		}
+	}
+
+	while (__atomic_load_n(&fsck->running, __ATOMIC_ACQUIRE)) {
+		nanosleep(&tick, NULL);
+		if (fsck->progress && now() - shown >= 1) {
+			double secs = now() - start;
+
+			shown = now();
+			printf("\r\033[K%s: %5.1f%% %8.1f MB/s", name,
+				total ? 100.0 * __atomic_load_n(&fsck->done, __ATOMIC_RELAXED) / total : 100.0,
+				__atomic_load_n(&fsck->bytes, __ATOMIC_RELAXED) / secs / (1 << 20));
+			fflush(stdout);
+		}
+	}
+	for (i = 0; i < fsck->threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	if (fsck->progress) {
+		printf("\r\033[K");
+	}
+
+	return fsck->failed ? FSCK_ERROR : 0;
+}
+
+void fsck_pass_done(struct fsck *fsck, const char *name, const char *what, double start)
+{
+	double secs = now() - start;
+
+	printf("%s: %llu %s in %.1fs, %.1f MB/s\n", name, (unsigned long long)fsck->items, what,
+		secs, secs > 0 ? fsck->bytes / secs / (1 << 20) : 0.0);
+	fsck->items = 0;
+	fsck->bytes = 0;
+}
+
+// the record for an inode in use, or NULL
+struct fsck_inode *fsck_lookup(struct fsck *fsck, uint32_t ino)
+{
+	size_t i;
+	uint32_t lo;
+	uint32_t hi;
+	struct fsck_chunk *chunk;
+	struct fsck_inode *found = NULL;
+
+	if (!ino || ino >= fsck->num_inodes) {
+		return NULL;
+	}
+
+	chunk = &fsck->chunks[(ino - 1) / fsck->chunk_inodes];
+	lo = 0;
+	hi = chunk->count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (chunk->inodes[mid].ino == ino) {
+			return &chunk->inodes[mid];
+		}
+		if (chunk->inodes[mid].ino < ino) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	// inodes marked free that a directory turned out to name
+	pthread_mutex_lock(&fsck->lock);
+	for (i = 0; i < fsck->adopted.count; i++) {
+		if (VEC_AT(&fsck->adopted, struct fsck_inode *, i)->ino == ino) {
+			found = VEC_AT(&fsck->adopted, struct fsck_inode *, i);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fsck->lock);
+
+	return found;
+}
+
+// call fn on every inode record, in inode table order then adopted ones
+void fsck_for_each_inode(struct fsck *fsck, void (*fn)(struct fsck *, struct fsck_inode *))
+{
+	uint32_t c;
+	uint32_t i;
+	size_t n;
+
+	for (c = 0; c < fsck->num_chunks; c++) {
+		for (i = 0; i < fsck->chunks[c].count; i++) {
+			fn(fsck, &fsck->chunks[c].inodes[i]);
+		}
+	}
+	for (n = 0; n < fsck->adopted.count; n++) {
+		fn(fsck, VEC_AT(&fsck->adopted, struct fsck_inode *, n));
+	}
+}
+
+// note a run of data blocks an inode owns, merging it into the last one
+void fsck_add_range(struct fsck_worker *w, uint32_t start, uint32_t len)
+{
+	struct fsck_range *r;
+
+	if (w->ranges.count) {
+		r = &VEC_AT(&w->ranges, struct fsck_range, w->ranges.count - 1);
+		if (r->start + r->len == start) {
+			r->len += len;
+			return;
+		}
+	}
+	r = vec_push(&w->ranges);
+	r->start = start;
+	r->len = len;
+}
+
+// note where file blocks of a directory live, up to its size
+void fsck_add_extent(struct fsck_worker *w, uint64_t block, uint32_t start, uint32_t len)
+{
+	struct fsck_extent *e;
+
+	if (block >= w->dir_blocks) {
+		return;
+	}
+	len = MIN(len, w->dir_blocks - block);
+	if (w->extents.count) {
+		e = &VEC_AT(&w->extents, struct fsck_extent, w->extents.count - 1);
+		if (e->block + e->len == block && e->start + e->len == start) {
+			e->len += len;
+			return;
+		}
+	}
+	e = vec_push(&w->extents);
+	e->block = block;
+	e->start = start;
+	e->len = len;
+}
+
+// extents held below one tree node at the given level
+uint64_t fsck_extent_span(struct fsck *fsck, uint16_t level)
+{
+	uint64_t per_block = (fsck->block_size - sizeof(struct winterfs_extent_header))
+		/ sizeof(struct winterfs_extent);
+	uint64_t span = per_block;
+
+	while (level--) {
+		span *= per_block;
+	}
+
+	return span;
+}
+
+struct fsck_extent_walk {
+	uint64_t next; // lowest file block the next extent may start at
+	uint64_t count; // extents so far
+};
+
+/*
+ * Check an extent tree node and everything below it, to the same rules
+ * the kernel loads a tree by, and collect the blocks it maps and uses.
+ */
+bool fsck_walk_extent_node(struct fsck_worker *w, uint32_t ino,
+	struct winterfs_extent_header *eh, uint16_t depth, struct fsck_extent_walk *walk)
+{
+	uint16_t i;
+	struct fsck *fsck = w->fsck;
+	uint16_t entries = le16(eh->entries);
+
+	if (le16(eh->magic) != WINTERFS_EXTENT_MAGIC || le16(eh->depth) != depth
+			|| entries > le16(eh->max)) {
+		fsck_worker_problem(w, "cleared", "Inode %u has a corrupt extent tree node", ino);
+		return false;
+	}
+
+	if (depth == 0) {
+		struct winterfs_extent *ext = (struct winterfs_extent *)(eh + 1);
+
+		for (i = 0; i < entries; i++) {
+			uint32_t block = le32(ext[i].block);
+			uint32_t raw_len = le32(ext[i].len);
+			uint32_t len = raw_len & WINTERFS_EXTENT_MAX_LEN;
+			uint32_t start = le32(ext[i].start);
+
+			if (((raw_len & WINTERFS_EXTENT_UNWRITTEN)
+					&& !(fsck->features & WINTERFS_FEATURE_UNWRITTEN))
+					|| !len || !start
+					|| (uint64_t)start + len > fsck->num_data_blocks
+					|| (uint64_t)block + len > (1ULL << 32)
+					|| block < walk->next) {
+				fsck_worker_problem(w, "cleared",
+					"Inode %u has a bad extent at file block %u", ino, block);
+				return false;
+			}
+			walk->next = (uint64_t)block + len;
+			walk->count++;
+			fsck_add_range(w, start, len);
+			fsck_add_extent(w, block, start, len);
+		}
+		return true;
+	}
+
+	for (i = 0; i < entries; i++) {
+		struct winterfs_extent_idx *idx = (struct winterfs_extent_idx *)(eh + 1);
+		struct winterfs_extent_header *child_eh;
+		uint32_t child = le32(idx[i].child);
+		uint16_t level = depth - 1;
+
+		if (!child || child >= fsck->num_data_blocks) {
+			fsck_worker_problem(w, "cleared",
+				"Inode %u has an extent tree node out of range", ino);
+			return false;
+		}
+		fsck_add_range(w, child, 1);
+
+		if (fsck_read(fsck, w->nodes[level], fsck->block_size,
+				(uint64_t)(fsck->data_blocks_idx + child) << fsck->block_bits)) {
+			return false;
+		}
+		child_eh = (struct winterfs_extent_header *)w->nodes[level];
+		// nodes below the root are never left empty
+		if (le16(child_eh->max) > fsck_extent_span(fsck, 0) || !le16(child_eh->entries)) {
+			fsck_worker_problem(w, "cleared", "Inode %u has a corrupt extent tree node", ino);
+			return false;
+		}
+		if (!fsck_walk_extent_node(w, ino, child_eh, level, walk)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool fsck_walk_extents(struct fsck_worker *w, uint32_t ino, struct winterfs_inode *raw)
+{
+	struct fsck_extent_walk walk;
+	struct winterfs_extent_root *root = &raw->extent_root;
+	uint16_t depth = le16(root->header.depth);
+
+	if (depth > WINTERFS_EXTENT_MAX_DEPTH || le16(root->header.max) > WINTERFS_INODE_EXTENTS) {
+		fsck_worker_problem(w, "cleared", "Inode %u has a corrupt extent root", ino);
+		return false;
+	}
+
+	memset(&walk, 0, sizeof(walk));
+	return fsck_walk_extent_node(w, ino, &root->header, depth, &walk);
+}
+
+// an indirect block of a revision 1 inode, and the blocks below it
+bool fsck_walk_indirect(struct fsck_worker *w, uint32_t ino, uint32_t node, uint32_t depth,
+	uint64_t base)
+{
+	uint32_t i;
+	struct fsck *fsck = w->fsck;
+	uint32_t per_block = fsck->block_size / sizeof(uint32_t);
+	uint64_t child_span = 1;
+	uint8_t *buf = w->nodes[depth - 1];
+
+	if (node >= fsck->num_data_blocks) {
+		fsck_worker_problem(w, "cleared", "Inode %u has an indirect block out of range", ino);
+		return false;
+	}
+	fsck_add_range(w, node, 1);
+	if (fsck_read(fsck, buf, fsck->block_size,
+			(uint64_t)(fsck->data_blocks_idx + node) << fsck->block_bits)) {
+		return false;
+	}
+
+	for (i = 1; i < depth; i++) {
+		child_span *= per_block;
+	}
+	for (i = 0; i < per_block; i++) {
+		uint32_t ptr;
+
+		memcpy(&ptr, buf + i * sizeof(uint32_t), sizeof(uint32_t));
+		ptr = le32(ptr);
+		if (!ptr) {
+			continue;
+		}
+		if (depth > 1) {
+			if (!fsck_walk_indirect(w, ino, ptr, depth - 1, base + i * child_span)) {
+				return false;
+			}
+			continue;
+		}
+		if (ptr >= fsck->num_data_blocks) {
+			fsck_worker_problem(w, "cleared", "Inode %u has a block out of range", ino);
+			return false;
+		}
+		fsck_add_range(w, ptr, 1);
+		fsck_add_extent(w, base + i, ptr, 1);
+	}
+
+	return true;
+}
+
+bool fsck_walk_blocks(struct fsck_worker *w, uint32_t ino, struct winterfs_inode *raw)
+{
+	uint32_t i;
+	struct fsck *fsck = w->fsck;
+	uint64_t per_block = fsck->block_size / sizeof(uint32_t);
+	uint64_t base = WINTERFS_INODE_DIRECT_BLOCKS;
+	uint64_t span = per_block;
+	uint32_t roots[3] = {
+		le32(raw->indirect_primary),
+		le32(raw->indirect_secondary),
+		le32(raw->indirect_tertiary),
+	};
+
+	for (i = 0; i < WINTERFS_INODE_DIRECT_BLOCKS; i++) {
+		uint32_t ptr = le32(raw->direct_blocks[i]);
+
+		if (!ptr) {
+			continue;
+		}
+		if (ptr >= fsck->num_data_blocks) {
+			fsck_worker_problem(w, "cleared", "Inode %u has a block out of range", ino);
+			return false;
+		}
+		fsck_add_range(w, ptr, 1);
+		fsck_add_extent(w, i, ptr, 1);
+	}
+
+	for (i = 0; i < 3; i++) {
+		if (roots[i] && !fsck_walk_indirect(w, ino, roots[i], i + 1, base)) {
+			return false;
+		}
+		base += span;
+		span *= per_block;
+	}
+
+	return true;
+}
+
+/*
+ * Check an inode in use and fill in its record, collecting the blocks it
+ * owns in w->ranges. Returns false if it has to be cleared.
+ */
+bool fsck_check_inode(struct fsck_worker *w, uint32_t ino, struct winterfs_inode *raw,
+	struct fsck_inode *rec)
+{
+	uint32_t i;
+	uint32_t next = 0;
+	struct fsck *fsck = w->fsck;
+	uint16_t mode = le16(raw->mode);
+	uint64_t size = le64(raw->size);
+	bool dir = S_ISDIR(mode);
+	struct fsck_dir *d;
+
+	memset(rec, 0, sizeof(struct fsck_inode));
+	rec->ino = ino;
+	rec->flags = le32(raw->flags);
+	rec->dir_block = le32(raw->dir_block);
+	rec->dir_block_off = le32(raw->dir_block_off);
+	rec->mtime = le64(raw->modify_time);
+	w->ranges.count = 0;
+	w->extents.count = 0;
+	w->dir_blocks = 0;
+
+	if (!S_ISREG(mode) && !dir) {
+		fsck_worker_problem(w, "cleared", "Inode %u has unknown mode 0%o", ino, mode);
+		return false;
+	}
+	if (dir) {
+		rec->state |= FSCK_INODE_DIR;
+	}
+
+	if ((rec->flags & WINTERFS_INODE_INDEX_FL) && (!dir
+			|| (rec->flags & WINTERFS_INODE_INLINE_FL)
+			|| !(fsck->features & WINTERFS_FEATURE_DIR_INDEX))) {
+		fsck_worker_problem(w, "flag cleared", "Inode %u is marked indexed", ino);
+		rec->flags &= ~WINTERFS_INODE_INDEX_FL;
+		if (!w->quiet) {
+			fsck_push_fix(fsck, ino, FSCK_FIX_FLAGS, WINTERFS_INODE_INDEX_FL, 0, NULL);
+		}
+	}
+
+	if (rec->flags & WINTERFS_INODE_INLINE_FL) {
+		if (!fsck->inline_size || size > fsck->inline_size
+				|| (dir && !(fsck->features & WINTERFS_FEATURE_DIRENT2))) {
+			fsck_worker_problem(w, "cleared", "Inode %u has bad inline data", ino);
+			return false;
+		}
+		if (dir) {
+			d = xcalloc(1, sizeof(struct fsck_dir));
+			d->num_children = le32(raw->num_children);
+			d->inline_data = xrealloc(NULL, fsck->inline_size);
+			memcpy(d->inline_data, (uint8_t *)raw + WINTERFS_INODE_SIZE, fsck->inline_size);
+			rec->dir = d;
+		}
+		return true;
+	}
+
+	if (dir) {
+		if (size & (fsck->block_size - 1) || (size >> fsck->block_bits) > UINT32_MAX) {
+			fsck_worker_problem(w, "cleared", "Directory %u has size %llu", ino,
+				(unsigned long long)size);
+			return false;
+		}
+		w->dir_blocks = size >> fsck->block_bits;
+	}
+
+	if (fsck->revision >= WINTERFS_REVISION_V2) {
+		if (!fsck_walk_extents(w, ino, raw)) {
+			return false;
+		}
+	} else if (!fsck_walk_blocks(w, ino, raw)) {
+		return false;
+	}
+
+	if (!dir) {
+		return true;
+	}
+
+	// directory blocks are read without regard to holes
+	for (i = 0; i < w->extents.count && next < w->dir_blocks; i++) {
+		if (VEC_AT(&w->extents, struct fsck_extent, i).block != next) {
+			break;
+		}
+		next += VEC_AT(&w->extents, struct fsck_extent, i).len;
+	}
+	if (next < w->dir_blocks) {
+		fsck_worker_problem(w, NULL, "Directory %u has no block %u", ino, next);
+	}
+
+	d = xcalloc(1, sizeof(struct fsck_dir));
+	d->num_blocks = w->dir_blocks;
+	d->num_children = le32(raw->num_children);
+	d->count = w->extents.count;
+	d->ext = xrealloc(NULL, w->extents.count * sizeof(struct fsck_extent));
+	memcpy(d->ext, w->extents.data, w->extents.count * sizeof(struct fsck_extent));
+	rec->dir = d;
+
+	return true;
+}
+
+void fsck_free_dir(struct fsck_inode *rec)
+{
+	if (rec->dir) {
+		free(rec->dir->ext);
+		free(rec->dir->inline_data);
+		free(rec->dir);
+		rec->dir = NULL;
+	}
+}
+
+// note a block claimed twice, merging it into the last one noted
+void fsck_add_dup(struct vec *dups, uint32_t block)
+{
+	struct fsck_range *r;
+
+	if (dups->count) {
+		r = &VEC_AT(dups, struct fsck_range, dups->count - 1);
+		if (r->start + r->len == block) {
+			r->len++;
+			return;
+		}
+	}
+	r = vec_push(dups);
+	r->start = block;
+	r->len = 1;
+}
+
+/*
+ * Mark the blocks collected in w->ranges as in use, a whole word of the
+ * bitmap at a time. Returns false if any was already claimed.
+ */
+bool fsck_mark_ranges(struct fsck_worker *w)
+{
+	size_t i;
+	bool clean = true;
+	uint64_t *map = w->fsck->blocks_used;
+
+	for (i = 0; i < w->ranges.count; i++) {
+		struct fsck_range *r = &VEC_AT(&w->ranges, struct fsck_range, i);
+		uint64_t bit = r->start;
+		uint64_t end = (uint64_t)r->start + r->len;
+
+		while (bit < end) {
+			uint32_t from = bit % 64;
+			uint32_t n = MIN(64 - from, end - bit);
+			uint64_t mask = (n == 64 ? ~0ULL : ((1ULL << n) - 1)) << from;
+			uint64_t old = __atomic_fetch_or(&map[bit / 64], mask, __ATOMIC_RELAXED);
+			uint64_t dup = old & mask;
+
+			while (dup) {
+				uint32_t b = __builtin_ctzll(dup);
+
+				fsck_add_dup(&w->dups, (bit - from) + b);
+				dup &= dup - 1;
+				clean = false;
+			}
+			bit += n;
+		}
+	}
+
+	return clean;
+}
+
+void fsck_clear_range(uint64_t *map, uint32_t start, uint32_t len)
+{
+	uint64_t bit;
+
+	for (bit = start; bit < (uint64_t)start + len; bit++) {
+		map[bit / 64] &= ~(1ULL << (bit % 64));
+	}
+}
+
+// first and one past the last inode of an inode table chunk
+void fsck_chunk_span(struct fsck *fsck, uint64_t chunk, uint32_t *first, uint32_t *end)
+{
+	*first = chunk * fsck->chunk_inodes + 1;
+	*end = MIN((uint64_t)*first + fsck->chunk_inodes, fsck->num_inodes);
+}
+
+// read the part of the inode table holding [first, end) into w->buf
+int fsck_read_chunk(struct fsck_worker *w, uint32_t first, uint32_t end)
+{
+	struct fsck *fsck = w->fsck;
+	uint64_t len = (uint64_t)(end - first) * fsck->inode_size;
+
+	len = (len + fsck->block_size - 1) & ~(uint64_t)(fsck->block_size - 1);
+	return fsck_read(fsck, w->buf, len,
+		((uint64_t)WINTERFS_INODES_BLOCK_ADDR << fsck->block_bits)
+		+ (uint64_t)(first - 1) * fsck->inode_size);
+}
+
+/*
+ * Pass 1: one chunk of the inode table. Only inodes marked in use are
+ * checked, and chunks without any aren't read at all, which skips the
+ * unused inode groups of a lazy_itable volume along with their garbage.
+ */
+void fsck_pass1_chunk(struct fsck_worker *w, uint64_t chunk)
+{
+	uint32_t i;
+	uint32_t ino;
+	uint32_t first;
+	uint32_t end;
+	uint32_t count = 0;
+	struct fsck *fsck = w->fsck;
+	struct fsck_chunk *c = &fsck->chunks[chunk];
+	struct vec recs = VEC_INIT(struct fsck_inode);
+
+	fsck_chunk_span(fsck, chunk, &first, &end);
+	for (ino = first; ino < end && !test_bit_le(fsck->inode_bitset, ino); ino++);
+	if (ino == end || fsck_read_chunk(w, first, end)) {
+		return;
+	}
+
+	for (; ino < end; ino++) {
+		struct winterfs_inode *raw;
+		struct fsck_inode *rec;
+
+		if (!test_bit_le(fsck->inode_bitset, ino)) {
+			continue;
+		}
+		raw = (struct winterfs_inode *)(w->buf + (uint64_t)(ino - first) * fsck->inode_size);
+		rec = vec_push(&recs);
+		count++;
+		if (!fsck_check_inode(w, ino, raw, rec)) {
+			rec->state |= FSCK_INODE_BAD;
+			continue;
+		}
+		rec->state |= FSCK_INODE_MARKED;
+		if (!fsck_mark_ranges(w)) {
+			rec->state |= FSCK_INODE_SHARED;
+		}
+	}
+
+	c->inodes = recs.data;
+	c->count = recs.count;
+	__atomic_add_fetch(&fsck->items, count, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&fsck->lock);
+	for (i = 0; i < c->count; i++) {
+		if (c->inodes[i].dir && !(c->inodes[i].state & FSCK_INODE_BAD)) {
+			*(struct fsck_inode **)vec_push(&fsck->dirs) = &c->inodes[i];
+		}
+	}
+	for (i = 0; i < w->dups.count; i++) {
+		*(struct fsck_range *)vec_push(&fsck->dups) = VEC_AT(&w->dups, struct fsck_range, i);
+	}
+	w->dups.count = 0;
+	pthread_mutex_unlock(&fsck->lock);
+}
+
+int fsck_range_cmp(const void *a, const void *b)
+{
+	const struct fsck_range *ra = a;
+	const struct fsck_range *rb = b;
+
+	return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+// index of the duplicate range overlapping r, or -1
+long fsck_find_dup(struct fsck *fsck, uint32_t start, uint32_t len)
+{
+	size_t lo = 0;
+	size_t hi = fsck->dups.count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		struct fsck_range *d = &VEC_AT(&fsck->dups, struct fsck_range, mid);
+
+		if ((uint64_t)d->start + d->len <= start) {
+			lo = mid + 1;
+		} else if (d->start >= (uint64_t)start + len) {
+			hi = mid;
+		} else {
+			return mid;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Pass 1b: the first inode to claim a block never sees the clash, so
+ * every inode is walked again to find all the owners of duplicate blocks.
+ */
+void fsck_pass1b_chunk(struct fsck_worker *w, uint64_t chunk)
+{
+	uint32_t i;
+	size_t r;
+	uint32_t first;
+	uint32_t end;
+	struct fsck *fsck = w->fsck;
+	struct fsck_chunk *c = &fsck->chunks[chunk];
+
+	if (!c->count) {
+		return;
+	}
+	fsck_chunk_span(fsck, chunk, &first, &end);
+	if (fsck_read_chunk(w, first, end)) {
+		return;
+	}
+
+	for (i = 0; i < c->count; i++) {
+		struct fsck_inode *rec = &c->inodes[i];
+		struct fsck_inode tmp;
+		struct fsck_shared *s;
+
+		if (rec->state & FSCK_INODE_BAD) {
+			continue;
+		}
+		fsck_check_inode(w, rec->ino, (struct winterfs_inode *)(w->buf
+			+ (uint64_t)(rec->ino - first) * fsck->inode_size), &tmp);
+		fsck_free_dir(&tmp);
+		for (r = 0; r < w->ranges.count; r++) {
+			struct fsck_range *range = &VEC_AT(&w->ranges, struct fsck_range, r);
+
+			if (fsck_find_dup(fsck, range->start, range->len) >= 0) {
+				break;
+			}
+		}
+		if (r == w->ranges.count) {
+			continue;
+		}
+
+		pthread_mutex_lock(&fsck->lock);
+		s = vec_push(&fsck->shared);
+		s->inode = rec;
+		s->count = w->ranges.count;
+		s->ranges = xrealloc(NULL, w->ranges.count * sizeof(struct fsck_range));
+		memcpy(s->ranges, w->ranges.data, w->ranges.count * sizeof(struct fsck_range));
+		pthread_mutex_unlock(&fsck->lock);
+	}
+}
+
+bool fsck_shared_has(struct fsck_shared *s, struct fsck_range *d)
+{
+	size_t i;
+
+	for (i = 0; i < s->count; i++) {
+		if (s->ranges[i].start < (uint64_t)d->start + d->len
+				&& d->start < (uint64_t)s->ranges[i].start + s->ranges[i].len) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// read the inode table slot of ino into w->slot, returning the inode
+struct winterfs_inode *fsck_read_slot(struct fsck_worker *w, uint32_t ino)
+{
+	struct fsck *fsck = w->fsck;
+	uint64_t pos = (uint64_t)(ino - 1) * fsck->inode_size;
+
+	if (fsck_read(fsck, w->slot, fsck->block_size,
+			((uint64_t)WINTERFS_INODES_BLOCK_ADDR << fsck->block_bits)
+			+ (pos & ~(uint64_t)(fsck->block_size - 1)))) {
+		return NULL;
+	}
+
+	return (struct winterfs_inode *)(w->slot + (pos & (fsck->block_size - 1)));
+}
+
+// whether any of the blocks is one s shares with the inode that keeps it
+bool fsck_copy_needed(struct fsck *fsck, struct fsck_shared **keepers, struct fsck_shared *s,
+	uint32_t start, uint32_t len)
+{
+	uint64_t b;
+
+	for (b = start; b < (uint64_t)start + len; b++) {
+		long d = fsck_find_dup(fsck, b, 1);
+
+		if (d >= 0 && keepers[d] != s) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// take a run of data blocks free on disk that no inode claims, or 0
+uint32_t fsck_alloc_run(struct fsck *fsck, uint32_t len)
+{
+	uint64_t b;
+	uint32_t run = 0;
+
+	for (b = 1; b < fsck->num_data_blocks; b++) {
+		if (test_bit64(fsck->blocks_used, b) || test_bit_le(fsck->block_bitset, b)) {
+			run = 0;
+			continue;
+		}
+		if (++run == len) {
+			for (b = b + 1 - len; run--; b++) {
+				set_bit64(fsck->blocks_used, b);
+			}
+			return b - len;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Move a run of blocks an inode maps to a fresh run, copying what they
+ * hold unless the caller writes the new blocks itself. Blocks nobody
+ * else claims are given up; the others still belong to their keeper.
+ */
+int fsck_copy_run(struct fsck_worker *w, uint32_t *start, uint32_t len, bool copy)
+{
+	int err;
+	uint32_t done;
+	uint32_t n;
+	uint64_t b;
+	struct fsck *fsck = w->fsck;
+	uint32_t run_max = FSCK_CHUNK_SIZE >> fsck->block_bits;
+	uint32_t to = fsck_alloc_run(fsck, len);
+
+	if (!to) {
+		return ENOSPC;
+	}
+	for (done = 0; copy && done < len; done += n) {
+		n = MIN(len - done, run_max);
+		err = fsck_read(fsck, w->buf, (size_t)n << fsck->block_bits,
+			(uint64_t)(fsck->data_blocks_idx + *start + done) << fsck->block_bits);
+		if (!err) {
+			err = fsck_write(fsck, w->buf, (size_t)n << fsck->block_bits,
+				(uint64_t)(fsck->data_blocks_idx + to + done) << fsck->block_bits);
+		}
+		if (err) {
+			return err;
+		}
+	}
+	for (b = *start; b < (uint64_t)*start + len; b++) {
+		if (fsck_find_dup(fsck, b, 1) < 0) {
+			fsck_clear_range(fsck->blocks_used, b, 1);
+		}
+	}
+	*start = to;
+
+	return 0;
+}
+
+/*
+ * Copy the shared blocks below an extent tree node. The node is changed
+ * in place, with *changed set for the caller to write it; nodes below are
+ * written here, even when a copy failed part way, so the tree on disk
+ * always maps what the bitmap of blocks in use holds.
+ */
+int fsck_copy_extent_node(struct fsck_worker *w, struct fsck_shared **keepers,
+	struct fsck_shared *s, struct winterfs_extent_header *eh, uint16_t depth, bool *changed)
+{
+	int err = 0;
+	uint16_t i;
+	struct fsck *fsck = w->fsck;
+
+	if (depth == 0) {
+		struct winterfs_extent *ext = (struct winterfs_extent *)(eh + 1);
+
+		for (i = 0; i < le16(eh->entries) && !err; i++) {
+			uint32_t start = le32(ext[i].start);
+			uint32_t len = le32(ext[i].len) & WINTERFS_EXTENT_MAX_LEN;
+
+			if (fsck_copy_needed(fsck, keepers, s, start, len)) {
+				err = fsck_copy_run(w, &start, len, true);
+				if (!err) {
+					ext[i].start = le32(start);
+					*changed = true;
+				}
+			}
+		}
+		return err;
+	}
+
+	for (i = 0; i < le16(eh->entries) && !err; i++) {
+		struct winterfs_extent_idx *idx = (struct winterfs_extent_idx *)(eh + 1);
+		uint32_t child = le32(idx[i].child);
+		uint16_t level = depth - 1;
+		bool child_changed = false;
+		int werr;
+
+		if (fsck_read(fsck, w->nodes[level], fsck->block_size,
+				(uint64_t)(fsck->data_blocks_idx + child) << fsck->block_bits)) {
+			return EIO;
+		}
+		err = fsck_copy_extent_node(w, keepers, s,
+			(struct winterfs_extent_header *)w->nodes[level], level, &child_changed);
+		if (!err && fsck_copy_needed(fsck, keepers, s, child, 1)) {
+			err = fsck_copy_run(w, &child, 1, false);
+			if (!err) {
+				idx[i].child = le32(child);
+				*changed = true;
+				child_changed = true;
+			}
+		}
+		if (child_changed) {
+			werr = fsck_write(fsck, w->nodes[level], fsck->block_size,
+				(uint64_t)(fsck->data_blocks_idx + child) << fsck->block_bits);
+			err = err ? err : werr;
+		}
+	}
+
+	return err;
+}
+
+// the same for an indirect block of a revision 1 inode, which may move too
+int fsck_copy_indirect(struct fsck_worker *w, struct fsck_shared **keepers,
+	struct fsck_shared *s, uint32_t *node, uint32_t depth)
+{
+	int err = 0;
+	int werr;
+	uint32_t i;
+	bool changed = false;
+	struct fsck *fsck = w->fsck;
+	uint32_t per_block = fsck->block_size / sizeof(uint32_t);
+	uint8_t *buf = w->nodes[depth - 1];
+
+	if (fsck_read(fsck, buf, fsck->block_size,
+			(uint64_t)(fsck->data_blocks_idx + *node) << fsck->block_bits)) {
+		return EIO;
+	}
+	for (i = 0; i < per_block && !err; i++) {
+		uint32_t ptr;
+		uint32_t old;
+
+		memcpy(&ptr, buf + i * sizeof(uint32_t), sizeof(uint32_t));
+		old = ptr = le32(ptr);
+		if (!ptr) {
+			continue;
+		}
+		if (depth > 1) {
+			err = fsck_copy_indirect(w, keepers, s, &ptr, depth - 1);
+		} else if (fsck_copy_needed(fsck, keepers, s, ptr, 1)) {
+			err = fsck_copy_run(w, &ptr, 1, true);
+		}
+		if (ptr != old) {
+			ptr = le32(ptr);
+			memcpy(buf + i * sizeof(uint32_t), &ptr, sizeof(uint32_t));
+			changed = true;
+		}
+	}
+	if (!err && fsck_copy_needed(fsck, keepers, s, *node, 1)) {
+		err = fsck_copy_run(w, node, 1, false);
+		changed |= !err;
+	}
+	if (changed) {
+		werr = fsck_write(fsck, buf, fsck->block_size,
+			(uint64_t)(fsck->data_blocks_idx + *node) << fsck->block_bits);
+		err = err ? err : werr;
+	}
+
+	return err;
+}
+
+// give an inode its own copy of every block it shares with their keeper
+int fsck_copy_shared(struct fsck *fsck, struct fsck_shared **keepers, struct fsck_shared *s)
+{
+	int err = 0;
+	int werr;
+	uint32_t i;
+	bool changed = false;
+	struct fsck_worker *w = fsck->main_worker;
+	uint64_t pos = (uint64_t)(s->inode->ino - 1) * fsck->inode_size;
+	struct winterfs_inode *raw = fsck_read_slot(w, s->inode->ino);
+
+	if (!raw) {
+		return EIO;
+	}
+	if (fsck->revision >= WINTERFS_REVISION_V2) {
+		err = fsck_copy_extent_node(w, keepers, s, &raw->extent_root.header,
+			le16(raw->extent_root.header.depth), &changed);
+	} else {
+		uint32_t roots[3] = {
+			le32(raw->indirect_primary),
+			le32(raw->indirect_secondary),
+			le32(raw->indirect_tertiary),
+		};
+
+		for (i = 0; i < WINTERFS_INODE_DIRECT_BLOCKS && !err; i++) {
+			uint32_t ptr = le32(raw->direct_blocks[i]);
+
+			if (ptr && fsck_copy_needed(fsck, keepers, s, ptr, 1)) {
+				err = fsck_copy_run(w, &ptr, 1, true);
+				if (!err) {
+					raw->direct_blocks[i] = le32(ptr);
+					changed = true;
+				}
+			}
+		}
+		for (i = 0; i < 3 && !err; i++) {
+			uint32_t old = roots[i];
+
+			if (roots[i]) {
+				err = fsck_copy_indirect(w, keepers, s, &roots[i], i + 1);
+			}
+			changed |= roots[i] != old;
+		}
+		raw->indirect_primary = le32(roots[0]);
+		raw->indirect_secondary = le32(roots[1]);
+		raw->indirect_tertiary = le32(roots[2]);
+	}
+	if (changed) {
+		werr = fsck_write(fsck, w->slot, fsck->block_size,
+			((uint64_t)WINTERFS_INODES_BLOCK_ADDR << fsck->block_bits)
+			+ (pos & ~(uint64_t)(fsck->block_size - 1)));
+		err = err ? err : werr;
+	}
+
+	return err;
+}
+
+// walk an inode again once blocks moved, for what it holds now
+void fsck_reload_shared(struct fsck *fsck, struct fsck_shared *s)
+{
+	struct fsck_worker *w = fsck->main_worker;
+	struct winterfs_inode *raw = fsck_read_slot(w, s->inode->ino);
+	struct fsck_inode tmp;
+	bool ok;
+
+	if (!raw) {
+		return;
+	}
+	w->quiet = true;
+	ok = fsck_check_inode(w, s->inode->ino, raw, &tmp);
+	w->quiet = false;
+	if (!ok) {
+		fsck_free_dir(&tmp);
+		return;
+	}
+	free(s->ranges);
+	s->count = w->ranges.count;
+	s->ranges = xrealloc(NULL, w->ranges.count * sizeof(struct fsck_range));
+	memcpy(s->ranges, w->ranges.data, w->ranges.count * sizeof(struct fsck_range));
+	if (s->inode->dir) {
+		fsck_free_dir(s->inode);
+		s->inode->dir = tmp.dir;
+	} else {
+		fsck_free_dir(&tmp);
+	}
+}
+
+/*
+ * Settle who keeps blocks claimed by more than one inode. Without a
+ * journal that happens when a crash lost the write of an inode that had
+ * given blocks up, so the inode written most recently keeps them, and
+ * every other claimant gets a copy of its own. An inode there is no room
+ * to copy for is cleared.
+ */
+void fsck_resolve_dups(struct fsck *fsck)
+{
+	int err;
+	size_t d;
+	size_t i;
+	size_t r;
+	struct fsck_shared *shared = fsck->shared.data;
+	struct fsck_shared **keepers = xcalloc(fsck->dups.count, sizeof(struct fsck_shared *));
+
+	for (d = 0; d < fsck->dups.count; d++) {
+		struct fsck_range *dup = &VEC_AT(&fsck->dups, struct fsck_range, d);
+
+		for (i = 0; i < fsck->shared.count; i++) {
+			struct fsck_inode *rec = shared[i].inode;
+
+			if (!fsck_shared_has(&shared[i], dup)) {
+				continue;
+			}
+			if (!keepers[d] || rec->mtime > keepers[d]->inode->mtime
+					|| (rec->mtime == keepers[d]->inode->mtime
+						&& rec->ino < keepers[d]->inode->ino)) {
+				keepers[d] = &shared[i];
+			}
+		}
+	}
+
+	for (i = 0; i < fsck->shared.count; i++) {
+		bool copy = false;
+
+		for (d = 0; d < fsck->dups.count; d++) {
+			struct fsck_range *dup = &VEC_AT(&fsck->dups, struct fsck_range, d);
+
+			if (keepers[d] != &shared[i] && fsck_shared_has(&shared[i], dup)) {
+				fsck_problem(fsck, "copied", "Inode %u shares blocks %u-%u with inode %u",
+					shared[i].inode->ino, dup->start, dup->start + dup->len - 1,
+					keepers[d]->inode->ino);
+				copy = true;
+			}
+		}
+		if (!copy || !fsck->repair || fsck->failed) {
+			continue;
+		}
+		err = fsck_copy_shared(fsck, keepers, &shared[i]);
+		if (fsck->failed) {
+			break;
+		}
+		fsck_reload_shared(fsck, &shared[i]);
+		if (err) {
+			fsck_problem(fsck, "cleared", "No room to copy the blocks inode %u shares",
+				shared[i].inode->ino);
+			shared[i].inode->state |= FSCK_INODE_BAD;
+		}
+	}
+	free(keepers);
+
+	// what the cleared inodes held alone is free again
+	for (i = 0; i < fsck->shared.count; i++) {
+		if (!(shared[i].inode->state & FSCK_INODE_BAD)) {
+			continue;
+		}
+		shared[i].inode->state &= ~FSCK_INODE_MARKED;
+		for (r = 0; r < shared[i].count; r++) {
+			uint64_t b;
+			struct fsck_range *range = &shared[i].ranges[r];
+
+			for (b = range->start; b < (uint64_t)range->start + range->len; b++) {
+				if (fsck_find_dup(fsck, b, 1) < 0) {
+					fsck_clear_range(fsck->blocks_used, b, 1);
+				}
+			}
+		}
+	}
+	for (d = 0; d < fsck->dups.count; d++) {
+		struct fsck_range *dup = &VEC_AT(&fsck->dups, struct fsck_range, d);
+
+		for (i = 0; i < fsck->shared.count; i++) {
+			if (!(shared[i].inode->state & FSCK_INODE_BAD) && fsck_shared_has(&shared[i], dup)) {
+				break;
+			}
+		}
+		if (i == fsck->shared.count) {
+			fsck_clear_range(fsck->blocks_used, dup->start, dup->len);
+		}
+	}
+}
+
+/*
+ * An entry names an inode the bitset has as free, as a crash between the
+ * two writes leaves it. Take the inode back if its slot holds a sound
+ * inode whose blocks nothing else owns.
+ */
+struct fsck_inode *fsck_adopt(struct fsck_worker *w, uint32_t ino)
+{
+	size_t i;
+	struct fsck *fsck = w->fsck;
+	struct fsck_inode *rec = NULL;
+	struct fsck_inode tmp;
+	struct winterfs_inode *raw;
+
+	pthread_mutex_lock(&fsck->lock);
+	for (i = 0; i < fsck->adopted.count; i++) {
+		if (VEC_AT(&fsck->adopted, struct fsck_inode *, i)->ino == ino) {
+			rec = VEC_AT(&fsck->adopted, struct fsck_inode *, i);
+			goto out;
+		}
+	}
+
+	raw = fsck_read_slot(w, ino);
+	if (!raw || !le16(raw->mode)) {
+		goto out;
+	}
+	w->quiet = true;
+	if (!fsck_check_inode(w, ino, raw, &tmp)) {
+		w->quiet = false;
+		goto out;
+	}
+	w->quiet = false;
+	for (i = 0; i < w->ranges.count; i++) {
+		struct fsck_range *r = &VEC_AT(&w->ranges, struct fsck_range, i);
+		uint64_t b;
+
+		for (b = r->start; b < (uint64_t)r->start + r->len; b++) {
+			if (test_bit64(fsck->blocks_used, b)) {
+				fsck_free_dir(&tmp);
+				goto out;
+			}
+		}
+	}
+	fsck_mark_ranges(w);
+
+	rec = xrealloc(NULL, sizeof(struct fsck_inode));
+	*rec = tmp;
+	rec->state |= FSCK_INODE_MARKED;
+	*(struct fsck_inode **)vec_push(&fsck->adopted) = rec;
+	if (rec->dir) {
+		*(struct fsck_inode **)vec_push(&fsck->pending) = rec;
+	}
+	fsck_problem(fsck, "marked in use", "Inode %u is in use but marked free", ino);
+out:
+	pthread_mutex_unlock(&fsck->lock);
+	return rec;
+}
+
+// what a directory's hash index says about each of its blocks
+#define FSCK_DX_ENTRIES		0 // entry block the index doesn't reach
+#define FSCK_DX_INDEX		1
+#define FSCK_DX_LEAF		2
+
+struct fsck_dx {
+	bool ok;
+	uint8_t *kind;
+	uint32_t *lo; // hashes a leaf may hold, lo <= hash < hi
+	uint64_t *hi;
+};
+
+// data block holding file block 'block' of a directory, or 0
+uint32_t fsck_dir_map(struct fsck_dir *d, uint32_t block)
+{
+	uint32_t i;
+
+	for (i = 0; i < d->count; i++) {
+		if (block >= d->ext[i].block && block - d->ext[i].block < d->ext[i].len) {
+			return d->ext[i].start + (block - d->ext[i].block);
+		}
+	}
+
+	return 0;
+}
+
+int fsck_dir_read(struct fsck_worker *w, struct fsck_dir *d, uint32_t block, uint8_t *buf)
+{
+	struct fsck *fsck = w->fsck;
+	uint32_t start = fsck_dir_map(d, block);
+
+	if (!start) {
+		return -1;
+	}
+
+	return fsck_read(fsck, buf, fsck->block_size,
+		(uint64_t)(fsck->data_blocks_idx + start) << fsck->block_bits);
+}
+
+void fsck_dx_bad(struct fsck_worker *w, struct fsck_inode *dir, struct fsck_dx *dx,
+	const char *why)
+{
+	if (dx->ok) {
+		fsck_problem(w->fsck, "index rebuilt", "Directory %u has %s", dir->ino, why);
+		dx->ok = false;
+	}
+}
+
+/*
+ * Note the hash range of a block the index leads to, from the key of the
+ * block to the next one. A block continuing a hash holds that hash, and
+ * so does the block before it.
+ */
+void fsck_dx_leaf(struct fsck_worker *w, struct fsck_inode *dir, struct fsck_dx *dx,
+	uint32_t block, uint32_t from, uint64_t to)
+{
+	if (!block || block >= dir->dir->num_blocks || dx->kind[block] != FSCK_DX_ENTRIES) {
+		fsck_dx_bad(w, dir, dx, "a corrupt hash index");
+		return;
+	}
+	dx->kind[block] = FSCK_DX_LEAF;
+	dx->lo[block] = from & ~WINTERFS_DX_CONT;
+	dx->hi[block] = (to & WINTERFS_DX_CONT) ? (to & ~WINTERFS_DX_CONT) + 1 : to;
+}
+
+// hashes in a dx node must rise, each entry covering up to the next one,
+// and only keys of blocks continuing a hash repeat
+bool fsck_dx_node_ok(struct fsck *fsck, struct winterfs_dx_node *node, uint32_t lo, uint64_t hi)
+{
+	uint32_t i;
+	uint32_t count = le16(node->header.count);
+	uint32_t limit = (fsck->block_size - sizeof(struct winterfs_dx_header))
+		/ sizeof(struct winterfs_dx_entry);
+
+	if (le16(node->header.magic) != WINTERFS_DX_MAGIC || !count || count > limit) {
+		return false;
+	}
+	for (i = 1; i < count; i++) {
+		uint32_t hash = le32(node->entries[i].hash);
+		uint32_t prev = le32(node->entries[i - 1].hash);
+
+		if (hash < prev || (hash == prev && !(hash & WINTERFS_DX_CONT))
+				|| hash < lo || hash >= hi) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// every entry covers from its hash up to the next, the first from lo
+void fsck_dx_range(struct winterfs_dx_node *node, uint32_t i, uint32_t lo, uint64_t hi,
+	uint32_t *from, uint64_t *to)
+{
+	*from = i ? le32(node->entries[i].hash) : lo;
+	*to = i + 1 < le16(node->header.count) ? le32(node->entries[i + 1].hash) : hi;
+}
+
+/*
+ * Check the hash index of a directory: which blocks hold index nodes,
+ * and which hash range each entry block may hold. Every block that is not
+ * an index node has to be reached exactly once.
+ */
+void fsck_check_dx(struct fsck_worker *w, struct fsck_inode *dir, struct fsck_dx *dx)
+{
+	uint32_t i;
+	uint32_t j;
+	uint32_t levels;
+	uint32_t from;
+	uint64_t to;
+	struct fsck *fsck = w->fsck;
+	struct fsck_dir *d = dir->dir;
+	struct winterfs_dx_node *root = (struct winterfs_dx_node *)w->nodes[0];
+	struct winterfs_dx_node *node = (struct winterfs_dx_node *)w->nodes[1];
+
+	dx->ok = true;
+	dx->kind = xcalloc(d->num_blocks, 1);
+	dx->lo = xcalloc(d->num_blocks, sizeof(uint32_t));
+	dx->hi = xcalloc(d->num_blocks, sizeof(uint64_t));
+	dx->kind[0] = FSCK_DX_INDEX;
+
+	if (fsck_dir_read(w, d, 0, w->nodes[0])) {
+		fsck_dx_bad(w, dir, dx, "no hash index root");
+		return;
+	}
+	levels = le16(root->header.levels);
+
+	// what the kernel skips as index nodes, sound or not
+	if (levels && le16(root->header.count)) {
+		uint32_t count = MIN((uint32_t)le16(root->header.count),
+			(fsck->block_size - sizeof(struct winterfs_dx_header))
+			/ sizeof(struct winterfs_dx_entry));
+
+		for (i = 0; i < count; i++) {
+			uint32_t block = le32(root->entries[i].block);
+
+			if (block < d->num_blocks) {
+				dx->kind[block] = FSCK_DX_INDEX;
+			}
+		}
+	}
+
+	if (!fsck_dx_node_ok(fsck, root, 0, 1ULL << 32) || levels > WINTERFS_DX_MAX_LEVELS) {
+		fsck_dx_bad(w, dir, dx, "a corrupt hash index");
+		return;
+	}
+
+	for (i = 0; i < le16(root->header.count) && dx->ok; i++) {
+		uint32_t block = le32(root->entries[i].block);
+
+		fsck_dx_range(root, i, 0, 1ULL << 32, &from, &to);
+		if (!levels) {
+			fsck_dx_leaf(w, dir, dx, block, from, to);
+			continue;
+		}
+		if (!block || block >= d->num_blocks || fsck_dir_read(w, d, block, w->nodes[1])
+				|| !fsck_dx_node_ok(fsck, node, from, to) || le16(node->header.levels)) {
+			fsck_dx_bad(w, dir, dx, "a corrupt hash index");
+			break;
+		}
+		for (j = 0; j < le16(node->header.count) && dx->ok; j++) {
+			uint32_t leaf_from;
+			uint64_t leaf_to;
+
+			fsck_dx_range(node, j, from, to, &leaf_from, &leaf_to);
+			fsck_dx_leaf(w, dir, dx, le32(node->entries[j].block), leaf_from, leaf_to);
+		}
+	}
+
+	for (i = 1; i < d->num_blocks && dx->ok; i++) {
+		if (dx->kind[i] == FSCK_DX_ENTRIES) {
+			fsck_dx_bad(w, dir, dx, "entry blocks missing from its hash index");
+		}
+	}
+}
+
+enum {
+	FSCK_ENTRY_KEEP,
+	FSCK_ENTRY_CHANGED,
+	FSCK_ENTRY_REMOVE,
+};
+
+/*
+ * Check one directory entry and the inode it names. 'block' & 'off' are
+ * where the entry lives, as the inode records it for unlink.
+ */
+int fsck_check_entry(struct fsck_worker *w, struct fsck_inode *dir, struct fsck_dx *dx,
+	uint32_t fb, const char *name, uint32_t name_len, uint32_t ino, uint8_t *file_type,
+	uint32_t block, uint32_t off)
+{
+	int ret = FSCK_ENTRY_KEEP;
+	char shown[WINTERFS_FILENAME_MAX_LEN];
+	struct fsck *fsck = w->fsck;
+	struct fsck_inode *target;
+	uint8_t type;
+
+	fsck_name(shown, name, name_len);
+	if (!name_len || memchr(name, '/', name_len) || memchr(name, '\0', name_len)) {
+		fsck_problem(fsck, "removed", "Directory %u has an entry with a bad name \"%s\"",
+			dir->ino, shown);
+		return FSCK_ENTRY_REMOVE;
+	}
+	if (ino == WINTERFS_ROOT_INODE || ino == dir->ino || ino >= fsck->num_inodes) {
+		fsck_problem(fsck, "removed", "Entry \"%s\" in directory %u names inode %u",
+			shown, dir->ino, ino);
+		return FSCK_ENTRY_REMOVE;
+	}
+
+	target = fsck_lookup(fsck, ino);
+	if (!target) {
+		target = fsck_adopt(w, ino);
+	}
+	if (!target) {
+		fsck_problem(fsck, "removed", "Entry \"%s\" in directory %u names free inode %u",
+			shown, dir->ino, ino);
+		return FSCK_ENTRY_REMOVE;
+	}
+	if (__atomic_load_n(&target->state, __ATOMIC_RELAXED) & FSCK_INODE_BAD) {
+		fsck_problem(fsck, "removed", "Entry \"%s\" in directory %u names cleared inode %u",
+			shown, dir->ino, ino);
+		return FSCK_ENTRY_REMOVE;
+	}
+	// there are no hard links, the first entry found keeps the inode
+	if (__atomic_fetch_or(&target->state, FSCK_INODE_LINKED, __ATOMIC_RELAXED)
+			& FSCK_INODE_LINKED) {
+		fsck_problem(fsck, "removed", "Entry \"%s\" in directory %u is a second link to inode %u",
+			shown, dir->ino, ino);
+		return FSCK_ENTRY_REMOVE;
+	}
+	target->parent = dir->ino;
+
+	type = (target->state & FSCK_INODE_DIR) ? WINTERFS_FT_DIR : WINTERFS_FT_REG_FILE;
+	if (file_type && *file_type != type) {
+		fsck_problem(fsck, "fixed", "Entry \"%s\" in directory %u has the wrong file type",
+			shown, dir->ino);
+		*file_type = type;
+		ret = FSCK_ENTRY_CHANGED;
+	}
+
+	if (dx && dx->ok && dx->kind[fb] == FSCK_DX_LEAF) {
+		uint32_t hash = (uint32_t)(siphash(name, name_len, fsck->hash_key) >> 32)
+			& ~WINTERFS_DX_CONT;
+
+		if (hash < dx->lo[fb] || hash >= dx->hi[fb]) {
+			fsck_dx_bad(w, dir, dx, "names outside their hash range");
+		}
+	}
+
+	// entries move when the index splits a block, or an inline directory
+	// moves out of its inode, so a stale back-pointer is only a hint gone
+	// bad rather than an error
+	if (target->dir_block != block || target->dir_block_off != off) {
+		__atomic_add_fetch(&fsck->stale, 1, __ATOMIC_RELAXED);
+		fsck_push_fix(fsck, ino, FSCK_FIX_BACKPTR, block, off, NULL);
+	}
+
+	return ret;
+}
+
+void fsck_dir_block_init(struct fsck *fsck, uint8_t *data, uint32_t size)
+{
+	memset(data, 0, size);
+	if (fsck->features & WINTERFS_FEATURE_DIRENT2) {
+		((struct winterfs_dirent *)data)->rec_len = rec_len_to_disk(size);
+	}
+}
+
+/*
+ * Check the entries of one directory block, or of an inline directory,
+ * removing the ones that can't stay. A broken record chain is cut at the
+ * last sound record. Returns true if the block was changed.
+ */
+bool fsck_check_dir_block(struct fsck_worker *w, struct fsck_inode *dir, struct fsck_dx *dx,
+	uint8_t *data, uint32_t size, uint32_t fb, uint32_t block)
+{
+	uint32_t i;
+	uint32_t off;
+	uint32_t prev = 0;
+	uint32_t rec_len;
+	bool has_prev = false;
+	bool changed = false;
+	struct fsck *fsck = w->fsck;
+
+	if (!(fsck->features & WINTERFS_FEATURE_DIRENT2)) {
+		struct winterfs_dir_block *db = (struct winterfs_dir_block *)data;
+
+		for (i = 0; i < WINTERFS_FILES_PER_DIR_BLOCK; i++) {
+			uint32_t ino = le32(db->inode_list[i]);
+			const char *name = (const char *)db->files[i].name;
+
+			if (!ino) {
+				continue;
+			}
+			if (fsck_check_entry(w, dir, dx, fb, name,
+					strnlen(name, WINTERFS_FILENAME_MAX_LEN - 1), ino, NULL,
+					block, i) == FSCK_ENTRY_REMOVE) {
+				db->inode_list[i] = 0;
+				changed = true;
+				continue;
+			}
+			dir->dir->children++;
+		}
+		return changed;
+	}
+
+	for (off = 0; off < size; off += rec_len) {
+		struct winterfs_dirent *de = (struct winterfs_dirent *)(data + off);
+
+		rec_len = rec_len_from_disk(de->rec_len);
+		// a block that was never written reads as one free record
+		if (off == 0 && rec_len == 0 && !de->inode) {
+			rec_len = size;
+		}
+		if (rec_len < sizeof(struct winterfs_dirent) || rec_len % 4 || rec_len > size - off
+				|| (de->inode && WINTERFS_DIRENT_LEN(de->name_len) > rec_len)) {
+			fsck_problem(fsck, "truncated",
+				"Directory %u has a corrupt entry at offset %u of block %u",
+				dir->ino, off, fb);
+			if (has_prev) {
+				((struct winterfs_dirent *)(data + prev))->rec_len =
+					rec_len_to_disk(size - prev);
+			} else {
+				fsck_dir_block_init(fsck, data, size);
+			}
+			return true;
+		}
+		if (!de->inode) {
+			prev = off;
+			has_prev = true;
+			continue;
+		}
+
+		switch (fsck_check_entry(w, dir, dx, fb, de->name, de->name_len, le32(de->inode),
+				&de->file_type, block, off)) {
+		case FSCK_ENTRY_REMOVE:
+			// merged into the record before it, as unlink does
+			if (has_prev) {
+				((struct winterfs_dirent *)(data + prev))->rec_len =
+					rec_len_to_disk(off + rec_len - prev);
+			} else {
+				de->inode = 0;
+				prev = off;
+				has_prev = true;
+			}
+			changed = true;
+			break;
+		case FSCK_ENTRY_CHANGED:
+			changed = true;
+			// fall through
+		default:
+			dir->dir->children++;
+			prev = off;
+			has_prev = true;
+		}
+	}
+
+	return changed;
+}
+
+// a live entry of a directory whose index is rebuilt
+struct fsck_dx_name {
+	uint32_t hash;
+	uint32_t ino;
+	size_t name; // offset into the names read
+	uint8_t name_len;
+	uint8_t file_type;
+};
+
+int fsck_dx_name_cmp(const void *a, const void *b)
+{
+	const struct fsck_dx_name *na = a;
+	const struct fsck_dx_name *nb = b;
+
+	return na->hash < nb->hash ? -1 : na->hash > nb->hash;
+}
+
+// bytes of an entry block an entry takes, or slots without dirent2
+uint32_t fsck_dx_need(struct fsck *fsck, struct fsck_dx_name *n)
+{
+	if (!(fsck->features & WINTERFS_FEATURE_DIRENT2)) {
+		return 1;
+	}
+	return WINTERFS_DIRENT_LEN(n->name_len);
+}
+
+/*
+ * Deal the entries, in hash order, out to 'leaves' entry blocks. Spread
+ * evenly there is room left in every block for the names still to come,
+ * and when that doesn't fit each block is filled up instead. Returns
+ * false if the entries don't fit either way.
+ */
+bool fsck_dx_deal(struct fsck *fsck, struct fsck_dx_name *names, size_t count, uint32_t leaves,
+	size_t *first)
+{
+	int pass;
+	size_t i;
+	uint32_t l;
+	uint64_t total = 0;
+	uint32_t cap = (fsck->features & WINTERFS_FEATURE_DIRENT2) ? fsck->block_size
+		: WINTERFS_FILES_PER_DIR_BLOCK;
+
+	for (i = 0; i < count; i++) {
+		total += fsck_dx_need(fsck, &names[i]);
+	}
+	for (pass = 0; pass < 2; pass++) {
+		uint64_t left = total;
+
+		for (i = 0, l = 0; l < leaves; l++) {
+			uint64_t used = 0;
+			uint64_t target = pass ? cap : DIV_ROUND_UP(left, leaves - l);
+
+			first[l] = i;
+			while (i < count && used < target
+					&& used + fsck_dx_need(fsck, &names[i]) <= cap) {
+				used += fsck_dx_need(fsck, &names[i]);
+				i++;
+			}
+			left -= used;
+		}
+		first[leaves] = i;
+		if (i == count) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Index keys of the entry blocks. A block starting part way through the
+ * names of one hash continues it. Empty blocks at the end, left by a
+ * directory that shrank, split the hashes above the last name between
+ * them, or continue the last hash if there are too few of those.
+ */
+void fsck_dx_keys(struct fsck_dx_name *names, uint32_t leaves, size_t *first, uint32_t *key)
+{
+	uint32_t l;
+	uint32_t empty;
+	uint64_t base;
+	uint64_t span;
+
+	key[0] = 0;
+	for (l = 1; l < leaves && first[l] < first[l + 1]; l++) {
+		uint32_t hash = names[first[l]].hash;
+
+		key[l] = names[first[l] - 1].hash == hash ? hash | WINTERFS_DX_CONT : hash;
+	}
+	if (l == leaves) {
+		return;
+	}
+
+	empty = leaves - l;
+	base = (uint64_t)(key[l - 1] | WINTERFS_DX_CONT) + 1;
+	span = (1ULL << 32) - base;
+	for (; l < leaves; l++) {
+		if (span >= 2ULL * empty) {
+			key[l] = base + ((span * (l - (leaves - empty)) / empty) & ~1ULL);
+		} else {
+			key[l] = key[l - 1] | WINTERFS_DX_CONT;
+		}
+	}
+}
+
+void fsck_dx_init_node(struct fsck *fsck, struct winterfs_dx_node *node, uint16_t levels,
+	uint16_t count)
+{
+	memset(node, 0, fsck->block_size);
+	node->header.magic = le16(WINTERFS_DX_MAGIC);
+	node->header.levels = le16(levels);
+	node->header.count = le16(count);
+	node->header.limit = le16((fsck->block_size - sizeof(struct winterfs_dx_header))
+		/ sizeof(struct winterfs_dx_entry));
+}
+
+/*
+ * Write a fresh hash index over the blocks of a directory: block 0 holds
+ * the root, index nodes follow when the root can't reach every block, and
+ * the rest hold the entries sorted by hash. The blocks index nodes took
+ * before hold entries now. Entries move, so their back-pointers are set
+ * again. Returns ENOSPC if the blocks can't hold the entries that way,
+ * so the index has to go, or the error of a failed read or write.
+ */
+int fsck_dx_rebuild(struct fsck_worker *w, struct fsck_inode *dir, struct fsck_dx *dx)
+{
+	int err = 0;
+	size_t i;
+	uint32_t b;
+	uint32_t l;
+	uint32_t j;
+	uint32_t off;
+	uint32_t rec_len;
+	uint32_t nodes = 0;
+	uint32_t leaves;
+	struct fsck *fsck = w->fsck;
+	struct fsck_dir *d = dir->dir;
+	uint32_t limit = (fsck->block_size - sizeof(struct winterfs_dx_header))
+		/ sizeof(struct winterfs_dx_entry);
+	struct vec names = VEC_INIT(struct fsck_dx_name);
+	char *text = NULL;
+	size_t text_len = 0;
+	size_t *first = NULL;
+	uint32_t *key = NULL;
+	uint32_t *node_first = NULL;
+	uint8_t *data = w->nodes[0];
+	struct winterfs_dx_node *node = (struct winterfs_dx_node *)w->nodes[0];
+
+	if (d->num_blocks < 2) {
+		return ENOSPC;
+	}
+	for (b = 0; b < d->num_blocks; b++) {
+		if (!fsck_dir_map(d, b)) {
+			return ENOSPC;
+		}
+	}
+	if (d->num_blocks - 1 > limit) {
+		nodes = DIV_ROUND_UP(d->num_blocks - 1, limit + 1);
+		if (nodes > limit) {
+			return ENOSPC;
+		}
+	}
+	leaves = d->num_blocks - 1 - nodes;
+
+	// the entries, as pass 2 left them
+	for (b = 1; b < d->num_blocks; b++) {
+		if (dx->kind[b] == FSCK_DX_INDEX) {
+			continue;
+		}
+		err = fsck_dir_read(w, d, b, data);
+		if (err) {
+			goto out;
+		}
+		for (off = 0; off < fsck->block_size; off += rec_len) {
+			struct fsck_dx_name *n;
+			const char *name;
+			uint32_t name_len;
+			uint32_t ino;
+			uint8_t file_type = 0;
+
+			if (!(fsck->features & WINTERFS_FEATURE_DIRENT2)) {
+				struct winterfs_dir_block *db = (struct winterfs_dir_block *)data;
+
+				rec_len = 1;
+				if (off >= WINTERFS_FILES_PER_DIR_BLOCK) {
+					break;
+				}
+				ino = le32(db->inode_list[off]);
+				name = (const char *)db->files[off].name;
+				name_len = strnlen(name, WINTERFS_FILENAME_MAX_LEN - 1);
+			} else {
+				struct winterfs_dirent *de = (struct winterfs_dirent *)(data + off);
+
+				rec_len = rec_len_from_disk(de->rec_len);
+				if (rec_len < sizeof(struct winterfs_dirent)
+						|| rec_len > fsck->block_size - off) {
+					break;
+				}
+				ino = le32(de->inode);
+				name = de->name;
+				name_len = de->name_len;
+				file_type = de->file_type;
+			}
+			if (!ino) {
+				continue;
+			}
+
+			n = vec_push(&names);
+			n->hash = (uint32_t)(siphash(name, name_len, fsck->hash_key) >> 32)
+				& ~WINTERFS_DX_CONT;
+			n->ino = ino;
+			n->name = text_len;
+			n->name_len = name_len;
+			n->file_type = file_type;
+			text = xrealloc(text, text_len + name_len);
+			memcpy(text + text_len, name, name_len);
+			text_len += name_len;
+		}
+	}
+	qsort(names.data, names.count, sizeof(struct fsck_dx_name), fsck_dx_name_cmp);
+
+	first = xcalloc(leaves + 1, sizeof(size_t));
+	key = xcalloc(leaves, sizeof(uint32_t));
+	if (!fsck_dx_deal(fsck, names.data, names.count, leaves, first)) {
+		err = ENOSPC;
+		goto out;
+	}
+	fsck_dx_keys(names.data, leaves, first, key);
+
+	// index nodes split the blocks evenly, but never between two of one key
+	node_first = xcalloc(nodes + 1, sizeof(uint32_t));
+	node_first[nodes] = leaves;
+	for (j = 1; j < nodes; j++) {
+		l = (uint64_t)j * leaves / nodes;
+		while (l > node_first[j - 1] + 1 && key[l] == key[l - 1]) {
+			l--;
+		}
+		if (key[l] == key[l - 1]) {
+			err = ENOSPC;
+			goto out;
+		}
+		node_first[j] = l;
+	}
+	for (j = 0; j < nodes; j++) {
+		if (node_first[j + 1] - node_first[j] > limit) {
+			err = ENOSPC;
+			goto out;
+		}
+	}
+
+	for (l = 0; l < leaves; l++) {
+		uint32_t fb = 1 + nodes + l;
+		uint32_t block = fsck->data_blocks_idx + fsck_dir_map(d, fb);
+
+		fsck_dir_block_init(fsck, data, fsck->block_size);
+		for (i = first[l], off = 0; i < first[l + 1]; i++) {
+			struct fsck_dx_name *n = &VEC_AT(&names, struct fsck_dx_name, i);
+
+			if (!(fsck->features & WINTERFS_FEATURE_DIRENT2)) {
+				struct winterfs_dir_block *db = (struct winterfs_dir_block *)data;
+
+				db->inode_list[off] = le32(n->ino);
+				memcpy(db->files[off].name, text + n->name, n->name_len);
+				fsck_push_fix(fsck, n->ino, FSCK_FIX_BACKPTR, block, off, NULL);
+				off++;
+			} else {
+				struct winterfs_dirent *de = (struct winterfs_dirent *)(data + off);
+
+				rec_len = i + 1 < first[l + 1] ? fsck_dx_need(fsck, n)
+					: fsck->block_size - off;
+				de->inode = le32(n->ino);
+				de->rec_len = rec_len_to_disk(rec_len);
+				de->name_len = n->name_len;
+				de->file_type = n->file_type;
+				memcpy(de->name, text + n->name, n->name_len);
+				fsck_push_fix(fsck, n->ino, FSCK_FIX_BACKPTR, block, off, NULL);
+				off += rec_len;
+			}
+		}
+		err = fsck_write(fsck, data, fsck->block_size,
+			(uint64_t)block << fsck->block_bits);
+		if (err) {
+			goto out;
+		}
+	}
+
+	for (j = 0; j < nodes; j++) {
+		fsck_dx_init_node(fsck, node, 0, node_first[j + 1] - node_first[j]);
+		for (l = node_first[j]; l < node_first[j + 1]; l++) {
+			node->entries[l - node_first[j]].hash = le32(key[l]);
+			node->entries[l - node_first[j]].block = le32(1 + nodes + l);
+		}
+		err = fsck_write(fsck, data, fsck->block_size,
+			(uint64_t)(fsck->data_blocks_idx + fsck_dir_map(d, 1 + j)) << fsck->block_bits);
+		if (err) {
+			goto out;
+		}
+	}
+
+	// entry blocks follow the root directly when there are no index nodes
+	fsck_dx_init_node(fsck, node, nodes ? 1 : 0, nodes ? nodes : leaves);
+	for (j = 0; j < (nodes ? nodes : leaves); j++) {
+		node->entries[j].hash = le32(key[nodes ? node_first[j] : j]);
+		node->entries[j].block = le32(1 + j);
+	}
+	err = fsck_write(fsck, data, fsck->block_size,
+		(uint64_t)(fsck->data_blocks_idx + fsck_dir_map(d, 0)) << fsck->block_bits);
+
+out:
+	free(node_first);
+	free(key);
+	free(first);
+	free(text);
+	vec_free(&names);
+
+	return err;
+}
+
+/*
+ * Pass 2: every entry of one directory. Blocks are read a run at a time,
+ * and written back in place when repairs changed them.
+ */
+void fsck_pass2_dir(struct fsck_worker *w, uint64_t item)
+{
+	uint32_t i;
+	uint32_t b;
+	struct fsck *fsck = w->fsck;
+	struct fsck_inode *dir = fsck->work[item];
+	struct fsck_dir *d = dir->dir;
+	struct fsck_dx dx;
+	struct fsck_dx *dxp = NULL;
+	uint32_t run_max = FSCK_CHUNK_SIZE >> fsck->block_bits;
+
+	if (__atomic_load_n(&dir->state, __ATOMIC_RELAXED) & FSCK_INODE_BAD) {
+		return;
+	}
+	__atomic_add_fetch(&fsck->items, 1, __ATOMIC_RELAXED);
+
+	if (dir->flags & WINTERFS_INODE_INLINE_FL) {
+		uint8_t *copy = xrealloc(NULL, fsck->inline_size);
+
+		memcpy(copy, d->inline_data, fsck->inline_size);
+		if (fsck_check_dir_block(w, dir, NULL, copy, fsck->inline_size, 0, 0)) {
+			fsck_push_fix(fsck, dir->ino, FSCK_FIX_INLINE, 0, 0, copy);
+		} else {
+			free(copy);
+		}
+		goto children;
+	}
+
+	if ((dir->flags & WINTERFS_INODE_INDEX_FL) && d->num_blocks) {
+		memset(&dx, 0, sizeof(dx));
+		fsck_check_dx(w, dir, &dx);
+		dxp = &dx;
+		if (fsck->failed) {
+			goto out;
+		}
+	}
+
+	for (i = 0; i < d->count; i++) {
+		struct fsck_extent *e = &d->ext[i];
+
+		for (b = 0; b < e->len; ) {
+			uint32_t run = MIN(e->len - b, run_max);
+			uint32_t k;
+			bool changed = false;
+			uint64_t pos = (uint64_t)(fsck->data_blocks_idx + e->start + b) << fsck->block_bits;
+
+			if (fsck_read(fsck, w->buf, (size_t)run << fsck->block_bits, pos)) {
+				goto out;
+			}
+			for (k = 0; k < run; k++) {
+				uint32_t fb = e->block + b + k;
+
+				if (dxp && dxp->kind[fb] == FSCK_DX_INDEX) {
+					continue;
+				}
+				changed |= fsck_check_dir_block(w, dir, dxp, w->buf + ((size_t)k << fsck->block_bits),
+					fsck->block_size, fb, fsck->data_blocks_idx + e->start + b + k);
+			}
+			if (changed && fsck->repair
+					&& fsck_write(fsck, w->buf, (size_t)run << fsck->block_bits, pos)) {
+				goto out;
+			}
+			b += run;
+		}
+	}
+
+	if (dxp && !dxp->ok && fsck->repair) {
+		int err = fsck_dx_rebuild(w, dir, dxp);
+
+		if (!err) {
+			goto children;
+		}
+		if (err != ENOSPC) {
+			goto out;
+		}
+		fsck_problem(fsck, "index dropped",
+			"Directory %u has no room to rebuild its hash index", dir->ino);
+	}
+
+	// an index that can't be rebuilt goes, and lookups fall back to
+	// reading every block
+	if (dxp && !dxp->ok && fsck->repair) {
+		fsck_dir_block_init(fsck, w->nodes[0], fsck->block_size);
+		for (b = 0; b < d->num_blocks; b++) {
+			uint32_t start = fsck_dir_map(d, b);
+
+			if (dxp->kind[b] == FSCK_DX_INDEX && start
+					&& fsck_write(fsck, w->nodes[0], fsck->block_size,
+						(uint64_t)(fsck->data_blocks_idx + start) << fsck->block_bits)) {
+				goto out;
+			}
+		}
+		fsck_push_fix(fsck, dir->ino, FSCK_FIX_FLAGS, WINTERFS_INODE_INDEX_FL, 0, NULL);
+	}
+
+children:
+	if (d->children != d->num_children) {
+		fsck_problem(fsck, "fixed", "Directory %u counts %u entries, but holds %u",
+			dir->ino, d->num_children, d->children);
+		fsck_push_fix(fsck, dir->ino, FSCK_FIX_CHILDREN, d->children, 0, NULL);
+	}
+out:
+	if (dxp) {
+		free(dx.kind);
+		free(dx.lo);
+		free(dx.hi);
+	}
+}
+
+/*
+ * Settle whether an inode can be reached from the root, following the
+ * chain of directories that name it. Anything along a chain that ends
+ * anywhere but the root, or loops, is an orphan.
+ */
+void fsck_reach(struct fsck *fsck, struct fsck_inode *rec)
+{
+	struct vec chain = VEC_INIT(struct fsck_inode *);
+	struct fsck_inode *cur = rec;
+	uint32_t mark;
+	size_t i;
+
+	while (cur && !(cur->state & (FSCK_INODE_REACHABLE | FSCK_INODE_ORPHAN
+			| FSCK_INODE_VISITING | FSCK_INODE_BAD))) {
+		cur->state |= FSCK_INODE_VISITING;
+		*(struct fsck_inode **)vec_push(&chain) = cur;
+		cur = (cur->state & FSCK_INODE_LINKED) ? fsck_lookup(fsck, cur->parent) : NULL;
+	}
+
+	mark = cur && (cur->state & FSCK_INODE_REACHABLE) ? FSCK_INODE_REACHABLE : FSCK_INODE_ORPHAN;
+	for (i = 0; i < chain.count; i++) {
+		struct fsck_inode *c = VEC_AT(&chain, struct fsck_inode *, i);
+
+		c->state = (c->state & ~FSCK_INODE_VISITING) | mark;
+	}
+	vec_free(&chain);
+}
+
+/*
+ * Pass 3: clear every inode in use that isn't reachable from the root.
+ * There is no lost+found to reconnect them to, so their blocks are freed.
+ */
+void fsck_pass3_inode(struct fsck *fsck, struct fsck_inode *rec)
+{
+	struct fsck_worker *w = fsck->main_worker;
+	struct fsck_inode tmp;
+	struct winterfs_inode *raw;
+	size_t i;
+
+	fsck->items++;
+	fsck_reach(fsck, rec);
+	if (!(rec->state & FSCK_INODE_ORPHAN) || (rec->state & FSCK_INODE_BAD)) {
+		return;
+	}
+
+	if (!(rec->state & FSCK_INODE_LINKED)) {
+		fsck_problem(fsck, "cleared", "Inode %u is in use but no directory names it", rec->ino);
+	} else {
+		fsck_problem(fsck, "cleared", "Inode %u is cut off from the root directory", rec->ino);
+	}
+	rec->state |= FSCK_INODE_BAD;
+
+	if (!(rec->state & FSCK_INODE_MARKED)) {
+		return;
+	}
+	rec->state &= ~FSCK_INODE_MARKED;
+	raw = fsck_read_slot(w, rec->ino);
+	if (!raw) {
+		return;
+	}
+	w->quiet = true;
+	if (fsck_check_inode(w, rec->ino, raw, &tmp)) {
+		for (i = 0; i < w->ranges.count; i++) {
+			struct fsck_range *r = &VEC_AT(&w->ranges, struct fsck_range, i);
+
+			fsck_clear_range(fsck->blocks_used, r->start, r->len);
+		}
+	}
+	w->quiet = false;
+	fsck_free_dir(&tmp);
+}
+
+void fsck_pass4_inode(struct fsck *fsck, struct fsck_inode *rec)
+{
+	if (!(rec->state & FSCK_INODE_BAD)) {
+		set_bit64(fsck->inodes_used, rec->ino);
+	}
+}
+
+/*
+ * Bring an on-disk bitset in line with the bits found in use, writing
+ * back only the blocks that differ. Bits past 'bits' are left alone.
+ */
+int fsck_sync_bitset(struct fsck *fsck, const char *what, uint8_t *bitset, uint32_t idx,
+	const uint64_t *map, uint32_t bits, uint64_t *used)
+{
+	uint64_t i;
+	uint64_t leaked = 0;
+	uint64_t lost = 0;
+	uint64_t bytes = DIV_ROUND_UP((uint64_t)bits, 8);
+	uint8_t *dirty = xcalloc(DIV_ROUND_UP(bytes, fsck->block_size), 1);
+	int err = 0;
+
+	*used = 0;
+	for (i = 0; i < bytes; i++) {
+		uint8_t want = map[i / 8] >> ((i % 8) * 8);
+		uint8_t old = bitset[i];
+
+		if (i == bytes - 1 && bits % 8) {
+			uint8_t keep = 0xff << (bits % 8);
+
+			want = (want & ~keep) | (old & keep);
+		}
+		*used += __builtin_popcount(want & (i == bytes - 1 && bits % 8
+			? (uint8_t)~(0xff << (bits % 8)) : 0xff));
+		if (want == old) {
+			continue;
+		}
+		leaked += __builtin_popcount(old & ~want);
+		lost += __builtin_popcount(want & ~old);
+		bitset[i] = want;
+		dirty[i / fsck->block_size] = 1;
+	}
+
+	if (lost) {
+		fsck_problem(fsck, "rebuilt", "%llu %s in use are marked free",
+			(unsigned long long)lost, what);
+	}
+	if (leaked) {
+		fsck_problem(fsck, "rebuilt", "%llu free %s are marked in use",
+			(unsigned long long)leaked, what);
+	}
+
+	for (i = 0; fsck->repair && i < DIV_ROUND_UP(bytes, fsck->block_size) && !err; i++) {
+		if (!dirty[i]) {
+			continue;
+		}
+		err = fsck_write(fsck, bitset + i * fsck->block_size, fsck->block_size,
+			(idx + i) << fsck->block_bits);
+	}
+	free(dirty);
+
+	return err;
+}
+
+int fsck_fix_cmp(const void *a, const void *b)
+{
+	const struct fsck_fix *fa = a;
+	const struct fsck_fix *fb = b;
+
+	if (fa->ino != fb->ino) {
+		return fa->ino < fb->ino ? -1 : 1;
+	}
+	return fa->seq < fb->seq ? -1 : fa->seq > fb->seq;
+}
+
+// write the changes to inode table slots, each table block once
+int fsck_apply_fixes(struct fsck *fsck)
+{
+	size_t i;
+	int err = 0;
+	uint64_t cur = UINT64_MAX;
+	uint8_t *buf = alloc_buffer(fsck->block_size);
+
+	qsort(fsck->fixes.data, fsck->fixes.count, sizeof(struct fsck_fix), fsck_fix_cmp);
+	for (i = 0; i < fsck->fixes.count && !err; i++) {
+		struct fsck_fix *fix = &VEC_AT(&fsck->fixes, struct fsck_fix, i);
+		struct fsck_inode *rec = fsck_lookup(fsck, fix->ino);
+		uint64_t pos = (uint64_t)(fix->ino - 1) * fsck->inode_size;
+		uint64_t block = WINTERFS_INODES_BLOCK_ADDR + (pos >> fsck->block_bits);
+		struct winterfs_inode *raw;
+
+		// cleared inodes only lose their bit, like the kernel frees them
+		if (!rec || (rec->state & FSCK_INODE_BAD)) {
+			continue;
+		}
+		if (block != cur) {
+			if (cur != UINT64_MAX) {
+				err = fsck_write(fsck, buf, fsck->block_size, cur << fsck->block_bits);
+				if (err) {
+					break;
+				}
+			}
+			cur = block;
+			err = fsck_read(fsck, buf, fsck->block_size, cur << fsck->block_bits);
+			if (err) {
+				break;
+			}
+		}
+
+		raw = (struct winterfs_inode *)(buf + (pos & (fsck->block_size - 1)));
+		switch (fix->kind) {
+		case FSCK_FIX_BACKPTR:
+			raw->dir_block = le32(fix->a);
+			raw->dir_block_off = le32(fix->b);
+			break;
+		case FSCK_FIX_CHILDREN:
+			raw->num_children = le32(fix->a);
+			break;
+		case FSCK_FIX_FLAGS:
+			raw->flags = le32(le32(raw->flags) & ~fix->a);
+			break;
+		case FSCK_FIX_INLINE:
+			memcpy((uint8_t *)raw + WINTERFS_INODE_SIZE, fix->data, fsck->inline_size);
+			break;
+		}
+	}
+	if (!err && cur != UINT64_MAX) {
+		err = fsck_write(fsck, buf, fsck->block_size, cur << fsck->block_bits);
+	}
+	free(buf);
+
+	return err;
+}
+
+int fsck_load_super(struct fsck *fsck)
+{
+	uint64_t dev_size;
+	uint32_t bits_per_block;
+	struct winterfs_superblock *ws;
+	static const uint8_t magic[4] = { 0x57, 0x4e, 0x46, 0x53 };
+	int err;
+
+	fsck->sb_block = alloc_buffer(WINTERFS_MAX_BLOCK_SIZE);
+	if ((err = read_at(fsck->fd, fsck->sb_block, WINTERFS_BLOCK_SIZE, 0))) {
+		printf("Error reading superblock: os error %d\n", err);
+		return FSCK_ERROR;
+	}
+	ws = fsck->sb = (struct winterfs_superblock *)fsck->sb_block;
+	if (memcmp(ws->magic, magic, sizeof(magic))) {
+		printf("%s is not a winterfs volume\n", fsck->device);
+		return FSCK_ERROR;
+	}
+
+	fsck->num_blocks = le32(ws->num_blocks);
+	fsck->free_inode_bitset_idx = le32(ws->free_inode_bitset_idx);
+	fsck->free_block_bitset_idx = le32(ws->free_block_bitset_idx);
+	fsck->bad_block_bitset_idx = le32(ws->bad_block_bitset_idx);
+	fsck->data_blocks_idx = le32(ws->data_blocks_idx);
+	fsck->revision = le32(ws->revision) ? le32(ws->revision) : WINTERFS_REVISION_V1;
+	fsck->features = le32(ws->features);
+	fsck->hash_key[0] = le32(ws->hash_key[0]) | (uint64_t)le32(ws->hash_key[1]) << 32;
+	fsck->hash_key[1] = le32(ws->hash_key[2]) | (uint64_t)le32(ws->hash_key[3]) << 32;
+	fsck->state = le32(ws->state);
+	fsck->inode_size = (fsck->features & WINTERFS_FEATURE_LARGE_INODE)
+		? le32(ws->inode_size) : WINTERFS_INODE_SIZE;
+	fsck->block_size = (fsck->features & WINTERFS_FEATURE_BLOCK_SIZE)
+		? le32(ws->block_size) : WINTERFS_BLOCK_SIZE;
+
+	if (fsck->revision > WINTERFS_REVISION_V2) {
+		printf("Unsupported winterfs revision %u\n", fsck->revision);
+		return FSCK_ERROR;
+	}
+	if (fsck->features & ~WINTERFS_FEATURE_SUPPORTED) {
+		printf("Unsupported winterfs features 0x%x\n",
+			fsck->features & ~WINTERFS_FEATURE_SUPPORTED);
+		return FSCK_ERROR;
+	}
+	if (fsck->block_size < WINTERFS_MIN_BLOCK_SIZE || fsck->block_size > WINTERFS_MAX_BLOCK_SIZE
+			|| (fsck->block_size & (fsck->block_size - 1))) {
+		printf("Unsupported block size %u\n", fsck->block_size);
+		return FSCK_ERROR;
+	}
+	if (fsck->inode_size < WINTERFS_INODE_SIZE || fsck->inode_size > WINTERFS_INODE_SIZE_MAX
+			|| (fsck->inode_size & (fsck->inode_size - 1))) {
+		printf("Unsupported inode size %u\n", fsck->inode_size);
+		return FSCK_ERROR;
+	}
+	if (!(fsck->features & WINTERFS_FEATURE_DIRENT2) && fsck->block_size != WINTERFS_MIN_BLOCK_SIZE) {
+		printf("Block size %u needs feature dirent2\n", fsck->block_size);
+		return FSCK_ERROR;
+	}
+	fsck->block_bits = __builtin_ctz(fsck->block_size);
+	if ((fsck->features & WINTERFS_FEATURE_INLINE_DATA) && fsck->inode_size > WINTERFS_INODE_SIZE) {
+		fsck->inline_size = fsck->inode_size - WINTERFS_INODE_SIZE;
+	}
+
+	// the rest of the superblock's block comes along for rewriting it
+	if (fsck->block_size > WINTERFS_BLOCK_SIZE
+			&& (err = read_at(fsck->fd, fsck->sb_block, fsck->block_size, 0))) {
+		printf("Error reading superblock: os error %d\n", err);
+		return FSCK_ERROR;
+	}
+
+	// every region in order, and all of them on the device
+	bits_per_block = fsck->block_size * 8;
+	if (ioctl(fsck->fd, BLKGETSIZE64, &dev_size)) {
+		printf("Error reading device size: os error %d\n", errno);
+		return FSCK_ERROR;
+	}
+	if (fsck->free_inode_bitset_idx <= WINTERFS_INODES_BLOCK_ADDR
+			|| fsck->free_block_bitset_idx < fsck->free_inode_bitset_idx
+			|| fsck->bad_block_bitset_idx < fsck->free_block_bitset_idx
+			|| fsck->data_blocks_idx < fsck->bad_block_bitset_idx
+			|| fsck->data_blocks_idx >= fsck->num_blocks
+			|| (uint64_t)fsck->num_blocks << fsck->block_bits > dev_size) {
+		printf("Superblock has a corrupt layout\n");
+		return FSCK_UNCORRECTED;
+	}
+	fsck->num_data_blocks = fsck->num_blocks - fsck->data_blocks_idx;
+	fsck->num_inodes = MIN((uint64_t)le32(ws->num_inodes),
+		(uint64_t)(fsck->free_block_bitset_idx - fsck->free_inode_bitset_idx) * bits_per_block);
+	if (fsck->num_inodes < 2
+			|| ((uint64_t)(fsck->num_inodes - 1) * fsck->inode_size
+				> (uint64_t)(fsck->free_inode_bitset_idx - WINTERFS_INODES_BLOCK_ADDR)
+				<< fsck->block_bits)
+			|| ((uint64_t)(fsck->bad_block_bitset_idx - fsck->free_block_bitset_idx)
+				* bits_per_block < fsck->num_data_blocks)) {
+		printf("Superblock has a corrupt layout\n");
+		return FSCK_UNCORRECTED;
+	}
+
+	return 0;
+}
+
+// both bitsets, each in a single large read
+int fsck_load_bitsets(struct fsck *fsck)
+{
+	uint32_t inode_blocks = fsck->free_block_bitset_idx - fsck->free_inode_bitset_idx;
+	uint32_t block_blocks = DIV_ROUND_UP(fsck->num_data_blocks, fsck->block_size * 8);
+
+	fsck->inode_bitset = alloc_buffer((size_t)inode_blocks << fsck->block_bits);
+	fsck->block_bitset = alloc_buffer((size_t)block_blocks << fsck->block_bits);
+	if (fsck_read(fsck, fsck->inode_bitset, (size_t)inode_blocks << fsck->block_bits,
+				(uint64_t)fsck->free_inode_bitset_idx << fsck->block_bits)
+			|| fsck_read(fsck, fsck->block_bitset, (size_t)block_blocks << fsck->block_bits,
+				(uint64_t)fsck->free_block_bitset_idx << fsck->block_bits)) {
+		return FSCK_ERROR;
+	}
+	fsck->blocks_used = xcalloc(DIV_ROUND_UP((uint64_t)fsck->num_data_blocks, 64),
+		sizeof(uint64_t));
+
+	return 0;
+}
+
+int check_device(struct fsck *fsck)
+{
+	int err;
+	uint32_t i;
+	uint64_t used_inodes;
+	uint64_t used_blocks;
+	double start;
+	double began = now();
+	struct fsck_worker *workers;
+	struct fsck_inode *root;
+
+	if ((err = fsck_load_super(fsck))) {
+		return err;
+	}
+
+	if ((fsck->state & WINTERFS_STATE_CLEAN) && !fsck->force) {
+		printf("%s: clean, %u/%u files, %u/%u blocks\n", fsck->device,
+			fsck->num_inodes - le32(fsck->sb->free_inodes), fsck->num_inodes,
+			fsck->num_data_blocks - le32(fsck->sb->free_blocks), fsck->num_data_blocks);
+		return FSCK_OK;
+	}
+
+	if ((err = fsck_load_bitsets(fsck))) {
+		return err;
+	}
+
+	pthread_mutex_init(&fsck->lock, NULL);
+	fsck->dirs.size = sizeof(struct fsck_inode *);
+	fsck->adopted.size = sizeof(struct fsck_inode *);
+	fsck->pending.size = sizeof(struct fsck_inode *);
+	fsck->fixes.size = sizeof(struct fsck_fix);
+	fsck->dups.size = sizeof(struct fsck_range);
+	fsck->shared.size = sizeof(struct fsck_shared);
+
+	fsck->chunk_inodes = FSCK_CHUNK_SIZE / fsck->inode_size;
+	fsck->num_chunks = DIV_ROUND_UP((uint64_t)fsck->num_inodes - 1, fsck->chunk_inodes);
+	fsck->chunks = xcalloc(fsck->num_chunks, sizeof(struct fsck_chunk));
+
+	// one more worker for the passes that run on the main thread
+	workers = xcalloc(fsck->threads + 1, sizeof(struct fsck_worker));
+	for (i = 0; i <= fsck->threads; i++) {
+		uint32_t level;
+
+		workers[i].fsck = fsck;
+		workers[i].buf = alloc_buffer(FSCK_CHUNK_SIZE);
+		workers[i].slot = alloc_buffer(fsck->block_size);
+		for (level = 0; level < WINTERFS_EXTENT_MAX_DEPTH; level++) {
+			workers[i].nodes[level] = alloc_buffer(fsck->block_size);
+		}
+		workers[i].ranges.size = sizeof(struct fsck_range);
+		workers[i].extents.size = sizeof(struct fsck_extent);
+		workers[i].dups.size = sizeof(struct fsck_range);
+	}
+	fsck->main_worker = &workers[fsck->threads];
+
+	start = now();
+	if ((err = fsck_run_pass(fsck, workers, "Pass 1", fsck_pass1_chunk, fsck->num_chunks))) {
+		return err;
+	}
+	fsck_pass_done(fsck, "Pass 1: inode table", "inodes", start);
+
+	if (fsck->dups.count) {
+		start = now();
+		qsort(fsck->dups.data, fsck->dups.count, sizeof(struct fsck_range), fsck_range_cmp);
+		if ((err = fsck_run_pass(fsck, workers, "Pass 1b", fsck_pass1b_chunk,
+				fsck->num_chunks))) {
+			return err;
+		}
+		fsck_resolve_dups(fsck);
+		fsck->items = fsck->shared.count;
+		fsck_pass_done(fsck, "Pass 1b: duplicate blocks", "inodes", start);
+	}
+
+	root = fsck_lookup(fsck, WINTERFS_ROOT_INODE);
+	if (!root) {
+		root = fsck_adopt(fsck->main_worker, WINTERFS_ROOT_INODE);
+	}
+	if (!root || (root->state & FSCK_INODE_BAD) || !(root->state & FSCK_INODE_DIR)) {
+		printf("Root directory is missing or corrupt, the volume can't be repaired\n");
+		return FSCK_UNCORRECTED;
+	}
+	root->state |= FSCK_INODE_LINKED | FSCK_INODE_REACHABLE;
+
+	// directories taken back while walking others are walked in turn
+	start = now();
+	fsck->work = fsck->dirs.data;
+	if ((err = fsck_run_pass(fsck, workers, "Pass 2", fsck_pass2_dir, fsck->dirs.count))) {
+		return err;
+	}
+	while (fsck->pending.count) {
+		struct vec batch = fsck->pending;
+
+		fsck->pending.data = NULL;
+		fsck->pending.count = 0;
+		fsck->pending.capacity = 0;
+		fsck->work = batch.data;
+		if ((err = fsck_run_pass(fsck, workers, "Pass 2", fsck_pass2_dir, batch.count))) {
+			return err;
+		}
+		vec_free(&batch);
+	}
+	fsck_pass_done(fsck, "Pass 2: directories", "directories", start);
+
+	start = now();
+	fsck_for_each_inode(fsck, fsck_pass3_inode);
+	if (fsck->failed) {
+		return FSCK_ERROR;
+	}
+	fsck_pass_done(fsck, "Pass 3: connectivity", "inodes", start);
+
+	// every fix to inode table slots lands before the bitsets change
+	if (fsck->repair && (err = fsck_apply_fixes(fsck))) {
+		return FSCK_ERROR;
+	}
+
+	start = now();
+	fsck->inodes_used = xcalloc(DIV_ROUND_UP((uint64_t)fsck->num_inodes, 64), sizeof(uint64_t));
+	set_bit64(fsck->inodes_used, 0);
+	fsck_for_each_inode(fsck, fsck_pass4_inode);
+	set_bit64(fsck->blocks_used, 0);
+	if (fsck_sync_bitset(fsck, "inodes", fsck->inode_bitset, fsck->free_inode_bitset_idx,
+				fsck->inodes_used, fsck->num_inodes, &used_inodes)
+			|| fsck_sync_bitset(fsck, "blocks", fsck->block_bitset, fsck->free_block_bitset_idx,
+				fsck->blocks_used, fsck->num_data_blocks, &used_blocks)) {
+		return FSCK_ERROR;
+	}
+	fsck->items = used_inodes;
+	fsck_pass_done(fsck, "Pass 4: bitsets", "inodes in use", start);
+
+	// counts saved at a clean unmount have to agree with the bitsets
+	if ((fsck->state & WINTERFS_STATE_CLEAN)
+			&& (le32(fsck->sb->free_inodes) != fsck->num_inodes - used_inodes
+				|| le32(fsck->sb->free_blocks) != fsck->num_data_blocks - used_blocks)) {
+		fsck_problem(fsck, "fixed", "Superblock free counts are wrong");
+	}
+
+	if (fsck->stale) {
+		printf(fsck->repair ? "Updated %llu stale directory back-pointers\n"
+			: "%llu directory back-pointers are stale\n", (unsigned long long)fsck->stale);
+	}
+
+	if (fsck->repair) {
+		if (fsync(fsck->fd)) {
+			printf("Failed flushing device: os error %d\n", errno);
+			return FSCK_ERROR;
+		}
+		fsck->sb->free_inodes = le32(fsck->num_inodes - used_inodes);
+		fsck->sb->free_blocks = le32(fsck->num_data_blocks - used_blocks);
+		fsck->sb->state = le32(le32(fsck->sb->state) | WINTERFS_STATE_CLEAN);
+		if (fsck_write_super(fsck)) {
+			return FSCK_ERROR;
+		}
+	}
+
+	printf("%s: %llu/%u files, %llu/%u blocks, checked in %.1fs\n", fsck->device,
+		(unsigned long long)used_inodes, fsck->num_inodes,
+		(unsigned long long)used_blocks, fsck->num_data_blocks, now() - began);
+
+	if (fsck->problems > fsck->fixed) {
+		printf("%llu problems left uncorrected\n",
+			(unsigned long long)(fsck->problems - fsck->fixed));
+		return FSCK_UNCORRECTED;
+	}
+	if (fsck->fixed) {
+		printf("%llu problems corrected\n", (unsigned long long)fsck->fixed);
+		return FSCK_NONDESTRUCT;
+	}
+
+	return FSCK_OK;
+}
+
+void usage(char *prog)
+{
+	printf("Usage: %s [-n | -p | -y] [-f] [-C] [-j threads] device\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	int ret;
+	struct stat s;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	bool read_only = false;
+	struct fsck fsck = {
+		.threads = cpus < FSCK_THREADS_MIN ? FSCK_THREADS_MIN
+			: cpus > FSCK_THREADS_MAX ? FSCK_THREADS_MAX : cpus,
+		.progress = isatty(STDOUT_FILENO),
+	};
+
+	while ((opt = getopt(argc, argv, "anpyfCj:")) != -1) {
+		switch (opt) {
+		case 'n':
+			read_only = true;
+			fsck.repair = false;
+			break;
+		case 'a':
+		case 'p':
+			fsck.repair = true;
+			fsck.preen = true;
+			break;
+		case 'y':
+			fsck.repair = true;
+			fsck.preen = false;
+			break;
+		case 'f':
+			fsck.force = true;
+			break;
+		case 'C':
+			fsck.progress = true;
+			break;
+		case 'j':
+			fsck.threads = strtoul(optarg, NULL, 10);
+			if (fsck.threads < 1 || fsck.threads > FSCK_THREADS_MAX) {
+				printf("Unsupported thread count %s, must be from 1 to %d\n",
+					optarg, FSCK_THREADS_MAX);
+				return FSCK_ERROR;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return FSCK_ERROR;
+		}
+	}
+	if (read_only && fsck.repair) {
+		printf("Only one of -n and -p/-y can be given\n");
+		return FSCK_ERROR;
+	}
+
+	if (optind != argc - 1) {
+		printf("Invalid number of arguments\n");
+		usage(argv[0]);
+		return FSCK_ERROR;
+	}
+	fsck.device = argv[optind];
+
+	if (stat(fsck.device, &s)) {
+		printf("Error opening file: os error %d\n", errno);
+		return FSCK_ERROR;
+	}
+	if (!S_ISBLK(s.st_mode)) {
+		printf("Not a block device\n");
+		return FSCK_ERROR;
+	}
+
+	// repairs need the device to themselves, which a mounted volume holds
+	fsck.fd = open(fsck.device, (fsck.repair ? O_RDWR | O_EXCL : O_RDONLY) | O_DIRECT);
+	if (fsck.fd < 0 && errno == EINVAL) {
+		fsck.fd = open(fsck.device, fsck.repair ? O_RDWR | O_EXCL : O_RDONLY);
+	}
+	if (fsck.fd < 0) {
+		printf("Error opening file: os error %d\n", errno);
+		return FSCK_ERROR;
+	}
+
+	ret = check_device(&fsck);
+	close(fsck.fd);
+	if (fsck.halted) {
+		ret = FSCK_UNCORRECTED;
+	}
+
+	return ret;
+}
@@ -1,5 +1,8 @@
+#define _GNU_SOURCE // O_DIRECT
+
 #include <byteswap.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <linux/fs.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -9,18 +12,50 @@
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 #define WINTERFS_BLOCK_SIZE     	4096
+#define WINTERFS_MIN_BLOCK_SIZE		4096
+#define WINTERFS_MAX_BLOCK_SIZE		65536
 
 #define WINTERFS_SUPERBLOCK_BLOCK_ADDR  0
+#define WINTERFS_ROOT_INODE		1
 
 #define WINTERFS_INODE_DIRECT_BLOCKS	8
 #define WINTERFS_INODE_SIZE             128
+#define WINTERFS_INODE_SIZE_MAX		1024
+#define WINTERFS_INODE_SIZE_DEFAULT	256
+
+#define WINTERFS_INODE_RATIO		(1 << 15) // default bytes per inode
+#define WINTERFS_INODE_RATIO_MAX	(1 << 26)
+#define WINTERFS_RESERVED_PERCENT_MAX	50
+
+// bits per kernel allocation group, a quarter of a bitset block
+#define WINTERFS_GROUP_BITS(block_size)	((block_size) * 8 / 4)
 
-#define WINTERFS_INODE_RATIO		(1 << 15)
+#define DIV_ROUND_UP(n, d)		(((n) + (d) - 1) / (d))
 
 #define WINTERFS_DEFAULT_PERMS		0755
 
+#define WINTERFS_REVISION_V1		1
+#define WINTERFS_REVISION_V2		2
+
+#define WINTERFS_FEATURE_DIR_INDEX	0x0001
+#define WINTERFS_FEATURE_DIRENT2	0x0002
+#define WINTERFS_FEATURE_UNWRITTEN	0x0004
+#define WINTERFS_FEATURE_LARGE_INODE	0x0008
+#define WINTERFS_FEATURE_INLINE_DATA	0x0010
+#define WINTERFS_FEATURE_BLOCK_SIZE	0x0020
+#define WINTERFS_FEATURE_LAZY_ITABLE	0x0040
+#define WINTERFS_FEATURE_RESERVED	0x0080
+
+#define WINTERFS_INODE_INLINE_FL	0x0002
+
+#define WINTERFS_STATE_CLEAN		0x0001
+
+#define WINTERFS_EXTENT_MAGIC		0x5745
+#define WINTERFS_INODE_EXTENTS		3
+
 bool host_is_le()
 {
 	int x = 1;
@@ -51,6 +86,24 @@ uint64_t le64(uint32_t val)
 	return val;
 }
 
+struct winterfs_extent_header {
+	uint16_t magic;
+	uint16_t entries;
+	uint16_t max;
+	uint16_t depth;
+} __attribute__((packed));
+
+struct winterfs_extent {
+	uint32_t block;
+	uint32_t len;
+	uint32_t start;
+} __attribute__((packed));
+
+struct winterfs_extent_root {
+	struct winterfs_extent_header header;
+	struct winterfs_extent extents[WINTERFS_INODE_EXTENTS];
+} __attribute__((packed));
+
 struct winterfs_inode {
 	uint64_t size;
 	uint16_t mode;
@@ -62,13 +115,32 @@ struct winterfs_inode {
 	uint32_t dir_block;
 	uint32_t dir_block_off;
 	uint32_t num_children; // only applicable for dirs
-	uint8_t pad[30]; // reserved for metadata
-	uint32_t direct_blocks[WINTERFS_INODE_DIRECT_BLOCKS];
-	uint32_t indirect_primary;
-	uint32_t indirect_secondary;
-	uint32_t indirect_tertiary;
+	uint32_t flags;
+	uint8_t pad[26]; // reserved for metadata
+	union {
+		struct {
+			uint32_t direct_blocks[WINTERFS_INODE_DIRECT_BLOCKS];
+			uint32_t indirect_primary;
+			uint32_t indirect_secondary;
+			uint32_t indirect_tertiary;
+		} __attribute__((packed));
+		struct winterfs_extent_root extent_root;
+	};
+} __attribute__((packed));
+
+struct winterfs_dirent {
+	uint32_t inode;
+	uint16_t rec_len;
+	uint8_t name_len;
+	uint8_t file_type;
 } __attribute__((packed));
 
+// the low bits of rec_len hold bits 16 & 17, for records of a whole 64K block
+uint16_t rec_len_to_disk(uint32_t len)
+{
+	return le16((len & 0xfffc) | ((len >> 16) & 3));
+}
+
 struct winterfs_superblock {
 	uint8_t magic[4];
 	uint32_t num_inodes;
@@ -77,78 +149,343 @@ struct winterfs_superblock {
         uint32_t free_block_bitset_idx;
         uint32_t bad_block_bitset_idx;
         uint32_t data_blocks_idx;
+	uint32_t revision;
+	uint32_t features;
+	uint32_t free_blocks;
+	uint32_t free_inodes;
+	uint32_t state;
+	uint32_t inode_size;
+	uint32_t block_size;
+	uint32_t reserved_blocks;
+	uint32_t hash_key[4];
 } __attribute__((packed));
 
-struct winterfs_bitset {
-	uint32_t size;
-	uint8_t * bitset;
-} __attribute__((packed));
+struct winterfs_feature {
+	const char *name;
+	uint32_t mask;
+};
 
-int get_next_free_bit(struct winterfs_bitset *bs)
+static const struct winterfs_feature features_table[] = {
+	{ "dir_index", WINTERFS_FEATURE_DIR_INDEX },
+	{ "dirent2", WINTERFS_FEATURE_DIRENT2 },
+	{ "unwritten", WINTERFS_FEATURE_UNWRITTEN },
+	{ "inline_data", WINTERFS_FEATURE_INLINE_DATA },
+	{ "lazy_itable", WINTERFS_FEATURE_LAZY_ITABLE },
+	{ NULL, 0 }
+};
+
+// apply a comma separated list like "dir_index,^other" to *features
+int parse_features(char *list, uint32_t *features)
 {
-	for (size_t i = 0; i < bs->size; i++) {
-		if (bs->bitset[i] != 0xFF) {
-			int bit = 0;
-			while (bit < 8) {
-				if (!((1 << bit) & bs->bitset[i])) {
-					bs->bitset[i] |= (1 << bit);
-					return (8 * i) + bit;
-				}
-				bit++;
+	char *name;
+	char *save;
+
+	for (name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+		bool clear = name[0] == '^';
+		const struct winterfs_feature *f;
+
+		if (clear) {
+			name++;
+		}
+		for (f = features_table; f->name; f++) {
+			if (strcmp(f->name, name) == 0) {
+				break;
 			}
 		}
+		if (!f->name) {
+			printf("Unknown feature %s\n", name);
+			return 1;
+		}
+		if (clear) {
+			*features &= ~f->mask;
+		} else {
+			*features |= f->mask;
+		}
 	}
 
-	return 0; // err inode
+	return 0;
+}
+
+// the secret key directory name hashes are made with, which a local user
+// must not know or they could make up colliding names
+void random_hash_key(uint32_t key[4])
+{
+	struct timespec now;
+	FILE *urandom = fopen("/dev/urandom", "r");
+
+	if (!urandom || fread(key, sizeof(uint32_t), 4, urandom) != 4) {
+		printf("Warning: no /dev/urandom, directory hashes keyed by the clock\n");
+		clock_gettime(CLOCK_REALTIME, &now);
+		key[0] = (uint32_t)now.tv_sec;
+		key[1] = (uint32_t)now.tv_nsec;
+		key[2] = (uint32_t)getpid();
+		key[3] = (uint32_t)(now.tv_sec >> 32) ^ (uint32_t)clock();
+	}
+	if (urandom) {
+		fclose(urandom);
+	}
+}
+
+// the first bits of a bitset that are in use, all past them are free
+void set_bit_le(uint8_t *bitset, uint32_t bit)
+{
+	bitset[bit / 8] |= 1 << (bit % 8);
 }
 
-int format_device(char *device_path)
+// a zeroed buffer of len bytes, aligned for direct I/O
+void *alloc_buffer(size_t len)
 {
+	void *buf;
+
+	if (posix_memalign(&buf, WINTERFS_MIN_BLOCK_SIZE, len)) {
+		return NULL;
+	}
+	memset(buf, 0, len);
+
+	return buf;
+}
+
+int write_at(int fd, const void *buf, size_t len, uint64_t off)
+{
+	while (len) {
+		ssize_t n = pwrite(fd, buf, len, off);
+
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno;
+		}
+		buf = (const uint8_t *)buf + n;
+		len -= n;
+		off += n;
+	}
+
+	return 0;
+}
+
+/*
+ * Make a range of the device read back as zeroes. Devices that support it
+ * do so without the zeroes ever crossing the bus, for the rest the kernel
+ * writes them out.
+ */
+int zero_range(int fd, uint64_t off, uint64_t len)
+{
+	uint64_t range[2] = { off, len };
+
+	if (len && ioctl(fd, BLKZEROOUT, range)) {
+		return errno;
+	}
+
+	return 0;
+}
+
+struct format_options {
+	uint32_t revision;
+	uint32_t features;
+	uint32_t inode_size;
+	uint32_t block_size;
+	uint32_t inode_ratio; // bytes of device per inode
+	uint32_t reserved_percent; // of the data blocks, kept for root
+	bool discard;
+};
+
+/*
+ * Only the metadata that has to read back a certain way gets written: the
+ * superblock, the bitsets, the root inode & its directory, and the inode
+ * table, of which lazy_itable leaves all but the first inode group to the
+ * kernel. Everything else is discarded up front, so a multi-terabyte
+ * volume formats in seconds.
+ */
+int format_device(char *device_path, struct format_options *opts)
+{
+	int err = 1;
+	int fd;
 	struct stat s;
-	int err = stat(device_path, &s);
-	if (err) {
+	uint8_t *block = NULL;
+	uint32_t features = opts->features;
+	uint32_t inode_size = opts->inode_size;
+	uint32_t block_size = opts->block_size;
+	uint32_t hash_key[4];
+
+	if (stat(device_path, &s)) {
 		printf("Error opening file: os error %d\n", errno);
-		goto err;
+		return 1;
 	}
 
 	if (!S_ISBLK(s.st_mode)) {
 		printf("Not a block device\n");
-		goto err;
+		return 1;
 	}
 
-	FILE *dev = fopen(device_path, "w");
-	if (!dev) {
+	// metadata goes out in whole aligned blocks, so it can skip the page
+	// cache, but not every device takes direct I/O
+	fd = open(device_path, O_RDWR | O_EXCL | O_DIRECT);
+	if (fd < 0 && errno == EINVAL) {
+		fd = open(device_path, O_RDWR | O_EXCL);
+	}
+	if (fd < 0) {
 		printf("Error opening file: os error %d\n", errno);
-		goto err;
+		return 1;
 	}
 
-	uint32_t block_dev_size_bytes;
-	ioctl(fileno(dev), BLKGETSIZE64, &block_dev_size_bytes);
-	uint32_t num_blocks = block_dev_size_bytes / WINTERFS_BLOCK_SIZE;
-	uint32_t num_inodes = block_dev_size_bytes / WINTERFS_INODE_RATIO;
+	uint64_t dev_size;
+	if (ioctl(fd, BLKGETSIZE64, &dev_size)) {
+		printf("Error reading device size: os error %d\n", errno);
+		goto cleanup;
+	}
 
-	uint32_t num_inode_blocks = ((num_inodes * WINTERFS_INODE_SIZE) / WINTERFS_BLOCK_SIZE) + (((num_inodes * WINTERFS_INODE_SIZE) % WINTERFS_BLOCK_SIZE) != 0);
+	// block numbers are 32 bits, so anything past 2^32 blocks goes unused
+	uint64_t num_blocks64 = dev_size / block_size;
+	uint32_t num_blocks = num_blocks64 > UINT32_MAX ? UINT32_MAX : num_blocks64;
+	uint64_t num_inodes64 = (uint64_t)num_blocks * block_size / opts->inode_ratio;
+	uint32_t num_inodes = num_inodes64 > UINT32_MAX ? UINT32_MAX : num_inodes64;
+	uint32_t bits_per_block = 8 * block_size;
 
-	uint32_t num_inode_bitset_blocks = (num_inode_blocks / (8 * WINTERFS_BLOCK_SIZE)) + (num_inode_blocks % (8 * WINTERFS_BLOCK_SIZE) != 0);
+	uint32_t num_inode_blocks = DIV_ROUND_UP((uint64_t)num_inodes * inode_size, block_size);
+	uint32_t num_inode_bitset_blocks = DIV_ROUND_UP(num_inodes, bits_per_block);
 	uint32_t free_inode_bitset_idx = (WINTERFS_SUPERBLOCK_BLOCK_ADDR+1) + num_inode_blocks;
 
-	uint32_t num_block_bitset_blocks = (num_blocks / (8 * WINTERFS_BLOCK_SIZE)) + (num_blocks % (8 * WINTERFS_BLOCK_SIZE) != 0);
+	uint32_t num_block_bitset_blocks = DIV_ROUND_UP(num_blocks, bits_per_block);
 	uint32_t free_block_bitset_idx = free_inode_bitset_idx + num_inode_bitset_blocks;
 	uint32_t bad_block_bitset_idx = free_block_bitset_idx + num_block_bitset_blocks;
 	uint32_t data_block_idx = bad_block_bitset_idx + num_block_bitset_blocks;
 
-	struct winterfs_bitset fi = {
-		.size = num_inodes,
-		.bitset = calloc((num_inodes / 8) + (num_inodes % 8 != 0), 1)
-	};
-	// skip null ino
-	get_next_free_bit(&fi);
+	if (num_inodes < 2 || (uint64_t)data_block_idx + 2 > num_blocks) {
+		printf("Device too small\n");
+		goto cleanup;
+	}
+
+	// null & root take an inode each, and a block each unless root is inline
+	bool root_inline = (features & WINTERFS_FEATURE_INLINE_DATA)
+		&& (features & WINTERFS_FEATURE_DIRENT2);
+	uint32_t inline_size = inode_size - WINTERFS_INODE_SIZE;
+	uint32_t root_block = root_inline ? 0 : 1;
+	uint32_t free_inodes = num_inodes - 2;
+	uint32_t free_blocks = num_blocks - data_block_idx - (root_inline ? 1 : 2);
+	uint32_t reserved_blocks = (uint64_t)(num_blocks - data_block_idx)
+		* opts->reserved_percent / 100;
+
+	// the kernel zeroes the table of an inode group before its first use,
+	// only the first group holds inodes yet
+	uint32_t zero_inode_blocks = num_inode_blocks;
+	if (features & WINTERFS_FEATURE_LAZY_ITABLE) {
+		uint64_t group_bytes = (uint64_t)(WINTERFS_GROUP_BITS(block_size) - 1) * inode_size;
+
+		if (DIV_ROUND_UP(group_bytes, block_size) < zero_inode_blocks) {
+			zero_inode_blocks = DIV_ROUND_UP(group_bytes, block_size);
+		}
+	}
+
+	if (inode_size != WINTERFS_INODE_SIZE) {
+		features |= WINTERFS_FEATURE_LARGE_INODE;
+	}
+	if (block_size != WINTERFS_BLOCK_SIZE) {
+		features |= WINTERFS_FEATURE_BLOCK_SIZE;
+	}
+	if (reserved_blocks) {
+		features |= WINTERFS_FEATURE_RESERVED;
+	}
+
+	block = alloc_buffer(block_size);
+	if (!block) {
+		printf("Out of memory\n");
+		goto cleanup;
+	}
+
+	// no old superblock may outlive a format that fails part way
+	if ((err = write_at(fd, block, block_size, 0))) {
+		printf("Failed clearing superblock: os error %d\n", err);
+		goto cleanup;
+	}
+
+	if (opts->discard) {
+		uint64_t range[2] = { block_size, (uint64_t)num_blocks * block_size - block_size };
+
+		// not every device supports it, and nothing depends on it
+		ioctl(fd, BLKDISCARD, range);
+	}
+
+	if ((err = zero_range(fd, (uint64_t)block_size * (WINTERFS_SUPERBLOCK_BLOCK_ADDR+1),
+			(uint64_t)block_size * zero_inode_blocks))) {
+		printf("Failed zeroing inode table: os error %d\n", err);
+		goto cleanup;
+	}
+	// all three bitsets, which sit back to back
+	if ((err = zero_range(fd, (uint64_t)block_size * free_inode_bitset_idx,
+			(uint64_t)block_size * (data_block_idx - free_inode_bitset_idx)))) {
+		printf("Failed zeroing bitsets: os error %d\n", err);
+		goto cleanup;
+	}
+
+	// the root inode, followed by its inline entries if it has any
+	struct winterfs_inode *root = (struct winterfs_inode *)block;
+
+	root->mode = le16(S_IFDIR | WINTERFS_DEFAULT_PERMS);
+	root->create_time = le64((uint32_t)time(NULL));
+	root->modify_time = le64((uint32_t)time(NULL));
+	root->access_time = le64((uint32_t)time(NULL));
+	if (opts->revision >= WINTERFS_REVISION_V2) {
+		root->extent_root.header.magic = le16(WINTERFS_EXTENT_MAGIC);
+		root->extent_root.header.max = le16(WINTERFS_INODE_EXTENTS);
+	}
+	if (root_inline) {
+		struct winterfs_dirent *empty = (struct winterfs_dirent *)(block + WINTERFS_INODE_SIZE);
+
+		root->size = le64(inline_size);
+		root->flags = le32(WINTERFS_INODE_INLINE_FL);
+		empty->rec_len = rec_len_to_disk(inline_size);
+	} else {
+		root->size = le64(block_size);
+		if (opts->revision >= WINTERFS_REVISION_V2) {
+			root->extent_root.header.entries = le16(1);
+			root->extent_root.extents[0].block = le32(0);
+			root->extent_root.extents[0].len = le32(1);
+			root->extent_root.extents[0].start = le32(root_block);
+		} else {
+			root->direct_blocks[0] = le32(root_block);
+		}
+	}
+	if ((err = write_at(fd, block, block_size,
+			(uint64_t)block_size * (WINTERFS_SUPERBLOCK_BLOCK_ADDR+1)))) {
+		printf("Failed writing root inode: os error %d\n", err);
+		goto cleanup;
+	}
+
+	// an empty directory is a single free record spanning the block
+	if (!root_inline) {
+		memset(block, 0, block_size);
+		if (features & WINTERFS_FEATURE_DIRENT2) {
+			struct winterfs_dirent *empty = (struct winterfs_dirent *)block;
+
+			empty->rec_len = rec_len_to_disk(block_size);
+		}
+		if ((err = write_at(fd, block, block_size,
+				(uint64_t)block_size * (data_block_idx + root_block)))) {
+			printf("Failed writing root directory: os error %d\n", err);
+			goto cleanup;
+		}
+	}
+
+	// the null inode & block are never handed out, then root's
+	memset(block, 0, block_size);
+	set_bit_le(block, 0);
+	set_bit_le(block, WINTERFS_ROOT_INODE);
+	if ((err = write_at(fd, block, block_size, (uint64_t)block_size * free_inode_bitset_idx))) {
+		printf("Failed writing free inode bitset: os error %d\n", err);
+		goto cleanup;
+	}
+
+	memset(block, 0, block_size);
+	set_bit_le(block, 0);
+	if (!root_inline) {
+		set_bit_le(block, root_block);
+	}
+	if ((err = write_at(fd, block, block_size, (uint64_t)block_size * free_block_bitset_idx))) {
+		printf("Failed writing free block bitset: os error %d\n", err);
+		goto cleanup;
+	}
 
-	struct winterfs_bitset fb = {
-		.size = num_blocks,
-		.bitset = calloc((num_blocks / 8) + (num_blocks % 8 != 0), 1)
-	};
-	
 	struct winterfs_superblock sb = {
 		.magic = {0x57, 0x4e, 0x46, 0x53},
 		.num_blocks = le32(num_blocks), 
@@ -157,56 +494,166 @@ int format_device(char *device_path)
 		.free_block_bitset_idx = le32(free_block_bitset_idx),
 		.bad_block_bitset_idx = le32(bad_block_bitset_idx),
 		.data_blocks_idx = le32(data_block_idx),
+		.revision = le32(opts->revision),
+		.features = le32(features),
+		.free_blocks = le32(free_blocks),
+		.free_inodes = le32(free_inodes),
+		.state = le32(WINTERFS_STATE_CLEAN),
+		.inode_size = le32(inode_size),
+		.block_size = le32(block_size),
+		.reserved_blocks = le32(reserved_blocks),
 	};
+	// random bytes read the same in either byte order
+	random_hash_key(hash_key);
+	memcpy(sb.hash_key, hash_key, sizeof(hash_key));
 
-	fseek(dev, 0, SEEK_SET);
-	if(!fwrite(&sb, sizeof(sb), 1, dev)) {
-		printf("Failed writing superblock\n");
+	// the superblock goes last, once everything it points at is in place
+	if ((err = fsync(fd) ? errno : 0)) {
+		printf("Failed flushing device: os error %d\n", err);
 		goto cleanup;
 	}
-
-	struct winterfs_inode root = {
-		.size = le64(WINTERFS_BLOCK_SIZE),
-		.mode = S_IFDIR | WINTERFS_DEFAULT_PERMS,
-		.create_time = le64((uint32_t)time(NULL)),
-		.modify_time = le64((uint32_t)time(NULL)),
-		.access_time = le64((uint32_t)time(NULL)),
-	};
-	root.direct_blocks[0] = get_next_free_bit(&fb);
-	get_next_free_bit(&fi);
-
-	fseek(dev, WINTERFS_BLOCK_SIZE * (WINTERFS_SUPERBLOCK_BLOCK_ADDR+1), SEEK_SET);
-        if(!fwrite(&root, sizeof(root), 1, dev)) {
-                printf("Failed writing root inode\n");
-		goto cleanup;
-        }
-
-	fseek(dev, WINTERFS_BLOCK_SIZE * free_inode_bitset_idx, SEEK_SET);
-	if (!fwrite(fi.bitset, sizeof(fi.bitset), 1, dev)) {
-		printf("Failed writing free inode bitset\n");
+	memset(block, 0, block_size);
+	memcpy(block, &sb, sizeof(sb));
+	if ((err = write_at(fd, block, block_size, 0))) {
+		printf("Failed writing superblock: os error %d\n", err);
 		goto cleanup;
 	}
-	
-	fseek(dev, WINTERFS_BLOCK_SIZE * free_block_bitset_idx, SEEK_SET);
-	if (!fwrite(fb.bitset, sizeof(fi.bitset), 1, dev)) {
-		printf("Failed writing free block bitset\n");
+	if ((err = fsync(fd) ? errno : 0)) {
+		printf("Failed flushing device: os error %d\n", err);
 		goto cleanup;
 	}
 
 cleanup:
-	fclose(dev);
-	free(fi.bitset);
-	free(fb.bitset);
-err:
+	free(block);
+	close(fd);
 	return err;
 }
 
+void usage(char *prog)
+{
+	printf("Usage: %s [-b block-size] [-r revision] [-I inode-size] [-i bytes-per-inode]\n"
+		"\t[-m reserved-blocks-percentage] [-K] [-O feature[,...]] device\n", prog);
+}
+
 int main(int argc, char **argv)
 {
-	if (argc != 2) {
+	int opt;
+	struct format_options opts = {
+		.revision = WINTERFS_REVISION_V2,
+		.features = WINTERFS_FEATURE_DIR_INDEX | WINTERFS_FEATURE_DIRENT2
+			| WINTERFS_FEATURE_UNWRITTEN | WINTERFS_FEATURE_INLINE_DATA
+			| WINTERFS_FEATURE_LAZY_ITABLE,
+		.inode_size = WINTERFS_INODE_SIZE_DEFAULT,
+		.block_size = WINTERFS_BLOCK_SIZE,
+		.inode_ratio = 0,
+		.reserved_percent = 0,
+		.discard = true,
+	};
+	bool unwritten_set = false;
+	bool inline_data_set = false;
+
+	while ((opt = getopt(argc, argv, "b:r:I:i:m:KO:")) != -1) {
+		switch (opt) {
+		case 'b':
+			opts.block_size = strtoul(optarg, NULL, 10);
+			if (opts.block_size < WINTERFS_MIN_BLOCK_SIZE
+					|| opts.block_size > WINTERFS_MAX_BLOCK_SIZE
+					|| (opts.block_size & (opts.block_size - 1))) {
+				printf("Unsupported block size %s, must be a power of 2 from %d to %d\n",
+					optarg, WINTERFS_MIN_BLOCK_SIZE, WINTERFS_MAX_BLOCK_SIZE);
+				return 1;
+			}
+			break;
+		case 'r':
+			opts.revision = strtoul(optarg, NULL, 10);
+			if (opts.revision != WINTERFS_REVISION_V1 && opts.revision != WINTERFS_REVISION_V2) {
+				printf("Unsupported revision %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'I':
+			opts.inode_size = strtoul(optarg, NULL, 10);
+			if (opts.inode_size < WINTERFS_INODE_SIZE || opts.inode_size > WINTERFS_INODE_SIZE_MAX
+					|| (opts.inode_size & (opts.inode_size - 1))) {
+				printf("Unsupported inode size %s, must be 128, 256, 512 or 1024\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'i':
+			opts.inode_ratio = strtoul(optarg, NULL, 10);
+			if (opts.inode_ratio < WINTERFS_MIN_BLOCK_SIZE
+					|| opts.inode_ratio > WINTERFS_INODE_RATIO_MAX) {
+				printf("Unsupported bytes per inode %s, must be from %d to %d\n",
+					optarg, WINTERFS_MIN_BLOCK_SIZE, WINTERFS_INODE_RATIO_MAX);
+				return 1;
+			}
+			break;
+		case 'm':
+			opts.reserved_percent = strtoul(optarg, NULL, 10);
+			if (opts.reserved_percent > WINTERFS_RESERVED_PERCENT_MAX) {
+				printf("Unsupported reserved blocks percentage %s, must be at most %d\n",
+					optarg, WINTERFS_RESERVED_PERCENT_MAX);
+				return 1;
+			}
+			break;
+		case 'K':
+			opts.discard = false;
+			break;
+		case 'O':
+			unwritten_set = unwritten_set || strstr(optarg, "unwritten");
+			inline_data_set = inline_data_set || strstr(optarg, "inline_data");
+			if (parse_features(optarg, &opts.features)) {
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	// unwritten extents only exist in extent mapped inodes
+	if (opts.revision < WINTERFS_REVISION_V2 && (opts.features & WINTERFS_FEATURE_UNWRITTEN)) {
+		if (unwritten_set) {
+			printf("Feature unwritten needs revision 2\n");
+			return 1;
+		}
+		opts.features &= ~WINTERFS_FEATURE_UNWRITTEN;
+	}
+
+	// inline data goes in the inode space past the fixed fields
+	if (opts.inode_size == WINTERFS_INODE_SIZE && (opts.features & WINTERFS_FEATURE_INLINE_DATA)) {
+		if (inline_data_set) {
+			printf("Feature inline_data needs an inode size above %d\n",
+				WINTERFS_INODE_SIZE);
+			return 1;
+		}
+		opts.features &= ~WINTERFS_FEATURE_INLINE_DATA;
+	}
+
+	// fixed size directory entries only fit the smallest block size
+	if (opts.block_size != WINTERFS_MIN_BLOCK_SIZE
+			&& !(opts.features & WINTERFS_FEATURE_DIRENT2)) {
+		printf("Block size %u needs feature dirent2\n", opts.block_size);
+		return 1;
+	}
+
+	// never more inodes than blocks
+	if (!opts.inode_ratio) {
+		opts.inode_ratio = opts.block_size > WINTERFS_INODE_RATIO
+			? opts.block_size : WINTERFS_INODE_RATIO;
+	} else if (opts.inode_ratio < opts.block_size) {
+		printf("Bytes per inode %u is less than the block size %u\n",
+			opts.inode_ratio, opts.block_size);
+		return 1;
+	}
+
+	if (optind != argc - 1) {
 		printf("Invalid number of arguments\n");
+		usage(argv[0]);
 		return 1;
 	}
 
-	return format_device(argv[1]);
+	return format_device(argv[optind], &opts);
 }
@@ -0,0 +1,223 @@
+USERNAME=$(whoami)
+TEST_FILE=/home/${USERNAME}/diskimg
+MOUNT_DIR=/home/${USERNAME}/wmnt
+MKFS_PATH=../mkfs.winterfs/a.out
+LOOP_DEV=/dev/loop7
+# filesystems to benchmark, each formatted in turn on the same device
+FILESYSTEMS=${1:-"winterfs ext4 ext2"}
+# size of the device in MB
+SIZE_MB=${2:-4096}
+# CSV file the results are appended to, one row per measurement:
+# fs,release,benchmark,metric,value
+RESULTS=${3:-bench-$(date +%Y%m%d-%H%M%S).csv}
+
+# loop for a file backed loop device, ram for a brd ramdisk of SIZE_MB
+BACKING=${BACKING:-loop}
+# size of the file fio works on in MB, and seconds each random I/O job runs
+FIO_MB=${FIO_MB:-1024}
+RUNTIME=${RUNTIME:-30}
+IOENGINE=${IOENGINE:-io_uring}
+# size in MB of the dirty file whose flush is timed
+FLUSH_MB=${FLUSH_MB:-1024}
+# files created, stated & unlinked in one directory
+FILES=${FILES:-100000}
+# entry counts of the directories read back
+DIR_SIZES=${DIR_SIZES:-"1000 100000 1000000"}
+# depth & fan out of the directory tree walked, with a file in every directory
+TREE_DEPTH=${TREE_DEPTH:-6}
+TREE_FANOUT=${TREE_FANOUT:-6}
+
+# every benchmark starts from a fresh format, and everything timed after
+# setting up starts from cold caches: the volume is remounted and the page,
+# dentry & inode caches dropped. winterfs has no O_DIRECT, so fio runs
+# buffered everywhere for a fair comparison, with the final fsync included
+
+if [ "${BACKING}" = ram ]; then
+	sudo rmmod brd 2> /dev/null || true
+	sudo modprobe brd rd_nr=1 rd_size=$((SIZE_MB * 1024))
+	DEV=/dev/ram0
+else
+	rm -f ${TEST_FILE}
+	fallocate -l ${SIZE_MB}M ${TEST_FILE}
+	sudo losetup -d ${LOOP_DEV} 2> /dev/null || true
+	# direct I/O keeps the backing file out of the page cache, so it isn't cached twice
+	sudo losetup --direct-io=on ${LOOP_DEV} ${TEST_FILE}
+	DEV=${LOOP_DEV}
+fi
+sudo umount ${MOUNT_DIR} 2> /dev/null || true
+mkdir -p ${MOUNT_DIR}
+
+case " ${FILESYSTEMS} " in
+*" winterfs "*)
+	sudo rmmod -f winterfs 2> /dev/null || true
+	sudo modprobe winterfs
+	;;
+esac
+
+[ -f ${RESULTS} ] || echo "fs,release,benchmark,metric,value" > ${RESULTS}
+
+record() {
+	echo "${FS},${RELEASE},$1,$2,$3" >> ${RESULTS}
+	printf "%-8s %-24s %-14s %s\n" ${FS} $1 $2 $3
+}
+
+fresh() {
+	sudo umount ${MOUNT_DIR} 2> /dev/null || true
+	if [ ${FS} = winterfs ]; then
+		sudo ./${MKFS_PATH} ${DEV} > /dev/null
+	else
+		sudo mkfs.${FS} -F -q ${DEV}
+	fi
+	sudo mount -t ${FS} ${DEV} ${MOUNT_DIR}
+	sudo chown ${USERNAME}:${USERNAME} ${MOUNT_DIR}
+}
+
+cold() {
+	sync
+	sudo umount ${MOUNT_DIR}
+	sudo sh -c "echo 3 > /proc/sys/vm/drop_caches"
+	sudo mount -t ${FS} ${DEV} ${MOUNT_DIR}
+}
+
+# run a command, leaving the seconds it took in ELAPSED
+timed() {
+	START=$(date +%s.%N)
+	sh -c "$1"
+	END=$(date +%s.%N)
+	ELAPSED=$(echo ${START} ${END} | awk '{ printf "%.6f", $2 - $1 }')
+}
+
+rate() {
+	awk -v n=$1 -v secs=$2 'BEGIN { printf "%.0f", n / secs }'
+}
+
+# fio job: name, rw, block size, queue depth. Sequential jobs move the
+# whole file, random ones run for RUNTIME seconds
+fio_job() {
+	TIME_ARGS=""
+	case $2 in
+	rand*) TIME_ARGS="--time_based --runtime=${RUNTIME}" ;;
+	esac
+
+	cold
+	timed "fio --name=$1 --filename=${MOUNT_DIR}/fio.dat --size=${FIO_MB}M --rw=$2 --bs=$3 \
+		--iodepth=$4 --ioengine=${IOENGINE} --end_fsync=1 ${TIME_ARGS} \
+		--output-format=terse --terse-version=3 > /tmp/bench-fio.out"
+
+	# terse v3 fields: read bandwidth KB/s 7, IOPS 8, 99th percentile
+	# completion latency 30, and the same for writes at 48, 49 & 71
+	case $2 in
+	*read) FIELDS='$7, $8, $30' ;;
+	*) FIELDS='$48, $49, $71' ;;
+	esac
+	set -- $1 $(awk -F';' "{ print ${FIELDS} }" /tmp/bench-fio.out | sed 's/[0-9.]*%=//')
+	record $1 bw_kbs $2
+	record $1 iops $3
+	record $1 p99_clat_us $4
+	record $1 elapsed_s ${ELAPSED}
+}
+
+# every directory of the tree, parents first
+tree_paths() {
+	awk -v depth=${TREE_DEPTH} -v fanout=${TREE_FANOUT} 'BEGIN {
+		n = 1
+		level[1] = "tree"
+		for (d = 0; d < depth; d++) {
+			m = 0
+			for (i = 1; i <= n; i++) {
+				for (j = 1; j <= fanout; j++) {
+					next_level[++m] = level[i] "/d" j
+					print next_level[m]
+				}
+			}
+			delete level
+			for (i = 1; i <= m; i++) {
+				level[i] = next_level[i]
+			}
+			delete next_level
+			n = m
+		}
+	}'
+}
+
+for FS in ${FILESYSTEMS}; do
+	if [ ${FS} = winterfs ]; then
+		RELEASE=$(git describe --always --dirty 2> /dev/null || echo unknown)
+	else
+		RELEASE=$(uname -r)
+	fi
+	record config size_mb ${SIZE_MB}
+	record config backing ${BACKING}
+
+	fresh
+	fio_job seqwrite-1m-qd1 write 1M 1
+	fio_job seqread-1m-qd1 read 1M 1
+	fio_job seqread-1m-qd32 read 1M 32
+	fio_job randwrite-4k-qd1 randwrite 4k 1
+	fio_job randwrite-4k-qd32 randwrite 4k 32
+	fio_job randread-4k-qd1 randread 4k 1
+	fio_job randread-4k-qd32 randread 4k 32
+
+	# dirty FLUSH_MB of page cache with background writeback held off, then
+	# time the flush and count the write requests that reached the device.
+	# Fields 5 & 7 of the block stat file are write I/Os & sectors written
+	fresh
+	STAT=/sys/block/$(basename $(readlink -f ${DEV}))/stat
+	DIRTY=$(cat /proc/sys/vm/dirty_ratio /proc/sys/vm/dirty_background_ratio \
+		/proc/sys/vm/dirty_expire_centisecs)
+	sudo sh -c "echo 90 > /proc/sys/vm/dirty_ratio; echo 80 > /proc/sys/vm/dirty_background_ratio; \
+		echo 360000 > /proc/sys/vm/dirty_expire_centisecs"
+	dd if=/dev/zero of=${MOUNT_DIR}/dirty bs=1M count=${FLUSH_MB} 2> /dev/null
+	set -- $(awk '{ print $5, $7 }' ${STAT})
+	timed "sync -f ${MOUNT_DIR}/dirty"
+	set -- $1 $2 $(awk '{ print $5, $7 }' ${STAT}) ${DIRTY}
+	sudo sh -c "echo $5 > /proc/sys/vm/dirty_ratio; echo $6 > /proc/sys/vm/dirty_background_ratio; \
+		echo $7 > /proc/sys/vm/dirty_expire_centisecs"
+	record flush-${FLUSH_MB}m write_ios $(($3 - $1))
+	record flush-${FLUSH_MB}m avg_write_kb $(awk -v ios=$(($3 - $1)) -v sectors=$(($4 - $2)) \
+		'BEGIN { printf "%.0f", ios ? sectors / 2 / ios : 0 }')
+	record flush-${FLUSH_MB}m elapsed_s ${ELAPSED}
+
+	# create, stat & unlink FILES empty files in one directory, many per
+	# process so the tools' start up doesn't dominate
+	fresh
+	mkdir ${MOUNT_DIR}/files
+	timed "cd ${MOUNT_DIR}/files && seq -f f%.0f 1 ${FILES} | xargs touch && sync -f ."
+	record create files_per_s $(rate ${FILES} ${ELAPSED})
+	cold
+	timed "ls -lU ${MOUNT_DIR}/files > /dev/null"
+	record stat files_per_s $(rate ${FILES} ${ELAPSED})
+	cold
+	timed "cd ${MOUNT_DIR}/files && seq -f f%.0f 1 ${FILES} | xargs rm -f && sync -f ."
+	record unlink files_per_s $(rate ${FILES} ${ELAPSED})
+
+	for N in ${DIR_SIZES}; do
+		fresh
+		mkdir ${MOUNT_DIR}/dir
+		(cd ${MOUNT_DIR}/dir && seq -f f%.0f 1 ${N} | xargs touch)
+		cold
+		timed "ls -U ${MOUNT_DIR}/dir > /dev/null"
+		record readdir-${N} entries_per_s $(rate ${N} ${ELAPSED})
+		timed "ls -U ${MOUNT_DIR}/dir > /dev/null"
+		record readdir-${N}-warm entries_per_s $(rate ${N} ${ELAPSED})
+	done
+
+	fresh
+	(cd ${MOUNT_DIR} && mkdir tree && touch tree/f && tree_paths | xargs mkdir \
+		&& tree_paths | sed 's|$|/f|' | xargs touch)
+	ENTRIES=$(find ${MOUNT_DIR}/tree | wc -l)
+	cold
+	timed "find ${MOUNT_DIR}/tree > /dev/null"
+	record tree-walk entries_per_s $(rate ${ENTRIES} ${ELAPSED})
+	timed "du -s ${MOUNT_DIR}/tree > /dev/null"
+	record tree-walk-stat entries_per_s $(rate ${ENTRIES} ${ELAPSED})
+
+	sudo umount ${MOUNT_DIR}
+done
+
+if [ "${BACKING}" = ram ]; then
+	sudo rmmod brd
+else
+	sudo losetup -d ${LOOP_DEV}
+fi
+echo "results in ${RESULTS}"
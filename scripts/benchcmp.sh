@@ -0,0 +1,40 @@
+# compare two result files of bench.sh, row by row. Compares winterfs in
+# both by default, or give two filesystems to compare them on the same
+# results, e.g. "sh benchcmp.sh results.csv results.csv ext4 winterfs"
+BASE=$1
+NEW=$2
+BASE_FS=${3:-winterfs}
+NEW_FS=${4:-${BASE_FS}}
+
+if [ -z "${BASE}" ] || [ -z "${NEW}" ]; then
+	echo "usage: $0 base.csv new.csv [base-fs] [new-fs]"
+	exit 1
+fi
+
+# a rerun of a benchmark in the same file replaces the earlier row
+awk -F, -v base_fs=${BASE_FS} -v new_fs=${NEW_FS} '
+FNR == 1 { file++; next }
+file == 1 && $1 == base_fs {
+	key = $3 "," $4
+	if (!(key in base)) {
+		order[++n] = key
+	}
+	base[key] = $5
+}
+file == 2 && $1 == new_fs { new[$3 "," $4] = $5 }
+END {
+	printf "%-24s %-14s %14s %14s %8s\n", "benchmark", "metric", base_fs, new_fs, "change"
+	for (i = 1; i <= n; i++) {
+		key = order[i]
+		split(key, k, ",")
+		if (!(key in new)) {
+			continue
+		}
+		if (base[key] ~ /^[0-9.]+$/ && base[key] > 0) {
+			printf "%-24s %-14s %14s %14s %+7.1f%%\n", k[1], k[2], base[key], new[key],
+				(new[key] - base[key]) * 100 / base[key]
+		} else {
+			printf "%-24s %-14s %14s %14s\n", k[1], k[2], base[key], new[key]
+		}
+	}
+}' ${BASE} ${NEW}
@@ -0,0 +1,51 @@
+USERNAME=$(whoami)
+TEST_FILE=/home/${USERNAME}/diskimg
+MOUNT_DIR=/home/${USERNAME}/wmnt
+MKFS_PATH=../mkfs.winterfs/a.out
+LOOP_DEV=/dev/loop7
+# highest thread count tried, doubling from 1
+MAX_THREADS=${1:-32}
+# files created by each thread, and the size of each in KB
+FILES=${2:-500}
+FILE_KB=${3:-64}
+
+# every thread creates and writes FILES files in a directory of its own,
+# then everything is synced. Reports total throughput per thread count,
+# which should keep growing while the allocators stay out of each other's way
+
+dd if=/dev/zero of=${TEST_FILE} bs=1M count=$((MAX_THREADS * FILES * FILE_KB / 1024 * 2 + 256))
+sudo losetup ${LOOP_DEV} ${TEST_FILE} || true
+sudo umount ${MOUNT_DIR} || true
+sudo rmmod -f winterfs || true
+sudo modprobe winterfs
+
+worker() {
+	mkdir -p $1
+	for i in $(seq 1 ${FILES}); do
+		head -c $((FILE_KB * 1024)) /dev/zero > $1/f${i}
+	done
+}
+
+THREADS=1
+while [ ${THREADS} -le ${MAX_THREADS} ]; do
+	sudo ./${MKFS_PATH} ${LOOP_DEV} > /dev/null
+	sudo mount -t winterfs ${LOOP_DEV} ${MOUNT_DIR}
+	sudo chown ${USERNAME}:${USERNAME} ${MOUNT_DIR}
+
+	START=$(date +%s.%N)
+	for t in $(seq 1 ${THREADS}); do
+		worker ${MOUNT_DIR}/t${t} &
+	done
+	wait
+	sync -f ${MOUNT_DIR}
+	END=$(date +%s.%N)
+
+	sudo umount ${MOUNT_DIR}
+
+	echo ${THREADS} ${START} ${END} | awk -v files=${FILES} -v kb=${FILE_KB} '{
+		secs = $3 - $2
+		total = $1 * files
+		printf "%2d threads: %8.0f files/s %8.1f MB/s\n", $1, total / secs, total * kb / 1024 / secs
+	}'
+	THREADS=$((THREADS * 2))
+done
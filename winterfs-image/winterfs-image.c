@@ -0,0 +1,1025 @@
+#define _GNU_SOURCE // O_DIRECT, copy_file_range
+
+#include <byteswap.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WINTERFS_BLOCK_SIZE		4096
+#define WINTERFS_MIN_BLOCK_SIZE		4096
+#define WINTERFS_MAX_BLOCK_SIZE		65536
+
+#define WINTERFS_SUPERBLOCK_BLOCK_ADDR	0
+#define WINTERFS_INODES_BLOCK_ADDR	1
+
+#define WINTERFS_INODE_DIRECT_BLOCKS	8
+#define WINTERFS_INODE_SIZE		128
+#define WINTERFS_INODE_SIZE_MAX		1024
+
+#define WINTERFS_REVISION_V1		1
+#define WINTERFS_REVISION_V2		2
+
+#define WINTERFS_FEATURE_LARGE_INODE	0x0008
+#define WINTERFS_FEATURE_BLOCK_SIZE	0x0020
+#define WINTERFS_FEATURE_LAZY_ITABLE	0x0040
+#define WINTERFS_FEATURE_SUPPORTED	0x00ff
+
+#define WINTERFS_INODE_INLINE_FL	0x0002
+
+#define WINTERFS_EXTENT_MAGIC		0x5745
+#define WINTERFS_EXTENT_MAX_DEPTH	3
+#define WINTERFS_EXTENT_MAX_LEN		0x7fffffff
+
+// copies are read a window at a time, through gaps of free blocks up to
+// IMAGE_MAX_GAP rather than seeking past them, while a writer thread
+// drains the windows already read
+#define IMAGE_WINDOW			(8 << 20)
+#define IMAGE_MAX_GAP			(1 << 20)
+#define IMAGE_BUFFERS			4
+
+#define DIV_ROUND_UP(n, d)		(((n) + (d) - 1) / (d))
+#define MIN(a, b)			((a) < (b) ? (a) : (b))
+
+bool host_is_le()
+{
+	int x = 1;
+	return *(char *)&x == 1;
+}
+
+uint16_t le16(uint16_t val)
+{
+	if (!host_is_le()) {
+		return bswap_16(val);
+	}
+	return val;
+}
+
+uint32_t le32(uint32_t val)
+{
+	if (!host_is_le()) {
+		return bswap_32(val);
+	}
+	return val;
+}
+
+uint64_t le64(uint64_t val)
+{
+	if (!host_is_le()) {
+		return bswap_64(val);
+	}
+	return val;
+}
+
+struct winterfs_superblock {
+	uint8_t magic[4];
+	uint32_t num_inodes;
+	uint32_t num_blocks;
+	uint32_t free_inode_bitset_idx;
+	uint32_t free_block_bitset_idx;
+	uint32_t bad_block_bitset_idx;
+	uint32_t data_blocks_idx;
+	uint32_t revision;
+	uint32_t features;
+	uint32_t free_blocks;
+	uint32_t free_inodes;
+	uint32_t state;
+	uint32_t inode_size;
+	uint32_t block_size;
+	uint32_t reserved_blocks;
+	uint32_t hash_key[4];
+} __attribute__((packed));
+
+struct winterfs_extent_header {
+	uint16_t magic;
+	uint16_t entries;
+	uint16_t max;
+	uint16_t depth;
+} __attribute__((packed));
+
+struct winterfs_extent {
+	uint32_t block;
+	uint32_t len;
+	uint32_t start;
+} __attribute__((packed));
+
+struct winterfs_extent_idx {
+	uint32_t block;
+	uint32_t child;
+	uint32_t reserved;
+} __attribute__((packed));
+
+struct winterfs_inode {
+	uint64_t size;
+	uint16_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint64_t create_time;
+	uint64_t modify_time;
+	uint64_t access_time;
+	uint32_t dir_block;
+	uint32_t dir_block_off;
+	uint32_t num_children; // only applicable for dirs
+	uint32_t flags;
+	uint8_t pad[26]; // reserved for metadata
+	union {
+		struct {
+			uint32_t direct_blocks[WINTERFS_INODE_DIRECT_BLOCKS];
+			uint32_t indirect_primary;
+			uint32_t indirect_secondary;
+			uint32_t indirect_tertiary;
+		} __attribute__((packed));
+		struct winterfs_extent_header extent_header;
+	};
+} __attribute__((packed));
+
+// a zeroed buffer of len bytes, aligned for direct I/O, or NULL
+void *alloc_buffer(size_t len)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, WINTERFS_MIN_BLOCK_SIZE, len)) {
+		return NULL;
+	}
+	memset(buf, 0, len);
+
+	return buf;
+}
+
+int read_at(int fd, void *buf, size_t len, uint64_t off)
+{
+	while (len) {
+		ssize_t n = pread(fd, buf, len, off);
+
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno;
+		}
+		if (n == 0) {
+			return EIO;
+		}
+		buf = (uint8_t *)buf + n;
+		len -= n;
+		off += n;
+	}
+
+	return 0;
+}
+
+int write_at(int fd, const void *buf, size_t len, uint64_t off)
+{
+	while (len) {
+		ssize_t n = pwrite(fd, buf, len, off);
+
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno;
+		}
+		buf = (const uint8_t *)buf + n;
+		len -= n;
+		off += n;
+	}
+
+	return 0;
+}
+
+bool test_bit_le(const uint8_t *bitset, uint64_t bit)
+{
+	return (bitset[bit / 8] >> (bit % 8)) & 1;
+}
+
+void set_bit_le(uint8_t *bitset, uint64_t bit)
+{
+	bitset[bit / 8] |= 1 << (bit % 8);
+}
+
+double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// blocks to copy, absolute to the start of the volume
+struct image_run {
+	uint64_t start;
+	uint64_t len;
+};
+
+// a window of the source read in one go, and the runs it holds
+struct image_buffer {
+	uint8_t *data;
+	uint64_t pos;
+	size_t first;
+	size_t count;
+};
+
+struct image {
+	int src;
+	int dst;
+	const char *src_path;
+	const char *dst_path;
+	bool metadata_only;
+	bool progress;
+	bool dst_is_file;
+
+	uint8_t *sb_block;
+	uint32_t block_size;
+	uint32_t block_bits;
+	uint32_t inode_size;
+	uint32_t num_inodes;
+	uint32_t num_blocks;
+	uint32_t num_data_blocks;
+	uint32_t free_inode_bitset_idx;
+	uint32_t free_block_bitset_idx;
+	uint32_t data_blocks_idx;
+	uint32_t revision;
+	uint32_t features;
+
+	uint8_t *inode_bitset;
+	uint8_t *block_bitset;
+	uint8_t *nodes[WINTERFS_EXTENT_MAX_DEPTH]; // a block per tree level
+
+	struct image_run *runs;
+	size_t num_runs;
+	size_t cap_runs;
+	uint64_t total; // bytes to copy
+	uint64_t copied;
+	double start;
+	double shown;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct image_buffer bufs[IMAGE_BUFFERS];
+	unsigned int filled; // buffers read but not yet written
+	bool done; // no more buffers coming
+	int err; // first write error
+};
+
+// add blocks to copy, merging with the last run and capping runs to a window
+void image_add_run(struct image *img, uint64_t start, uint64_t len)
+{
+	uint64_t window = IMAGE_WINDOW >> img->block_bits;
+	struct image_run *last = img->num_runs ? &img->runs[img->num_runs - 1] : NULL;
+
+	// inode table blocks arrive once per inode in use
+	if (last && start < last->start + last->len) {
+		uint64_t end = start + len;
+
+		if (end <= last->start + last->len) {
+			return;
+		}
+		start = last->start + last->len;
+		len = end - start;
+	}
+
+	img->total += len << img->block_bits;
+	while (len) {
+		uint64_t n;
+
+		if (last && last->start + last->len == start && last->len < window) {
+			n = MIN(len, window - last->len);
+			last->len += n;
+		} else {
+			if (img->num_runs == img->cap_runs) {
+				img->cap_runs = img->cap_runs ? img->cap_runs * 2 : 1024;
+				img->runs = realloc(img->runs, img->cap_runs * sizeof(struct image_run));
+				if (!img->runs) {
+					printf("Out of memory\n");
+					exit(1);
+				}
+			}
+			last = &img->runs[img->num_runs++];
+			n = MIN(len, window);
+			last->start = start;
+			last->len = n;
+		}
+		start += n;
+		len -= n;
+	}
+}
+
+int image_load_super(struct image *img)
+{
+	int err;
+	struct winterfs_superblock *ws;
+	static const uint8_t magic[4] = { 0x57, 0x4e, 0x46, 0x53 };
+
+	img->sb_block = alloc_buffer(WINTERFS_MAX_BLOCK_SIZE);
+	if (!img->sb_block) {
+		printf("Out of memory\n");
+		return 1;
+	}
+	if ((err = read_at(img->src, img->sb_block, WINTERFS_BLOCK_SIZE, 0))) {
+		printf("Error reading superblock: os error %d\n", err);
+		return 1;
+	}
+	ws = (struct winterfs_superblock *)img->sb_block;
+	if (memcmp(ws->magic, magic, sizeof(magic))) {
+		printf("%s is not a winterfs volume\n", img->src_path);
+		return 1;
+	}
+
+	img->num_blocks = le32(ws->num_blocks);
+	img->free_inode_bitset_idx = le32(ws->free_inode_bitset_idx);
+	img->free_block_bitset_idx = le32(ws->free_block_bitset_idx);
+	img->data_blocks_idx = le32(ws->data_blocks_idx);
+	img->revision = le32(ws->revision) ? le32(ws->revision) : WINTERFS_REVISION_V1;
+	img->features = le32(ws->features);
+	img->inode_size = (img->features & WINTERFS_FEATURE_LARGE_INODE)
+		? le32(ws->inode_size) : WINTERFS_INODE_SIZE;
+	img->block_size = (img->features & WINTERFS_FEATURE_BLOCK_SIZE)
+		? le32(ws->block_size) : WINTERFS_BLOCK_SIZE;
+
+	if (img->revision > WINTERFS_REVISION_V2 || (img->features & ~WINTERFS_FEATURE_SUPPORTED)) {
+		printf("Unsupported winterfs revision %u or features 0x%x\n",
+			img->revision, img->features);
+		return 1;
+	}
+	if (img->block_size < WINTERFS_MIN_BLOCK_SIZE || img->block_size > WINTERFS_MAX_BLOCK_SIZE
+			|| (img->block_size & (img->block_size - 1))
+			|| img->inode_size < WINTERFS_INODE_SIZE || img->inode_size > WINTERFS_INODE_SIZE_MAX
+			|| (img->inode_size & (img->inode_size - 1))) {
+		printf("Unsupported block size %u or inode size %u\n",
+			img->block_size, img->inode_size);
+		return 1;
+	}
+	img->block_bits = __builtin_ctz(img->block_size);
+
+	if (img->free_inode_bitset_idx <= WINTERFS_INODES_BLOCK_ADDR
+			|| img->free_block_bitset_idx <= img->free_inode_bitset_idx
+			|| img->data_blocks_idx <= img->free_block_bitset_idx
+			|| img->data_blocks_idx >= img->num_blocks) {
+		printf("Superblock has a corrupt layout\n");
+		return 1;
+	}
+	img->num_data_blocks = img->num_blocks - img->data_blocks_idx;
+	img->num_inodes = MIN((uint64_t)le32(ws->num_inodes),
+		(uint64_t)(img->free_block_bitset_idx - img->free_inode_bitset_idx)
+		* img->block_size * 8);
+	img->num_inodes = MIN((uint64_t)img->num_inodes,
+		((uint64_t)(img->free_inode_bitset_idx - WINTERFS_INODES_BLOCK_ADDR)
+		<< img->block_bits) / img->inode_size + 1);
+
+	if (img->block_size > WINTERFS_BLOCK_SIZE
+			&& (err = read_at(img->src, img->sb_block, img->block_size, 0))) {
+		printf("Error reading superblock: os error %d\n", err);
+		return 1;
+	}
+
+	return 0;
+}
+
+int image_load_bitsets(struct image *img)
+{
+	int err;
+	uint64_t inode_len = (uint64_t)(img->free_block_bitset_idx - img->free_inode_bitset_idx)
+		<< img->block_bits;
+	uint64_t block_len = DIV_ROUND_UP((uint64_t)img->num_data_blocks, (uint64_t)img->block_size * 8)
+		<< img->block_bits;
+
+	img->inode_bitset = alloc_buffer(inode_len);
+	img->block_bitset = alloc_buffer(block_len);
+	if (!img->inode_bitset || !img->block_bitset) {
+		printf("Out of memory\n");
+		return 1;
+	}
+	if ((err = read_at(img->src, img->inode_bitset, inode_len,
+				(uint64_t)img->free_inode_bitset_idx << img->block_bits))
+			|| (err = read_at(img->src, img->block_bitset, block_len,
+				(uint64_t)img->free_block_bitset_idx << img->block_bits))) {
+		printf("Error reading bitsets: os error %d\n", err);
+		return 1;
+	}
+
+	return 0;
+}
+
+// data blocks mapped by an extent tree node, and the nodes below it
+int image_walk_extents(struct image *img, struct winterfs_extent_header *eh, uint16_t depth,
+	bool dir, uint8_t *meta)
+{
+	uint16_t i;
+	int err;
+	uint16_t entries = le16(eh->entries);
+	uint32_t max = (img->block_size - sizeof(struct winterfs_extent_header))
+		/ sizeof(struct winterfs_extent);
+
+	// what isn't sound is copied as far as it can be followed
+	if (le16(eh->magic) != WINTERFS_EXTENT_MAGIC || le16(eh->depth) != depth
+			|| depth > WINTERFS_EXTENT_MAX_DEPTH || entries > max) {
+		return 0;
+	}
+
+	for (i = 0; i < entries; i++) {
+		if (depth == 0) {
+			struct winterfs_extent *ext = (struct winterfs_extent *)(eh + 1) + i;
+			uint64_t start = le32(ext->start);
+			uint64_t len = le32(ext->len) & WINTERFS_EXTENT_MAX_LEN;
+			uint64_t b;
+
+			for (b = start; dir && b < start + len && b < img->num_data_blocks; b++) {
+				set_bit_le(meta, b);
+			}
+			continue;
+		}
+
+		struct winterfs_extent_idx *idx = (struct winterfs_extent_idx *)(eh + 1) + i;
+		uint32_t child = le32(idx->child);
+
+		if (!child || child >= img->num_data_blocks) {
+			continue;
+		}
+		set_bit_le(meta, child);
+		if ((err = read_at(img->src, img->nodes[depth - 1], img->block_size,
+				(uint64_t)(img->data_blocks_idx + child) << img->block_bits))) {
+			return err;
+		}
+		if ((err = image_walk_extents(img, (struct winterfs_extent_header *)img->nodes[depth - 1],
+				depth - 1, dir, meta))) {
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+// an indirect block of a revision 1 inode, and the blocks below it
+int image_walk_indirect(struct image *img, uint32_t node, uint32_t depth, bool dir, uint8_t *meta)
+{
+	uint32_t i;
+	int err;
+	uint8_t *buf = img->nodes[depth - 1];
+
+	if (node >= img->num_data_blocks) {
+		return 0;
+	}
+	set_bit_le(meta, node);
+	if ((err = read_at(img->src, buf, img->block_size,
+			(uint64_t)(img->data_blocks_idx + node) << img->block_bits))) {
+		return err;
+	}
+
+	for (i = 0; i < img->block_size / sizeof(uint32_t); i++) {
+		uint32_t ptr;
+
+		memcpy(&ptr, buf + i * sizeof(uint32_t), sizeof(uint32_t));
+		ptr = le32(ptr);
+		if (!ptr || ptr >= img->num_data_blocks) {
+			continue;
+		}
+		if (depth > 1) {
+			if ((err = image_walk_indirect(img, ptr, depth - 1, dir, meta))) {
+				return err;
+			}
+		} else if (dir) {
+			set_bit_le(meta, ptr);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * For a metadata image, find the data blocks holding metadata: directory
+ * blocks, extent tree nodes and indirect blocks. File contents are left
+ * out, and read back as zeroes from the image.
+ */
+int image_find_metadata(struct image *img, uint8_t *meta)
+{
+	int err;
+	uint32_t i;
+	uint32_t ino;
+	uint64_t table_len = (uint64_t)(img->free_inode_bitset_idx - WINTERFS_INODES_BLOCK_ADDR)
+		<< img->block_bits;
+	uint32_t per_chunk = IMAGE_WINDOW / img->inode_size;
+	uint8_t *chunk = alloc_buffer(IMAGE_WINDOW);
+
+	if (!chunk) {
+		printf("Out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < WINTERFS_EXTENT_MAX_DEPTH; i++) {
+		img->nodes[i] = alloc_buffer(img->block_size);
+		if (!img->nodes[i]) {
+			printf("Out of memory\n");
+			return 1;
+		}
+	}
+
+	for (ino = 1; ino < img->num_inodes; ino += per_chunk) {
+		uint32_t end = MIN((uint64_t)ino + per_chunk, img->num_inodes);
+		uint64_t off = (uint64_t)(ino - 1) * img->inode_size;
+		uint64_t len = MIN((uint64_t)(end - ino) * img->inode_size + img->block_size - 1,
+			table_len - off) & ~(uint64_t)(img->block_size - 1);
+		uint32_t n;
+
+		for (n = ino; n < end && !test_bit_le(img->inode_bitset, n); n++);
+		if (n == end) {
+			continue;
+		}
+		if ((err = read_at(img->src, chunk, len,
+				((uint64_t)WINTERFS_INODES_BLOCK_ADDR << img->block_bits) + off))) {
+			printf("Error reading inode table: os error %d\n", err);
+			return 1;
+		}
+
+		for (; n < end; n++) {
+			struct winterfs_inode *raw;
+			bool dir;
+
+			if (!test_bit_le(img->inode_bitset, n)) {
+				continue;
+			}
+			raw = (struct winterfs_inode *)(chunk + (uint64_t)(n - ino) * img->inode_size);
+			dir = S_ISDIR(le16(raw->mode));
+			if (le32(raw->flags) & WINTERFS_INODE_INLINE_FL) {
+				continue;
+			}
+
+			if (img->revision >= WINTERFS_REVISION_V2) {
+				err = image_walk_extents(img, &raw->extent_header,
+					le16(raw->extent_header.depth), dir, meta);
+			} else {
+				uint32_t k;
+				uint32_t roots[3] = {
+					le32(raw->indirect_primary),
+					le32(raw->indirect_secondary),
+					le32(raw->indirect_tertiary),
+				};
+
+				for (k = 0; dir && k < WINTERFS_INODE_DIRECT_BLOCKS; k++) {
+					uint32_t ptr = le32(raw->direct_blocks[k]);
+
+					if (ptr && ptr < img->num_data_blocks) {
+						set_bit_le(meta, ptr);
+					}
+				}
+				err = 0;
+				for (k = 0; k < 3 && !err; k++) {
+					if (roots[k]) {
+						err = image_walk_indirect(img, roots[k], k + 1, dir, meta);
+					}
+				}
+			}
+			if (err) {
+				printf("Error reading block map of inode %u: os error %d\n", n, err);
+				return 1;
+			}
+		}
+	}
+
+	free(chunk);
+	return 0;
+}
+
+// runs of set bits in a bitset, as blocks from 'base'
+void image_add_bitset(struct image *img, const uint8_t *bitset, uint64_t bits, uint64_t base)
+{
+	uint64_t bit = 0;
+
+	while (bit < bits) {
+		uint64_t start;
+
+		// whole bytes of free blocks are skipped at once
+		if (!(bit % 8) && !bitset[bit / 8]) {
+			bit += 8;
+			continue;
+		}
+		if (!test_bit_le(bitset, bit)) {
+			bit++;
+			continue;
+		}
+		start = bit;
+		while (bit < bits) {
+			if (!(bit % 8) && bitset[bit / 8] == 0xff && bit + 8 <= bits) {
+				bit += 8;
+			} else if (test_bit_le(bitset, bit)) {
+				bit++;
+			} else {
+				break;
+			}
+		}
+		image_add_run(img, base + start, bit - start);
+	}
+}
+
+/*
+ * Everything to copy but the superblock, in volume order: the inode table
+ * blocks holding inodes in use, all three bitsets, then the data blocks
+ * in use, or only those holding metadata.
+ */
+int image_plan(struct image *img)
+{
+	uint32_t ino;
+	uint64_t last = UINT64_MAX;
+	uint8_t *meta = img->block_bitset;
+
+	for (ino = 1; ino < img->num_inodes; ino++) {
+		uint64_t block;
+
+		if (!(ino % 8) && !img->inode_bitset[ino / 8]) {
+			ino += 7;
+			continue;
+		}
+		if (!test_bit_le(img->inode_bitset, ino)) {
+			continue;
+		}
+		block = WINTERFS_INODES_BLOCK_ADDR
+			+ (((uint64_t)(ino - 1) * img->inode_size) >> img->block_bits);
+		if (block != last) {
+			image_add_run(img, block, 1);
+			last = block;
+		}
+	}
+
+	image_add_run(img, img->free_inode_bitset_idx, img->data_blocks_idx - img->free_inode_bitset_idx);
+
+	if (img->metadata_only) {
+		meta = calloc(DIV_ROUND_UP((uint64_t)img->num_data_blocks, 8), 1);
+		if (!meta) {
+			printf("Out of memory\n");
+			return 1;
+		}
+		if (image_find_metadata(img, meta)) {
+			return 1;
+		}
+	}
+	// data block 0 is never handed out
+	image_add_bitset(img, meta, img->num_data_blocks, img->data_blocks_idx);
+	if (meta != img->block_bitset) {
+		free(meta);
+	}
+
+	return 0;
+}
+
+/*
+ * A device target holds whatever it held before in the blocks not copied.
+ * Only the inode table cares: without lazy_itable the kernel expects the
+ * slots of unused inodes zeroed, as mkfs leaves them.
+ */
+int image_zero_itable(struct image *img)
+{
+	size_t i;
+	uint64_t pos = WINTERFS_INODES_BLOCK_ADDR;
+	uint64_t range[2];
+
+	if (img->dst_is_file || (img->features & WINTERFS_FEATURE_LAZY_ITABLE)) {
+		return 0;
+	}
+
+	for (i = 0; i <= img->num_runs && pos < img->free_inode_bitset_idx; i++) {
+		uint64_t end = i < img->num_runs
+			? MIN(img->runs[i].start, (uint64_t)img->free_inode_bitset_idx)
+			: img->free_inode_bitset_idx;
+
+		if (end > pos) {
+			range[0] = pos << img->block_bits;
+			range[1] = (end - pos) << img->block_bits;
+			if (ioctl(img->dst, BLKZEROOUT, range)) {
+				printf("Failed zeroing inode table: os error %d\n", errno);
+				return 1;
+			}
+		}
+		if (i < img->num_runs && img->runs[i].start + img->runs[i].len > pos) {
+			pos = img->runs[i].start + img->runs[i].len;
+		}
+	}
+
+	return 0;
+}
+
+void image_progress(struct image *img)
+{
+	double secs = now() - img->start;
+
+	if (!img->progress || now() - img->shown < 1) {
+		return;
+	}
+	img->shown = now();
+	printf("\r\033[KCopied %llu of %llu MB, %.1f MB/s",
+		(unsigned long long)(img->copied >> 20), (unsigned long long)(img->total >> 20),
+		secs > 0 ? img->copied / secs / (1 << 20) : 0.0);
+	fflush(stdout);
+}
+
+// writes each run out of the windows the reader fills, in order
+void *image_writer(void *arg)
+{
+	struct image *img = arg;
+	unsigned int tail = 0;
+
+	for (;;) {
+		size_t i;
+		int err = 0;
+		struct image_buffer *buf = &img->bufs[tail];
+
+		pthread_mutex_lock(&img->lock);
+		while (!img->filled && !img->done) {
+			pthread_cond_wait(&img->cond, &img->lock);
+		}
+		if (!img->filled) {
+			pthread_mutex_unlock(&img->lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&img->lock);
+
+		for (i = buf->first; i < buf->first + buf->count && !err; i++) {
+			struct image_run *run = &img->runs[i];
+
+			err = write_at(img->dst, buf->data + ((run->start - buf->pos) << img->block_bits),
+				run->len << img->block_bits, run->start << img->block_bits);
+			__atomic_add_fetch(&img->copied, run->len << img->block_bits, __ATOMIC_RELAXED);
+		}
+
+		pthread_mutex_lock(&img->lock);
+		if (err && !img->err) {
+			img->err = err;
+		}
+		img->filled--;
+		pthread_cond_broadcast(&img->cond);
+		pthread_mutex_unlock(&img->lock);
+		tail = (tail + 1) % IMAGE_BUFFERS;
+	}
+}
+
+/*
+ * Copy every run, reading whole windows at a time so neighbouring runs
+ * come in one sequential read, with the writes overlapped on a second
+ * thread.
+ */
+int image_copy_buffered(struct image *img, size_t from)
+{
+	size_t i = from;
+	unsigned int head = 0;
+	int err = 0;
+	pthread_t writer;
+	uint64_t window = IMAGE_WINDOW >> img->block_bits;
+	uint64_t gap = IMAGE_MAX_GAP >> img->block_bits;
+
+	for (head = 0; head < IMAGE_BUFFERS; head++) {
+		img->bufs[head].data = alloc_buffer(IMAGE_WINDOW);
+		if (!img->bufs[head].data) {
+			printf("Out of memory\n");
+			return 1;
+		}
+	}
+	pthread_mutex_init(&img->lock, NULL);
+	pthread_cond_init(&img->cond, NULL);
+	if (pthread_create(&writer, NULL, image_writer, img)) {
+		printf("Error starting writer thread\n");
+		return 1;
+	}
+
+	head = 0;
+	while (i < img->num_runs) {
+		struct image_buffer *buf = &img->bufs[head];
+		uint64_t end = img->runs[i].start + img->runs[i].len;
+		size_t j = i + 1;
+
+		while (j < img->num_runs && img->runs[j].start - end <= gap
+				&& img->runs[j].start + img->runs[j].len - img->runs[i].start <= window) {
+			end = img->runs[j].start + img->runs[j].len;
+			j++;
+		}
+
+		pthread_mutex_lock(&img->lock);
+		while (img->filled == IMAGE_BUFFERS) {
+			pthread_cond_wait(&img->cond, &img->lock);
+		}
+		err = img->err;
+		pthread_mutex_unlock(&img->lock);
+		if (err) {
+			printf("Error writing %s: os error %d\n", img->dst_path, err);
+			break;
+		}
+
+		buf->pos = img->runs[i].start;
+		buf->first = i;
+		buf->count = j - i;
+		if ((err = read_at(img->src, buf->data, (end - buf->pos) << img->block_bits,
+				buf->pos << img->block_bits))) {
+			printf("Error reading block %llu: os error %d\n",
+				(unsigned long long)buf->pos, err);
+			break;
+		}
+
+		pthread_mutex_lock(&img->lock);
+		img->filled++;
+		pthread_cond_broadcast(&img->cond);
+		pthread_mutex_unlock(&img->lock);
+
+		image_progress(img);
+		head = (head + 1) % IMAGE_BUFFERS;
+		i = j;
+	}
+
+	pthread_mutex_lock(&img->lock);
+	img->done = true;
+	pthread_cond_broadcast(&img->cond);
+	pthread_mutex_unlock(&img->lock);
+	pthread_join(writer, NULL);
+
+	if (!err && img->err) {
+		err = img->err;
+		printf("Error writing %s: os error %d\n", img->dst_path, err);
+	}
+	for (head = 0; head < IMAGE_BUFFERS; head++) {
+		free(img->bufs[head].data);
+	}
+
+	return err ? 1 : 0;
+}
+
+/*
+ * Between two regular files copy_file_range lets the kernel copy without
+ * a round trip through userspace, or share the blocks outright on
+ * filesystems that reflink. The rest falls back to reading & writing.
+ */
+int image_copy(struct image *img)
+{
+	size_t i = 0;
+	struct stat s;
+
+	if (!fstat(img->src, &s) && S_ISREG(s.st_mode) && img->dst_is_file) {
+		for (; i < img->num_runs; i++) {
+			loff_t in = img->runs[i].start << img->block_bits;
+			loff_t out = in;
+			uint64_t len = img->runs[i].len << img->block_bits;
+
+			while (len) {
+				ssize_t n = copy_file_range(img->src, &in, img->dst, &out, len, 0);
+
+				if (n <= 0) {
+					break;
+				}
+				len -= n;
+				img->copied += n;
+			}
+			if (len) {
+				// what is left of the run goes the buffered way
+				img->runs[i].start = in >> img->block_bits;
+				img->runs[i].len = len >> img->block_bits;
+				break;
+			}
+			image_progress(img);
+		}
+	}
+
+	if (i < img->num_runs) {
+		return image_copy_buffered(img, i);
+	}
+
+	return 0;
+}
+
+void usage(char *prog)
+{
+	printf("Usage: %s [-m] [-p] source target\n"
+		"\t-m\tcopy metadata only, file contents read back as zeroes\n"
+		"\t-p\tshow progress\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	int err;
+	int ret = 1;
+	struct stat s;
+	uint64_t size;
+	double secs;
+	struct image img = {
+		.src = -1,
+		.dst = -1,
+		.progress = isatty(STDOUT_FILENO),
+	};
+
+	while ((opt = getopt(argc, argv, "mp")) != -1) {
+		switch (opt) {
+		case 'm':
+			img.metadata_only = true;
+			break;
+		case 'p':
+			img.progress = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 2) {
+		printf("Invalid number of arguments\n");
+		usage(argv[0]);
+		return 1;
+	}
+	img.src_path = argv[optind];
+	img.dst_path = argv[optind + 1];
+
+	// a mounted source would change under the copy, and O_EXCL refuses it
+	if (stat(img.src_path, &s)) {
+		printf("Error opening %s: os error %d\n", img.src_path, errno);
+		return 1;
+	}
+	img.src = open(img.src_path, O_RDONLY | O_DIRECT | (S_ISBLK(s.st_mode) ? O_EXCL : 0));
+	if (img.src < 0 && errno == EINVAL) {
+		img.src = open(img.src_path, O_RDONLY | (S_ISBLK(s.st_mode) ? O_EXCL : 0));
+	}
+	if (img.src < 0) {
+		printf("Error opening %s: os error %d\n", img.src_path, errno);
+		return 1;
+	}
+
+	if (image_load_super(&img) || image_load_bitsets(&img) || image_plan(&img)) {
+		goto cleanup;
+	}
+	size = (uint64_t)img.num_blocks << img.block_bits;
+	if (!fstat(img.src, &s) && S_ISREG(s.st_mode) && (uint64_t)s.st_size < size) {
+		printf("%s is smaller than the volume it holds\n", img.src_path);
+		goto cleanup;
+	}
+
+	// image files come out sparse, with only what was copied allocated
+	img.dst_is_file = stat(img.dst_path, &s) || !S_ISBLK(s.st_mode);
+	img.dst = open(img.dst_path, img.dst_is_file ? O_WRONLY | O_CREAT | O_TRUNC : O_WRONLY | O_EXCL,
+		0644);
+	if (img.dst < 0) {
+		printf("Error opening %s: os error %d\n", img.dst_path, errno);
+		goto cleanup;
+	}
+	if (img.dst_is_file) {
+		if (ftruncate(img.dst, size)) {
+			printf("Error sizing %s: os error %d\n", img.dst_path, errno);
+			goto cleanup;
+		}
+	} else {
+		uint64_t dev_size;
+
+		if (ioctl(img.dst, BLKGETSIZE64, &dev_size) || dev_size < size) {
+			printf("%s is smaller than the volume\n", img.dst_path);
+			goto cleanup;
+		}
+	}
+
+	// the superblock goes last, so a copy cut short is never mountable
+	if (!img.dst_is_file) {
+		uint8_t *zero = alloc_buffer(img.block_size);
+
+		if (!zero || (err = write_at(img.dst, zero, img.block_size, 0))) {
+			printf("Failed clearing superblock: os error %d\n", zero ? err : ENOMEM);
+			free(zero);
+			goto cleanup;
+		}
+		free(zero);
+	}
+
+	if (image_zero_itable(&img)) {
+		goto cleanup;
+	}
+
+	img.start = now();
+	img.shown = img.start;
+	if (image_copy(&img)) {
+		goto cleanup;
+	}
+	if (fsync(img.dst)) {
+		printf("Failed flushing %s: os error %d\n", img.dst_path, errno);
+		goto cleanup;
+	}
+	if ((err = write_at(img.dst, img.sb_block, img.block_size,
+			(uint64_t)WINTERFS_SUPERBLOCK_BLOCK_ADDR << img.block_bits)) || fsync(img.dst)) {
+		printf("Failed writing superblock: os error %d\n", err ? err : errno);
+		goto cleanup;
+	}
+	img.copied += img.block_size;
+	if (img.progress) {
+		printf("\r\033[K");
+	}
+
+	secs = now() - img.start;
+	printf("Copied %.1f MB of a %llu MB volume in %.1fs, %.1f MB/s\n",
+		img.copied / (double)(1 << 20), (unsigned long long)(size >> 20), secs,
+		secs > 0 ? img.copied / secs / (1 << 20) : 0.0);
+	ret = 0;
+
+cleanup:
+	if (img.dst >= 0) {
+		close(img.dst);
+	}
+	close(img.src);
+	return ret;
+}
@@ -0,0 +1,697 @@
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+#include <linux/smp.h>
+#include "winterfs.h"
+#include "winterfs_alloc.h"
+
+// number of bitset blocks read ahead while building the index
+#define WINTERFS_BITSET_READAHEAD	32
+
+static struct winterfs_free_extent *winterfs_free_extent_entry(struct rb_node *node)
+{
+	return rb_entry_safe(node, struct winterfs_free_extent, off_node);
+}
+
+static void winterfs_free_extent_insert_off(struct winterfs_free_group *g,
+	struct winterfs_free_extent *ext)
+{
+	struct rb_node **p = &g->by_off.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*p) {
+		struct winterfs_free_extent *cur;
+
+		parent = *p;
+		cur = rb_entry(parent, struct winterfs_free_extent, off_node);
+		if (ext->start < cur->start) {
+			p = &(*p)->rb_left;
+		} else {
+			p = &(*p)->rb_right;
+		}
+	}
+
+	rb_link_node(&ext->off_node, parent, p);
+	rb_insert_color(&ext->off_node, &g->by_off);
+}
+
+static void winterfs_free_extent_insert_size(struct winterfs_free_group *g,
+	struct winterfs_free_extent *ext)
+{
+	struct rb_node **p = &g->by_size.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*p) {
+		struct winterfs_free_extent *cur;
+
+		parent = *p;
+		cur = rb_entry(parent, struct winterfs_free_extent, size_node);
+		if (ext->len < cur->len
+			|| (ext->len == cur->len && ext->start < cur->start)) {
+			p = &(*p)->rb_left;
+		} else {
+			p = &(*p)->rb_right;
+		}
+	}
+
+	rb_link_node(&ext->size_node, parent, p);
+	rb_insert_color(&ext->size_node, &g->by_size);
+}
+
+// extent containing pos, or else the first extent starting after it
+static struct winterfs_free_extent *winterfs_free_extent_find(
+	struct winterfs_free_group *g, u32 pos)
+{
+	struct rb_node *node = g->by_off.rb_node;
+	struct winterfs_free_extent *next = NULL;
+
+	while (node) {
+		struct winterfs_free_extent *ext;
+
+		ext = rb_entry(node, struct winterfs_free_extent, off_node);
+		if (pos < ext->start) {
+			next = ext;
+			node = node->rb_left;
+		} else if (pos >= ext->start + ext->len) {
+			node = node->rb_right;
+		} else {
+			return ext;
+		}
+	}
+
+	return next;
+}
+
+// record the longest free extent, so allocators can skip the group unlocked
+static void winterfs_group_update_max_run(struct winterfs_free_group *g)
+{
+	struct rb_node *node = rb_last(&g->by_size);
+
+	WRITE_ONCE(g->max_run, node
+		? rb_entry(node, struct winterfs_free_extent, size_node)->len : 0);
+}
+
+// remove [start, start + len) from ext; spare is consumed if ext has to split
+static void winterfs_free_extent_take(struct winterfs_free_group *g,
+	struct winterfs_free_extent *ext, u32 start, u32 len,
+	struct winterfs_free_extent **spare)
+{
+	u32 end = start + len;
+	u32 ext_end = ext->start + ext->len;
+
+	rb_erase(&ext->size_node, &g->by_size);
+
+	if (start == ext->start) {
+		ext->start = end;
+		ext->len -= len;
+	} else if (end == ext_end) {
+		ext->len -= len;
+	} else {
+		struct winterfs_free_extent *tail = *spare;
+
+		*spare = NULL;
+		tail->start = end;
+		tail->len = ext_end - end;
+		ext->len = start - ext->start;
+		winterfs_free_extent_insert_off(g, tail);
+		winterfs_free_extent_insert_size(g, tail);
+	}
+
+	if (ext->len == 0) {
+		rb_erase(&ext->off_node, &g->by_off);
+		kfree(ext);
+	} else {
+		winterfs_free_extent_insert_size(g, ext);
+	}
+	winterfs_group_update_max_run(g);
+}
+
+/*
+ * Add [start, start + len) to the index, merging with adjacent extents.
+ * A new extent record is taken from spare when given one, so that putting
+ * back a range taken out of the index cannot fail.
+ */
+static int winterfs_free_extent_add(struct winterfs_free_group *g,
+	u32 start, u32 len, struct winterfs_free_extent **spare)
+{
+	struct winterfs_free_extent *prev;
+	struct winterfs_free_extent *next;
+	struct winterfs_free_extent *ext;
+	u32 end = start + len;
+
+	next = winterfs_free_extent_find(g, start);
+	if (next) {
+		prev = winterfs_free_extent_entry(rb_prev(&next->off_node));
+	} else {
+		prev = winterfs_free_extent_entry(rb_last(&g->by_off));
+	}
+
+	if (prev && prev->start + prev->len == start) {
+		rb_erase(&prev->size_node, &g->by_size);
+		prev->len += len;
+		if (next && next->start == end) {
+			prev->len += next->len;
+			rb_erase(&next->size_node, &g->by_size);
+			rb_erase(&next->off_node, &g->by_off);
+			kfree(next);
+		}
+		winterfs_free_extent_insert_size(g, prev);
+		goto out;
+	}
+
+	if (next && next->start == end) {
+		rb_erase(&next->size_node, &g->by_size);
+		next->start = start;
+		next->len += len;
+		winterfs_free_extent_insert_size(g, next);
+		goto out;
+	}
+
+	if (spare && *spare) {
+		ext = *spare;
+		*spare = NULL;
+	} else {
+		ext = kmalloc(sizeof(struct winterfs_free_extent), GFP_NOFS);
+		if (!ext) {
+			return -ENOMEM;
+		}
+	}
+	ext->start = start;
+	ext->len = len;
+	winterfs_free_extent_insert_off(g, ext);
+	winterfs_free_extent_insert_size(g, ext);
+
+out:
+	winterfs_group_update_max_run(g);
+	return 0;
+}
+
+/*
+ * Set or clear [start, start + len) in the on-disk bitset, returning the
+ * number of bits that actually changed state. The range lies within group
+ * g and so within one bitset block. Groups never share a word of the
+ * bitset, so the non-atomic bit ops are safe under the group lock alone.
+ */
+static u32 winterfs_bitset_update(struct super_block *sb,
+	struct winterfs_free_space *fs, struct winterfs_free_group *g,
+	u32 start, u32 len, bool set)
+{
+	struct buffer_head *bh;
+	u32 block = start >> fs->bitset_shift;
+	u32 bit = start & ((1U << fs->bitset_shift) - 1);
+	u32 end = bit + len;
+	u32 changed = 0;
+
+	bh = sb_bread(sb, fs->bitset_idx + block);
+	if (!bh) {
+		printk(KERN_ERR "Error reading bitset block %u\n", fs->bitset_idx + block);
+		return 0;
+	}
+
+	for (; bit < end; bit++) {
+		if (!!test_bit_le(bit, bh->b_data) != set) {
+			if (set) {
+				__set_bit_le(bit, bh->b_data);
+			} else {
+				__clear_bit_le(bit, bh->b_data);
+			}
+			changed++;
+		}
+	}
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	if (set) {
+		g->free -= changed;
+		percpu_counter_sub(&fs->free_count, changed);
+	} else {
+		g->free += changed;
+		percpu_counter_add(&fs->free_count, changed);
+	}
+
+	return changed;
+}
+
+// index the free bits [start, start + len), split at group boundaries
+static int winterfs_free_space_add(struct winterfs_free_space *fs, u32 start, u32 len)
+{
+	int err;
+
+	while (len) {
+		struct winterfs_free_group *g = &fs->groups[start >> fs->group_shift];
+		u32 part = min_t(u32, len, g->first + (1U << fs->group_shift) - start);
+
+		err = winterfs_free_extent_add(g, start, part, NULL);
+		if (err) {
+			return err;
+		}
+		g->free += part;
+		start += part;
+		len -= part;
+	}
+
+	return 0;
+}
+
+int winterfs_free_space_init(struct super_block *sb,
+	struct winterfs_free_space *fs, u32 bitset_idx, u32 num_bits)
+{
+	u32 i;
+	u64 free = 0;
+	int err = 0;
+
+	fs->bitset_idx = bitset_idx;
+	fs->num_bits = num_bits;
+	fs->bitset_shift = WINTERFS_BITSET_SHIFT(sb);
+	fs->group_shift = WINTERFS_GROUP_SHIFT(sb);
+	fs->num_bitset_blocks = (num_bits >> fs->bitset_shift)
+		+ ((num_bits & (WINTERFS_BITS_PER_BITSET_BLOCK(sb) - 1)) != 0);
+	fs->num_groups = DIV_ROUND_UP(num_bits, 1U << fs->group_shift);
+	fs->reserved = 0;
+	spin_lock_init(&fs->reserve_lock);
+
+	fs->groups = kvcalloc(max_t(u32, fs->num_groups, 1),
+		sizeof(struct winterfs_free_group), GFP_KERNEL);
+	if (!fs->groups) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < fs->num_groups; i++) {
+		struct winterfs_free_group *g = &fs->groups[i];
+
+		g->first = i << fs->group_shift;
+		g->cursor = g->first;
+		g->by_off = RB_ROOT;
+		g->by_size = RB_ROOT;
+		mutex_init(&g->lock);
+	}
+
+	for (i = 0; i < min_t(u32, fs->num_bitset_blocks, WINTERFS_BITSET_READAHEAD); i++) {
+		sb_breadahead(sb, bitset_idx + i);
+	}
+
+	for (i = 0; i < fs->num_bitset_blocks; i++) {
+		struct buffer_head *bh;
+		u32 base = i << fs->bitset_shift;
+		u32 valid = min_t(u32, num_bits - base, WINTERFS_BITS_PER_BITSET_BLOCK(sb));
+		// bit 0 of each bitset (null inode, root dir block) is never handed out
+		u32 bit = (i == 0);
+
+		if (i + WINTERFS_BITSET_READAHEAD < fs->num_bitset_blocks) {
+			sb_breadahead(sb, bitset_idx + i + WINTERFS_BITSET_READAHEAD);
+		}
+
+		bh = sb_bread(sb, bitset_idx + i);
+		if (!bh) {
+			printk(KERN_ERR "Error reading bitset block %u\n", bitset_idx + i);
+			err = -EIO;
+			goto err;
+		}
+
+		while (bit < valid) {
+			u32 zero = find_next_zero_bit_le(bh->b_data, valid, bit);
+			if (zero >= valid) {
+				break;
+			}
+			bit = find_next_bit_le(bh->b_data, valid, zero);
+
+			err = winterfs_free_space_add(fs, base + zero, bit - zero);
+			if (err) {
+				brelse(bh);
+				goto err;
+			}
+			free += bit - zero;
+		}
+		brelse(bh);
+	}
+
+	err = percpu_counter_init(&fs->free_count, free, GFP_KERNEL);
+	if (err) {
+		goto err;
+	}
+
+	return 0;
+
+err:
+	winterfs_free_space_destroy(fs);
+	return err;
+}
+
+void winterfs_free_space_destroy(struct winterfs_free_space *fs)
+{
+	struct winterfs_free_extent *ext;
+	struct winterfs_free_extent *tmp;
+	u32 i;
+
+	for (i = 0; fs->groups && i < fs->num_groups; i++) {
+		rbtree_postorder_for_each_entry_safe(ext, tmp, &fs->groups[i].by_off, off_node) {
+			kfree(ext);
+		}
+	}
+	kvfree(fs->groups);
+	fs->groups = NULL;
+	fs->num_groups = 0;
+	percpu_counter_destroy(&fs->free_count);
+}
+
+// smallest extent holding at least len bits, or the largest one if none does
+static struct winterfs_free_extent *winterfs_free_extent_best_fit(
+	struct winterfs_free_group *g, u32 len)
+{
+	struct rb_node *node = g->by_size.rb_node;
+	struct winterfs_free_extent *best = NULL;
+
+	while (node) {
+		struct winterfs_free_extent *ext;
+
+		ext = rb_entry(node, struct winterfs_free_extent, size_node);
+		if (ext->len >= len) {
+			best = ext;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+
+	if (!best) {
+		node = rb_last(&g->by_size);
+		best = rb_entry_safe(node, struct winterfs_free_extent, size_node);
+	}
+
+	return best;
+}
+
+/*
+ * Allocate a run of up to *len contiguous bits from one group, preferring
+ * to start exactly at goal so that files keep growing in place, or else at
+ * the first free run after goal that fits the whole request. Failing that,
+ * a multi-bit request is served best-fit and a single bit next-fit from
+ * the cursor. With whole set, nothing shorter than the request is taken
+ * unless it continues goal. Returns the first bit and the run length in
+ * *len, or 0 when nothing suitable is free.
+ */
+static u32 winterfs_group_alloc(struct super_block *sb,
+	struct winterfs_free_space *fs, struct winterfs_free_group *g,
+	u32 goal, u32 *len, bool whole)
+{
+	struct winterfs_free_extent *ext = NULL;
+	struct winterfs_free_extent *spare = NULL;
+	u32 want = *len;
+	u32 start = 0;
+	u32 ext_end;
+
+	*len = 0;
+	mutex_lock(&g->lock);
+
+	if (goal) {
+		ext = winterfs_free_extent_find(g, goal);
+		if (ext && ext->start <= goal) {
+			start = goal;
+		} else if (ext && ext->len < want) {
+			// the next free run after goal is too short, look elsewhere
+			ext = NULL;
+		}
+	}
+	if (!ext && want > 1) {
+		ext = winterfs_free_extent_best_fit(g, want);
+		if (ext && whole && ext->len < want) {
+			ext = NULL;
+		}
+	}
+	if (!ext && (want == 1 || !whole)) {
+		ext = winterfs_free_extent_find(g, g->cursor);
+		if (ext && ext->start <= g->cursor) {
+			start = g->cursor;
+		}
+		if (!ext) {
+			ext = winterfs_free_extent_entry(rb_first(&g->by_off));
+		}
+	}
+	if (!ext) {
+		mutex_unlock(&g->lock);
+		return 0;
+	}
+
+	ext_end = ext->start + ext->len;
+	if (start < ext->start || start >= ext_end) {
+		start = ext->start;
+	}
+
+	want = min_t(u32, want, ext_end - start);
+
+	if (start != ext->start && start + want != ext_end) {
+		spare = kmalloc(sizeof(struct winterfs_free_extent), GFP_NOFS);
+		if (!spare) {
+			// take from the front of the extent instead of splitting it
+			start = ext->start;
+		}
+	}
+
+	winterfs_free_extent_take(g, ext, start, want, &spare);
+	g->cursor = start + want;
+	if (winterfs_bitset_update(sb, fs, g, start, want, true) != want) {
+		// unreadable or already in use on disk, either way stop handing it out
+		printk(KERN_ERR "Bitset out of sync with free space index at %u+%u\n",
+			start, want);
+		start = 0;
+		want = 0;
+	}
+
+	mutex_unlock(&g->lock);
+	kfree(spare);
+
+	*len = want;
+	return start;
+}
+
+/*
+ * Allocate a run of up to *len contiguous bits. The search starts in the
+ * group holding goal, or without one in a group picked by CPU so that
+ * concurrent allocators spread out over the volume instead of queueing on
+ * one lock. Groups are first asked for a run covering the whole request,
+ * capped at a group, skipping without taking the lock those whose longest
+ * free run is shorter, then for whatever they have. Runs never cross a
+ * group, so only one on-disk bitset block is modified. Returns the first
+ * bit and the run length in *len, or 0 when nothing is free. *groups is
+ * set to the number of groups searched.
+ */
+u32 winterfs_free_space_alloc(struct super_block *sb,
+	struct winterfs_free_space *fs, u32 goal, u32 *len, u32 *groups)
+{
+	u32 want = *len;
+	u32 first_group;
+	u32 start;
+	u32 i;
+	int pass;
+
+	*len = 0;
+	*groups = 0;
+	if (!fs->num_groups) {
+		return 0;
+	}
+	// no run is longer than a group, and asking for more would make the
+	// first pass skip every group, even empty ones
+	want = min_t(u32, want, 1U << fs->group_shift);
+
+	if (goal && goal < fs->num_bits) {
+		first_group = goal >> fs->group_shift;
+	} else {
+		goal = 0;
+		first_group = raw_smp_processor_id() % fs->num_groups;
+	}
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < fs->num_groups; i++) {
+			struct winterfs_free_group *g;
+			u32 group_goal = i == 0 ? goal : 0;
+
+			g = &fs->groups[(first_group + i) % fs->num_groups];
+			// an unlocked peek, so groups without a long enough run cost nothing
+			if (!group_goal && (pass ? READ_ONCE(g->free) < 1
+					: READ_ONCE(g->max_run) < want)) {
+				continue;
+			}
+
+			*len = want;
+			(*groups)++;
+			start = winterfs_group_alloc(sb, fs, g, group_goal, len, pass == 0);
+			if (start) {
+				return start;
+			}
+		}
+	}
+
+	*len = 0;
+	return 0;
+}
+
+/*
+ * Goal for something that should start a neighbourhood of its own, like a
+ * top level directory: the first group from a random one on that has at
+ * least the average number of free bits, so such allocations spread over
+ * the volume and leave room next to each for what follows. 0 if the
+ * space is empty.
+ */
+u32 winterfs_free_space_spread_goal(struct winterfs_free_space *fs)
+{
+	u32 i;
+	u32 avg;
+	u32 first_group;
+
+	if (!fs->num_groups) {
+		return 0;
+	}
+
+	avg = percpu_counter_read_positive(&fs->free_count) / fs->num_groups;
+	first_group = prandom_u32_max(fs->num_groups);
+	for (i = 0; i < fs->num_groups; i++) {
+		struct winterfs_free_group *g;
+		u32 free;
+
+		g = &fs->groups[(first_group + i) % fs->num_groups];
+		free = READ_ONCE(g->free);
+		if (free && free >= avg) {
+			// bit 0 is never free, and a zero goal means no goal
+			return max_t(u32, g->first, 1);
+		}
+	}
+
+	return 0;
+}
+
+void winterfs_free_space_release(struct super_block *sb,
+	struct winterfs_free_space *fs, u32 start, u32 len)
+{
+	u32 changed;
+
+	if (!start || start + len > fs->num_bits) {
+		printk(KERN_ERR "Attempt to free invalid range %u+%u\n", start, len);
+		return;
+	}
+
+	// the range may have been allocated in pieces from neighbouring groups
+	while (len) {
+		struct winterfs_free_group *g = &fs->groups[start >> fs->group_shift];
+		u32 part = min_t(u32, len, g->first + (1U << fs->group_shift) - start);
+
+		mutex_lock(&g->lock);
+		changed = winterfs_bitset_update(sb, fs, g, start, part, false);
+		if (changed != part) {
+			// part of the range was already free, don't let the index double count it
+			printk(KERN_ERR "Freed range %u+%u was not fully allocated\n", start, part);
+		} else if (winterfs_free_extent_add(g, start, part, NULL)) {
+			printk(KERN_WARNING "Out of memory indexing freed range %u+%u\n", start, part);
+		}
+		mutex_unlock(&g->lock);
+
+		start += part;
+		len -= part;
+	}
+}
+
+/*
+ * Discard the free runs of at least minlen bits that overlap [start, end),
+ * bit n being device block base + n. Each run is taken out of the index
+ * while the device discards it, so it cannot be handed out meanwhile but
+ * the rest of its group stays free to allocate from, and is put back
+ * afterwards. Bits allocated since they were queued for discard are left
+ * alone. Returns the number of bits discarded, or a negative error.
+ */
+s64 winterfs_free_space_trim(struct super_block *sb,
+	struct winterfs_free_space *fs, u32 base, u32 start, u32 end, u32 minlen)
+{
+	struct winterfs_free_extent *spare = NULL;
+	struct winterfs_free_extent *back = NULL;
+	int err = 0;
+	s64 trimmed = 0;
+
+	end = min_t(u32, end, fs->num_bits);
+	while (start < end && !err) {
+		struct winterfs_free_group *g = &fs->groups[start >> fs->group_shift];
+		u32 group_end = min_t(u64, (u64)g->first + (1U << fs->group_shift), end);
+		struct winterfs_free_extent *ext;
+		u32 from = 0;
+		u32 to = 0;
+
+		// records for splitting the run out of its extent and putting it back
+		if (!spare) {
+			spare = kmalloc(sizeof(struct winterfs_free_extent), GFP_NOFS);
+		}
+		if (!back) {
+			back = kmalloc(sizeof(struct winterfs_free_extent), GFP_NOFS);
+		}
+		if (!spare || !back) {
+			err = -ENOMEM;
+			break;
+		}
+
+		mutex_lock(&g->lock);
+		for (ext = winterfs_free_extent_find(g, start); ext && ext->start < group_end;
+				ext = winterfs_free_extent_entry(rb_next(&ext->off_node))) {
+			from = max_t(u32, ext->start, start);
+			to = min_t(u32, ext->start + ext->len, group_end);
+			if (to - from >= minlen) {
+				break;
+			}
+		}
+		if (!ext || ext->start >= group_end) {
+			mutex_unlock(&g->lock);
+			start = group_end;
+			continue;
+		}
+		winterfs_free_extent_take(g, ext, from, to - from, &spare);
+		mutex_unlock(&g->lock);
+
+		err = sb_issue_discard(sb, base + from, to - from, GFP_NOFS, 0);
+		if (!err) {
+			trimmed += to - from;
+		}
+
+		mutex_lock(&g->lock);
+		winterfs_free_extent_add(g, from, to - from, &back);
+		mutex_unlock(&g->lock);
+
+		if (fatal_signal_pending(current)) {
+			err = -ERESTARTSYS;
+		}
+		start = to;
+	}
+	kfree(spare);
+	kfree(back);
+
+	return err ? err : trimmed;
+}
+
+/*
+ * Promise len bits to a later allocation without choosing them yet. Fails
+ * with -ENOSPC unless len bits remain free beyond those already promised
+ * and the keep bits held back for allocations that cannot be reserved.
+ */
+int winterfs_free_space_reserve(struct winterfs_free_space *fs, u32 len,
+	u32 keep)
+{
+	int err = 0;
+
+	spin_lock(&fs->reserve_lock);
+	if (percpu_counter_compare(&fs->free_count, (s64)fs->reserved + keep + len) < 0) {
+		err = -ENOSPC;
+	} else {
+		fs->reserved += len;
+	}
+	spin_unlock(&fs->reserve_lock);
+
+	return err;
+}
+
+void winterfs_free_space_unreserve(struct winterfs_free_space *fs, u32 len)
+{
+	spin_lock(&fs->reserve_lock);
+	if (len > fs->reserved) {
+		printk(KERN_ERR "Unreserving %u bits with only %u reserved\n",
+			len, fs->reserved);
+		len = fs->reserved;
+	}
+	fs->reserved -= len;
+	spin_unlock(&fs->reserve_lock);
+}
@@ -1,142 +1,1364 @@
 #include <linux/buffer_head.h>
+#include <linux/compat.h>
+#include <linux/siphash.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
 #include <linux/fs.h>
 #include "winterfs.h"
 #include "winterfs_dir.h"
 #include "winterfs_file.h"
 #include "winterfs_ino.h"
 #include "winterfs_sb.h"
+#include "winterfs_trace.h"
 
-static struct winterfs_dir_block_info *winterfs_dir_load_block(struct super_block *sb, 
-	u32 block)
+// read file block 'block' of a directory
+static struct buffer_head *winterfs_dir_bread(struct inode *dir, u32 block)
 {
-	u8 i;
 	struct buffer_head *bh;
-	struct winterfs_dir_block *wdb;
-	struct winterfs_dir_block_info *wdbi;
+	u32 mapped_block = winterfs_get_inode_block_idx(dir, block);
 
-	wdbi = kzalloc(sizeof(struct winterfs_dir_block_info), GFP_KERNEL);
-	if (!wdbi) {
+	if (!mapped_block) {
+		printk(KERN_ERR "Directory %lu has no block %u\n", dir->i_ino, block);
+		return ERR_PTR(-EIO);
+	}
+	bh = sb_bread(dir->i_sb, mapped_block);
+	if (!bh) {
+		printk(KERN_ERR "Error reading directory block %u\n", mapped_block);
+		return ERR_PTR(-EIO);
+	}
+
+	return bh;
+}
+
+static bool winterfs_dir_dirent2(struct inode *dir)
+{
+	return winterfs_has_feature(dir->i_sb, WINTERFS_FEATURE_DIRENT2);
+}
+
+// entries live in blocks, or in the inode of an inline directory
+static void winterfs_dir_block_init(struct inode *dir, void *data, u32 size)
+{
+	struct winterfs_dirent *de = data;
+
+	memset(data, 0, size);
+	if (winterfs_dir_dirent2(dir)) {
+		de->rec_len = winterfs_rec_len_to_disk(size);
+	}
+}
+
+/*
+ * Read the entry at position 'off' of a directory block of 'size' bytes.
+ * Returns 1 with *ent filled in, 0 past the last entry, or -EIO if the
+ * block is corrupt. Free records are returned too, with an ino of 0.
+ */
+static int winterfs_dir_block_entry(struct inode *dir, void *data, u32 size, u32 off,
+	struct winterfs_dir_entry *ent)
+{
+	u32 rec_len;
+	struct winterfs_dirent *de;
+
+	if (!winterfs_dir_dirent2(dir)) {
+		struct winterfs_dir_block *db = data;
+
+		if (off >= WINTERFS_FILES_PER_DIR_BLOCK) {
+			return 0;
+		}
+		ent->ino = le32_to_cpu(db->inode_list[off]);
+		ent->name = (char*)(db->files[off].name);
+		ent->name_len = strnlen(ent->name, WINTERFS_FILENAME_MAX_LEN - 1);
+		ent->file_type = FT_UNKNOWN;
+		ent->off = off;
+		ent->next = off + 1;
+		return 1;
+	}
+
+	if (off >= size) {
+		return 0;
+	}
+	de = data + off;
+	rec_len = winterfs_rec_len_from_disk(de->rec_len);
+	// a block that was never written reads as one free record
+	if (off == 0 && rec_len == 0 && !de->inode) {
+		rec_len = size;
+	}
+	if (rec_len < sizeof(struct winterfs_dirent) || rec_len % 4
+			|| rec_len > size - off
+			|| (de->inode && WINTERFS_DIRENT_LEN(de->name_len) > rec_len)) {
+		printk(KERN_ERR "Corrupt entry at offset %u in directory %lu\n",
+			off, dir->i_ino);
+		return -EIO;
+	}
+	ent->ino = le32_to_cpu(de->inode);
+	ent->name = de->name;
+	ent->name_len = de->name_len;
+	ent->file_type = de->file_type;
+	ent->off = off;
+	ent->next = off + rec_len;
+
+	return 1;
+}
+
+static int winterfs_dir_block_find(struct inode *dir, void *data, u32 size,
+	const struct qstr *name, struct winterfs_dir_entry *ent)
+{
+	int ret;
+	u32 off;
+
+	for (off = 0; (ret = winterfs_dir_block_entry(dir, data, size, off, ent)) > 0; off = ent->next) {
+		if (ent->ino && ent->name_len == name->len
+				&& memcmp(ent->name, name->name, name->len) == 0) {
+			return 0;
+		}
+	}
+
+	return ret ? ret : -ENOENT;
+}
+
+// add an entry to a directory block, -ENOSPC if it does not fit
+static int winterfs_dir_block_add(struct inode *dir, void *data, u32 size,
+	const char *name, u8 name_len, u32 ino, u8 file_type, u32 *off_out)
+{
+	int ret;
+	u32 off;
+	u32 used;
+	u32 rec_len;
+	struct winterfs_dirent *de;
+	struct winterfs_dir_entry ent;
+	u32 need = WINTERFS_DIRENT_LEN(name_len);
+
+	if (!winterfs_dir_dirent2(dir)) {
+		struct winterfs_dir_block *db = data;
+
+		for (off = 0; off < WINTERFS_FILES_PER_DIR_BLOCK; off++) {
+			if (!db->inode_list[off]) {
+				db->inode_list[off] = cpu_to_le32(ino);
+				memset(&db->files[off], 0, sizeof(struct winterfs_filename));
+				memcpy(db->files[off].name, name, name_len);
+				*off_out = off;
+				return 0;
+			}
+		}
+		return -ENOSPC;
+	}
+
+	for (off = 0; (ret = winterfs_dir_block_entry(dir, data, size, off, &ent)) > 0; off = ent.next) {
+		used = ent.ino ? WINTERFS_DIRENT_LEN(ent.name_len) : 0;
+		rec_len = ent.next - off;
+		if (rec_len - used < need) {
+			continue;
+		}
+		// take the slack at the end of the record
+		if (used) {
+			de = data + off;
+			de->rec_len = winterfs_rec_len_to_disk(used);
+			off += used;
+			rec_len -= used;
+		}
+		de = data + off;
+		de->inode = cpu_to_le32(ino);
+		de->rec_len = winterfs_rec_len_to_disk(rec_len);
+		de->name_len = name_len;
+		de->file_type = file_type;
+		memcpy(de->name, name, name_len);
+		*off_out = off;
+		return 0;
+	}
+
+	return ret ? ret : -ENOSPC;
+}
+
+// remove the entry at 'off', merging its record into the one before it
+static int winterfs_dir_block_remove(struct inode *dir, void *data, u32 size, u32 off)
+{
+	int ret;
+	u32 pos;
+	struct winterfs_dirent *de;
+	struct winterfs_dir_entry ent;
+
+	if (!winterfs_dir_dirent2(dir)) {
+		struct winterfs_dir_block *db = data;
+
+		db->inode_list[off] = cpu_to_le32(WINTERFS_NULL_INODE);
+		return 0;
+	}
+
+	de = data + off;
+	if (off == 0) {
+		de->inode = cpu_to_le32(WINTERFS_NULL_INODE);
+		return 0;
+	}
+
+	for (pos = 0; (ret = winterfs_dir_block_entry(dir, data, size, pos, &ent)) > 0; pos = ent.next) {
+		if (ent.next == off) {
+			struct winterfs_dirent *prev = data + pos;
+
+			prev->rec_len = winterfs_rec_len_to_disk(off - pos
+				+ winterfs_rec_len_from_disk(de->rec_len));
+			return 0;
+		}
+	}
+
+	return ret ? ret : -EIO;
+}
+
+// add a name for inode to a directory block held in bh
+static int winterfs_dir_add_to_block(struct inode *dir, struct buffer_head *bh,
+	struct dentry *dent, struct inode *inode)
+{
+	int err;
+	u32 off;
+	struct winterfs_inode_info *wfs_info_dir = WINTERFS_I(dir);
+	struct winterfs_inode_info *wfs_info_file = WINTERFS_I(inode);
+
+	err = winterfs_dir_block_add(dir, bh->b_data, dir->i_sb->s_blocksize, dent->d_name.name,
+		dent->d_name.len, inode->i_ino, fs_umode_to_ftype(inode->i_mode), &off);
+	if (err) {
+		return err;
+	}
+	mark_buffer_dirty(bh);
+
+	wfs_info_dir->num_children++;
+	wfs_info_file->dir_block = bh->b_blocknr;
+	wfs_info_file->dir_block_off = off;
+	mark_inode_dirty(dir);
+
+	return 0;
+}
+
+// grow a directory by one empty block, returning its buffer and file block
+static struct buffer_head *winterfs_dir_append_block(struct inode *dir, u32 *block)
+{
+	int err;
+	u32 count = 1;
+	u32 mapped_block;
+	struct buffer_head *bh;
+	u32 num_blocks = winterfs_inode_num_blocks(dir);
+
+	err = winterfs_alloc_inode_blocks(dir, num_blocks, &count, &mapped_block,
+		false);
+	if (err) {
+		return ERR_PTR(err);
+	}
+	dir->i_size += dir->i_sb->s_blocksize;
+	mark_inode_dirty(dir);
+
+	bh = sb_getblk(dir->i_sb, mapped_block);
+	if (!bh) {
 		return ERR_PTR(-ENOMEM);
 	}
+	lock_buffer(bh);
+	winterfs_dir_block_init(dir, bh->b_data, dir->i_sb->s_blocksize);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+
+	*block = num_blocks;
+	return bh;
+}
+
+// add a name for inode to the entries held in an inline directory
+static int winterfs_dir_inline_add(struct inode *dir, struct dentry *dent,
+	struct inode *inode)
+{
+	int err;
+	u32 off;
+	struct winterfs_inode_info *wfs_info_dir = WINTERFS_I(dir);
+	struct winterfs_inode_info *wfs_info_file = WINTERFS_I(inode);
+
+	err = winterfs_dir_block_add(dir, wfs_info_dir->inline_data,
+		winterfs_inline_size(dir->i_sb), dent->d_name.name, dent->d_name.len,
+		inode->i_ino, fs_umode_to_ftype(inode->i_mode), &off);
+	if (err) {
+		return err;
+	}
+
+	wfs_info_dir->num_children++;
+	// there is no block for unlink to search first
+	wfs_info_file->dir_block = 0;
+	wfs_info_file->dir_block_off = off;
+	mark_inode_dirty(dir);
+
+	return 0;
+}
+
+/*
+ * Move the entries of an inline directory out to a block of its own, once
+ * a new name no longer fits in the inode. They keep their offsets, so a
+ * readdir part way through the directory resumes at the same entry.
+ */
+static int winterfs_dir_inline_convert(struct inode *dir)
+{
+	u32 at;
+	u32 last = 0;
+	u32 block;
+	struct winterfs_dirent *de;
+	struct buffer_head *bh;
+	struct winterfs_dir_entry ent;
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(dir);
+	u32 size = winterfs_inline_size(dir->i_sb);
+
+	// the inline entries counted as the size, the new block goes first
+	dir->i_size = 0;
+	bh = winterfs_dir_append_block(dir, &block);
+	if (IS_ERR(bh)) {
+		dir->i_size = size;
+		return PTR_ERR(bh);
+	}
+
+	// adding the name just failed after a full walk, so the entries are
+	// sound, dirent2 records as in any inline directory, and the last one
+	// takes the rest of the block as slack
+	for (at = 0; winterfs_dir_block_entry(dir, wfs_info->inline_data, size, at, &ent) > 0;
+			at = ent.next) {
+		last = at;
+	}
+	memcpy(bh->b_data, wfs_info->inline_data, size);
+	de = (struct winterfs_dirent *)(bh->b_data + last);
+	de->rec_len = winterfs_rec_len_to_disk(dir->i_sb->s_blocksize - last);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	wfs_info->flags &= ~WINTERFS_INODE_INLINE_FL;
+	mark_inode_dirty(dir);
+
+	return 0;
+}
+
+static bool winterfs_dir_indexed(struct inode *dir)
+{
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(dir);
+
+	return (wfs_info->flags & WINTERFS_INODE_INDEX_FL) != 0;
+}
+
+// the full hash of a name, the index keyed by its upper half
+static u64 winterfs_dx_name_hash(struct inode *dir, const char *name, u32 len)
+{
+	struct winterfs_sb_info *sbi = dir->i_sb->s_fs_info;
+
+	return siphash(name, len, &sbi->hash_key);
+}
+
+static u32 winterfs_dx_hash(struct inode *dir, const char *name, u32 len)
+{
+	return (u32)(winterfs_dx_name_hash(dir, name, len) >> 32) & ~WINTERFS_DX_CONT;
+}
+
+// index nodes visited on the way to an entry block
+struct winterfs_dx_frame {
+	u32 block; // file block of the index node
+	u32 at; // entry followed
+};
+
+struct winterfs_dx_path {
+	u32 levels;
+	struct winterfs_dx_frame frames[WINTERFS_DX_MAX_LEVELS + 1];
+	u32 leaf; // file block of the entry block
+};
+
+static bool winterfs_dx_node_sound(struct inode *dir, struct winterfs_dx_node *node)
+{
+	u32 count = le16_to_cpu(node->header.count);
+
+	return le16_to_cpu(node->header.magic) == WINTERFS_DX_MAGIC && count
+		&& count <= WINTERFS_DX_ENTRIES(dir->i_sb);
+}
+
+// walk the index down to the entry block that holds names with this hash
+static int winterfs_dx_probe(struct inode *dir, u32 hash, struct winterfs_dx_path *path)
+{
+	u32 lo;
+	u32 hi;
+	u32 count;
+	u32 level;
+	u32 levels = 0;
+	u32 node_block = 0;
+	struct buffer_head *bh;
+	struct winterfs_dx_node *node;
+
+	for (level = 0; level <= levels; level++) {
+		bh = winterfs_dir_bread(dir, node_block);
+		if (IS_ERR(bh)) {
+			return PTR_ERR(bh);
+		}
+		node = (struct winterfs_dx_node *)bh->b_data;
+		count = le16_to_cpu(node->header.count);
+		if (level == 0) {
+			levels = le16_to_cpu(node->header.levels);
+		}
+		if (!winterfs_dx_node_sound(dir, node) || levels > WINTERFS_DX_MAX_LEVELS) {
+			printk(KERN_ERR "Corrupt index block %u in directory %lu\n",
+				node_block, dir->i_ino);
+			brelse(bh);
+			return -EIO;
+		}
+
+		// last entry whose hash is <= hash, entry 0 covers the lowest
+		lo = 0;
+		hi = count - 1;
+		while (lo < hi) {
+			u32 mid = lo + (hi - lo + 1) / 2;
+
+			if (le32_to_cpu(node->entries[mid].hash) <= hash) {
+				lo = mid;
+			} else {
+				hi = mid - 1;
+			}
+		}
+		path->frames[level].block = node_block;
+		path->frames[level].at = lo;
+		node_block = le32_to_cpu(node->entries[lo].block);
+		brelse(bh);
+	}
+
+	path->levels = levels;
+	path->leaf = node_block;
+	return 0;
+}
+
+/*
+ * Move the path on to the entry block following its leaf in hash order,
+ * with *key set to the index key of that block. Returns 1, 0 if the leaf
+ * was the last one, or an error.
+ */
+static int winterfs_dx_next(struct inode *dir, struct winterfs_dx_path *path, u32 *key)
+{
+	int level;
+	u32 at;
+	u32 block = 0;
+	struct buffer_head *bh;
+	struct winterfs_dx_node *node;
+
+	// up to the lowest node with an entry after the one followed
+	for (level = path->levels; level >= 0; level--) {
+		bh = winterfs_dir_bread(dir, path->frames[level].block);
+		if (IS_ERR(bh)) {
+			return PTR_ERR(bh);
+		}
+		node = (struct winterfs_dx_node *)bh->b_data;
+		at = path->frames[level].at + 1;
+		if (winterfs_dx_node_sound(dir, node) && at < le16_to_cpu(node->header.count)) {
+			path->frames[level].at = at;
+			*key = le32_to_cpu(node->entries[at].hash);
+			block = le32_to_cpu(node->entries[at].block);
+			brelse(bh);
+			break;
+		}
+		brelse(bh);
+	}
+	if (level < 0) {
+		return 0;
+	}
+
+	// and back down along the first entry of each node
+	for (level++; level <= path->levels; level++) {
+		bh = winterfs_dir_bread(dir, block);
+		if (IS_ERR(bh)) {
+			return PTR_ERR(bh);
+		}
+		node = (struct winterfs_dx_node *)bh->b_data;
+		if (!winterfs_dx_node_sound(dir, node)) {
+			printk(KERN_ERR "Corrupt index block %u in directory %lu\n",
+				block, dir->i_ino);
+			brelse(bh);
+			return -EIO;
+		}
+		path->frames[level].block = block;
+		path->frames[level].at = 0;
+		*key = le32_to_cpu(node->entries[0].hash);
+		block = le32_to_cpu(node->entries[0].block);
+		brelse(bh);
+	}
+
+	path->leaf = block;
+	return 1;
+}
+
+static void winterfs_dx_init_node(struct inode *dir, struct winterfs_dx_node *node,
+	u16 levels)
+{
+	node->header.magic = cpu_to_le16(WINTERFS_DX_MAGIC);
+	node->header.levels = cpu_to_le16(levels);
+	node->header.limit = cpu_to_le16(WINTERFS_DX_ENTRIES(dir->i_sb));
+}
+
+// move the root's entries into a new node below it, adding an index level
+static int winterfs_dx_grow(struct inode *dir, struct winterfs_dx_path *path)
+{
+	u32 block;
+	struct buffer_head *root_bh;
+	struct buffer_head *bh;
+	struct winterfs_dx_node *root;
+	struct winterfs_dx_node *node;
+
+	root_bh = winterfs_dir_bread(dir, 0);
+	if (IS_ERR(root_bh)) {
+		return PTR_ERR(root_bh);
+	}
+	bh = winterfs_dir_append_block(dir, &block);
+	if (IS_ERR(bh)) {
+		brelse(root_bh);
+		return PTR_ERR(bh);
+	}
+
+	root = (struct winterfs_dx_node *)root_bh->b_data;
+	node = (struct winterfs_dx_node *)bh->b_data;
+	memcpy(node, root, dir->i_sb->s_blocksize);
+	node->header.levels = 0;
+	root->header.levels = cpu_to_le16(path->levels + 1);
+	root->header.count = cpu_to_le16(1);
+	root->entries[0].hash = 0;
+	root->entries[0].block = cpu_to_le32(block);
+	mark_buffer_dirty(bh);
+	mark_buffer_dirty(root_bh);
+	brelse(bh);
+	brelse(root_bh);
+
+	memmove(&path->frames[1], &path->frames[0],
+		(path->levels + 1) * sizeof(struct winterfs_dx_frame));
+	path->frames[0].block = 0;
+	path->frames[0].at = 0;
+	path->frames[1].block = block;
+	path->levels++;
+
+	return 0;
+}
+
+/*
+ * Add (hash, block) to the index node at 'level' of the path, just after
+ * the entry the path followed. A full node is split in two, and a full
+ * root pushes its entries down a level while the tree may still grow.
+ */
+static int winterfs_dx_insert(struct inode *dir, struct winterfs_dx_path *path,
+	u32 level, u32 hash, u32 block)
+{
+	int err;
+	u32 at;
+	u32 half;
+	u32 count;
+	u32 levels;
+	u32 new_block;
+	u32 split_hash;
+	struct buffer_head *bh;
+	struct buffer_head *new_bh;
+	struct winterfs_dx_node *node;
+	struct winterfs_dx_node *new_node;
+
+	bh = winterfs_dir_bread(dir, path->frames[level].block);
+	if (IS_ERR(bh)) {
+		return PTR_ERR(bh);
+	}
+	node = (struct winterfs_dx_node *)bh->b_data;
+	count = le16_to_cpu(node->header.count);
+
+	if (count < WINTERFS_DX_ENTRIES(dir->i_sb)) {
+		at = path->frames[level].at + 1;
+		memmove(&node->entries[at + 1], &node->entries[at],
+			(count - at) * sizeof(struct winterfs_dx_entry));
+		node->entries[at].hash = cpu_to_le32(hash);
+		node->entries[at].block = cpu_to_le32(block);
+		node->header.count = cpu_to_le16(count + 1);
+		mark_buffer_dirty(bh);
+		brelse(bh);
+		return 0;
+	}
+
+	if (level == 0) {
+		brelse(bh);
+		if (path->levels >= WINTERFS_DX_MAX_LEVELS) {
+			printk(KERN_WARNING "Directory %lu index is full\n", dir->i_ino);
+			return -ENOSPC;
+		}
+		err = winterfs_dx_grow(dir, path);
+		if (err) {
+			return err;
+		}
+		return winterfs_dx_insert(dir, path, 1, hash, block);
+	}
+
+	// keys only repeat along a run of continued blocks, which stays in
+	// one node so the parent's keys keep rising
+	for (half = count / 2; half < count; half++) {
+		if (node->entries[half].hash != node->entries[half - 1].hash) {
+			break;
+		}
+	}
+	if (half == count) {
+		printk(KERN_WARNING "Directory %lu index is full\n", dir->i_ino);
+		brelse(bh);
+		return -ENOSPC;
+	}
+
+	// link a new node into the parent first, then move the upper half to it
+	new_bh = winterfs_dir_append_block(dir, &new_block);
+	if (IS_ERR(new_bh)) {
+		brelse(bh);
+		return PTR_ERR(new_bh);
+	}
+	split_hash = le32_to_cpu(node->entries[half].hash);
+	levels = path->levels;
+	err = winterfs_dx_insert(dir, path, level - 1, split_hash, new_block);
+	if (err) {
+		brelse(new_bh);
+		brelse(bh);
+		return err;
+	}
+	level += path->levels - levels;
+
+	new_node = (struct winterfs_dx_node *)new_bh->b_data;
+	winterfs_dx_init_node(dir, new_node, 0);
+	memcpy(new_node->entries, &node->entries[half],
+		(count - half) * sizeof(struct winterfs_dx_entry));
+	new_node->header.count = cpu_to_le16(count - half);
+	node->header.count = cpu_to_le16(half);
+	mark_buffer_dirty(new_bh);
+	mark_buffer_dirty(bh);
+	brelse(new_bh);
+	brelse(bh);
+
+	if (path->frames[level].at >= half) {
+		path->frames[level].block = new_block;
+		path->frames[level].at -= half;
+	}
+
+	return winterfs_dx_insert(dir, path, level, hash, block);
+}
+
+struct winterfs_dx_slot {
+	u32 hash;
+	u32 off; // entry position in the block
+};
+
+static int winterfs_dx_slot_cmp(const void *a, const void *b)
+{
+	const struct winterfs_dx_slot *sa = a;
+	const struct winterfs_dx_slot *sb = b;
+
+	if (sa->hash != sb->hash) {
+		return sa->hash < sb->hash ? -1 : 1;
+	}
+	return 0;
+}
+
+/*
+ * Split the full entry block the path leads to. Names in the upper hash
+ * range move to a new block, linked into the index right after it.
+ */
+static int winterfs_dx_split_leaf(struct inode *dir, struct winterfs_dx_path *path)
+{
+	int err;
+	int ret;
+	u32 i;
+	u32 n = 0;
+	u32 off;
+	u32 mid;
+	u32 split = 0;
+	u32 new_block;
+	u32 split_hash;
+	void *copy;
+	struct buffer_head *bh;
+	struct buffer_head *new_bh;
+	struct winterfs_dir_entry ent;
+	struct winterfs_dx_slot *map;
+	u32 size = dir->i_sb->s_blocksize;
+	u32 max = WINTERFS_DIRENTS_PER_BLOCK(dir->i_sb);
+
+	bh = winterfs_dir_bread(dir, path->leaf);
+	if (IS_ERR(bh)) {
+		return PTR_ERR(bh);
+	}
+	copy = kmemdup(bh->b_data, size, GFP_NOFS);
+	map = kmalloc_array(max, sizeof(struct winterfs_dx_slot), GFP_NOFS);
+	if (!copy || !map) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (off = 0; (ret = winterfs_dir_block_entry(dir, copy, size, off, &ent)) > 0;
+			off = ent.next) {
+		if (ent.ino && n < max) {
+			map[n].hash = winterfs_dx_hash(dir, ent.name, ent.name_len);
+			map[n].off = ent.off;
+			n++;
+		}
+	}
+	if (ret < 0) {
+		err = ret;
+		goto out;
+	}
+	if (n < 2) {
+		printk(KERN_ERR "Corrupt entry block %u in directory %lu\n", path->leaf,
+			dir->i_ino);
+		err = -EIO;
+		goto out;
+	}
+	sort(map, n, sizeof(struct winterfs_dx_slot), winterfs_dx_slot_cmp, NULL);
+
+	// split near the middle, but never between two equal hashes
+	mid = n / 2;
+	for (i = 0; i < n && !split; i++) {
+		if (mid + i < n && mid + i > 0 && map[mid + i - 1].hash != map[mid + i].hash) {
+			split = mid + i;
+		} else if (mid > i && map[mid - i - 1].hash != map[mid - i].hash) {
+			split = mid - i;
+		}
+	}
+	if (split) {
+		split_hash = map[split].hash;
+	} else {
+		// the whole block is one hash, the upper half continues it
+		split = n / 2;
+		split_hash = map[split].hash | WINTERFS_DX_CONT;
+	}
+
+	// link the new block into the index first, then move the upper half
+	new_bh = winterfs_dir_append_block(dir, &new_block);
+	if (IS_ERR(new_bh)) {
+		err = PTR_ERR(new_bh);
+		goto out;
+	}
+	err = winterfs_dx_insert(dir, path, path->levels, split_hash, new_block);
+	if (err) {
+		brelse(new_bh);
+		goto out;
+	}
+
+	winterfs_dir_block_init(dir, bh->b_data, size);
+	for (i = 0; i < n; i++) {
+		void *dest = i >= split ? new_bh->b_data : bh->b_data;
+
+		winterfs_dir_block_entry(dir, copy, size, map[i].off, &ent);
+		winterfs_dir_block_add(dir, dest, size, ent.name, ent.name_len,
+			ent.ino, ent.file_type, &off);
+	}
+	mark_buffer_dirty(new_bh);
+	mark_buffer_dirty(bh);
+	brelse(new_bh);
+
+out:
+	kfree(map);
+	kfree(copy);
+	brelse(bh);
+	return err;
+}
+
+// turn a full single block directory into an indexed one
+static int winterfs_dx_create(struct inode *dir)
+{
+	u32 block;
+	struct buffer_head *root_bh;
+	struct buffer_head *bh;
+	struct winterfs_dx_node *root;
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(dir);
+
+	root_bh = winterfs_dir_bread(dir, 0);
+	if (IS_ERR(root_bh)) {
+		return PTR_ERR(root_bh);
+	}
+	bh = winterfs_dir_append_block(dir, &block);
+	if (IS_ERR(bh)) {
+		brelse(root_bh);
+		return PTR_ERR(bh);
+	}
+
+	memcpy(bh->b_data, root_bh->b_data, dir->i_sb->s_blocksize);
+	memset(root_bh->b_data, 0, dir->i_sb->s_blocksize);
+	root = (struct winterfs_dx_node *)root_bh->b_data;
+	winterfs_dx_init_node(dir, root, 0);
+	root->header.count = cpu_to_le16(1);
+	root->entries[0].hash = 0;
+	root->entries[0].block = cpu_to_le32(block);
+	mark_buffer_dirty(bh);
+	mark_buffer_dirty(root_bh);
+	brelse(bh);
+	brelse(root_bh);
+
+	wfs_info->flags |= WINTERFS_INODE_INDEX_FL;
+	mark_inode_dirty(dir);
+
+	return 0;
+}
+
+/*
+ * Add the entry to the entry block its hash leads to, adding to *scanned
+ * the directory blocks read. The half of a split block the name belongs
+ * in can still be too full for it when names differ in length, so the
+ * block it leads to is split until the name fits.
+ */
+static int winterfs_dx_add_entry(struct inode *dir, struct dentry *dent,
+	struct inode *inode, u32 *scanned)
+{
+	int err;
+	struct buffer_head *bh;
+	struct winterfs_dx_path path;
+	u32 hash = winterfs_dx_hash(dir, dent->d_name.name, dent->d_name.len);
+
+	for (;;) {
+		err = winterfs_dx_probe(dir, hash, &path);
+		if (err) {
+			return err;
+		}
+
+		*scanned += path.levels + 2;
+		bh = winterfs_dir_bread(dir, path.leaf);
+		if (IS_ERR(bh)) {
+			return PTR_ERR(bh);
+		}
+		err = winterfs_dir_add_to_block(dir, bh, dent, inode);
+		brelse(bh);
+		if (err != -ENOSPC) {
+			return err;
+		}
+
+		err = winterfs_dx_split_leaf(dir, &path);
+		if (err) {
+			return err;
+		}
+	}
+}
+
+/*
+ * Find the entry for 'name' in an indexed directory, in the entry block
+ * its hash leads to or the blocks continuing that hash after it.
+ */
+static struct buffer_head *winterfs_dx_find_entry(struct inode *dir,
+	const struct qstr *name, struct winterfs_dir_entry *ent, u32 *scanned)
+{
+	int err;
+	int ret;
+	u32 key;
+	struct buffer_head *bh;
+	struct winterfs_dx_path path;
+	u32 hash = winterfs_dx_hash(dir, name->name, name->len);
 
-	bh = sb_bread(sb, block);
-	if (!bh) {
-		printk(KERN_ERR "Error reading directory block %u\n", block);
-		kfree(wdbi);
-		return ERR_PTR(-EIO);
-	}
-	
-	wdb = (struct winterfs_dir_block *)bh->b_data;
-	wdbi->bh = bh;
-	wdbi->db = wdb;
-	for (i = 0; i < WINTERFS_FILES_PER_DIR_BLOCK; i++) {
-		wdbi->inode_list[i] = le32_to_cpu(wdb->inode_list[i]);
+	err = winterfs_dx_probe(dir, hash, &path);
+	if (err) {
+		return ERR_PTR(err);
 	}
+	*scanned = path.levels + 1;
+
+	do {
+		bh = winterfs_dir_bread(dir, path.leaf);
+		if (IS_ERR(bh)) {
+			return bh;
+		}
+		(*scanned)++;
+		err = winterfs_dir_block_find(dir, bh->b_data, dir->i_sb->s_blocksize, name, ent);
+		if (!err) {
+			return bh;
+		}
+		brelse(bh);
+		if (err != -ENOENT) {
+			return ERR_PTR(err);
+		}
+		ret = winterfs_dx_next(dir, &path, &key);
+		if (ret < 0) {
+			return ERR_PTR(ret);
+		}
+	} while (ret && key == (hash | WINTERFS_DX_CONT));
 
-	return wdbi;
+	return ERR_PTR(-ENOENT);
 }
 
-static struct dentry *winterfs_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags)
+/*
+ * Find the entry for 'name', through the hash index when the directory
+ * has one. Returns the buffer of the entry's block, with the entry in
+ * *ent. *scanned counts the directory blocks read on the way.
+ */
+static struct buffer_head *winterfs_dir_find_entry(struct inode *dir,
+	const struct qstr *name, struct winterfs_dir_entry *ent, u32 *scanned)
 {
-	u32 dir_num_blocks;
+	int err;
 	u32 block;
-	struct winterfs_inode_info *wfs_info;
-	struct super_block *sb;
-	struct winterfs_sb_info *sbi;
-
-	if (dentry->d_name.len >= WINTERFS_FILENAME_MAX_LEN) {
-		return ERR_PTR(-ENAMETOOLONG);
-	}
+	u32 dir_num_blocks;
+	struct buffer_head *bh;
 
-	sb = dir->i_sb;
-	sbi = sb->s_fs_info;
-	wfs_info = dir->i_private;
-	if (!wfs_info) {
-		printk(KERN_ERR "Attempt to read data from improperly loaded inode\n");
-		return ERR_PTR(-EINVAL);
+	*scanned = 0;
+	if (winterfs_dir_indexed(dir)) {
+		return winterfs_dx_find_entry(dir, name, ent, scanned);
 	}
 
 	dir_num_blocks = winterfs_inode_num_blocks(dir);
 	for (block = 0; block < dir_num_blocks; block++) {
-		struct winterfs_dir_block_info *wdbi;
-		u8 file_idx;
 		u32 mapped_block = winterfs_get_inode_block_idx(dir, block);
 		if (!mapped_block) {
 			printk(KERN_WARNING "Attempt to access invalid inode block\n");
 			continue;
 		}
-		wdbi = winterfs_dir_load_block(sb, mapped_block);
-		if (IS_ERR(wdbi)) {
+		bh = sb_bread(dir->i_sb, mapped_block);
+		if (!bh) {
+			printk(KERN_ERR "Error reading directory block %u\n", mapped_block);
+			return ERR_PTR(-EIO);
+		}
+		(*scanned)++;
+		err = winterfs_dir_block_find(dir, bh->b_data, dir->i_sb->s_blocksize, name, ent);
+		if (!err) {
+			return bh;
+		}
+		brelse(bh);
+		if (err != -ENOENT) {
+			return ERR_PTR(err);
+		}
+	}
+
+	return ERR_PTR(-ENOENT);
+}
+
+/*
+ * Read ahead the inode table blocks of the entries of a directory block,
+ * from byte offset off on. Whoever lists a directory or looks up one of
+ * its names usually goes on to stat the neighbouring entries too.
+ */
+static void winterfs_dir_block_readahead(struct inode *dir, char *data, u32 size,
+	u32 off)
+{
+	u32 at;
+	u32 n = 0;
+	u32 inos[WINTERFS_INODE_READAHEAD];
+	struct winterfs_dir_entry ent;
+
+	for (at = 0; winterfs_dir_block_entry(dir, data, size, at, &ent) > 0; at = ent.next) {
+		if (!ent.ino || ent.off < off) {
+			continue;
+		}
+		inos[n++] = ent.ino;
+		if (n == WINTERFS_INODE_READAHEAD) {
+			winterfs_inode_readahead(dir->i_sb, inos, n);
+			n = 0;
+		}
+	}
+	if (n) {
+		winterfs_inode_readahead(dir->i_sb, inos, n);
+	}
+}
+
+static struct dentry *__winterfs_lookup(struct inode *dir, struct dentry *dentry,
+	u32 *ino, u32 *scanned)
+{
+	int err;
+	u32 size;
+	void *data;
+	struct inode *inode;
+	struct buffer_head *bh = NULL;
+	struct winterfs_dir_entry ent;
+
+	*ino = 0;
+	*scanned = 0;
+	if (dentry->d_name.len >= WINTERFS_FILENAME_MAX_LEN) {
+		return ERR_PTR(-ENAMETOOLONG);
+	}
+
+	// the entries of an inline directory came in with its inode
+	if (winterfs_inode_inline(dir)) {
+		data = WINTERFS_I(dir)->inline_data;
+		size = winterfs_inline_size(dir->i_sb);
+		err = winterfs_dir_block_find(dir, data, size, &dentry->d_name, &ent);
+		if (err == -ENOENT) {
 			return NULL;
 		}
-		for (file_idx = 0; file_idx < WINTERFS_FILES_PER_DIR_BLOCK; file_idx++) {
-			u32 ino = wdbi->inode_list[file_idx];
-			struct winterfs_filename *filename = winterfs_dir_block_filename(wdbi, file_idx);
-			if (strncmp(filename->name, dentry->d_name.name, WINTERFS_FILENAME_MAX_LEN) == 0) {
-				struct inode *inode = winterfs_iget(sb, ino);
-				winterfs_free_dir_block_info(wdbi, false);
-				return d_splice_alias(inode, dentry);
-			}
+		if (err) {
+			return ERR_PTR(err);
+		}
+	} else {
+		bh = winterfs_dir_find_entry(dir, &dentry->d_name, &ent, scanned);
+		if (bh == ERR_PTR(-ENOENT)) {
+			// File not found
+			return NULL;
+		}
+		if (IS_ERR(bh)) {
+			return ERR_CAST(bh);
+		}
+		data = bh->b_data;
+		size = dir->i_sb->s_blocksize;
+	}
+	*ino = ent.ino;
+	// a cold inode table block suggests a cold directory
+	if (!winterfs_inode_cached(dir->i_sb, *ino)) {
+		winterfs_dir_block_readahead(dir, data, size, 0);
+	}
+	brelse(bh);
+
+	inode = winterfs_iget(dir->i_sb, *ino);
+	return d_splice_alias(inode, dentry);
+}
+
+static struct dentry *winterfs_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags)
+{
+	u32 ino;
+	u32 scanned;
+	struct dentry *ret;
+	u64 start = trace_winterfs_lookup_enabled() ? ktime_get_ns() : 0;
+
+	ret = __winterfs_lookup(dir, dentry, &ino, &scanned);
+	trace_winterfs_lookup(dir, &dentry->d_name, ino, scanned, PTR_ERR_OR_ZERO(ret), start);
+
+	return ret;
+}
+
+// list an inline directory, its entries addressed as if in file block 0
+static int winterfs_readdir_inline(struct inode *dir, struct dir_context *ctx)
+{
+	int ret;
+	u32 at;
+	u32 off;
+	struct winterfs_dir_entry ent;
+	void *data = WINTERFS_I(dir)->inline_data;
+	u32 size = winterfs_inline_size(dir->i_sb);
+
+	if (ctx->pos - 2 >= size) {
+		return 0;
+	}
+	off = ctx->pos - 2;
+	winterfs_dir_block_readahead(dir, data, size, off);
+
+	for (at = 0; (ret = winterfs_dir_block_entry(dir, data, size, at, &ent)) > 0; at = ent.next) {
+		if (!ent.ino || ent.off < off) {
+			continue;
+		}
+		ctx->pos = WINTERFS_DIR_POS(dir->i_sb, 0, ent.off);
+		if (!dir_emit(ctx, ent.name, ent.name_len, ent.ino,
+				fs_ftype_to_dtype(ent.file_type))) {
+			return 0;
+		}
+	}
+	if (ret < 0) {
+		return ret;
+	}
+	ctx->pos = WINTERFS_DIR_POS(dir->i_sb, 0, size);
+
+	return 0;
+}
+
+/*
+ * Indexed directories move entries between blocks as they split, and so
+ * does indexing a full single block directory. Those directories, and any
+ * that may yet be indexed, are listed in hash order instead, positioned
+ * by name hashes that stay with an entry wherever it moves.
+ */
+static bool winterfs_dir_hash_order(struct inode *dir)
+{
+	return winterfs_dir_indexed(dir)
+		|| (winterfs_has_feature(dir->i_sb, WINTERFS_FEATURE_DIR_INDEX)
+			&& (winterfs_inode_inline(dir) || winterfs_inode_num_blocks(dir) <= 1));
+}
+
+// nfsd may ask for 32-bit positions, and compat tasks can only keep those,
+// taken from the upper half of the hash alone
+static bool winterfs_dir_hash_32bit(struct file *file)
+{
+	if (file->f_mode & FMODE_32BITHASH) {
+		return true;
+	}
+	if (file->f_mode & FMODE_64BITHASH) {
+		return false;
+	}
+#ifdef CONFIG_COMPAT
+	return in_compat_syscall();
+#else
+	return BITS_PER_LONG == 32;
+#endif
+}
+
+// position past the last entry of a directory listed in hash order
+static loff_t winterfs_dir_hash_eof(struct file *file)
+{
+	return winterfs_dir_hash_32bit(file) ? 0x7fffffff : LLONG_MAX;
+}
+
+/*
+ * Position of a name whose hash has index hash 'major' and lower half
+ * 'minor'. Index hashes are even, so dropping their low bit keeps the
+ * positions below the end of directory.
+ */
+static loff_t winterfs_dir_hash_pos(struct file *file, u32 major, u32 minor)
+{
+	loff_t pos;
+
+	if (winterfs_dir_hash_32bit(file)) {
+		pos = major >> 1;
+	} else {
+		pos = (loff_t)(major >> 1) << 32 | minor;
+	}
+	// 0 and 1 are "." and ".."
+	return clamp_t(loff_t, pos, 2, winterfs_dir_hash_eof(file) - 1);
+}
+
+// the lowest index hash of names at position 'pos' or after it
+static u32 winterfs_dir_pos_hash(struct file *file, loff_t pos)
+{
+	if (pos <= 2) {
+		return 0;
+	}
+	if (winterfs_dir_hash_32bit(file)) {
+		return (u32)pos << 1;
+	}
+	return (u32)(pos >> 32) << 1;
+}
+
+struct winterfs_readdir_slot {
+	loff_t pos;
+	struct winterfs_dir_entry ent;
+};
+
+// the blocks of one hash range, held while their entries are listed
+struct winterfs_readdir_batch {
+	struct buffer_head **bhs;
+	u32 nr_bhs;
+	struct winterfs_readdir_slot *slots;
+	u32 nr_slots;
+};
+
+static int winterfs_readdir_slot_cmp(const void *a, const void *b)
+{
+	const struct winterfs_readdir_slot *sa = a;
+	const struct winterfs_readdir_slot *sb = b;
+
+	if (sa->pos != sb->pos) {
+		return sa->pos < sb->pos ? -1 : 1;
+	}
+	return 0;
+}
+
+/*
+ * Add the entries of a directory block, or of an inline directory, at
+ * 'from' or after it to the batch. Its buffer, if any, is held by the
+ * batch from then on.
+ */
+static int winterfs_readdir_batch_add(struct file *file, struct winterfs_readdir_batch *batch,
+	struct buffer_head *bh, void *data, u32 size, loff_t from)
+{
+	int ret;
+	u32 at;
+	u64 hash;
+	void *grown;
+	struct winterfs_dir_entry ent;
+	struct inode *dir = file_inode(file);
+
+	if (bh) {
+		grown = krealloc(batch->bhs, (batch->nr_bhs + 1) * sizeof(*batch->bhs), GFP_KERNEL);
+		if (!grown) {
+			brelse(bh);
+			return -ENOMEM;
+		}
+		batch->bhs = grown;
+		batch->bhs[batch->nr_bhs++] = bh;
+	}
+	grown = krealloc(batch->slots, (batch->nr_slots + WINTERFS_DIRENTS_PER_BLOCK(dir->i_sb))
+		* sizeof(*batch->slots), GFP_KERNEL);
+	if (!grown) {
+		return -ENOMEM;
+	}
+	batch->slots = grown;
+
+	winterfs_dir_block_readahead(dir, data, size, 0);
+	for (at = 0; (ret = winterfs_dir_block_entry(dir, data, size, at, &ent)) > 0; at = ent.next) {
+		if (!ent.ino) {
+			continue;
+		}
+		hash = winterfs_dx_name_hash(dir, ent.name, ent.name_len);
+		batch->slots[batch->nr_slots].pos = winterfs_dir_hash_pos(file,
+			(u32)(hash >> 32) & ~WINTERFS_DX_CONT, (u32)hash);
+		if (batch->slots[batch->nr_slots].pos < from) {
+			continue;
 		}
-		winterfs_free_dir_block_info(wdbi, false);
+		batch->slots[batch->nr_slots].ent = ent;
+		batch->nr_slots++;
 	}
 
-	// File not found
-	return NULL;
+	return ret;
 }
 
-static int winterfs_readdir(struct file *dir, struct dir_context *ctx)
+// emit the batch in hash order, false once the caller's buffer is full
+static bool winterfs_readdir_batch_emit(struct winterfs_readdir_batch *batch,
+	struct dir_context *ctx)
 {
-	u8 i;
-	u32 block_idx;
-	u32 mapped_idx;
-	struct inode *inode = dir->f_inode;
-	struct winterfs_dir_block_info *wdbi;
-	struct super_block *sb = inode->i_sb;
-	struct winterfs_inode_info *wfs_info = inode->i_private;
-	loff_t pos = ctx->pos;
-	int count = 0;
+	u32 i;
+	struct winterfs_readdir_slot *slot;
 
-	if (pos == 0) {
-		dir_emit_dot(dir, ctx);
-		dir_emit_dotdot(dir, ctx);
+	sort(batch->slots, batch->nr_slots, sizeof(*batch->slots), winterfs_readdir_slot_cmp,
+		NULL);
+	for (i = 0; i < batch->nr_slots; i++) {
+		slot = &batch->slots[i];
+		// entries sharing a position are listed again when the buffer
+		// fills among them, as there is no finer place to resume
+		ctx->pos = slot->pos;
+		if (!dir_emit(ctx, slot->ent.name, slot->ent.name_len, slot->ent.ino,
+				fs_ftype_to_dtype(slot->ent.file_type))) {
+			return false;
+		}
 	}
 
-	ctx->pos += WINTERFS_BLOCK_SIZE;
+	return true;
+}
 
-	if (pos >= inode->i_size) {
-		return count;	
+static void winterfs_readdir_batch_release(struct winterfs_readdir_batch *batch)
+{
+	while (batch->nr_bhs) {
+		brelse(batch->bhs[--batch->nr_bhs]);
 	}
+	batch->nr_slots = 0;
+}
+
+/*
+ * List a directory in hash order, an entry block of an indexed directory
+ * at a time together with the blocks continuing its last hash. A single
+ * block or inline directory is one batch.
+ */
+static int winterfs_readdir_hash(struct file *file, struct dir_context *ctx)
+{
+	int ret;
+	int more = 0;
+	u32 key = 0;
+	struct inode *dir = file_inode(file);
+	struct buffer_head *bh;
+	struct winterfs_dx_path path;
+	struct winterfs_readdir_batch batch = {};
+	loff_t eof = winterfs_dir_hash_eof(file);
 
-        if (!wfs_info) {
-                printk(KERN_ERR "Attempt to read data from improperly loaded inode: %lu\n", inode->i_ino);
-                return 0;
-        }
+	if (ctx->pos >= eof) {
+		return 0;
+	}
 
-	block_idx = pos / WINTERFS_BLOCK_SIZE;
-	mapped_idx = winterfs_get_inode_block_idx(inode, block_idx);
-	if (!mapped_idx) {
-		printk(KERN_ERR "Attempt to access invalid inode block: %d\n", mapped_idx);
-		return count;
+	if (winterfs_inode_inline(dir)) {
+		ret = winterfs_readdir_batch_add(file, &batch, NULL, WINTERFS_I(dir)->inline_data,
+			winterfs_inline_size(dir->i_sb), ctx->pos);
+		if (!ret && winterfs_readdir_batch_emit(&batch, ctx)) {
+			ctx->pos = eof;
+		}
+		goto out;
+	}
+	if (!winterfs_dir_indexed(dir)) {
+		bh = winterfs_dir_bread(dir, 0);
+		if (IS_ERR(bh)) {
+			return PTR_ERR(bh);
+		}
+		ret = winterfs_readdir_batch_add(file, &batch, bh, bh->b_data,
+			dir->i_sb->s_blocksize, ctx->pos);
+		if (!ret && winterfs_readdir_batch_emit(&batch, ctx)) {
+			ctx->pos = eof;
+		}
+		goto out;
 	}
-	wdbi = winterfs_dir_load_block(sb, mapped_idx);
-	if (IS_ERR(wdbi)) {
-                return count;
-        }
-	for (i = 0; i < WINTERFS_FILES_PER_DIR_BLOCK; i++) {
-		if (wdbi->inode_list[i] != 0) {
-			u32 ino = wdbi->inode_list[i];
-			const char *name = (char*)(wdbi->db->files[i].name);
-			u32 len = strnlen(name, WINTERFS_FILENAME_MAX_LEN);
-			count++;
-			dir_emit(ctx, name, len, ino, DT_UNKNOWN);
+
+	ret = winterfs_dx_probe(dir, winterfs_dir_pos_hash(file, ctx->pos), &path);
+	while (!ret) {
+		do {
+			bh = winterfs_dir_bread(dir, path.leaf);
+			if (IS_ERR(bh)) {
+				ret = PTR_ERR(bh);
+				goto out;
+			}
+			ret = winterfs_readdir_batch_add(file, &batch, bh, bh->b_data,
+				dir->i_sb->s_blocksize, ctx->pos);
+			if (ret) {
+				goto out;
+			}
+			more = winterfs_dx_next(dir, &path, &key);
+		} while (more > 0 && (key & WINTERFS_DX_CONT));
+		if (more < 0) {
+			ret = more;
+			break;
+		}
+
+		if (!winterfs_readdir_batch_emit(&batch, ctx)) {
+			break;
+		}
+		winterfs_readdir_batch_release(&batch);
+		if (!more) {
+			ctx->pos = eof;
+			break;
 		}
+		ctx->pos = winterfs_dir_hash_pos(file, key, 0);
+	}
+
+out:
+	winterfs_readdir_batch_release(&batch);
+	kfree(batch.bhs);
+	kfree(batch.slots);
+	return ret;
+}
+
+/*
+ * Fill as much of the caller's buffer as fits. Positions 0 and 1 are "."
+ * and "..". Every entry after them is addressed by its name hash, see
+ * winterfs_dir_hash_order, or else by its block and position within the
+ * block, so a later call resumes at the exact entry.
+ */
+static int winterfs_readdir(struct file *file, struct dir_context *ctx)
+{
+	int ret;
+	u32 at;
+	u32 off;
+	u32 block;
+	u32 count;
+	u32 num_blocks;
+	u32 run_start = 0;
+	u32 run_end = 0;
+	u32 mapped_block = 0;
+	struct inode *dir = file_inode(file);
+	struct super_block *sb = dir->i_sb;
+	struct buffer_head *bh;
+	struct winterfs_dir_entry ent;
+
+	if (!dir_emit_dots(file, ctx)) {
+		return 0;
+	}
+	if (winterfs_dir_hash_order(dir)) {
+		return winterfs_readdir_hash(file, ctx);
 	}
+	if (winterfs_inode_inline(dir)) {
+		return winterfs_readdir_inline(dir, ctx);
+	}
+
+	num_blocks = winterfs_inode_num_blocks(dir);
+	block = (ctx->pos - 2) >> sb->s_blocksize_bits;
+	off = (ctx->pos - 2) & (sb->s_blocksize - 1);
+	for (; block < num_blocks; block++, off = 0) {
+		// map the run of blocks ahead and start reading it in
+		if (block >= run_end) {
+			count = min_t(u32, num_blocks - block, WINTERFS_DIR_READAHEAD);
+			mapped_block = winterfs_get_inode_blocks(dir, block, &count, NULL);
+			if (!mapped_block) {
+				printk(KERN_ERR "Directory %lu has no block %u\n", dir->i_ino, block);
+				return -EIO;
+			}
+			for (at = 1; at < count; at++) {
+				sb_breadahead(sb, mapped_block + at);
+			}
+			run_start = block;
+			run_end = block + count;
+		}
+
+		bh = sb_bread(sb, mapped_block + (block - run_start));
+		if (!bh) {
+			printk(KERN_ERR "Error reading directory block %u\n",
+				mapped_block + (block - run_start));
+			return -EIO;
+		}
+		winterfs_dir_block_readahead(dir, bh->b_data, sb->s_blocksize, off);
 
-	winterfs_free_dir_block_info(wdbi, false);
+		// entries are always walked from the start of the block, in case
+		// the one at the resume position has since been merged away
+		for (at = 0; (ret = winterfs_dir_block_entry(dir, bh->b_data, sb->s_blocksize, at,
+				&ent)) > 0; at = ent.next) {
+			if (!ent.ino || ent.off < off) {
+				continue;
+			}
+			ctx->pos = WINTERFS_DIR_POS(sb, block, ent.off);
+			if (!dir_emit(ctx, ent.name, ent.name_len, ent.ino,
+					fs_ftype_to_dtype(ent.file_type))) {
+				brelse(bh);
+				return 0;
+			}
+		}
+		brelse(bh);
+		if (ret < 0) {
+			return ret;
+		}
+		ctx->pos = WINTERFS_DIR_POS(sb, block + 1, 0);
+	}
 
-	return count;
+	return 0;
 }
 
 static int winterfs_create(struct user_namespace *mnt_userns, struct inode *dir,
@@ -144,9 +1366,8 @@ static int winterfs_create(struct user_namespace *mnt_userns, struct inode *dir,
 {
 	int err;
         struct inode *inode;
-	struct super_block *sb = dir->i_sb;
 
-        inode = winterfs_new_inode(sb);
+        inode = winterfs_new_inode(dir, mode);
         if (IS_ERR(inode)) {
                 return PTR_ERR(inode);
 	}
@@ -154,134 +1375,156 @@ static int winterfs_create(struct user_namespace *mnt_userns, struct inode *dir,
 	inode->i_op = &winterfs_file_inode_operations;
 	inode->i_fop = &winterfs_file_operations;
 	inode->i_mapping->a_ops = &winterfs_address_operations;
+	mapping_set_large_folios(inode->i_mapping);
 	inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
 	inode_init_owner(&init_user_ns, inode, dir, mode);
 
-	d_instantiate_new(dentry, inode);
+	// the dentry only turns positive once the name is in the directory
 	err = winterfs_dir_link_inode(dentry, inode);
 	if (err) {
+		clear_nlink(inode);
+		discard_new_inode(inode);
 		return err;
 	}
-	__winterfs_write_inode(inode);
+	__winterfs_write_inode(inode, false);
         mark_inode_dirty(inode);
+	d_instantiate_new(dentry, inode);
 
 	return 0;
 }
 
-static int winterfs_unlink(struct inode *dir, struct dentry *dentry)
+// remove the entry of dentry's inode from dir
+static int winterfs_dir_remove_entry(struct inode *dir, struct dentry *dentry)
 {
-	u32 i;
-	u32 num_blocks;
-	u32 bitset_block;
+	int err;
+	u32 scanned;
 	struct buffer_head *bh;
-	struct winterfs_dir_block_info *wdbi;
-	struct winterfs_inode *wfs_inode;
-	struct winterfs_inode_info *wfs_dir_info;
-	struct winterfs_inode_info *wfs_file_info;
+	struct winterfs_dir_entry ent;
 	struct inode *inode = d_inode(dentry);
+	struct winterfs_inode_info *wfs_dir_info = WINTERFS_I(dir);
+	struct winterfs_inode_info *wfs_file_info = WINTERFS_I(inode);
 	struct super_block *sb = dir->i_sb;
-	struct winterfs_sb_info *sbi = sb->s_fs_info;
-	int err = 0;
+	u32 size = winterfs_inline_size(sb);
 
-	wfs_dir_info = dir->i_private;
-	wfs_file_info = inode->i_private;
-	if (!wfs_dir_info || !wfs_file_info) {
-                printk(KERN_ERR "Attempt to read data from improperly loaded inode\n");
-                return -EINVAL;
+	if (winterfs_inode_inline(dir)) {
+		err = winterfs_dir_block_find(dir, wfs_dir_info->inline_data, size,
+			&dentry->d_name, &ent);
+		if (err) {
+			return err;
+		}
+		err = winterfs_dir_block_remove(dir, wfs_dir_info->inline_data, size, ent.off);
+		if (err) {
+			return err;
+		}
+		mark_inode_dirty(dir);
+		return 0;
+	}
+
+	// entries of an unindexed directory never move, so the block
+	// recorded in the inode can be searched directly
+	bh = NULL;
+	if (!winterfs_dir_indexed(dir) && wfs_file_info->dir_block) {
+		bh = sb_bread(sb, wfs_file_info->dir_block);
+		if (!bh) {
+			return -EIO;
+		}
+		err = winterfs_dir_block_find(dir, bh->b_data, dir->i_sb->s_blocksize,
+			&dentry->d_name, &ent);
+		if (err || ent.ino != inode->i_ino) {
+			brelse(bh);
+			bh = NULL;
+		}
 	}
-	
-	// remove dir entry
-	wdbi = winterfs_dir_load_block(sb, wfs_file_info->dir_block);
-	if (IS_ERR(wdbi)) {
-                return PTR_ERR(wdbi);
-        }
-	wdbi->db->inode_list[wfs_file_info->dir_block_off] = WINTERFS_NULL_INODE;
-	winterfs_free_dir_block_info(wdbi, true);
-	
-	// mark inode as free
-	bitset_block = sbi->free_inode_bitset_idx + (inode->i_ino / (WINTERFS_BLOCK_SIZE * 8));
-	bh = sb_bread(sb, bitset_block);
 	if (!bh) {
-		printk(KERN_ERR "Error reading directory block %u\n", bitset_block);
-		err = -EIO;
-		goto finish;
+		bh = winterfs_dir_find_entry(dir, &dentry->d_name, &ent, &scanned);
+		if (IS_ERR(bh)) {
+			return PTR_ERR(bh);
+		}
+	}
+	err = winterfs_dir_block_remove(dir, bh->b_data, dir->i_sb->s_blocksize, ent.off);
+	if (err) {
+		brelse(bh);
+		return err;
 	}
-	clear_bit(inode->i_ino % (WINTERFS_BLOCK_SIZE * 8), (unsigned long*)bh->b_data);
 	mark_buffer_dirty(bh);
 	brelse(bh);
 
-	// mark data blocks as free
-	num_blocks = winterfs_inode_num_blocks(inode);
-	for (i = 0; i < num_blocks; i++) {
-		if (i < WINTERFS_INODE_DIRECT_BLOCKS) {
-			u32 mapped_block = winterfs_get_inode_block_idx(inode, i);
-			u32 block_num = mapped_block - sbi->data_blocks_idx;
-			bitset_block = sbi->free_block_bitset_idx + (i / (WINTERFS_BLOCK_SIZE * 8));
-			bh = sb_bread(sb, bitset_block);
-			if (!bh) {
-				printk(KERN_ERR "Error reading directory block %u\n", bitset_block);
-				err = -EIO;
-				goto finish;
-			}
-			clear_bit(block_num % (WINTERFS_BLOCK_SIZE * 8), (unsigned long*)bh->b_data);
-			mark_buffer_dirty(bh);
-			brelse(bh);
-		} else {
-			//TODO
-			break;
-		}
-        }
+	return 0;
+}
+
+static int winterfs_unlink(struct inode *dir, struct dentry *dentry)
+{
+	int err;
+	struct inode *inode = d_inode(dentry);
+	struct winterfs_inode_info *wfs_dir_info = WINTERFS_I(dir);
+
+	err = winterfs_dir_remove_entry(dir, dentry);
+	if (err) {
+		return err;
+	}
 
-finish:
 	wfs_dir_info->num_children--;
 	mark_inode_dirty(dir);
 	mark_inode_dirty(inode);
 	inode->i_ctime = dir->i_ctime;
 	inode_dec_link_count(inode);
 	
-	return err;
+	return 0;
 }
 
 static int winterfs_mkdir(struct user_namespace *mnt_userns,
         struct inode *dir, struct dentry *dentry, umode_t mode)
 {
 	int err;
+	u32 block;
+	struct buffer_head *bh;
 	struct inode *inode;
-	struct winterfs_inode_info *wfs_info;
-	struct super_block *sb = dir->i_sb;
 
 	mode |= S_IFDIR;
 
 	inode_inc_link_count(dir);
 
-	inode = winterfs_new_inode(sb);
+	inode = winterfs_new_inode(dir, mode);
 	if (IS_ERR(inode)) {
 		err = PTR_ERR(inode);
 		goto err;
 	}
 
-	wfs_info = inode->i_private;
-	wfs_info->direct_blocks[0] = winterfs_allocate_data_block(sb);
+	if (winterfs_inode_inline(inode)) {
+		winterfs_dir_block_init(inode, WINTERFS_I(inode)->inline_data,
+			winterfs_inline_size(dir->i_sb));
+		inode->i_size = winterfs_inline_size(dir->i_sb);
+	} else {
+		bh = winterfs_dir_append_block(inode, &block);
+		if (IS_ERR(bh)) {
+			err = PTR_ERR(bh);
+			goto err_inode;
+		}
+		brelse(bh);
+	}
 	
 	inode_inc_link_count(inode);
 
 	inode->i_op = &winterfs_dir_inode_operations;
         inode->i_fop = &winterfs_dir_operations;
         inode->i_mapping->a_ops = &winterfs_address_operations;
-	inode->i_size = WINTERFS_BLOCK_SIZE;
 	inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
 	inode_init_owner(&init_user_ns, inode, dir, mode);
 
-	d_instantiate_new(dentry, inode);
 	err = winterfs_dir_link_inode(dentry, inode);
 	if (err) {
-		goto err;
+		goto err_inode;
 	}
-	__winterfs_write_inode(inode);
+	__winterfs_write_inode(inode, false);
 	mark_inode_dirty(inode);
+	d_instantiate_new(dentry, inode);
 
 	return 0;
 
+err_inode:
+	// unlinked, evict releases the inode number & any block it got
+	clear_nlink(inode);
+	discard_new_inode(inode);
 err:
 	inode_dec_link_count(dir);
 	return err;
@@ -291,11 +1534,7 @@ static int winterfs_rmdir(struct inode *dir, struct dentry *dentry)
 {
 	int err;
 	struct inode *inode = d_inode(dentry);
-	struct winterfs_inode_info *wfs_info = inode->i_private;
-	if (!wfs_info) {
-		printk(KERN_ERR "Attempt to read data from improperly loaded inode\n");
-                return -EINVAL;
-	}
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
 
 	if (wfs_info->num_children > 0) {
 		return -ENOTEMPTY;
@@ -306,73 +1545,101 @@ static int winterfs_rmdir(struct inode *dir, struct dentry *dentry)
 		return err;
 	}
 
-	inode->i_size = 0;
 	inode_dec_link_count(inode);
 	inode_dec_link_count(dir);
 
 	return 0;
 }
 
-void winterfs_free_dir_block_info(struct winterfs_dir_block_info *wdbi, bool dirty)
-{
-	if (dirty) {
-		mark_buffer_dirty(wdbi->bh);
-	}
-	brelse(wdbi->bh);
-	kfree(wdbi);
-}
-
-struct winterfs_filename *winterfs_dir_block_filename(
-	struct winterfs_dir_block_info *dbi, u8 idx)
-{
-	return &(dbi->db->files[idx]);
-}
-
-int winterfs_dir_link_inode(struct dentry *dent, struct inode *inode)
+static int __winterfs_dir_link_inode(struct inode *dir, struct dentry *dent,
+	struct inode *inode, u32 *scanned)
 {
+	int err;
 	struct super_block *sb;
 	u32 dir_num_blocks;
 	u32 block;
-	struct winterfs_inode_info *wfs_info_dir;
-	struct winterfs_inode_info *wfs_info_file;
-	struct inode *dir = d_inode(dent->d_parent);
-	int res = -ENOMEM;
+	struct buffer_head *bh;
+
+	if (winterfs_inode_inline(dir)) {
+		err = winterfs_dir_inline_add(dir, dent, inode);
+		if (err != -ENOSPC) {
+			return err;
+		}
+		err = winterfs_dir_inline_convert(dir);
+		if (err) {
+			return err;
+		}
+	}
 
-	wfs_info_dir = dir->i_private;
-	wfs_info_file = inode->i_private;
-	if (!wfs_info_dir || !wfs_info_file) {
-		printk(KERN_ERR "Attempt to read data from improperly loaded inode\n");
-                return -EINVAL;
+	if (winterfs_dir_indexed(dir)) {
+		return winterfs_dx_add_entry(dir, dent, inode, scanned);
 	}
 
 	sb = dir->i_sb;
 	dir_num_blocks = winterfs_inode_num_blocks(dir);
-	for (block = 0; (res != 0) && block < dir_num_blocks; block++) {
-		u8 i;
+	for (block = 0; block < dir_num_blocks; block++) {
 		u32 mapped_block = winterfs_get_inode_block_idx(dir, block);
-		struct winterfs_dir_block_info *wdbi = winterfs_dir_load_block(sb, mapped_block);
-		
-		for (i = 0; i < WINTERFS_FILES_PER_DIR_BLOCK; i++) {
-			if (!wdbi->inode_list[i]) {
-				const char *filename = dent->d_name.name;
-				wdbi->inode_list[i] = inode->i_ino;
-				wdbi->db->inode_list[i] = inode->i_ino;
-				strncpy((char*)(&wdbi->db->files[i]), filename, WINTERFS_FILENAME_MAX_LEN);
-				wfs_info_dir->num_children++;
-				wfs_info_file->dir_block = mapped_block;
-				wfs_info_file->dir_block_off = i;
-				res = 0;	
-				break;
-			}
+		if (!mapped_block) {
+			continue;
+		}
+		bh = sb_bread(sb, mapped_block);
+		if (!bh) {
+			printk(KERN_ERR "Error reading directory block %u\n", mapped_block);
+			return -EIO;
+		}
+		(*scanned)++;
+		err = winterfs_dir_add_to_block(dir, bh, dent, inode);
+		brelse(bh);
+		if (err != -ENOSPC) {
+			return err;
 		}
-		winterfs_free_dir_block_info(wdbi, true);
 	}
 
-	mark_inode_dirty(dir);
-	//TODO allocate more blocks as needed, write function to do this
+	// every block is full, index the directory once it outgrows one
+	if (winterfs_has_feature(sb, WINTERFS_FEATURE_DIR_INDEX) && dir_num_blocks == 1) {
+		err = winterfs_dx_create(dir);
+		if (err) {
+			return err;
+		}
+		return winterfs_dx_add_entry(dir, dent, inode, scanned);
+	}
 
-	return res;
-};
+	bh = winterfs_dir_append_block(dir, &block);
+	if (IS_ERR(bh)) {
+		return PTR_ERR(bh);
+	}
+	(*scanned)++;
+	err = winterfs_dir_add_to_block(dir, bh, dent, inode);
+	brelse(bh);
+
+	return err;
+}
+
+int winterfs_dir_link_inode(struct dentry *dent, struct inode *inode)
+{
+	int err;
+	u32 scanned = 0;
+	struct inode *dir = d_inode(dent->d_parent);
+	u64 start = trace_winterfs_dir_link_inode_enabled() ? ktime_get_ns() : 0;
+
+	err = __winterfs_dir_link_inode(dir, dent, inode, &scanned);
+	trace_winterfs_dir_link_inode(dir, &dent->d_name, inode->i_ino, scanned, err, start);
+
+	return err;
+}
+
+// positions of a directory listed in hash order run up to its end
+static loff_t winterfs_dir_llseek(struct file *file, loff_t offset, int whence)
+{
+	loff_t eof;
+
+	if (!winterfs_dir_hash_order(file_inode(file))) {
+		return generic_file_llseek(file, offset, whence);
+	}
+	eof = winterfs_dir_hash_eof(file);
+
+	return generic_file_llseek_size(file, offset, whence, eof, eof);
+}
 
 const struct inode_operations winterfs_dir_inode_operations = {
 	.mkdir		= winterfs_mkdir,
@@ -383,7 +1650,9 @@ const struct inode_operations winterfs_dir_inode_operations = {
 };
 
 const struct file_operations winterfs_dir_operations = {
-	.iterate	= winterfs_readdir,
-	.llseek		= generic_file_llseek,
-	.read		= generic_read_dir
+	.compat_ioctl	= compat_ptr_ioctl,
+	.iterate_shared	= winterfs_readdir,
+	.llseek		= winterfs_dir_llseek,
+	.read		= generic_read_dir,
+	.unlocked_ioctl	= winterfs_ioctl
 };
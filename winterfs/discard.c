@@ -0,0 +1,156 @@
+#include <linux/blkdev.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include "winterfs.h"
+#include "winterfs_alloc.h"
+#include "winterfs_discard.h"
+#include "winterfs_sb.h"
+
+/*
+ * With the discard mount option, data blocks freed by unlink, truncate and
+ * hole punching are passed on to the device in batches. The bitsets that
+ * record them as free are written out first, so a crash never leaves a
+ * discarded block in use on disk. Only the part of a range that is still
+ * free by then gets discarded, blocks allocated again in the meantime are
+ * skipped.
+ */
+static void winterfs_discard_work(struct work_struct *work)
+{
+	struct winterfs_discard_queue *dq = container_of(to_delayed_work(work),
+		struct winterfs_discard_queue, work);
+	struct winterfs_sb_info *sbi = container_of(dq, struct winterfs_sb_info, discards);
+	struct super_block *sb = sbi->vfs_sb;
+	struct winterfs_discard_range *range;
+	struct winterfs_discard_range *next;
+	LIST_HEAD(ranges);
+	int err;
+
+	spin_lock(&dq->lock);
+	list_splice_init(&dq->ranges, &ranges);
+	dq->count = 0;
+	spin_unlock(&dq->lock);
+
+	if (list_empty(&ranges)) {
+		return;
+	}
+
+	err = sync_blockdev(sb->s_bdev);
+	if (err) {
+		printk(KERN_WARNING "winterfs: skipping discards, metadata writeback failed\n");
+	}
+
+	list_for_each_entry_safe(range, next, &ranges, list) {
+		// discard is only a hint, a range the device refuses is dropped
+		if (!err) {
+			winterfs_free_space_trim(sb, &sbi->block_space, sbi->data_blocks_idx,
+				range->start, range->start + range->len, 1);
+		}
+		list_del(&range->list);
+		kfree(range);
+	}
+}
+
+void winterfs_discard_init(struct super_block *sb)
+{
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+	struct winterfs_discard_queue *dq = &sbi->discards;
+
+	spin_lock_init(&dq->lock);
+	INIT_LIST_HEAD(&dq->ranges);
+	dq->count = 0;
+	INIT_DELAYED_WORK(&dq->work, winterfs_discard_work);
+}
+
+// discard whatever is still queued, while the free space index is around
+void winterfs_discard_destroy(struct super_block *sb)
+{
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+	struct winterfs_discard_queue *dq = &sbi->discards;
+
+	cancel_delayed_work_sync(&dq->work);
+	winterfs_discard_work(&dq->work.work);
+}
+
+// queue freed data blocks [block, block + count) for discard
+void winterfs_discard_queue(struct super_block *sb, u32 block, u32 count)
+{
+	bool full;
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+	struct winterfs_discard_queue *dq = &sbi->discards;
+	struct winterfs_discard_range *range;
+	struct winterfs_discard_range *last = NULL;
+
+	if (!winterfs_has_mount_opt(sb, WINTERFS_MOUNT_DISCARD)) {
+		return;
+	}
+
+	range = kmalloc(sizeof(struct winterfs_discard_range), GFP_NOFS);
+
+	spin_lock(&dq->lock);
+	if (!list_empty(&dq->ranges)) {
+		last = list_last_entry(&dq->ranges, struct winterfs_discard_range, list);
+	}
+	// files are freed front to back, so runs usually continue the last one
+	if (last && last->start + last->len == block) {
+		last->len += count;
+	} else if (range) {
+		range->start = block;
+		range->len = count;
+		list_add_tail(&range->list, &dq->ranges);
+		dq->count++;
+		range = NULL;
+	}
+	// without memory for it, the range just isn't discarded
+	full = dq->count >= WINTERFS_DISCARD_BATCH;
+	spin_unlock(&dq->lock);
+	kfree(range);
+
+	if (full) {
+		mod_delayed_work(system_unbound_wq, &dq->work, 0);
+	} else {
+		queue_delayed_work(system_unbound_wq, &dq->work, WINTERFS_DISCARD_DELAY);
+	}
+}
+
+/*
+ * FITRIM: discard the free data blocks of at least range->minlen bytes
+ * within the byte range given, reporting the bytes discarded in
+ * range->len.
+ */
+int winterfs_trim_fs(struct super_block *sb, struct fstrim_range *range)
+{
+	s64 trimmed;
+	u64 end;
+	u32 start_block;
+	u32 end_block;
+	u32 minlen;
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+	struct block_device *bdev = sb->s_bdev;
+
+	if (!bdev_max_discard_sectors(bdev)) {
+		return -EOPNOTSUPP;
+	}
+
+	minlen = DIV_ROUND_UP(max_t(u64, range->minlen, bdev_discard_granularity(bdev)),
+		sb->s_blocksize);
+	if (range->len < sb->s_blocksize || minlen > sbi->num_blocks) {
+		return -EINVAL;
+	}
+
+	end = range->len > U64_MAX - range->start ? U64_MAX : range->start + range->len;
+	start_block = min_t(u64, range->start >> sb->s_blocksize_bits, sbi->num_blocks);
+	end_block = min_t(u64, end >> sb->s_blocksize_bits, sbi->num_blocks);
+
+	// only the data blocks have free space to trim, bit n is block data_blocks_idx + n
+	start_block = max(start_block, sbi->data_blocks_idx) - sbi->data_blocks_idx;
+	end_block = max(end_block, sbi->data_blocks_idx) - sbi->data_blocks_idx;
+
+	trimmed = winterfs_free_space_trim(sb, &sbi->block_space, sbi->data_blocks_idx,
+		start_block, end_block, max_t(u32, minlen, 1));
+	if (trimmed < 0) {
+		return trimmed;
+	}
+
+	range->len = (u64)trimmed << sb->s_blocksize_bits;
+	return 0;
+}
@@ -0,0 +1,997 @@
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/math64.h>
+#include <linux/slab.h>
+#include "winterfs.h"
+#include "winterfs_extent.h"
+#include "winterfs_ino.h"
+#include "winterfs_sb.h"
+
+void winterfs_extent_map_init(struct winterfs_extent_map *map)
+{
+	memset(map, 0, sizeof(struct winterfs_extent_map));
+	init_rwsem(&map->lock);
+}
+
+void winterfs_extent_map_destroy(struct winterfs_extent_map *map)
+{
+	u16 level;
+
+	kvfree(map->ext);
+	map->ext = NULL;
+	map->count = 0;
+	map->capacity = 0;
+	for (level = 0; level < WINTERFS_EXTENT_MAX_DEPTH; level++) {
+		kvfree(map->nodes[level]);
+		kvfree(map->first[level]);
+		map->nodes[level] = NULL;
+		map->first[level] = NULL;
+		map->num_nodes[level] = 0;
+		map->node_capacity[level] = 0;
+	}
+}
+
+static void winterfs_extent_decode(struct winterfs_mem_extent *m,
+	struct winterfs_extent *ext)
+{
+	u32 len = le32_to_cpu(ext->len);
+
+	m->block = le32_to_cpu(ext->block);
+	m->len = len & WINTERFS_EXTENT_MAX_LEN;
+	m->start = le32_to_cpu(ext->start);
+	m->unwritten = !!(len & WINTERFS_EXTENT_UNWRITTEN);
+}
+
+static void winterfs_extent_encode(struct winterfs_extent *ext,
+	struct winterfs_mem_extent *m)
+{
+	ext->block = cpu_to_le32(m->block);
+	ext->len = cpu_to_le32(m->len | (m->unwritten ? WINTERFS_EXTENT_UNWRITTEN : 0));
+	ext->start = cpu_to_le32(m->start);
+}
+
+static int winterfs_extent_reserve(struct winterfs_extent_map *map, u32 count)
+{
+	struct winterfs_mem_extent *ext;
+	u32 capacity;
+
+	if (count <= map->capacity) {
+		return 0;
+	}
+
+	capacity = max_t(u32, count, map->capacity * 2);
+	capacity = max_t(u32, capacity, WINTERFS_INODE_EXTENTS);
+	ext = kvmalloc_array(capacity, sizeof(struct winterfs_mem_extent), GFP_NOFS);
+	if (!ext) {
+		return -ENOMEM;
+	}
+	if (map->count) {
+		memcpy(ext, map->ext, map->count * sizeof(struct winterfs_mem_extent));
+	}
+	kvfree(map->ext);
+	map->ext = ext;
+	map->capacity = capacity;
+
+	return 0;
+}
+
+static int winterfs_extent_node_reserve(struct winterfs_extent_map *map,
+	u16 level, u32 count)
+{
+	u32 *nodes;
+	u32 *first;
+	u32 capacity;
+
+	if (count <= map->node_capacity[level]) {
+		return 0;
+	}
+
+	capacity = max_t(u32, count, map->node_capacity[level] * 2);
+	nodes = kvmalloc_array(capacity, sizeof(u32), GFP_NOFS);
+	first = kvmalloc_array(capacity, sizeof(u32), GFP_NOFS);
+	if (!nodes || !first) {
+		kvfree(nodes);
+		kvfree(first);
+		return -ENOMEM;
+	}
+	if (map->num_nodes[level]) {
+		memcpy(nodes, map->nodes[level], map->num_nodes[level] * sizeof(u32));
+		memcpy(first, map->first[level], map->num_nodes[level] * sizeof(u32));
+	}
+	kvfree(map->nodes[level]);
+	kvfree(map->first[level]);
+	map->nodes[level] = nodes;
+	map->first[level] = first;
+	map->node_capacity[level] = capacity;
+
+	return 0;
+}
+
+// entries on a level, extents for the leaves
+static u32 winterfs_extent_level_entries(struct winterfs_extent_map *map, u16 level)
+{
+	return level ? map->num_nodes[level - 1] : map->count;
+}
+
+static u32 winterfs_extent_node_entries(struct winterfs_extent_map *map, u16 level,
+	u32 node)
+{
+	u32 end = node + 1 < map->num_nodes[level] ? map->first[level][node + 1]
+		: winterfs_extent_level_entries(map, level);
+
+	return end - map->first[level][node];
+}
+
+// index of the first extent below a node
+static u32 winterfs_extent_node_extent(struct winterfs_extent_map *map, u16 level,
+	u32 node)
+{
+	for (;;) {
+		node = map->first[level][node];
+		if (!level--) {
+			return node;
+		}
+	}
+}
+
+// the node of a level holding entry 'entry', the last node past the end
+static u32 winterfs_extent_node_find(struct winterfs_extent_map *map, u16 level,
+	u32 entry)
+{
+	u32 lo = 0;
+	u32 hi = map->num_nodes[level] - 1;
+
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo + 1) / 2;
+
+		if (map->first[level][mid] <= entry) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	return lo;
+}
+
+static int winterfs_extent_load_node(struct inode *inode,
+	struct winterfs_extent_map *map, struct winterfs_extent_header *eh, u16 depth)
+{
+	u16 i;
+	int err;
+	struct super_block *sb = inode->i_sb;
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+	u16 entries = le16_to_cpu(eh->entries);
+
+	if (le16_to_cpu(eh->magic) != WINTERFS_EXTENT_MAGIC
+		|| le16_to_cpu(eh->depth) != depth
+		|| entries > le16_to_cpu(eh->max)) {
+		printk(KERN_ERR "Corrupt extent node in inode %lu\n", inode->i_ino);
+		return -EIO;
+	}
+
+	if (depth == 0) {
+		struct winterfs_extent *ext = (struct winterfs_extent *)(eh + 1);
+
+		err = winterfs_extent_reserve(map, map->count + entries);
+		if (err) {
+			return err;
+		}
+		for (i = 0; i < entries; i++) {
+			winterfs_extent_decode(&map->ext[map->count++], &ext[i]);
+		}
+		return 0;
+	}
+
+	for (i = 0; i < entries; i++) {
+		struct winterfs_extent_idx *idx = (struct winterfs_extent_idx *)(eh + 1);
+
+		sb_breadahead(sb, sbi->data_blocks_idx + le32_to_cpu(idx[i].child));
+	}
+
+	for (i = 0; i < entries; i++) {
+		struct buffer_head *bh;
+		struct winterfs_extent_idx *idx = (struct winterfs_extent_idx *)(eh + 1);
+		u32 child = le32_to_cpu(idx[i].child);
+		u16 level = depth - 1;
+		u32 node = map->num_nodes[level];
+
+		err = winterfs_extent_node_reserve(map, level, node + 1);
+		if (err) {
+			return err;
+		}
+		map->nodes[level][node] = child;
+		map->first[level][node] = winterfs_extent_level_entries(map, level);
+		map->num_nodes[level]++;
+
+		bh = sb_bread(sb, sbi->data_blocks_idx + child);
+		if (!bh) {
+			printk(KERN_ERR "Error reading extent node %u\n", child);
+			return -EIO;
+		}
+		err = winterfs_extent_load_node(inode, map,
+			(struct winterfs_extent_header *)bh->b_data, level);
+		brelse(bh);
+		if (err) {
+			return err;
+		}
+
+		// nodes below the root are never left empty
+		if (!winterfs_extent_node_entries(map, level, node)) {
+			printk(KERN_ERR "Empty extent node %u in inode %lu\n", child, inode->i_ino);
+			return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+int winterfs_extent_map_load(struct inode *inode, struct winterfs_extent_map *map,
+	struct winterfs_extent_root *root)
+{
+	int err;
+	u16 depth = le16_to_cpu(root->header.depth);
+
+	if (depth > WINTERFS_EXTENT_MAX_DEPTH
+		|| le16_to_cpu(root->header.max) > WINTERFS_INODE_EXTENTS) {
+		printk(KERN_ERR "Corrupt extent root in inode %lu\n", inode->i_ino);
+		return -EIO;
+	}
+
+	err = winterfs_extent_load_node(inode, map, &root->header, depth);
+	if (err) {
+		winterfs_extent_map_destroy(map);
+		return err;
+	}
+
+	// a root with no entries maps nothing, whatever its depth
+	map->depth = depth && map->num_nodes[depth - 1] ? depth : 0;
+
+	return 0;
+}
+
+void winterfs_extent_map_store(struct inode *inode, struct winterfs_extent_map *map,
+	struct winterfs_extent_root *root)
+{
+	u32 i;
+
+	down_read(&map->lock);
+
+	memset(root, 0, sizeof(struct winterfs_extent_root));
+	root->header.magic = cpu_to_le16(WINTERFS_EXTENT_MAGIC);
+	root->header.max = cpu_to_le16(WINTERFS_INODE_EXTENTS);
+	root->header.depth = cpu_to_le16(map->depth);
+
+	if (map->depth == 0) {
+		root->header.entries = cpu_to_le16(map->count);
+		for (i = 0; i < map->count; i++) {
+			winterfs_extent_encode(&root->extents[i], &map->ext[i]);
+		}
+	} else {
+		struct winterfs_extent_idx *idx = (struct winterfs_extent_idx *)root->extents;
+		u16 level = map->depth - 1;
+
+		root->header.entries = cpu_to_le16(map->num_nodes[level]);
+		for (i = 0; i < map->num_nodes[level]; i++) {
+			idx[i].block = cpu_to_le32(
+				map->ext[winterfs_extent_node_extent(map, level, i)].block);
+			idx[i].child = cpu_to_le32(map->nodes[level][i]);
+		}
+	}
+
+	up_read(&map->lock);
+}
+
+// index of the last extent starting at or before block, or count if none
+static u32 winterfs_extent_search(struct winterfs_extent_map *map, u32 block)
+{
+	u32 lo = 0;
+	u32 hi = map->count;
+
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+
+		if (map->ext[mid].block <= block) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo ? lo - 1 : map->count;
+}
+
+/*
+ * Map a file block to a data block. *len is set to the number of blocks
+ * that stay contiguous from there, or for a hole to the distance to the
+ * next mapped block. Returns 0 for a hole. *unwritten, when given, tells
+ * whether the mapped blocks are preallocated and still read as zeroes.
+ */
+u32 winterfs_extent_lookup(struct winterfs_extent_map *map, u32 block, u32 *len,
+	bool *unwritten)
+{
+	struct winterfs_mem_extent *ext;
+	u32 i;
+	u32 start = 0;
+
+	down_read(&map->lock);
+
+	i = READ_ONCE(map->hint);
+	if (i >= map->count || map->ext[i].block > block) {
+		i = winterfs_extent_search(map, block);
+	} else if (block >= map->ext[i].block + map->ext[i].len
+		&& i + 1 < map->count && map->ext[i + 1].block <= block) {
+		// sequential access usually moves on to the next extent
+		i++;
+		if (i + 1 < map->count && map->ext[i + 1].block <= block) {
+			i = winterfs_extent_search(map, block);
+		}
+	}
+
+	if (i < map->count && block < map->ext[i].block + map->ext[i].len) {
+		ext = &map->ext[i];
+		start = ext->start + (block - ext->block);
+		*len = ext->block + ext->len - block;
+		if (unwritten) {
+			*unwritten = ext->unwritten;
+		}
+		WRITE_ONCE(map->hint, i);
+	} else {
+		u32 next = i < map->count ? i + 1 : 0;
+
+		if (next < map->count && map->ext[next].block > block) {
+			*len = map->ext[next].block - block;
+		} else {
+			*len = U32_MAX - block;
+		}
+	}
+
+	up_read(&map->lock);
+
+	return start;
+}
+
+// data block just past the end of the file's last extent, 0 if it has none
+u32 winterfs_extent_goal(struct winterfs_extent_map *map)
+{
+	u32 goal = 0;
+
+	down_read(&map->lock);
+	if (map->count) {
+		goal = map->ext[map->count - 1].start + map->ext[map->count - 1].len;
+	}
+	up_read(&map->lock);
+
+	return goal;
+}
+
+static void winterfs_extent_forget_node(struct super_block *sb, u32 block)
+{
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+	struct buffer_head *bh;
+
+	bh = sb_find_get_block(sb, sbi->data_blocks_idx + block);
+	if (bh) {
+		bforget(bh);
+	}
+	winterfs_free_data_blocks(sb, block, 1);
+}
+
+static int winterfs_extent_write_node(struct inode *inode,
+	struct winterfs_extent_map *map, u16 level, u32 node)
+{
+	u32 i;
+	u16 entries;
+	struct buffer_head *bh;
+	struct winterfs_extent_header *eh;
+	struct super_block *sb = inode->i_sb;
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+	u32 first = map->first[level][node];
+
+	entries = winterfs_extent_node_entries(map, level, node);
+
+	bh = sb_getblk(sb, sbi->data_blocks_idx + map->nodes[level][node]);
+	if (!bh) {
+		return -ENOMEM;
+	}
+
+	lock_buffer(bh);
+	memset(bh->b_data, 0, sb->s_blocksize);
+	eh = (struct winterfs_extent_header *)bh->b_data;
+	eh->magic = cpu_to_le16(WINTERFS_EXTENT_MAGIC);
+	eh->entries = cpu_to_le16(entries);
+	eh->max = cpu_to_le16(WINTERFS_EXTENTS_PER_BLOCK(sb));
+	eh->depth = cpu_to_le16(level);
+
+	if (level == 0) {
+		struct winterfs_extent *ext = (struct winterfs_extent *)(eh + 1);
+
+		for (i = 0; i < entries; i++) {
+			winterfs_extent_encode(&ext[i], &map->ext[first + i]);
+		}
+	} else {
+		struct winterfs_extent_idx *idx = (struct winterfs_extent_idx *)(eh + 1);
+
+		for (i = 0; i < entries; i++) {
+			idx[i].block = cpu_to_le32(
+				map->ext[winterfs_extent_node_extent(map, level - 1, first + i)].block);
+			idx[i].child = cpu_to_le32(map->nodes[level - 1][first + i]);
+		}
+	}
+
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty_inode(bh, inode);
+	brelse(bh);
+
+	return 0;
+}
+
+/*
+ * A change of one level of the tree: entries [lo, lo + old_n) of the level
+ * become new_n entries, held by the nodes from 'node' on.
+ */
+struct winterfs_extent_step {
+	u32 node; // first node holding the changed entries
+	u32 old_nodes; // nodes that held them
+	u32 new_nodes; // nodes that hold them after the change
+	u32 entries; // entries held by those nodes after the change
+};
+
+// work out a step from the level as it is, 'total' entries before the change
+static void winterfs_extent_plan_step(struct super_block *sb,
+	struct winterfs_extent_map *map, u16 level, u32 total, u32 lo, u32 old_n, u32 new_n,
+	struct winterfs_extent_step *step)
+{
+	u32 last;
+	u32 end;
+
+	step->node = winterfs_extent_node_find(map, level, lo);
+	last = old_n ? winterfs_extent_node_find(map, level, lo + old_n - 1) : step->node;
+	end = last + 1 < map->num_nodes[level] ? map->first[level][last + 1] : total;
+
+	step->old_nodes = last - step->node + 1;
+	step->entries = end - map->first[level][step->node] - old_n + new_n;
+	step->new_nodes = DIV_ROUND_UP(step->entries, WINTERFS_EXTENTS_PER_BLOCK(sb));
+}
+
+// the level above is unchanged when one node still holds the change, and
+// the entry its key comes from is untouched
+static bool winterfs_extent_step_local(struct winterfs_extent_map *map, u16 level,
+	u32 lo, struct winterfs_extent_step *step)
+{
+	return step->old_nodes == 1 && step->new_nodes == 1
+		&& lo > map->first[level][step->node];
+}
+
+/*
+ * Count the nodes a change of extents [lo, lo + old_n) into new_n extents
+ * adds to the tree, splitting nodes or growing it a level.
+ */
+static int winterfs_extent_plan(struct super_block *sb, struct winterfs_extent_map *map,
+	u32 lo, u32 old_n, u32 new_n, u32 *added)
+{
+	u16 level;
+	u32 total = map->count;
+	u32 top = map->count - old_n + new_n;
+	struct winterfs_extent_step step;
+
+	*added = 0;
+	for (level = 0; level < map->depth; level++) {
+		winterfs_extent_plan_step(sb, map, level, total, lo, old_n, new_n, &step);
+		if (step.new_nodes > step.old_nodes) {
+			*added += step.new_nodes - step.old_nodes;
+		}
+		if (winterfs_extent_step_local(map, level, lo, &step)) {
+			top = map->num_nodes[map->depth - 1];
+			break;
+		}
+		total = map->num_nodes[level];
+		top = total - step.old_nodes + step.new_nodes;
+		lo = step.node;
+		old_n = step.old_nodes;
+		new_n = step.new_nodes;
+	}
+
+	if (top > WINTERFS_INODE_EXTENTS) {
+		if (map->depth == WINTERFS_EXTENT_MAX_DEPTH) {
+			return -EFBIG;
+		}
+		*added += DIV_ROUND_UP(top, WINTERFS_EXTENTS_PER_BLOCK(sb));
+	}
+
+	return 0;
+}
+
+static void winterfs_extent_put_spares(struct super_block *sb,
+	struct winterfs_extent_map *map)
+{
+	while (map->num_spare) {
+		winterfs_free_data_blocks(sb, map->spare[--map->num_spare], 1);
+	}
+}
+
+/*
+ * Take the blocks and memory a change of extents [lo, lo + old_n) into at
+ * most new_n extents needs, so that changing the tree afterwards cannot
+ * run out of either part way. Spare blocks left over are freed by
+ * winterfs_extent_put_spares.
+ */
+static int winterfs_extent_prepare(struct inode *inode, struct winterfs_extent_map *map,
+	u32 lo, u32 old_n, u32 new_n)
+{
+	struct super_block *sb = inode->i_sb;
+	u32 added;
+	u32 goal;
+	u16 level;
+	int err;
+
+	err = winterfs_extent_reserve(map, map->count - old_n + new_n);
+	if (err) {
+		return err;
+	}
+	err = winterfs_extent_plan(sb, map, lo, old_n, new_n, &added);
+	if (err) {
+		return err;
+	}
+	// a level gains at most one node from a change this small
+	for (level = 0; added && level < WINTERFS_EXTENT_MAX_DEPTH; level++) {
+		err = winterfs_extent_node_reserve(map, level, map->num_nodes[level] + 1);
+		if (err) {
+			return err;
+		}
+	}
+
+	// keep the nodes inline with the data they map
+	goal = lo < map->count ? map->ext[lo].start : winterfs_extent_goal(map);
+	while (map->num_spare < added) {
+		u32 count = 1;
+		u32 block = winterfs_allocate_data_blocks(sb, goal, &count);
+
+		if (!block) {
+			winterfs_extent_put_spares(sb, map);
+			return -ENOSPC;
+		}
+		map->spare[map->num_spare++] = block;
+	}
+
+	return 0;
+}
+
+/*
+ * Apply a step to a level: the nodes holding the changed entries are
+ * split, or joined, into step->new_nodes nodes and rewritten. The entries
+ * are spread evenly over them, except at the end of the level, where a
+ * file usually grows, so nodes are filled in turn.
+ */
+static int winterfs_extent_apply_step(struct inode *inode,
+	struct winterfs_extent_map *map, u16 level, u32 lo, u32 old_n, u32 new_n,
+	struct winterfs_extent_step *step)
+{
+	struct super_block *sb = inode->i_sb;
+	u32 per = WINTERFS_EXTENTS_PER_BLOCK(sb);
+	u32 node = step->node;
+	u32 base = map->first[level][node];
+	u32 after = node + step->old_nodes;
+	u32 moved = map->num_nodes[level] - after;
+	bool append = lo + new_n == winterfs_extent_level_entries(map, level);
+	u32 i;
+	int err;
+	int ret = 0;
+
+	// nodes no longer needed go, new ones come from the spares
+	for (i = step->new_nodes; i < step->old_nodes; i++) {
+		winterfs_extent_forget_node(sb, map->nodes[level][node + i]);
+	}
+	memmove(&map->nodes[level][node + step->new_nodes], &map->nodes[level][after],
+		moved * sizeof(u32));
+	memmove(&map->first[level][node + step->new_nodes], &map->first[level][after],
+		moved * sizeof(u32));
+	for (i = step->old_nodes; i < step->new_nodes; i++) {
+		map->nodes[level][node + i] = map->spare[--map->num_spare];
+	}
+	map->num_nodes[level] += step->new_nodes - step->old_nodes;
+
+	for (i = 0; i < moved; i++) {
+		map->first[level][node + step->new_nodes + i] += new_n - old_n;
+	}
+	for (i = 0; i < step->new_nodes; i++) {
+		map->first[level][node + i] = base + (append ? i * per
+			: (u32)div_u64((u64)i * step->entries, step->new_nodes));
+	}
+
+	for (i = 0; i < step->new_nodes; i++) {
+		err = winterfs_extent_write_node(inode, map, level, node + i);
+		if (err && !ret) {
+			ret = err;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Bring the tree in line with the extents once [lo, hi) of them changed,
+ * from old_count extents in all. Only the nodes holding the change, and
+ * those above them whose entries change in turn, are rewritten. The root
+ * lives in the inode and is written by __winterfs_write_inode. Takes its
+ * new nodes from the spares of winterfs_extent_prepare, and leaves the
+ * tree sound even when writing a node fails.
+ */
+static int winterfs_extent_update(struct inode *inode, struct winterfs_extent_map *map,
+	u32 lo, u32 hi, u32 old_count)
+{
+	struct super_block *sb = inode->i_sb;
+	u32 per = WINTERFS_EXTENTS_PER_BLOCK(sb);
+	u32 total = old_count;
+	u32 old_n = hi - lo + old_count - map->count;
+	u32 new_n = hi - lo;
+	struct winterfs_extent_step step;
+	u16 level;
+	u32 top;
+	u32 i;
+	int err;
+	int ret = 0;
+
+	for (level = 0; level < map->depth; level++) {
+		winterfs_extent_plan_step(sb, map, level, total, lo, old_n, new_n, &step);
+		total = map->num_nodes[level];
+		err = winterfs_extent_apply_step(inode, map, level, lo, old_n, new_n, &step);
+		if (err && !ret) {
+			ret = err;
+		}
+		if (winterfs_extent_step_local(map, level, lo, &step)) {
+			break;
+		}
+		lo = step.node;
+		old_n = step.old_nodes;
+		new_n = step.new_nodes;
+	}
+
+	// grow a level when the root overflows
+	top = winterfs_extent_level_entries(map, map->depth);
+	if (top > WINTERFS_INODE_EXTENTS) {
+		level = map->depth++;
+		map->num_nodes[level] = DIV_ROUND_UP(top, per);
+		for (i = 0; i < map->num_nodes[level]; i++) {
+			map->nodes[level][i] = map->spare[--map->num_spare];
+			map->first[level][i] = i * per;
+		}
+		for (i = 0; i < map->num_nodes[level]; i++) {
+			err = winterfs_extent_write_node(inode, map, level, i);
+			if (err && !ret) {
+				ret = err;
+			}
+		}
+	}
+
+	// and drop levels the root can hold again
+	while (map->depth) {
+		level = map->depth - 1;
+		if (map->num_nodes[level] > 1 || (map->num_nodes[level]
+				&& winterfs_extent_level_entries(map, level) > WINTERFS_INODE_EXTENTS)) {
+			break;
+		}
+		if (map->num_nodes[level]) {
+			winterfs_extent_forget_node(sb, map->nodes[level][0]);
+			map->num_nodes[level] = 0;
+		}
+		map->depth--;
+	}
+
+	return ret;
+}
+
+/*
+ * Map file blocks [block, block + len) to data blocks starting at start,
+ * merging with the neighbouring extents when they are contiguous. The
+ * range must not already be mapped.
+ */
+int winterfs_extent_add(struct inode *inode, struct winterfs_extent_map *map,
+	u32 block, u32 start, u32 len, bool unwritten)
+{
+	struct winterfs_mem_extent *prev = NULL;
+	u32 pos;
+	int err;
+
+	down_write(&map->lock);
+
+	pos = winterfs_extent_search(map, block);
+	pos = pos == map->count ? 0 : pos + 1;
+	if (pos) {
+		prev = &map->ext[pos - 1];
+	}
+
+	if (prev && prev->block + prev->len == block && prev->start + prev->len == start
+		&& prev->unwritten == unwritten
+		&& (u64)prev->len + len <= WINTERFS_EXTENT_MAX_LEN) {
+		prev->len += len;
+		err = winterfs_extent_update(inode, map, pos - 1, pos, map->count);
+		if (err) {
+			prev->len -= len;
+			winterfs_extent_update(inode, map, pos - 1, pos, map->count);
+		}
+		goto out;
+	}
+
+	err = winterfs_extent_prepare(inode, map, pos, 0, 1);
+	if (err) {
+		goto out;
+	}
+	memmove(&map->ext[pos + 1], &map->ext[pos],
+		(map->count - pos) * sizeof(struct winterfs_mem_extent));
+	map->ext[pos].block = block;
+	map->ext[pos].len = len;
+	map->ext[pos].start = start;
+	map->ext[pos].unwritten = unwritten;
+	map->count++;
+
+	err = winterfs_extent_update(inode, map, pos, pos + 1, map->count - 1);
+	if (err) {
+		// the caller frees the blocks, so they must not stay mapped
+		map->count--;
+		memmove(&map->ext[pos], &map->ext[pos + 1],
+			(map->count - pos) * sizeof(struct winterfs_mem_extent));
+		winterfs_extent_update(inode, map, pos, pos, map->count + 1);
+	}
+	winterfs_extent_put_spares(inode->i_sb, map);
+
+out:
+	up_write(&map->lock);
+	return err;
+}
+
+// index of the first extent ending after block, count if there is none
+static u32 winterfs_extent_first(struct winterfs_extent_map *map, u32 block)
+{
+	u32 i = winterfs_extent_search(map, block);
+
+	if (i == map->count) {
+		return 0;
+	}
+	if (block >= map->ext[i].block + map->ext[i].len) {
+		i++;
+	}
+
+	return i;
+}
+
+// cut extent i in two at file block 'at', the map must have room for one more
+static void winterfs_extent_split(struct winterfs_extent_map *map, u32 i, u32 at)
+{
+	struct winterfs_mem_extent *ext = &map->ext[i];
+
+	memmove(ext + 1, ext, (map->count - i) * sizeof(struct winterfs_mem_extent));
+	map->count++;
+	ext->len = at - ext->block;
+	ext[1].block = at;
+	ext[1].start += ext->len;
+	ext[1].len -= ext->len;
+}
+
+// join neighbouring extents in [from, to) that continue each other on disk
+static void winterfs_extent_merge(struct winterfs_extent_map *map, u32 from, u32 to)
+{
+	u32 i;
+	u32 out = from;
+
+	if (from >= to) {
+		return;
+	}
+
+	for (i = from + 1; i < to; i++) {
+		struct winterfs_mem_extent *prev = &map->ext[out];
+		struct winterfs_mem_extent *ext = &map->ext[i];
+
+		if (prev->block + prev->len == ext->block
+			&& prev->start + prev->len == ext->start
+			&& prev->unwritten == ext->unwritten
+			&& (u64)prev->len + ext->len <= WINTERFS_EXTENT_MAX_LEN) {
+			prev->len += ext->len;
+		} else {
+			map->ext[++out] = *ext;
+		}
+	}
+	memmove(&map->ext[out + 1], &map->ext[to],
+		(map->count - to) * sizeof(struct winterfs_mem_extent));
+	map->count -= to - out - 1;
+}
+
+/*
+ * Unmap and free file blocks [block, end). The blocks are only freed once
+ * the tree has been rewritten without them, so a tree that couldn't be
+ * leaves them allocated instead of handing them out again while the old
+ * nodes on disk still map them.
+ */
+int winterfs_extent_remove(struct inode *inode, struct winterfs_extent_map *map,
+	u32 block, u32 end)
+{
+	struct super_block *sb = inode->i_sb;
+	struct winterfs_mem_extent *gone = NULL;
+	struct winterfs_mem_extent *ext;
+	u32 num_gone = 0;
+	u32 old_count;
+	u32 first;
+	u32 lo;
+	u32 i;
+	int err = 0;
+
+	down_write(&map->lock);
+
+	old_count = map->count;
+	first = winterfs_extent_first(map, block);
+	for (i = first; i < map->count && map->ext[i].block < end; i++) {
+	}
+	if (i == first) {
+		goto out;
+	}
+	// one range to free for every extent the removal touches
+	gone = kvmalloc_array(i - first, sizeof(struct winterfs_mem_extent), GFP_NOFS);
+	if (!gone) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	if (map->ext[first].block < block && map->ext[first].block + map->ext[first].len > end) {
+		err = winterfs_extent_prepare(inode, map, first, 1, 2);
+		if (err) {
+			goto out;
+		}
+		winterfs_extent_split(map, first, end);
+	}
+	lo = first;
+
+	i = first;
+	if (i < map->count && map->ext[i].block < block) {
+		ext = &map->ext[i];
+		gone[num_gone].start = ext->start + (block - ext->block);
+		gone[num_gone++].len = ext->block + ext->len - block;
+		ext->len = block - ext->block;
+		i++;
+		first = i;
+	}
+	for (; i < map->count && map->ext[i].block + map->ext[i].len <= end; i++) {
+		gone[num_gone++] = map->ext[i];
+	}
+	if (i < map->count && map->ext[i].block < end) {
+		ext = &map->ext[i];
+		gone[num_gone].start = ext->start;
+		gone[num_gone++].len = end - ext->block;
+		ext->start += end - ext->block;
+		ext->len -= end - ext->block;
+		ext->block = end;
+	}
+	memmove(&map->ext[first], &map->ext[i],
+		(map->count - i) * sizeof(struct winterfs_mem_extent));
+	map->count -= i - first;
+	map->hint = 0;
+
+	// the extents left changed are the one cut at block and the one cut
+	// at end, and the tree only shrinks unless a hole split one of them
+	err = winterfs_extent_update(inode, map, lo, min_t(u32, lo + 2, map->count), old_count);
+	winterfs_extent_put_spares(sb, map);
+	if (err) {
+		printk(KERN_ERR "Error rewriting extent tree of inode %lu, leaking removed blocks\n",
+			inode->i_ino);
+		goto out;
+	}
+	for (i = 0; i < num_gone; i++) {
+		winterfs_free_data_blocks(sb, gone[i].start, gone[i].len);
+	}
+out:
+	up_write(&map->lock);
+	kvfree(gone);
+	return err;
+}
+
+/*
+ * Clear the unwritten flag of file blocks [block, end) once their data is
+ * on disk, splitting off the parts of extents outside the range and
+ * merging the rest with written neighbours.
+ */
+int winterfs_extent_mark_written(struct inode *inode, struct winterfs_extent_map *map,
+	u32 block, u32 end)
+{
+	u32 old_count;
+	u32 old_end;
+	u32 first;
+	u32 lo;
+	u32 i;
+	int err;
+
+	down_write(&map->lock);
+
+	// only the extents at either edge of the range can be split, and the
+	// merge reaches one past the last extent changed
+	old_count = map->count;
+	first = winterfs_extent_first(map, block);
+	lo = first ? first - 1 : 0;
+	old_end = min_t(u32, winterfs_extent_first(map, end) + 2, map->count);
+	err = winterfs_extent_prepare(inode, map, lo, old_end - lo, old_end - lo + 2);
+	if (err) {
+		goto out;
+	}
+
+	for (i = first; i < map->count && map->ext[i].block < end; i++) {
+		struct winterfs_mem_extent *ext = &map->ext[i];
+
+		if (!ext->unwritten) {
+			continue;
+		}
+		if (ext->block < block) {
+			winterfs_extent_split(map, i, block);
+			continue;
+		}
+		if (ext->block + ext->len > end) {
+			winterfs_extent_split(map, i, end);
+		}
+		ext->unwritten = false;
+	}
+
+	winterfs_extent_merge(map, lo, min_t(u32, i + 1, map->count));
+	map->hint = 0;
+
+	// the same range as prepared for, so no more nodes are split than taken
+	err = winterfs_extent_update(inode, map, lo, old_end + map->count - old_count,
+		old_count);
+	winterfs_extent_put_spares(inode->i_sb, map);
+out:
+	up_write(&map->lock);
+	return err;
+}
+
+/*
+ * Move every extent from file block 'block' on down by shift blocks, for
+ * collapsing a range. [block - shift, block) must already be unmapped.
+ */
+int winterfs_extent_shift(struct inode *inode, struct winterfs_extent_map *map,
+	u32 block, u32 shift)
+{
+	u32 old_count;
+	u32 first;
+	u32 i;
+	int err;
+
+	down_write(&map->lock);
+
+	old_count = map->count;
+	first = winterfs_extent_first(map, block);
+	for (i = first; i < map->count; i++) {
+		map->ext[i].block -= shift;
+	}
+
+	first = first ? first - 1 : 0;
+	winterfs_extent_merge(map, first, min_t(u32, first + 2, map->count));
+	map->hint = 0;
+
+	// every extent after the first one moved, the tree only shrinks
+	err = winterfs_extent_update(inode, map, first, map->count, old_count);
+
+	up_write(&map->lock);
+	return err;
+}
+
+// free every data block and tree node of the file
+void winterfs_extent_release_all(struct inode *inode, struct winterfs_extent_map *map)
+{
+	struct super_block *sb = inode->i_sb;
+	u16 level;
+	u32 i;
+
+	down_write(&map->lock);
+
+	for (i = 0; i < map->count; i++) {
+		winterfs_free_data_blocks(sb, map->ext[i].start, map->ext[i].len);
+	}
+	for (level = 0; level < WINTERFS_EXTENT_MAX_DEPTH; level++) {
+		while (map->num_nodes[level]) {
+			winterfs_extent_forget_node(sb,
+				map->nodes[level][--map->num_nodes[level]]);
+		}
+	}
+	map->count = 0;
+	map->depth = 0;
+	map->hint = 0;
+
+	up_write(&map->lock);
+}
@@ -1,43 +1,458 @@
-#include <linux/buffer_head.h>
-#include <linux/mpage.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/falloc.h>
 #include <linux/fs.h>
+#include <linux/iomap.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/uaccess.h>
 #include "winterfs.h"
+#include "winterfs_file.h"
 #include "winterfs_ino.h"
+#include "winterfs_sb.h"
+#include "winterfs_trace.h"
 
-static int winterfs_get_block(struct inode *inode, sector_t iblock,
-        struct buffer_head *bh, int create)
+// drop the reservations of file blocks [block, end), returning how many there were
+static u32 winterfs_delalloc_release(struct inode *inode, u32 block, u32 end)
 {
+	u32 released = 0;
+	unsigned long index;
+	void *entry;
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+
+	xa_for_each_range(&wfs_info->delalloc, index, entry, block, end - 1) {
+		xa_erase(&wfs_info->delalloc, index);
+		released++;
+	}
+	winterfs_unreserve_data_blocks(inode->i_sb, released);
+	wfs_info->reserved_blocks -= released;
+
+	return released;
+}
+
+// reserve every block of the hole [block, block + count) that is not already
+static int winterfs_delalloc_reserve(struct inode *inode, u32 block, u32 count)
+{
+	int err;
 	u32 i;
-	u32 num_blocks_to_allocate;
+	u32 need = count;
+	unsigned long index;
+	void *entry;
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+
+	xa_for_each_range(&wfs_info->delalloc, index, entry, block, block + count - 1) {
+		need--;
+	}
+	if (!need) {
+		return 0;
+	}
+
+	err = winterfs_reserve_data_blocks(inode->i_sb, need);
+	if (err) {
+		return err;
+	}
+	for (i = 0; i < count && need; i++) {
+		err = xa_insert(&wfs_info->delalloc, block + i, xa_mk_value(1), GFP_NOFS);
+		if (err == -EBUSY) {
+			err = 0;
+			continue;
+		}
+		if (err) {
+			break;
+		}
+		wfs_info->reserved_blocks++;
+		need--;
+	}
+	winterfs_unreserve_data_blocks(inode->i_sb, need);
+
+	return err;
+}
+
+/*
+ * Split a hole at its first block into reserved and unreserved parts.
+ * Returns the length of the leading part, and its type in *type.
+ */
+static u32 winterfs_delalloc_extent(struct inode *inode, u32 block, u32 count,
+	u16 *type)
+{
+	u32 i;
+	unsigned long index = block;
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+
+	if (!xa_load(&wfs_info->delalloc, block)) {
+		*type = IOMAP_HOLE;
+		if (xa_find(&wfs_info->delalloc, &index, block + count - 1, XA_PRESENT)) {
+			return index - block;
+		}
+		return count;
+	}
+
+	*type = IOMAP_DELALLOC;
+	for (i = 1; i < count && xa_load(&wfs_info->delalloc, block + i); i++);
+
+	return i;
+}
+
+static int __winterfs_iomap_begin(struct inode *inode, loff_t offset, loff_t length,
+        unsigned flags, struct iomap *iomap)
+{
+	int err = 0;
+	u32 count;
 	u32 mapped_block;
-	u32 inode_num_blocks = winterfs_inode_num_blocks(inode);
-	struct super_block *sb = inode->i_sb;
-	struct winterfs_inode_info *wfs_info = inode->i_private;
-	if (!wfs_info) {
-		printk(KERN_ERR "Attempt to read data from improperly loaded inode\n");
-		return -EINVAL;
+	bool unwritten;
+	u32 block = offset >> inode->i_blkbits;
+	u32 last = min_t(loff_t, (offset + length - 1) >> inode->i_blkbits, U32_MAX - 1);
+	u32 max_blocks = last - block + 1;
+	bool reserve = (flags & IOMAP_WRITE) && !(flags & IOMAP_ZERO);
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+
+	iomap->bdev = inode->i_sb->s_bdev;
+	iomap->offset = (loff_t)block << inode->i_blkbits;
+	iomap->addr = IOMAP_NULL_ADDR;
+	iomap->flags = 0;
+
+	// small files are served from the inode, which iget already read.
+	// Writes that would not fit moved the data out to blocks beforehand
+	if (winterfs_inode_inline(inode)) {
+		u32 size = winterfs_inline_size(inode->i_sb);
+
+		if (offset < size) {
+			iomap->type = IOMAP_INLINE;
+			iomap->offset = 0;
+			iomap->length = size;
+			iomap->inline_data = wfs_info->inline_data;
+		} else {
+			iomap->type = IOMAP_HOLE;
+			iomap->offset = offset;
+			iomap->length = length;
+		}
+		return 0;
 	}
-	if (iblock >= inode_num_blocks) {
-		num_blocks_to_allocate = (iblock - inode_num_blocks)+1;
-		for (i = inode_num_blocks; i <= iblock; i++) {
-			if (i < WINTERFS_INODE_DIRECT_BLOCKS) {
-				wfs_info->direct_blocks[i] = winterfs_allocate_data_block(sb);
-			} else {
-				//TODO
-				return -ENOMEM;
-			}
-			inode->i_size += WINTERFS_BLOCK_SIZE;
+
+	// nothing is mapped or reserved past the end of the file, but
+	// preallocated extents may be
+	if (!reserve && !winterfs_has_extents(inode->i_sb)
+			&& block >= winterfs_inode_num_blocks(inode)) {
+		iomap->type = IOMAP_HOLE;
+		iomap->length = (u64)max_blocks << inode->i_blkbits;
+		return 0;
+	}
+
+	// keep writeback from mapping the range between the lookup and the
+	// reservation below
+	if (reserve) {
+		mutex_lock(&wfs_info->alloc_lock);
+	}
+
+	// report as much of the request as is contiguous on disk, or as far
+	// as the hole goes
+	count = max_blocks;
+	mapped_block = winterfs_get_inode_blocks(inode, block, &count, &unwritten);
+	if (!count) {
+		err = -EIO;
+		goto out;
+	}
+	if (mapped_block) {
+		// preallocated blocks read as zeroes until written
+		iomap->type = unwritten ? IOMAP_UNWRITTEN : IOMAP_MAPPED;
+		iomap->addr = (u64)mapped_block << inode->i_blkbits;
+		iomap->length = (u64)count << inode->i_blkbits;
+		goto out;
+	}
+
+	if (!reserve) {
+		// holes read as zeroes, but written data may be waiting on them
+		count = winterfs_delalloc_extent(inode, block, count, &iomap->type);
+		iomap->length = (u64)count << inode->i_blkbits;
+		goto out;
+	}
+
+	// only reserve space here. writeback picks the blocks once it can see
+	// how much of the file is dirty, so small appends still end up in one
+	// run and files deleted before writeback never touch the bitsets
+	err = winterfs_delalloc_reserve(inode, block, count);
+	if (err) {
+		goto out;
+	}
+	iomap->type = IOMAP_DELALLOC;
+	iomap->length = (u64)count << inode->i_blkbits;
+
+out:
+	if (reserve) {
+		mutex_unlock(&wfs_info->alloc_lock);
+	}
+	return err;
+}
+
+static int winterfs_iomap_begin(struct inode *inode, loff_t offset, loff_t length,
+        unsigned flags, struct iomap *iomap, struct iomap *srcmap)
+{
+	int err;
+	u64 start = trace_winterfs_iomap_begin_enabled() ? ktime_get_ns() : 0;
+
+	err = __winterfs_iomap_begin(inode, offset, length, flags, iomap);
+	trace_winterfs_iomap_begin(inode, offset, length, flags, iomap->type, iomap->addr,
+		iomap->length, err, start);
+
+	return err;
+}
+
+static int winterfs_iomap_end(struct inode *inode, loff_t offset, loff_t length,
+        ssize_t written, unsigned flags, struct iomap *iomap)
+{
+	u32 block;
+	u32 end = DIV_ROUND_UP(offset + length, i_blocksize(inode));
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+
+	// the new size has to reach the disk on fdatasync as well
+	if (iomap->flags & IOMAP_F_SIZE_CHANGED) {
+		mark_inode_dirty(inode);
+	}
+	if (iomap->type != IOMAP_DELALLOC || written >= length) {
+		return 0;
+	}
+
+	// a short write leaves blocks reserved that no data was written to,
+	// unless earlier writes already dirtied them
+	mutex_lock(&wfs_info->alloc_lock);
+	block = DIV_ROUND_UP(offset + max_t(ssize_t, written, 0), i_blocksize(inode));
+	for (; block < end; block++) {
+		loff_t pos = (loff_t)block << inode->i_blkbits;
+
+		if (!filemap_range_needs_writeback(inode->i_mapping, pos,
+				pos + i_blocksize(inode) - 1)) {
+			winterfs_delalloc_release(inode, block, block + 1);
+		}
+	}
+	mutex_unlock(&wfs_info->alloc_lock);
+
+	return 0;
+}
+
+const struct iomap_ops winterfs_iomap_ops = {
+	.iomap_begin		= winterfs_iomap_begin,
+	.iomap_end		= winterfs_iomap_end,
+};
+
+/*
+ * Give a hole waiting for writeback its blocks. Every dirty reserved block
+ * following 'block' is allocated along with it, not just the folio being
+ * written, so a file appended to in small writes is laid out in as few
+ * runs as the free space allows.
+ */
+static int winterfs_delalloc_alloc(struct inode *inode, u32 block)
+{
+	int err = 0;
+	u32 run;
+	u32 count;
+	u32 mapped_block;
+	u32 size_blocks = winterfs_inode_num_blocks(inode);
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+
+	mutex_lock(&wfs_info->alloc_lock);
+
+	count = block < size_blocks ? size_blocks - block : 1;
+	if (winterfs_get_inode_blocks(inode, block, &count, NULL) || !count) {
+		// mapped in the meantime, or unmappable
+		mutex_unlock(&wfs_info->alloc_lock);
+		return count ? 0 : -EIO;
+	}
+
+	for (run = 1; run < count; run++) {
+		loff_t pos = (loff_t)(block + run) << inode->i_blkbits;
+
+		if (!xa_load(&wfs_info->delalloc, block + run) ||
+				!filemap_range_needs_writeback(inode->i_mapping, pos,
+					pos + i_blocksize(inode) - 1)) {
+			break;
+		}
+	}
+
+	while (run) {
+		count = run;
+		err = winterfs_alloc_inode_blocks(inode, block, &count, &mapped_block,
+			false);
+		if (err) {
+			break;
 		}
-		bh->b_size = num_blocks_to_allocate * WINTERFS_BLOCK_SIZE;
-		set_buffer_new(bh);
-		set_buffer_boundary(bh);
+		winterfs_delalloc_release(inode, block, block + count);
+		block += count;
+		run -= count;
 	}
 
-	mapped_block = winterfs_get_inode_block_idx(inode, iblock);
-	map_bh(bh, inode->i_sb, mapped_block);
+	mutex_unlock(&wfs_info->alloc_lock);
 	mark_inode_dirty(inode);
 
-	return 0;
+	return err;
+}
+
+// unmap and unreserve everything past the end of the file
+static int winterfs_truncate_blocks(struct inode *inode, loff_t old_size)
+{
+	int err;
+	u32 from = winterfs_inode_num_blocks(inode);
+	u32 end = DIV_ROUND_UP(old_size, i_blocksize(inode));
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+
+	// extents preallocated past the old size go as well
+	if (winterfs_has_extents(inode->i_sb)) {
+		end = U32_MAX;
+	}
+
+	mutex_lock(&wfs_info->alloc_lock);
+	winterfs_delalloc_release(inode, from, U32_MAX);
+	err = winterfs_truncate_inode_blocks(inode, from, end);
+	mutex_unlock(&wfs_info->alloc_lock);
+
+	return err;
+}
+
+static int winterfs_map_blocks(struct iomap_writepage_ctx *wpc,
+        struct inode *inode, loff_t offset)
+{
+	int err;
+	u32 count = 1;
+
+	// the previous mapping usually covers the next dirty folio as well
+	if (offset >= wpc->iomap.offset &&
+			offset < wpc->iomap.offset + wpc->iomap.length) {
+		return 0;
+	}
+
+	if (!winterfs_get_inode_blocks(inode, offset >> inode->i_blkbits, &count, NULL)) {
+		err = winterfs_delalloc_alloc(inode, offset >> inode->i_blkbits);
+		if (err) {
+			return err;
+		}
+	}
+
+	return winterfs_iomap_begin(inode, offset, i_size_read(inode) - offset, 0,
+		&wpc->iomap, NULL);
+}
+
+// convert the unwritten blocks an ioend wrote to, then finish its folios
+static void winterfs_end_ioend(struct iomap_ioend *ioend)
+{
+	struct inode *inode = ioend->io_inode;
+	int err = blk_status_to_errno(ioend->io_bio->bi_status);
+
+	if (!err) {
+		err = winterfs_convert_inode_blocks(inode,
+			ioend->io_offset >> inode->i_blkbits,
+			DIV_ROUND_UP(ioend->io_offset + ioend->io_size, i_blocksize(inode)));
+	}
+	if (err) {
+		// the blocks stay unwritten and keep reading as zeroes
+		mapping_set_error(inode->i_mapping, err);
+	}
+	iomap_finish_ioends(ioend, err);
+}
+
+void winterfs_end_io_work(struct work_struct *work)
+{
+	unsigned long flags;
+	struct iomap_ioend *ioend;
+	struct list_head ioends;
+	struct winterfs_inode_info *wfs_info =
+		container_of(work, struct winterfs_inode_info, end_io_work);
+
+	spin_lock_irqsave(&wfs_info->end_io_lock, flags);
+	list_replace_init(&wfs_info->end_io_list, &ioends);
+	spin_unlock_irqrestore(&wfs_info->end_io_lock, flags);
+
+	// neighbouring ioends are converted together, keeping the extents merged
+	iomap_sort_ioends(&ioends);
+	while ((ioend = list_first_entry_or_null(&ioends, struct iomap_ioend, io_list))) {
+		list_del_init(&ioend->io_list);
+		iomap_ioend_try_merge(ioend, &ioends);
+		winterfs_end_ioend(ioend);
+	}
+}
+
+// updating the extent tree can sleep, so it is left to the end_io workqueue
+static void winterfs_end_bio(struct bio *bio)
+{
+	unsigned long flags;
+	struct iomap_ioend *ioend = bio->bi_private;
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(ioend->io_inode);
+	struct winterfs_sb_info *sbi = ioend->io_inode->i_sb->s_fs_info;
+
+	spin_lock_irqsave(&wfs_info->end_io_lock, flags);
+	if (list_empty(&wfs_info->end_io_list)) {
+		queue_work(sbi->end_io_wq, &wfs_info->end_io_work);
+	}
+	list_add_tail(&ioend->io_list, &wfs_info->end_io_list);
+	spin_unlock_irqrestore(&wfs_info->end_io_lock, flags);
+}
+
+static int winterfs_prepare_ioend(struct iomap_ioend *ioend, int status)
+{
+	if (!status && ioend->io_type == IOMAP_UNWRITTEN) {
+		ioend->io_bio->bi_end_io = winterfs_end_bio;
+	}
+
+	return status;
+}
+
+static const struct iomap_writeback_ops winterfs_writeback_ops = {
+	.map_blocks		= winterfs_map_blocks,
+	.prepare_ioend		= winterfs_prepare_ioend,
+};
+
+/*
+ * Move the data of an inline file out to the page cache, reserved for
+ * delayed allocation like any other buffered write, so the file can grow
+ * past the space in its inode. Called with the inode locked, which every
+ * writer of inline data holds.
+ */
+static int winterfs_inline_convert(struct inode *inode)
+{
+	int err = 0;
+	u32 count;
+	void *addr;
+	struct folio *folio;
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+
+	if (!winterfs_inode_inline(inode)) {
+		return 0;
+	}
+
+	// holding the folio lock keeps reads from filling it meanwhile
+	folio = __filemap_get_folio(inode->i_mapping, 0, FGP_LOCK | FGP_CREAT,
+		mapping_gfp_mask(inode->i_mapping));
+	if (!folio) {
+		return -ENOMEM;
+	}
+	// an uptodate folio already holds everything written to the inode
+	if (!folio_test_uptodate(folio)) {
+		folio_zero_range(folio, 0, folio_size(folio));
+		addr = kmap_local_folio(folio, 0);
+		memcpy(addr, wfs_info->inline_data, i_size_read(inode));
+		kunmap_local(addr);
+		flush_dcache_folio(folio);
+		folio_mark_uptodate(folio);
+	}
+
+	count = DIV_ROUND_UP(i_size_read(inode), i_blocksize(inode));
+	mutex_lock(&wfs_info->alloc_lock);
+	if (count) {
+		err = winterfs_delalloc_reserve(inode, 0, count);
+	}
+	if (!err) {
+		wfs_info->flags &= ~WINTERFS_INODE_INLINE_FL;
+	}
+	mutex_unlock(&wfs_info->alloc_lock);
+
+	if (!err && count) {
+		folio_mark_dirty(folio);
+	}
+	folio_unlock(folio);
+	folio_put(folio);
+	if (!err) {
+		mark_inode_dirty(inode);
+	}
+
+	return err;
 }
 
 static int winterfs_getattr(struct user_namespace *mnt_userns, const struct path *path,
@@ -56,61 +471,469 @@ static int winterfs_setattr(struct user_namespace *mnt_userns, struct dentry *de
 	struct inode *inode = d_inode(dentry);
 
 	err = setattr_prepare(&init_user_ns, dentry, iattr);
+	if (err) {
+		return err;
+	}
 
 	if (iattr->ia_valid & ATTR_SIZE && iattr->ia_size != inode->i_size) {
-		err = block_truncate_page(inode->i_mapping, iattr->ia_size, winterfs_get_block);
+		loff_t old_size = inode->i_size;
+
+		if (iattr->ia_size > winterfs_inline_size(inode->i_sb)) {
+			err = winterfs_inline_convert(inode);
+			if (err) {
+				return err;
+			}
+		}
+
+		err = iomap_truncate_page(inode, iattr->ia_size, NULL, &winterfs_iomap_ops);
 		if (err) {
 			return err;
 		}
 
 		truncate_setsize(inode, iattr->ia_size);
+		if (iattr->ia_size < old_size) {
+			err = winterfs_truncate_blocks(inode, old_size);
+		}
 		inode->i_mtime = inode->i_ctime = current_time(inode);
-	        mark_inode_dirty(inode);
 	}
 
+	// mode, owner and times, the size is already done
+	setattr_copy(&init_user_ns, inode, iattr);
+	mark_inode_dirty(inode);
+
+	return err;
+}
+
+/*
+ * Give every hole in file blocks [block, end) unwritten blocks, placed
+ * after the preceding data so a file preallocated in one call comes out
+ * as a single run when the free space allows. Reservations held by dirty
+ * pages in the range are handed over to the new blocks.
+ */
+static int winterfs_prealloc(struct inode *inode, u32 block, u32 end)
+{
+	int err = 0;
+	u32 count;
+	u32 mapped_block;
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+
+	mutex_lock(&wfs_info->alloc_lock);
+
+	while (block < end) {
+		count = end - block;
+		if (winterfs_get_inode_blocks(inode, block, &count, NULL)) {
+			block += count;
+			continue;
+		}
+		if (!count) {
+			err = -EIO;
+			break;
+		}
+
+		// blocks reserved for delayed allocation must stay available
+		err = winterfs_reserve_data_blocks(inode->i_sb, count);
+		if (err) {
+			break;
+		}
+		winterfs_unreserve_data_blocks(inode->i_sb, count);
+
+		err = winterfs_alloc_inode_blocks(inode, block, &count, &mapped_block, true);
+		if (err) {
+			break;
+		}
+		winterfs_delalloc_release(inode, block, block + count);
+		block += count;
+	}
+
+	mutex_unlock(&wfs_info->alloc_lock);
+	mark_inode_dirty(inode);
+
+	return err;
+}
+
+/*
+ * Free the blocks fully inside [offset, offset + len) without writing
+ * anything to them, and zero what is left of the partial blocks at
+ * either end.
+ */
+static int winterfs_punch_hole(struct inode *inode, loff_t offset, loff_t len)
+{
+	int err;
+	loff_t end = offset + len;
+	u32 first = DIV_ROUND_UP(offset, i_blocksize(inode));
+	u32 last = min_t(loff_t, end >> inode->i_blkbits, U32_MAX);
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+
+	truncate_pagecache_range(inode, offset, end - 1);
+
+	if (first < last) {
+		mutex_lock(&wfs_info->alloc_lock);
+		winterfs_delalloc_release(inode, first, last);
+		err = winterfs_truncate_inode_blocks(inode, first, last);
+		mutex_unlock(&wfs_info->alloc_lock);
+		mark_inode_dirty(inode);
+		if (err) {
+			return err;
+		}
+	}
+
+	// the blocks freed above are holes now and skipped
+	if (offset >= i_size_read(inode)) {
+		return 0;
+	}
+	len = min_t(loff_t, end, i_size_read(inode)) - offset;
+
+	return iomap_zero_range(inode, offset, len, NULL, &winterfs_iomap_ops);
+}
+
+// remove [offset, offset + len) and move the rest of the file down over it
+static int winterfs_collapse_range(struct inode *inode, loff_t offset, loff_t len)
+{
+	int err;
+	u32 first = offset >> inode->i_blkbits;
+	u32 last = (offset + len) >> inode->i_blkbits;
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+
+	if ((offset | len) & (i_blocksize(inode) - 1)) {
+		return -EINVAL;
+	}
+	if (offset + len >= i_size_read(inode)) {
+		return -EINVAL;
+	}
+
+	// the page cache past offset is about to shift, so get it on disk
+	// and converted first
+	err = filemap_write_and_wait_range(inode->i_mapping, offset, LLONG_MAX);
+	if (err) {
+		return err;
+	}
+	truncate_pagecache(inode, offset);
+
+	mutex_lock(&wfs_info->alloc_lock);
+	winterfs_delalloc_release(inode, first, U32_MAX);
+	err = winterfs_truncate_inode_blocks(inode, first, last);
+	if (!err) {
+		err = winterfs_shift_inode_blocks(inode, last, last - first);
+	}
+	mutex_unlock(&wfs_info->alloc_lock);
+	if (err) {
+		return err;
+	}
+
+	i_size_write(inode, i_size_read(inode) - len);
+	mark_inode_dirty(inode);
+
 	return 0;
 }
 
+#define WINTERFS_FALLOC_MODES	(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE \
+	| FALLOC_FL_ZERO_RANGE | FALLOC_FL_COLLAPSE_RANGE)
+
+static long winterfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+	int err;
+	struct inode *inode = file_inode(file);
+	struct super_block *sb = inode->i_sb;
+	loff_t end = offset + len;
+
+	if (mode & ~WINTERFS_FALLOC_MODES) {
+		return -EOPNOTSUPP;
+	}
+	// revision 1 has nowhere to record blocks that must read as zeroes,
+	// and shifting its block pointers would mean rewriting them all
+	if (!(mode & FALLOC_FL_PUNCH_HOLE)
+			&& !winterfs_has_feature(sb, WINTERFS_FEATURE_UNWRITTEN)) {
+		return -EOPNOTSUPP;
+	}
+	if (!S_ISREG(inode->i_mode)) {
+		return -ENODEV;
+	}
+
+	inode_lock(inode);
+	filemap_invalidate_lock(inode->i_mapping);
+
+	if (!(mode & (FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_COLLAPSE_RANGE))
+			&& end > i_size_read(inode)) {
+		err = inode_newsize_ok(inode, end);
+		if (err) {
+			goto out;
+		}
+	}
+
+	err = file_modified(file);
+	if (err) {
+		goto out;
+	}
+
+	// every mode works on blocks
+	err = winterfs_inline_convert(inode);
+	if (err) {
+		goto out;
+	}
+
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		err = winterfs_punch_hole(inode, offset, len);
+		goto out;
+	}
+	if (mode & FALLOC_FL_COLLAPSE_RANGE) {
+		err = winterfs_collapse_range(inode, offset, len);
+		goto out;
+	}
+	if (mode & FALLOC_FL_ZERO_RANGE) {
+		err = winterfs_punch_hole(inode, offset, len);
+		if (err) {
+			goto out;
+		}
+	}
+
+	err = winterfs_prealloc(inode, offset >> inode->i_blkbits,
+		DIV_ROUND_UP(end, i_blocksize(inode)));
+	if (err) {
+		goto out;
+	}
+
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+		i_size_write(inode, end);
+		mark_inode_dirty(inode);
+	}
+
+out:
+	filemap_invalidate_unlock(inode->i_mapping);
+	inode_unlock(inode);
+	return err;
+}
+
+static int winterfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+	u64 start, u64 len)
+{
+	int err;
+
+	inode_lock_shared(inode);
+	err = iomap_fiemap(inode, fieinfo, start, len, &winterfs_iomap_ops);
+	inode_unlock_shared(inode);
+
+	return err;
+}
+
+static loff_t winterfs_file_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct inode *inode = file->f_mapping->host;
+
+	switch (whence) {
+	case SEEK_HOLE:
+		inode_lock_shared(inode);
+		offset = iomap_seek_hole(inode, offset, &winterfs_iomap_ops);
+		inode_unlock_shared(inode);
+		break;
+	case SEEK_DATA:
+		inode_lock_shared(inode);
+		offset = iomap_seek_data(inode, offset, &winterfs_iomap_ops);
+		inode_unlock_shared(inode);
+		break;
+	default:
+		return generic_file_llseek(file, offset, whence);
+	}
+
+	if (offset < 0) {
+		return offset;
+	}
+	return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
+
 static int winterfs_read_folio(struct file *file, struct folio *folio)
 {
-        return mpage_read_folio(folio, winterfs_get_block);
+	return iomap_read_folio(folio, &winterfs_iomap_ops);
 }
 
 static void winterfs_read_ahead(struct readahead_control *rac)
 {
-	mpage_readahead(rac, winterfs_get_block);
+	iomap_readahead(rac, &winterfs_iomap_ops);
+}
+
+static int winterfs_write_pages(struct address_space *mapping,
+        struct writeback_control *wbc)
+{
+	struct iomap_writepage_ctx wpc = { };
+
+	// iomap builds one bio per contiguous on-disk run of dirty folios
+	return iomap_writepages(mapping, wbc, &wpc, &winterfs_writeback_ops);
+}
+
+static ssize_t winterfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	ssize_t ret;
+	struct inode *inode = file_inode(iocb->ki_filp);
+
+	inode_lock(inode);
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0) {
+		goto out_unlock;
+	}
+	ret = file_remove_privs(iocb->ki_filp);
+	if (ret) {
+		goto out_unlock;
+	}
+	ret = file_update_time(iocb->ki_filp);
+	if (ret) {
+		goto out_unlock;
+	}
+
+	if (iocb->ki_pos + iov_iter_count(from) > winterfs_inline_size(inode->i_sb)) {
+		ret = winterfs_inline_convert(inode);
+		if (ret) {
+			goto out_unlock;
+		}
+	}
+
+	ret = iomap_file_buffered_write(iocb, from, &winterfs_iomap_ops);
+	if (ret > 0) {
+		iocb->ki_pos += ret;
+	}
+
+out_unlock:
+	inode_unlock(inode);
+	if (ret > 0) {
+		ret = generic_write_sync(iocb, ret);
+	}
+	return ret;
+}
+
+/*
+ * Blocks of delayed writes are only allocated by the writeback started
+ * here. The extent & indirect blocks mapping them are kept on the inode's
+ * list of metadata buffers, and the rest of the mapping lives in the inode
+ * itself, which a datasync leaves alone unless the size or the mapping
+ * changed. As with ext2, the bitsets are left to writeback, and rebuilt
+ * by fsck if the volume isn't unmounted cleanly.
+ */
+static int winterfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	int err;
+	struct inode *inode = file->f_mapping->host;
+	struct super_block *sb = inode->i_sb;
+
+	err = file_write_and_wait_range(file, start, end);
+	if (err) {
+		return err;
+	}
+	// preallocated blocks are only marked written once the I/O ended
+	flush_work(&WINTERFS_I(inode)->end_io_work);
+
+	err = sync_mapping_buffers(inode->i_mapping);
+	if (err) {
+		return err;
+	}
+	if ((inode->i_state & I_DIRTY_ALL)
+			&& (!datasync || (inode->i_state & I_DIRTY_DATASYNC))) {
+		err = sync_inode_metadata(inode, 1);
+		if (err) {
+			return err;
+		}
+	}
+
+	return blkdev_issue_flush(sb->s_bdev);
 }
 
-static int winterfs_write_page(struct page *page, struct writeback_control *wbc)
+static vm_fault_t winterfs_page_mkwrite(struct vm_fault *vmf)
 {
-	return block_write_full_page(page, winterfs_get_block, wbc);
+	int err;
+	vm_fault_t ret;
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(vmf->vma->vm_file);
+	// dirty folios of an inline file would have nowhere to be written.
+	// Writers hold the inode lock across a fault on their own buffer,
+	// so rather than wait for it under mmap_lock, fault again later
+	if (winterfs_inode_inline(inode)) {
+		if (!inode_trylock(inode)) {
+			ret = VM_FAULT_NOPAGE;
+			goto out;
+		}
+		err = winterfs_inline_convert(inode);
+		inode_unlock(inode);
+		if (err) {
+			ret = vmf_error(err);
+			goto out;
+		}
+	}
+	// fallocate holds this while it punches or shifts blocks
+	filemap_invalidate_lock_shared(inode->i_mapping);
+	ret = iomap_page_mkwrite(vmf, &winterfs_iomap_ops);
+	filemap_invalidate_unlock_shared(inode->i_mapping);
+out:
+	sb_end_pagefault(inode->i_sb);
+
+	return ret;
 }
 
-static int winterfs_write_begin(struct file *file, struct address_space *mapping,
-        loff_t pos, unsigned len, struct page **pagep, void **fsdata)
+static const struct vm_operations_struct winterfs_file_vm_ops = {
+	.fault		= filemap_fault,
+	.map_pages	= filemap_map_pages,
+	.page_mkwrite	= winterfs_page_mkwrite,
+};
+
+static int winterfs_file_mmap(struct file *file, struct vm_area_struct *vma)
 {
-        return block_write_begin(mapping, pos, len, pagep, winterfs_get_block);
+	file_accessed(file);
+	vma->vm_ops = &winterfs_file_vm_ops;
+
+	return 0;
 }
 
 const struct inode_operations winterfs_file_inode_operations = {
 	.getattr        = winterfs_getattr,
-        .setattr        = winterfs_setattr
+        .setattr        = winterfs_setattr,
+	.fiemap		= winterfs_fiemap
 };
 
+long winterfs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	int err;
+	struct fstrim_range range;
+	struct super_block *sb = file_inode(file)->i_sb;
+
+	switch (cmd) {
+	case FITRIM:
+		if (!capable(CAP_SYS_ADMIN)) {
+			return -EPERM;
+		}
+		if (copy_from_user(&range, (struct fstrim_range __user *)arg, sizeof(range))) {
+			return -EFAULT;
+		}
+		err = winterfs_trim_fs(sb, &range);
+		if (err) {
+			return err;
+		}
+		if (copy_to_user((struct fstrim_range __user *)arg, &range, sizeof(range))) {
+			return -EFAULT;
+		}
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
 const struct file_operations winterfs_file_operations = {
-	.fsync		= generic_file_fsync,
-	.llseek         = generic_file_llseek,
-	.mmap		= generic_file_mmap,
+	.compat_ioctl	= compat_ptr_ioctl,
+	.fallocate	= winterfs_fallocate,
+	.fsync		= winterfs_fsync,
+	.llseek         = winterfs_file_llseek,
+	.mmap		= winterfs_file_mmap,
 	.open		= generic_file_open,
         .read_iter      = generic_file_read_iter,
-        .write_iter     = generic_file_write_iter
+	.unlocked_ioctl	= winterfs_ioctl,
+        .write_iter     = winterfs_file_write_iter
 };
 
 const struct address_space_operations winterfs_address_operations = {
 	.readahead		= winterfs_read_ahead,
 	.read_folio		= winterfs_read_folio,
-	.write_begin		= winterfs_write_begin,
-	.writepage		= winterfs_write_page,
-	.write_end		= generic_write_end,
+	.writepages		= winterfs_write_pages,
+	.dirty_folio		= filemap_dirty_folio,
+	.release_folio		= iomap_release_folio,
+	.invalidate_folio	= iomap_invalidate_folio,
+	.migrate_folio		= filemap_migrate_folio,
+	.is_partially_uptodate	= iomap_is_partially_uptodate,
 	.error_remove_page	= generic_error_remove_page,
 };
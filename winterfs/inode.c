@@ -1,11 +1,17 @@
+#include <linux/bitmap.h>
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
+#include <linux/blkdev.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
 #include "winterfs.h"
 #include "winterfs_dir.h"
+#include "winterfs_discard.h"
 #include "winterfs_file.h"
 #include "winterfs_ino.h"
+#include "winterfs_map.h"
 #include "winterfs_sb.h"
+#include "winterfs_trace.h"
 
 enum winterfs_indirection_level {
 	WINTERFS_INDIRECTION_DIR = 0,
@@ -14,211 +20,960 @@ enum winterfs_indirection_level {
 	WINTERFS_INDIRECTION_IND3,
 };
 
-struct winterfs_indirect_block_list {
-	__le32 blocks[WINTERFS_BLOCK_SIZE / sizeof(__le32)];
-} __attribute__((packed));
-
-struct winterfs_indirect_block_list_info {
-	u32 blocks[WINTERFS_BLOCK_SIZE / sizeof(__le32)];
-};
-
 struct winterfs_inode_key {
 	enum winterfs_indirection_level ind_level;
-	u32 ind1;
-	u32 ind2;
-	u32 ind3;
-	u32 idx;
+	// index into each indirect block on the path, from the inode down
+	u32 offsets[WINTERFS_INDIRECTION_IND3];
+	u32 idx; // index into the direct blocks or the last indirect block
 };
 
-static void winterfs_fill_inode_key(struct winterfs_inode_key *key, u32 idx)
+static int winterfs_fill_inode_key(struct super_block *sb,
+	struct winterfs_inode_key *key, u32 block)
 {
-	if (idx < WINTERFS_NUM_BLOCK_IDX_DIRECT) {
+	u64 shift = block;
+	u32 bits = WINTERFS_PTR_SHIFT(sb);
+	u32 mask = WINTERFS_PTRS_PER_BLOCK(sb) - 1;
+
+	memset(key, 0, sizeof(struct winterfs_inode_key));
+
+	if (shift < WINTERFS_NUM_BLOCK_IDX_DIRECT) {
 		key->ind_level = WINTERFS_INDIRECTION_DIR;
-		key->idx = idx;
-        } else {
-		u32 shift = idx - WINTERFS_NUM_BLOCK_IDX_DIRECT;
-                key->idx = shift % (WINTERFS_BLOCK_SIZE / 4);
-		if (idx >= WINTERFS_NUM_BLOCK_IDX_DIRECT) {
-			key->ind_level = WINTERFS_INDIRECTION_IND1;
-			key->ind1 = shift / WINTERFS_NUM_BLOCK_IDX_IND1;
-		}
-		if (idx >= WINTERFS_NUM_BLOCK_IDX_DIRECT
-			+ WINTERFS_NUM_BLOCK_IDX_IND1) {
+		key->idx = shift;
+		return 0;
+	}
+
+	// pointers per block is a power of two, so the offsets are shifts
+	// and masks for every block size
+	shift -= WINTERFS_NUM_BLOCK_IDX_DIRECT;
+	if (shift < WINTERFS_NUM_BLOCK_IDX_IND1(sb)) {
+		key->ind_level = WINTERFS_INDIRECTION_IND1;
+		key->offsets[0] = shift;
+	} else {
+		shift -= WINTERFS_NUM_BLOCK_IDX_IND1(sb);
+		if (shift < WINTERFS_NUM_BLOCK_IDX_IND2(sb)) {
 			key->ind_level = WINTERFS_INDIRECTION_IND2;
-			key->ind2 = shift / WINTERFS_NUM_BLOCK_IDX_IND2;
-		}
-		if (idx >= WINTERFS_NUM_BLOCK_IDX_DIRECT
-			+ WINTERFS_NUM_BLOCK_IDX_IND1
-			+ WINTERFS_NUM_BLOCK_IDX_IND2) {
+			key->offsets[0] = shift >> bits;
+			key->offsets[1] = shift & mask;
+		} else {
+			shift -= WINTERFS_NUM_BLOCK_IDX_IND2(sb);
+			if (shift >= WINTERFS_NUM_BLOCK_IDX_IND3(sb)) {
+				return -EFBIG;
+			}
 			key->ind_level = WINTERFS_INDIRECTION_IND3;
-			key->ind3 = shift / WINTERFS_NUM_BLOCK_IDX_IND3;
-		} 
+			key->offsets[0] = shift >> (2 * bits);
+			key->offsets[1] = (shift >> bits) & mask;
+			key->offsets[2] = shift & mask;
+		}
+	}
+	key->idx = key->offsets[key->ind_level - 1];
+
+	return 0;
+}
+
+// the inode's pointer to the top indirect block of a key's tree
+static u32 *winterfs_indirect_root(struct winterfs_inode_info *wfs_info,
+	enum winterfs_indirection_level ind_level)
+{
+	switch (ind_level) {
+	case WINTERFS_INDIRECTION_IND1:
+		return &wfs_info->indirect_primary;
+	case WINTERFS_INDIRECTION_IND2:
+		return &wfs_info->indirect_secondary;
+	default:
+		return &wfs_info->indirect_tertiary;
+	}
+}
+
+/*
+ * Walk down to the indirect block holding a key's pointer, through the
+ * inode's map cache. *leaf is 0 if part of the path is not allocated.
+ * map_cache.lock must be held.
+ */
+static int winterfs_indirect_leaf(struct inode *inode,
+	struct winterfs_inode_key *key, u32 *leaf)
+{
+	u32 level;
+	u32 *ptrs;
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+	u32 node = *winterfs_indirect_root(wfs_info, key->ind_level);
+
+	for (level = 0; node && level + 1 < key->ind_level; level++) {
+		ptrs = winterfs_map_cache_get(inode->i_sb, &wfs_info->map_cache, node);
+		if (IS_ERR(ptrs)) {
+			return PTR_ERR(ptrs);
+		}
+		node = ptrs[key->offsets[level]];
 	}
+	*leaf = node;
+
+	return 0;
+}
+
+/*
+ * Map a revision 1 file block to its data block, and count in *count how
+ * many of the following blocks (at most max_blocks) are contiguous on
+ * disk. Returns 0 for a hole, with *count blocks of it ahead, or with
+ * *count 0 if the block could not be mapped at all. map_cache.lock must
+ * be held.
+ */
+static u32 __winterfs_map_block(struct inode *inode, u32 block, u32 max_blocks,
+	u32 *count)
+{
+	u32 i;
+	u32 idx;
+	u32 leaf;
+	u32 limit;
+	u32 *ptrs;
+	struct winterfs_inode_key key;
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+
+	*count = 0;
+	if (winterfs_fill_inode_key(inode->i_sb, &key, block)) {
+		return 0;
+	}
+
+	if (key.ind_level == WINTERFS_INDIRECTION_DIR) {
+		ptrs = wfs_info->direct_blocks;
+		limit = WINTERFS_NUM_BLOCK_IDX_DIRECT;
+	} else {
+		if (winterfs_indirect_leaf(inode, &key, &leaf)) {
+			return 0;
+		}
+		if (!leaf) {
+			// no indirect block yet, so everything it would map is a hole
+			*count = min_t(u32, max_blocks, WINTERFS_PTRS_PER_BLOCK(inode->i_sb) - key.idx);
+			return 0;
+		}
+		ptrs = winterfs_map_cache_get(inode->i_sb, &wfs_info->map_cache, leaf);
+		if (IS_ERR(ptrs)) {
+			return 0;
+		}
+		limit = WINTERFS_PTRS_PER_BLOCK(inode->i_sb);
+	}
+
+	max_blocks = min_t(u32, max_blocks, limit - key.idx);
+	idx = ptrs[key.idx];
+	if (!idx) {
+		for (i = 1; i < max_blocks && !ptrs[key.idx + i]; i++);
+		*count = i;
+		return 0;
+	}
+
+	for (i = 1; i < max_blocks && ptrs[key.idx + i] == idx + i; i++);
+	*count = i;
+
+	return idx;
 }
 
 u32 winterfs_inode_num_blocks(struct inode *inode)
 {
-	return (inode->i_size / WINTERFS_BLOCK_SIZE) + ((inode->i_size % WINTERFS_BLOCK_SIZE) != 0);
+	return (inode->i_size >> inode->i_blkbits)
+		+ ((inode->i_size & (i_blocksize(inode) - 1)) != 0);
 }
 
 u32 winterfs_get_inode_block_idx(struct inode *inode, u32 block) 
 {
 	u32 inode_num_blocks;
 	u32 idx = 0;
-	struct winterfs_inode_key key;
+	u32 len = 0;
+	u32 mapped_block = 0;
 	struct super_block *sb = inode->i_sb;
 	struct winterfs_sb_info *sbi = sb->s_fs_info;
-	struct winterfs_inode_info *wfs_info = inode->i_private;
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
 	u32 data_blocks_idx = sbi->data_blocks_idx;
+	u64 start = trace_winterfs_get_inode_block_idx_enabled() ? ktime_get_ns() : 0;
 
-	memset(&key, 0, sizeof(struct winterfs_inode_key));
+	inode_num_blocks = winterfs_inode_num_blocks(inode);
+	if (block >= inode_num_blocks) {
+		printk(KERN_ERR "Inode block index out of bounds\n");
+		goto out;
+	}
 
-	if (!wfs_info) {
-		printk(KERN_ERR "Attempt to read data from improperly loaded inode\n");
+	if (winterfs_has_extents(sb)) {
+		idx = winterfs_extent_lookup(&wfs_info->extent_map, block, &len, NULL);
+	} else {
+		mutex_lock(&wfs_info->map_cache.lock);
+		idx = __winterfs_map_block(inode, block, 1, &len);
+		mutex_unlock(&wfs_info->map_cache.lock);
+	}
+	if (idx) {
+		mapped_block = data_blocks_idx + idx;
+	}
+
+out:
+	trace_winterfs_get_inode_block_idx(inode, block, 1, mapped_block, len, false, start);
+	return mapped_block;
+}
+
+static u32 __winterfs_get_inode_blocks(struct inode *inode, u32 block, u32 *count,
+	bool *unwritten)
+{
+	u32 len;
+	u32 mapped_block;
+	u32 max_blocks = *count;
+	struct winterfs_sb_info *sbi = inode->i_sb->s_fs_info;
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+	struct winterfs_map_cache *mc = &wfs_info->map_cache;
+
+	if (winterfs_has_extents(inode->i_sb)) {
+		mapped_block = winterfs_extent_lookup(&wfs_info->extent_map, block, &len,
+			unwritten);
+		*count = min_t(u32, max_blocks, len);
+		return mapped_block ? sbi->data_blocks_idx + mapped_block : 0;
+	}
+
+	if (unwritten) {
+		*unwritten = false;
+	}
+
+	// the last run found usually covers the next page of a sequential read
+	mutex_lock(&mc->lock);
+	if (mc->run_len && block >= mc->run_block
+			&& block - mc->run_block < mc->run_len) {
+		mapped_block = mc->run_start + (block - mc->run_block);
+		len = mc->run_len - (block - mc->run_block);
+	} else {
+		mapped_block = __winterfs_map_block(inode, block, U32_MAX, &len);
+		if (mapped_block) {
+			mc->run_block = block;
+			mc->run_len = len;
+			mc->run_start = mapped_block;
+		}
+	}
+	mutex_unlock(&mc->lock);
+
+	*count = min_t(u32, max_blocks, len);
+
+	return mapped_block ? sbi->data_blocks_idx + mapped_block : 0;
+}
+
+/*
+ * Map a file block like winterfs_get_inode_block_idx, and also report in
+ * *count how many of the following blocks (at most the incoming *count)
+ * are contiguous on disk. For a hole 0 is returned and *count is the
+ * length of the hole, or 0 if the block could not be mapped at all.
+ * *unwritten, when given, is set for preallocated blocks.
+ */
+u32 winterfs_get_inode_blocks(struct inode *inode, u32 block, u32 *count,
+	bool *unwritten)
+{
+	u32 mapped_block;
+	u32 max_blocks = *count;
+	u64 start = trace_winterfs_get_inode_blocks_enabled() ? ktime_get_ns() : 0;
+
+	mapped_block = __winterfs_get_inode_blocks(inode, block, count, unwritten);
+	trace_winterfs_get_inode_blocks(inode, block, max_blocks, mapped_block, *count,
+		mapped_block && unwritten && *unwritten, start);
+
+	return mapped_block;
+}
+
+// point count entries of an indirect block, from idx on, at the run from
+// start, or clear them when start is 0
+static int winterfs_set_indirect_ptrs(struct inode *inode, u32 node, u32 idx,
+	u32 start, u32 count)
+{
+	u32 i;
+	struct buffer_head *bh;
+	__le32 *list;
+	struct super_block *sb = inode->i_sb;
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+
+	bh = sb_bread(sb, sbi->data_blocks_idx + node);
+	if (!bh) {
+		printk(KERN_ERR "Error reading indirect block %u\n", node);
+		return -EIO;
+	}
+	list = (__le32 *)bh->b_data;
+	for (i = 0; i < count; i++) {
+		list[idx + i] = cpu_to_le32(start ? start + i : 0);
+	}
+	mark_buffer_dirty_inode(bh, inode);
+	brelse(bh);
+
+	winterfs_map_cache_update(&wfs_info->map_cache, node, idx, start, count);
+
+	return 0;
+}
+
+int winterfs_set_inode_block_idx(struct inode *inode, u32 block, u32 idx)
+{
+	int err;
+	u32 leaf;
+	struct winterfs_inode_key key;
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+
+	err = winterfs_fill_inode_key(inode->i_sb, &key, block);
+	if (err) {
+		return err;
+	}
+
+	if (key.ind_level == WINTERFS_INDIRECTION_DIR) {
+		wfs_info->direct_blocks[block] = idx;
 		return 0;
 	}
 
-	inode_num_blocks = winterfs_inode_num_blocks(inode);
-	if (block >= inode_num_blocks) {
-		printk(KERN_ERR "Inode block index out of bounds\n");
+	mutex_lock(&wfs_info->map_cache.lock);
+	err = winterfs_indirect_leaf(inode, &key, &leaf);
+	if (!err && !leaf) {
+		err = -EIO;
+	}
+	if (!err) {
+		err = winterfs_set_indirect_ptrs(inode, leaf, key.idx, idx, 1);
+	}
+	mutex_unlock(&wfs_info->map_cache.lock);
+
+	return err;
+}
+
+static int winterfs_new_indirect_block(struct inode *inode, u32 goal, u32 *ind)
+{
+	struct buffer_head *bh;
+	struct super_block *sb = inode->i_sb;
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+	u32 count = 1;
+	u32 block;
+
+	block = winterfs_allocate_data_blocks(sb, goal, &count);
+	if (!block) {
+		return -ENOSPC;
+	}
+
+	bh = sb_getblk(sb, sbi->data_blocks_idx + block);
+	if (!bh) {
+		winterfs_free_data_blocks(sb, block, 1);
+		return -ENOMEM;
+	}
+	lock_buffer(bh);
+	memset(bh->b_data, 0, sb->s_blocksize);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty_inode(bh, inode);
+	brelse(bh);
+
+	*ind = block;
+	return 0;
+}
+
+/*
+ * Like winterfs_indirect_leaf, but allocate the missing indirect blocks on
+ * the way down. Each one is placed at *goal, which then moves past it, so
+ * the tree sits inline with the data it maps.
+ */
+static int winterfs_indirect_leaf_create(struct inode *inode,
+	struct winterfs_inode_key *key, u32 *goal, u32 *leaf)
+{
+	int err;
+	u32 level;
+	u32 node;
+	u32 child;
+	u32 *ptrs;
+	struct super_block *sb = inode->i_sb;
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+	u32 *root = winterfs_indirect_root(wfs_info, key->ind_level);
+
+	if (!*root) {
+		err = winterfs_new_indirect_block(inode, *goal, root);
+		if (err) {
+			return err;
+		}
+		*goal = *root + 1;
+	}
+
+	node = *root;
+	for (level = 0; level + 1 < key->ind_level; level++) {
+		ptrs = winterfs_map_cache_get(sb, &wfs_info->map_cache, node);
+		if (IS_ERR(ptrs)) {
+			return PTR_ERR(ptrs);
+		}
+		child = ptrs[key->offsets[level]];
+		if (!child) {
+			err = winterfs_new_indirect_block(inode, *goal, &child);
+			if (err) {
+				return err;
+			}
+			err = winterfs_set_indirect_ptrs(inode, node,
+				key->offsets[level], child, 1);
+			if (err) {
+				winterfs_free_data_blocks(sb, child, 1);
+				return err;
+			}
+			*goal = child + 1;
+		}
+		node = child;
+	}
+	*leaf = node;
+
+	return 0;
+}
+
+/*
+ * Map up to *count blocks of a hole starting at file block 'block'; the
+ * caller makes sure all of them are unmapped. Blocks are placed directly
+ * after the data block of the preceding file block when that space is
+ * free, so a file written in one pass stays contiguous on disk. Returns
+ * the first newly mapped device block and the number of contiguous blocks
+ * mapped in *count. Unwritten blocks read as zeroes until converted, and
+ * need an extent mapped inode.
+ */
+int winterfs_alloc_inode_blocks(struct inode *inode, u32 block, u32 *count,
+	u32 *mapped, bool unwritten)
+{
+	u32 i;
+	u32 len;
+	u32 leaf;
+	u32 first;
+	u32 goal = 0;
+	int err;
+	struct winterfs_inode_key key;
+	struct super_block *sb = inode->i_sb;
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+
+	if (winterfs_has_extents(sb)) {
+		if (block > 0) {
+			goal = winterfs_extent_lookup(&wfs_info->extent_map, block - 1,
+				&len, NULL);
+		}
+		goal = goal ? goal + 1 : winterfs_extent_goal(&wfs_info->extent_map);
+		first = winterfs_allocate_data_blocks(sb, goal, count);
+		if (!first) {
+			return -ENOSPC;
+		}
+		err = winterfs_extent_add(inode, &wfs_info->extent_map, block, first,
+			*count, unwritten);
+		if (err) {
+			winterfs_free_data_blocks(sb, first, *count);
+			return err;
+		}
+		*mapped = sbi->data_blocks_idx + first;
 		return 0;
 	}
 
-	winterfs_fill_inode_key(&key, block);
-	//printk(KERN_ERR "block: %u type: %u d: %u 1: %u 2: %u 3: %u\n", block, key.ind_level, key.idx, key.ind1, key.ind2, key.ind3);
+	if (unwritten) {
+		return -EOPNOTSUPP;
+	}
 
-	if (block < WINTERFS_NUM_BLOCK_IDX_DIRECT) {
-		idx = wfs_info->direct_blocks[block];
-	} else if (block < WINTERFS_NUM_BLOCK_IDX_DIRECT
-			 + WINTERFS_NUM_BLOCK_IDX_IND1) {
-		u8 pidx = (block * (WINTERFS_BLOCK_SIZE / 4)) / WINTERFS_BLOCK_SIZE;
-		u16 off = (block * (WINTERFS_BLOCK_SIZE / 4)) % WINTERFS_BLOCK_SIZE;
-		struct super_block *sb = inode->i_sb;
-		struct buffer_head *bh = sb_bread(sb, wfs_info->direct_blocks[pidx]);
-		if (!bh) {
-			printk(KERN_ERR "Error reading specified data block\n");
-			return idx;
+	err = winterfs_fill_inode_key(inode->i_sb, &key, block);
+	if (err) {
+		return err;
+	}
+
+	mutex_lock(&wfs_info->map_cache.lock);
+
+	if (block > 0) {
+		goal = __winterfs_map_block(inode, block - 1, 1, &len);
+		goal = goal ? goal + 1 : 0;
+	}
+
+	if (key.ind_level == WINTERFS_INDIRECTION_DIR) {
+		*count = min_t(u32, *count, WINTERFS_NUM_BLOCK_IDX_DIRECT - block);
+	} else {
+		// a run never spans two indirect blocks
+		*count = min_t(u32, *count, WINTERFS_PTRS_PER_BLOCK(sb) - key.idx);
+		err = winterfs_indirect_leaf_create(inode, &key, &goal, &leaf);
+		if (err) {
+			goto out;
 		}
-		idx = le32_to_cpu(*((__le32 *)bh->b_data+off));
-		brelse(bh);
-	// TODO
-	} else if (block < WINTERFS_NUM_BLOCK_IDX_DIRECT
-			 + WINTERFS_NUM_BLOCK_IDX_IND1
-			 + WINTERFS_NUM_BLOCK_IDX_IND2) {
+	}
 
-	} else if (block < WINTERFS_NUM_BLOCK_IDX_DIRECT
-			 + WINTERFS_NUM_BLOCK_IDX_IND1
-			 + WINTERFS_NUM_BLOCK_IDX_IND2
-			 + WINTERFS_NUM_BLOCK_IDX_IND3) {
+	first = winterfs_allocate_data_blocks(sb, goal, count);
+	if (!first) {
+		err = -ENOSPC;
+		goto out;
 	}
 
-	return data_blocks_idx + idx;
+	if (key.ind_level == WINTERFS_INDIRECTION_DIR) {
+		for (i = 0; i < *count; i++) {
+			wfs_info->direct_blocks[block + i] = first + i;
+		}
+	} else {
+		err = winterfs_set_indirect_ptrs(inode, leaf, key.idx, first, *count);
+		if (err) {
+			winterfs_free_data_blocks(sb, first, *count);
+			goto out;
+		}
+	}
+
+	*mapped = sbi->data_blocks_idx + first;
+out:
+	mutex_unlock(&wfs_info->map_cache.lock);
+	return err;
+}
+
+// mark file blocks [block, end) written once their data has reached the disk
+int winterfs_convert_inode_blocks(struct inode *inode, u32 block, u32 end)
+{
+	int err;
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+
+	if (!winterfs_has_extents(inode->i_sb)) {
+		return 0;
+	}
+
+	err = winterfs_extent_mark_written(inode, &wfs_info->extent_map, block, end);
+	mark_inode_dirty(inode);
+
+	return err;
+}
+
+// move the mapping of every file block from 'block' on down by shift blocks
+int winterfs_shift_inode_blocks(struct inode *inode, u32 block, u32 shift)
+{
+	int err;
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+
+	if (!winterfs_has_extents(inode->i_sb)) {
+		return -EOPNOTSUPP;
+	}
+
+	err = winterfs_extent_shift(inode, &wfs_info->extent_map, block, shift);
+	mark_inode_dirty(inode);
+
+	return err;
+}
+
+/*
+ * Free an indirect block, and with depth > 0 the indirect blocks below
+ * it. Data blocks are left to the caller. map_cache.lock must be held.
+ */
+static void winterfs_free_indirect_tree(struct inode *inode, u32 node, u32 depth)
+{
+	u32 i;
+	u32 *ptrs;
+	u32 child;
+	struct super_block *sb = inode->i_sb;
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+
+	if (!node) {
+		return;
+	}
+
+	for (i = 0; depth && i < WINTERFS_PTRS_PER_BLOCK(sb); i++) {
+		// look the node up each time, freeing a child may evict it
+		ptrs = winterfs_map_cache_get(sb, &wfs_info->map_cache, node);
+		if (IS_ERR(ptrs)) {
+			printk(KERN_ERR "Leaking blocks below indirect block %u\n", node);
+			break;
+		}
+		child = ptrs[i];
+		if (child) {
+			winterfs_free_indirect_tree(inode, child, depth - 1);
+		}
+	}
+
+	winterfs_map_cache_forget(sb, &wfs_info->map_cache, node);
+	winterfs_free_data_blocks(sb, node, 1);
+}
+
+// return every data and indirect block of an inode to the free space index
+void winterfs_release_inode_blocks(struct inode *inode)
+{
+	u32 i;
+	u32 len;
+	u32 run_start = 0;
+	u32 run_len = 0;
+	struct super_block *sb = inode->i_sb;
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+	u32 num_blocks = winterfs_inode_num_blocks(inode);
+
+	if (winterfs_has_extents(sb)) {
+		winterfs_extent_release_all(inode, &wfs_info->extent_map);
+		return;
+	}
+
+	mutex_lock(&wfs_info->map_cache.lock);
+
+	for (i = 0; i < num_blocks; i += len) {
+		u32 block_num = __winterfs_map_block(inode, i, num_blocks - i, &len);
+
+		if (!block_num) {
+			len = max_t(u32, len, 1);
+			continue;
+		}
+		if (run_len && run_start + run_len == block_num) {
+			run_len += len;
+			continue;
+		}
+		if (run_len) {
+			winterfs_free_data_blocks(sb, run_start, run_len);
+		}
+		run_start = block_num;
+		run_len = len;
+	}
+	if (run_len) {
+		winterfs_free_data_blocks(sb, run_start, run_len);
+	}
+
+	winterfs_free_indirect_tree(inode, wfs_info->indirect_primary, 0);
+	winterfs_free_indirect_tree(inode, wfs_info->indirect_secondary, 1);
+	winterfs_free_indirect_tree(inode, wfs_info->indirect_tertiary, 2);
+	memset(wfs_info->direct_blocks, 0, sizeof(wfs_info->direct_blocks));
+	wfs_info->indirect_primary = 0;
+	wfs_info->indirect_secondary = 0;
+	wfs_info->indirect_tertiary = 0;
+	wfs_info->map_cache.run_len = 0;
+
+	mutex_unlock(&wfs_info->map_cache.lock);
+}
+
+/*
+ * Unmap and free the data blocks from file block 'from' up to 'end'.
+ * Revision 1 indirect blocks stay allocated for when the file grows
+ * again, and are freed with the inode.
+ */
+int winterfs_truncate_inode_blocks(struct inode *inode, u32 from, u32 end)
+{
+	u32 i;
+	u32 len;
+	u32 leaf;
+	struct winterfs_inode_key key;
+	struct super_block *sb = inode->i_sb;
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+
+	if (winterfs_has_extents(sb)) {
+		return winterfs_extent_remove(inode, &wfs_info->extent_map, from, end);
+	}
+
+	mutex_lock(&wfs_info->map_cache.lock);
+
+	for (i = from; i < end; i += len) {
+		u32 block_num = __winterfs_map_block(inode, i, end - i, &len);
+
+		if (!len) {
+			break;
+		}
+		if (!block_num) {
+			continue;
+		}
+
+		// a run never spans two indirect blocks
+		winterfs_fill_inode_key(sb, &key, i);
+		if (key.ind_level == WINTERFS_INDIRECTION_DIR) {
+			memset(&wfs_info->direct_blocks[i], 0, len * sizeof(u32));
+		} else if (winterfs_indirect_leaf(inode, &key, &leaf) || !leaf
+				|| winterfs_set_indirect_ptrs(inode, leaf, key.idx, 0, len)) {
+			// leave the blocks mapped rather than free them while in use
+			continue;
+		}
+		winterfs_free_data_blocks(sb, block_num, len);
+	}
+	wfs_info->map_cache.run_len = 0;
+
+	mutex_unlock(&wfs_info->map_cache.lock);
+
+	return 0;
 }
 
 u32 winterfs_allocate_data_block(struct super_block *sb)
 {
-	int i;
-	struct buffer_head *bh;
+	u32 count = 1;
+
+	return winterfs_allocate_data_blocks(sb, 0, &count);
+}
+
+/*
+ * Allocate up to *count contiguous data blocks, starting at goal if it is
+ * free. On return *count holds the number of blocks actually allocated.
+ */
+u32 winterfs_allocate_data_blocks(struct super_block *sb, u32 goal, u32 *count)
+{
+	u32 block;
+	u32 groups;
+	u32 want = *count;
 	struct winterfs_sb_info *sbi = sb->s_fs_info;
-	u32 free_block = 0;
-	u32 num_bitset_blocks = (sbi->num_blocks / (WINTERFS_BLOCK_SIZE * 8)) + ((sbi->num_blocks % (BLOCK_SIZE * 8)) != 0);
-	u32 bitset_idx = sbi->free_block_bitset_idx;
-	u32 num_bits = WINTERFS_BLOCK_SIZE * 8;
-
-        for (i = 0; i < num_bitset_blocks; i++) {
-                int zero_bit;
-                u32 idx;
-
-                idx = bitset_idx + i;
-                bh = sb_bread(sb, idx);
-                if (!bh) {
-			return 0;
+	u64 start = trace_winterfs_alloc_blocks_enabled() ? ktime_get_ns() : 0;
+
+	block = winterfs_free_space_alloc(sb, &sbi->block_space, goal, count, &groups);
+	trace_winterfs_alloc_blocks(sb, goal, want, block, *count, groups, start);
+
+	return block;
+}
+
+void winterfs_free_data_blocks(struct super_block *sb, u32 block, u32 count)
+{
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+
+	winterfs_free_space_release(sb, &sbi->block_space, block, count);
+	winterfs_discard_queue(sb, block, count);
+}
+
+int winterfs_reserve_data_blocks(struct super_block *sb, u32 count)
+{
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+	u32 keep = min_t(u32, sbi->block_space.num_bits / WINTERFS_DELALLOC_META_RATIO,
+		WINTERFS_DELALLOC_META_MAX);
+
+	if (!capable(CAP_SYS_RESOURCE)) {
+		keep += sbi->reserved_blocks;
+	}
+
+	return winterfs_free_space_reserve(&sbi->block_space, count, keep);
+}
+
+void winterfs_unreserve_data_blocks(struct super_block *sb, u32 count)
+{
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+
+	if (count) {
+		winterfs_free_space_unreserve(&sbi->block_space, count);
+	}
+}
+
+void winterfs_free_ino(struct super_block *sb, u32 ino)
+{
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+
+	winterfs_free_space_release(sb, &sbi->inode_space, ino, 1);
+}
+
+/*
+ * With WINTERFS_FEATURE_LAZY_ITABLE mkfs only zeroes the inode table of
+ * the first inode group, the rest hold whatever the device returned. A
+ * group with an inode in use has a usable table, any other group gets its
+ * slots zeroed right before its first inode is handed out.
+ */
+int winterfs_itable_setup(struct super_block *sb)
+{
+	u32 i;
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+	struct winterfs_free_space *fs = &sbi->inode_space;
+
+	mutex_init(&sbi->itable_lock);
+	if (!winterfs_has_feature(sb, WINTERFS_FEATURE_LAZY_ITABLE)) {
+		return 0;
+	}
+
+	sbi->itable_init = bitmap_zalloc(max_t(u32, fs->num_groups, 1), GFP_KERNEL);
+	if (!sbi->itable_init) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < fs->num_groups; i++) {
+		struct winterfs_free_group *g = &fs->groups[i];
+
+		if (g->free < min_t(u32, 1U << fs->group_shift, fs->num_bits - g->first)) {
+			__set_bit(i, sbi->itable_init);
 		}
+	}
+
+	return 0;
+}
 
-                zero_bit = find_first_zero_bit((unsigned long *)bh->b_data, num_bits);
-                if (zero_bit != num_bits) {
-			set_bit(zero_bit, (unsigned long *)bh->b_data);
-                        mark_buffer_dirty(bh);
-                        free_block = (i * 8 * WINTERFS_BLOCK_SIZE) + zero_bit;
-                        brelse(bh);
-                        break;
-                }
-                brelse(bh);
-        }
+void winterfs_itable_destroy(struct super_block *sb)
+{
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
 
-	return free_block;
+	bitmap_free(sbi->itable_init);
+	sbi->itable_init = NULL;
 }
 
-struct inode *winterfs_new_inode(struct super_block *sb)
+// zero the table slots of every inode in a group
+static int winterfs_itable_zero_group(struct super_block *sb, u32 group)
+{
+	u64 pos;
+	u64 end;
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+	struct winterfs_free_space *fs = &sbi->inode_space;
+	u32 first = max_t(u32, group << fs->group_shift, 1);
+	u32 last = min_t(u64, ((u64)group + 1) << fs->group_shift, fs->num_bits);
+
+	pos = (u64)(first - 1) * sbi->inode_size;
+	end = (u64)(last - 1) * sbi->inode_size;
+	while (pos < end) {
+		struct buffer_head *bh;
+		u32 block = WINTERFS_INODES_BLOCK_IDX + (pos >> sb->s_blocksize_bits);
+		u32 off = pos & (sb->s_blocksize - 1);
+		u32 len = min_t(u64, sb->s_blocksize - off, end - pos);
+
+		// the blocks at either end may be shared with the next group over
+		if (len == sb->s_blocksize) {
+			bh = sb_getblk(sb, block);
+		} else {
+			bh = sb_bread(sb, block);
+		}
+		if (!bh) {
+			printk(KERN_ERR "Error initializing inode table block %u\n", block);
+			return -EIO;
+		}
+		lock_buffer(bh);
+		memset(bh->b_data + off, 0, len);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		brelse(bh);
+		pos += len;
+	}
+
+	return 0;
+}
+
+// make sure the table slot of a newly allocated ino holds no stale data
+static int winterfs_itable_prepare(struct super_block *sb, u32 ino)
+{
+	int err = 0;
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+	u32 group = ino >> sbi->inode_space.group_shift;
+
+	if (!sbi->itable_init) {
+		return 0;
+	}
+	if (test_bit(group, sbi->itable_init)) {
+		// pairs with the barrier before set_bit below
+		smp_rmb();
+		return 0;
+	}
+
+	mutex_lock(&sbi->itable_lock);
+	if (!test_bit(group, sbi->itable_init)) {
+		err = winterfs_itable_zero_group(sb, group);
+		if (!err) {
+			smp_wmb();
+			set_bit(group, sbi->itable_init);
+		}
+	}
+	mutex_unlock(&sbi->itable_lock);
+
+	return err;
+}
+
+// bytes of data an inline inode holds, 0 when the volume has no inline data
+u32 winterfs_inline_size(struct super_block *sb)
+{
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+
+	if (!winterfs_has_feature(sb, WINTERFS_FEATURE_INLINE_DATA)) {
+		return 0;
+	}
+	return sbi->inode_size - WINTERFS_INODE_SIZE;
+}
+
+/*
+ * New files, and new directories with variable length entries, start out
+ * with their data inside the inode. They move to blocks of their own once
+ * they outgrow it, and stay there.
+ */
+static int winterfs_new_inode_inline(struct inode *inode, umode_t mode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+	u32 size = winterfs_inline_size(sb);
+
+	if (!size || !(S_ISREG(mode) || (S_ISDIR(mode)
+			&& winterfs_has_feature(sb, WINTERFS_FEATURE_DIRENT2)))) {
+		return 0;
+	}
+
+	wfs_info->inline_data = kzalloc(size, GFP_NOFS);
+	if (!wfs_info->inline_data) {
+		return -ENOMEM;
+	}
+	wfs_info->flags |= WINTERFS_INODE_INLINE_FL;
+
+	return 0;
+}
+
+/*
+ * Inode number goal for a new inode in dir. Files and subdirectories go
+ * right after their parent, so a directory's entries share inode table
+ * blocks and are read together by iget. Top level directories are spread
+ * Orlov style instead, each starting a fresh area for its own subtree.
+ */
+static u32 winterfs_new_inode_goal(struct inode *dir, umode_t mode)
+{
+	struct winterfs_sb_info *sbi = dir->i_sb->s_fs_info;
+
+	if (S_ISDIR(mode) && dir->i_ino == WINTERFS_ROOT_INODE) {
+		return winterfs_free_space_spread_goal(&sbi->inode_space);
+	}
+
+	return dir->i_ino;
+}
+
+struct inode *winterfs_new_inode(struct inode *dir, umode_t mode)
 {
-	int i;
 	int err;
-	u32 num_bits;
-	u32 bitset_idx;
 	u32 free_ino;
-	u32 num_bitset_blocks;
-	struct buffer_head *bh;
+	u32 goal;
+	u32 groups;
+	u32 count = 1;
+	struct super_block *sb = dir->i_sb;
 	struct winterfs_sb_info *sbi;
 	struct inode *inode;
-	struct winterfs_inode_info *wfs_info;
+	u64 alloc_start;
+	u64 start = trace_winterfs_new_inode_enabled() ? ktime_get_ns() : 0;
 
 	inode = new_inode(sb);
 	if (!inode) {
+		trace_winterfs_new_inode(dir, 0, mode, -ENOMEM, start);
                 return ERR_PTR(-ENOMEM);
 	}
-	wfs_info = kzalloc(sizeof(struct winterfs_inode_info), GFP_KERNEL);
-	if (!wfs_info) {
-		err = -ENOMEM;
-		goto err_inode;
-	}
-	inode->i_private = wfs_info;
 
 	sbi = sb->s_fs_info;
-	bitset_idx = sbi->free_inode_bitset_idx;
-	num_bitset_blocks = (sbi->num_inodes / (WINTERFS_BLOCK_SIZE * 8)) + ((sbi->num_inodes % (BLOCK_SIZE * 8)) != 0);
-	num_bits = 8 * WINTERFS_BLOCK_SIZE;
-
-	for (i = 0; i < num_bitset_blocks; i++) {
-		int zero_bit;
-		u32 idx;
-
-		idx = bitset_idx + i;
-		bh = sb_bread(sb, idx);
-		if (!bh) {
-			err = -EIO;
-			goto err_info;
-		}
-
-		zero_bit = find_first_zero_bit((unsigned long*)bh->b_data, num_bits);
-		if (zero_bit != num_bits) {
-			set_bit(zero_bit, (unsigned long*)bh->b_data);
-			mark_buffer_dirty(bh);
-			free_ino = (i * 8 * WINTERFS_BLOCK_SIZE) + zero_bit;
-			brelse(bh);
-			break;
-		}
-		brelse(bh);
+	goal = winterfs_new_inode_goal(dir, mode);
+	alloc_start = trace_winterfs_alloc_inodes_enabled() ? ktime_get_ns() : 0;
+	free_ino = winterfs_free_space_alloc(sb, &sbi->inode_space, goal, &count, &groups);
+	trace_winterfs_alloc_inodes(sb, goal, 1, free_ino, count, groups, alloc_start);
+	if (!free_ino) {
+		printk(KERN_ERR "Free inode not found\n");
+		err = -ENOSPC;
+		goto err_inode;
 	}
-	if (free_ino == num_bits) {
-		printk("Free inode not found\n");
-		err = -ENOMEM;
-		goto err_info;
+
+	err = winterfs_itable_prepare(sb, free_ino);
+	if (err) {
+		winterfs_free_ino(sb, free_ino);
+		goto err_inode;
 	}
 
 	inode->i_ino = free_ino;
 	insert_inode_locked(inode);
 	mark_inode_dirty(inode);
 
+	err = winterfs_new_inode_inline(inode, mode);
+	if (err) {
+		goto err_new_inode;
+	}
+
+	trace_winterfs_new_inode(dir, free_ino, mode, 0, start);
 	return inode;
 
-err_info:
-	kfree(wfs_info);
+err_new_inode:
+	// the inode is hashed & locked by now, and a bad inode keeps evict
+	// from releasing its number a second time
+	trace_winterfs_new_inode(dir, free_ino, mode, err, start);
+	winterfs_free_ino(sb, free_ino);
+	clear_nlink(inode);
+	make_bad_inode(inode);
+	discard_new_inode(inode);
+	return ERR_PTR(err);
+
 err_inode:
+	trace_winterfs_new_inode(dir, inode->i_ino, mode, err, start);
 	make_bad_inode(inode);
         iput(inode);
 	return ERR_PTR(err);
 }
 
+// copy the data of an inline inode out of its inode table slot
+static int winterfs_inline_load(struct inode *inode, struct winterfs_inode *wfs_inode)
+{
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+	u32 size = winterfs_inline_size(inode->i_sb);
+
+	if (!size || (S_ISREG(inode->i_mode) && inode->i_size > size)) {
+		printk(KERN_ERR "Corrupt inline inode %lu\n", inode->i_ino);
+		return -EIO;
+	}
+
+	wfs_info->inline_data = kmemdup((char *)wfs_inode + WINTERFS_INODE_SIZE, size, GFP_NOFS);
+	if (!wfs_info->inline_data) {
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
 struct inode *winterfs_iget(struct super_block *sb, u32 ino)
 {
 	struct inode *inode;
@@ -241,8 +996,7 @@ struct inode *winterfs_iget(struct super_block *sb, u32 ino)
 		err = PTR_ERR(wfs_inode);
 		goto cleanup;
 	}
-	wfs_info = kzalloc(sizeof(struct winterfs_inode_info), GFP_KERNEL);
-	inode->i_private = wfs_info;
+	wfs_info = WINTERFS_I(inode);
 
 	inode->i_size = le64_to_cpu(wfs_inode->size);
 	inode->i_mode = le16_to_cpu(wfs_inode->mode);
@@ -254,17 +1008,32 @@ struct inode *winterfs_iget(struct super_block *sb, u32 ino)
 	wfs_info->dir_block = le32_to_cpu(wfs_inode->dir_block);
 	wfs_info->dir_block_off = le32_to_cpu(wfs_inode->dir_block_off);
 	wfs_info->num_children = le32_to_cpu(wfs_inode->num_children);
-        for (i = 0; i < WINTERFS_INODE_DIRECT_BLOCKS; i++) {
-                wfs_info->direct_blocks[i] = le32_to_cpu(wfs_inode->direct_blocks[i]);
-        }
-	wfs_info->indirect_primary = le32_to_cpu(wfs_inode->indirect_primary);
-        wfs_info->indirect_secondary = le32_to_cpu(wfs_inode->indirect_secondary);
-        wfs_info->indirect_tertiary = le32_to_cpu(wfs_inode->indirect_tertiary);
+	wfs_info->flags = le32_to_cpu(wfs_inode->flags);
+	if (wfs_info->flags & WINTERFS_INODE_INLINE_FL) {
+		err = winterfs_inline_load(inode, wfs_inode);
+		if (err) {
+			goto cleanup;
+		}
+	} else if (winterfs_has_extents(sb)) {
+		err = winterfs_extent_map_load(inode, &wfs_info->extent_map,
+			&wfs_inode->extent_root);
+		if (err) {
+			goto cleanup;
+		}
+	} else {
+		for (i = 0; i < WINTERFS_INODE_DIRECT_BLOCKS; i++) {
+			wfs_info->direct_blocks[i] = le32_to_cpu(wfs_inode->direct_blocks[i]);
+		}
+		wfs_info->indirect_primary = le32_to_cpu(wfs_inode->indirect_primary);
+		wfs_info->indirect_secondary = le32_to_cpu(wfs_inode->indirect_secondary);
+		wfs_info->indirect_tertiary = le32_to_cpu(wfs_inode->indirect_tertiary);
+	}
 
 	if (S_ISREG(inode->i_mode)) {
                 inode->i_op = &winterfs_file_inode_operations;
                 inode->i_fop = &winterfs_file_operations;
 		inode->i_mapping->a_ops = &winterfs_address_operations;
+		mapping_set_large_folios(inode->i_mapping);
 	} else if (S_ISDIR(inode->i_mode)) {
                 inode->i_op = &winterfs_dir_inode_operations;
                 inode->i_fop = &winterfs_dir_operations;
@@ -285,16 +1054,75 @@ cleanup:
 	return ERR_PTR(err);
 }
 
+// device block of the inode table that holds ino
+static u32 winterfs_inode_table_block(struct super_block *sb, u32 ino)
+{
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+
+	return WINTERFS_INODES_BLOCK_IDX
+		+ (((u64)(ino - 1) * sbi->inode_size) >> sb->s_blocksize_bits);
+}
+
+static int winterfs_block_cmp(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a;
+	u32 y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Start reading the inode table blocks holding up to
+ * WINTERFS_INODE_READAHEAD inodes, each block once and in one plugged
+ * batch, so a stat of every entry of a cold directory waits on a few
+ * large reads instead of one small read per block in turn.
+ */
+void winterfs_inode_readahead(struct super_block *sb, const u32 *inos, u32 count)
+{
+	u32 i;
+	u32 n = 0;
+	u32 blocks[WINTERFS_INODE_READAHEAD];
+	struct blk_plug plug;
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+
+	for (i = 0; i < min_t(u32, count, WINTERFS_INODE_READAHEAD); i++) {
+		if (inos[i] && inos[i] < sbi->num_inodes) {
+			blocks[n++] = winterfs_inode_table_block(sb, inos[i]);
+		}
+	}
+	sort(blocks, n, sizeof(u32), winterfs_block_cmp, NULL);
+
+	blk_start_plug(&plug);
+	for (i = 0; i < n; i++) {
+		if (i == 0 || blocks[i] != blocks[i - 1]) {
+			sb_breadahead(sb, blocks[i]);
+		}
+	}
+	blk_finish_plug(&plug);
+}
+
+// whether the inode table block holding ino is already in memory
+bool winterfs_inode_cached(struct super_block *sb, u32 ino)
+{
+	bool cached;
+	struct buffer_head *bh;
+
+	bh = sb_find_get_block(sb, winterfs_inode_table_block(sb, ino));
+	cached = bh && buffer_uptodate(bh);
+	brelse(bh);
+
+	return cached;
+}
+
 struct winterfs_inode *winterfs_get_inode(struct super_block *sb, ino_t ino, struct buffer_head **bh_out)
 {
 	struct buffer_head *bh;
-	u32 inode_block; 	
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
 	u32 inode_block_idx;
-	u16 offset; 
+	u32 offset;
 
-	inode_block = ((ino-1) * WINTERFS_INODE_SIZE) / WINTERFS_BLOCK_SIZE;
-	inode_block_idx = inode_block + WINTERFS_INODES_BLOCK_IDX;
-	offset = ((ino-1) * WINTERFS_INODE_SIZE) % WINTERFS_BLOCK_SIZE;
+	inode_block_idx = winterfs_inode_table_block(sb, ino);
+	offset = ((u64)(ino - 1) * sbi->inode_size) & (sb->s_blocksize - 1);
 
 	bh = sb_bread(sb, inode_block_idx);
 	if (!bh) {
@@ -306,20 +1134,22 @@ struct winterfs_inode *winterfs_get_inode(struct super_block *sb, ino_t ino, str
 	return (struct winterfs_inode *) (bh->b_data + offset);
 }
 
-int __winterfs_write_inode(struct inode *inode)
+/*
+ * Copy the inode into its inode table block. With sync the block is
+ * also written out & waited on, for fsync and sync(2).
+ */
+int __winterfs_write_inode(struct inode *inode, bool sync)
 {
 	int i;
+	int err = 0;
 	struct buffer_head *bh;
 	struct winterfs_inode *wfs_inode;
 	struct winterfs_inode_info *wfs_info;
 	struct super_block *sb = inode->i_sb;
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
 	u32 ino = inode->i_ino;
 
-	wfs_info = inode->i_private;
-	if (!wfs_info) {
-		printk(KERN_ERR "Attempt to save invalid inode: ino %d\n", ino);
-		return -EINVAL;
-	}
+	wfs_info = WINTERFS_I(inode);
 
 	wfs_inode = winterfs_get_inode(sb, ino, &bh);
 	if (IS_ERR(wfs_inode)) {
@@ -336,25 +1166,140 @@ int __winterfs_write_inode(struct inode *inode)
 	wfs_inode->dir_block = cpu_to_le32(wfs_info->dir_block);
 	wfs_inode->dir_block_off = cpu_to_le32(wfs_info->dir_block_off);
 	wfs_inode->num_children = cpu_to_le32(wfs_info->num_children);
-	for (i = 0; i < WINTERFS_INODE_DIRECT_BLOCKS; i++) {
-		wfs_inode->direct_blocks[i] = cpu_to_le32(wfs_info->direct_blocks[i]);
+	wfs_inode->flags = cpu_to_le32(wfs_info->flags);
+	if (winterfs_has_extents(sb)) {
+		winterfs_extent_map_store(inode, &wfs_info->extent_map, &wfs_inode->extent_root);
+	} else {
+		for (i = 0; i < WINTERFS_INODE_DIRECT_BLOCKS; i++) {
+			wfs_inode->direct_blocks[i] = cpu_to_le32(wfs_info->direct_blocks[i]);
+		}
+		wfs_inode->indirect_primary = cpu_to_le32(wfs_info->indirect_primary);
+		wfs_inode->indirect_secondary = cpu_to_le32(wfs_info->indirect_secondary);
+		wfs_inode->indirect_tertiary = cpu_to_le32(wfs_info->indirect_tertiary);
+	}
+	// an inode that moved out to blocks leaves no stale data behind
+	if (wfs_info->flags & WINTERFS_INODE_INLINE_FL) {
+		memcpy((char *)wfs_inode + WINTERFS_INODE_SIZE, wfs_info->inline_data,
+			winterfs_inline_size(sb));
+	} else {
+		memset((char *)wfs_inode + WINTERFS_INODE_SIZE, 0,
+			sbi->inode_size - WINTERFS_INODE_SIZE);
 	}
-	wfs_inode->indirect_primary = cpu_to_le32(wfs_info->indirect_primary);
-	wfs_inode->indirect_secondary = cpu_to_le32(wfs_info->indirect_secondary);
-	wfs_inode->indirect_tertiary = cpu_to_le32(wfs_info->indirect_tertiary);
 
 	mark_buffer_dirty(bh);
+	if (sync) {
+		sync_dirty_buffer(bh);
+		if (!buffer_uptodate(bh)) {
+			printk(KERN_ERR "Error writing inode %u\n", ino);
+			err = -EIO;
+		}
+	}
 	brelse(bh);
 
-	return 0;
+	return err;
 }
 
 int winterfs_write_inode(struct inode *inode, struct writeback_control *wbc)
 {
-	return __winterfs_write_inode(inode);
+	int err;
+	u64 start = trace_winterfs_write_inode_enabled() ? ktime_get_ns() : 0;
+
+	err = __winterfs_write_inode(inode, wbc->sync_mode == WB_SYNC_ALL);
+	trace_winterfs_write_inode(inode, wbc->sync_mode == WB_SYNC_ALL, err, start);
+
+	return err;
+}
+
+static struct kmem_cache *winterfs_inode_cachep;
+
+static void winterfs_inode_init_once(void *obj)
+{
+	struct winterfs_inode_info *wfs_info = obj;
+
+	inode_init_once(&wfs_info->vfs_inode);
+}
+
+int winterfs_init_inode_cache(void)
+{
+	winterfs_inode_cachep = kmem_cache_create("winterfs_inode_cache",
+		sizeof(struct winterfs_inode_info), 0,
+		SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD | SLAB_ACCOUNT,
+		winterfs_inode_init_once);
+	if (!winterfs_inode_cachep) {
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void winterfs_destroy_inode_cache(void)
+{
+	// inodes are freed after an RCU grace period
+	rcu_barrier();
+	kmem_cache_destroy(winterfs_inode_cachep);
+}
+
+struct inode *winterfs_alloc_inode(struct super_block *sb)
+{
+	struct winterfs_inode_info *wfs_info;
+
+	wfs_info = alloc_inode_sb(sb, winterfs_inode_cachep, GFP_KERNEL);
+	if (!wfs_info) {
+		return NULL;
+	}
+
+	memset(wfs_info->direct_blocks, 0, sizeof(wfs_info->direct_blocks));
+	wfs_info->indirect_primary = 0;
+	wfs_info->indirect_secondary = 0;
+	wfs_info->indirect_tertiary = 0;
+	wfs_info->dir_block = 0;
+	wfs_info->dir_block_off = 0;
+	wfs_info->num_children = 0;
+	wfs_info->flags = 0;
+	wfs_info->reserved_blocks = 0;
+	xa_init(&wfs_info->delalloc);
+	mutex_init(&wfs_info->alloc_lock);
+	INIT_LIST_HEAD(&wfs_info->end_io_list);
+	spin_lock_init(&wfs_info->end_io_lock);
+	INIT_WORK(&wfs_info->end_io_work, winterfs_end_io_work);
+	winterfs_extent_map_init(&wfs_info->extent_map);
+	winterfs_map_cache_init(&wfs_info->map_cache);
+	wfs_info->inline_data = NULL;
+
+	return &wfs_info->vfs_inode;
 }
 
 void winterfs_free_inode(struct inode *inode)
 {
-	// TODO
+	kmem_cache_free(winterfs_inode_cachep, WINTERFS_I(inode));
+}
+
+void winterfs_evict_inode(struct inode *inode)
+{
+	struct winterfs_inode_info *wfs_info = WINTERFS_I(inode);
+
+	truncate_inode_pages_final(&inode->i_data);
+	// the conversion work can still be running once writeback has ended
+	flush_work(&wfs_info->end_io_work);
+
+	// dirty pages dropped above never got their blocks, so a file deleted
+	// before writeback leaves the bitsets untouched
+	winterfs_unreserve_data_blocks(inode->i_sb, wfs_info->reserved_blocks);
+	wfs_info->reserved_blocks = 0;
+	xa_destroy(&wfs_info->delalloc);
+
+	// the last link went away while the file was open, so its blocks
+	// and inode number are only released once nothing references it
+	if (!inode->i_nlink && !is_bad_inode(inode)) {
+		winterfs_release_inode_blocks(inode);
+		winterfs_free_ino(inode->i_sb, inode->i_ino);
+	}
+
+	invalidate_inode_buffers(inode);
+	clear_inode(inode);
+
+	winterfs_extent_map_destroy(&wfs_info->extent_map);
+	winterfs_map_cache_destroy(inode->i_sb, &wfs_info->map_cache);
+	kfree(wfs_info->inline_data);
+	wfs_info->inline_data = NULL;
 }
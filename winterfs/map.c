@@ -0,0 +1,230 @@
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+#include "winterfs.h"
+#include "winterfs_map.h"
+#include "winterfs_sb.h"
+
+void winterfs_map_cache_init(struct winterfs_map_cache *mc)
+{
+	memset(mc, 0, sizeof(struct winterfs_map_cache));
+	mutex_init(&mc->lock);
+	INIT_LIST_HEAD(&mc->list);
+}
+
+static void winterfs_map_node_drop(struct winterfs_map_cache_list *mcl,
+	struct winterfs_map_node *node)
+{
+	if (node->ptrs) {
+		kfree(node->ptrs);
+		atomic_long_dec(&mcl->num_nodes);
+	}
+	node->ptrs = NULL;
+	node->block = 0;
+}
+
+// drop every cached node, returns the number freed. mc->lock must be held
+static unsigned long winterfs_map_cache_drop(struct winterfs_map_cache_list *mcl,
+	struct winterfs_map_cache *mc)
+{
+	int i;
+	unsigned long freed = 0;
+
+	for (i = 0; i < WINTERFS_MAP_CACHE_NODES; i++) {
+		if (mc->nodes[i].ptrs) {
+			freed++;
+		}
+		winterfs_map_node_drop(mcl, &mc->nodes[i]);
+	}
+	mc->run_len = 0;
+
+	return freed;
+}
+
+void winterfs_map_cache_destroy(struct super_block *sb, struct winterfs_map_cache *mc)
+{
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+	struct winterfs_map_cache_list *mcl = &sbi->map_caches;
+
+	mutex_lock(&mc->lock);
+	winterfs_map_cache_drop(mcl, mc);
+	if (!list_empty(&mc->list)) {
+		spin_lock(&mcl->lock);
+		list_del_init(&mc->list);
+		spin_unlock(&mcl->lock);
+	}
+	mutex_unlock(&mc->lock);
+}
+
+/*
+ * Return the decoded pointers of indirect block 'block', reading it into
+ * the least recently used slot on a miss. mc->lock must be held, and the
+ * array is only valid until it is released.
+ */
+u32 *winterfs_map_cache_get(struct super_block *sb, struct winterfs_map_cache *mc,
+	u32 block)
+{
+	int i;
+	__le32 *list;
+	struct buffer_head *bh;
+	struct winterfs_map_node *node;
+	struct winterfs_map_node *victim = NULL;
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+	struct winterfs_map_cache_list *mcl = &sbi->map_caches;
+
+	lockdep_assert_held(&mc->lock);
+
+	for (i = 0; i < WINTERFS_MAP_CACHE_NODES; i++) {
+		node = &mc->nodes[i];
+		if (node->block == block && node->ptrs) {
+			node->last_used = ++mc->tick;
+			return node->ptrs;
+		}
+		if (!victim || (victim->block && (!node->block
+				|| node->last_used < victim->last_used))) {
+			victim = node;
+		}
+	}
+
+	bh = sb_bread(sb, sbi->data_blocks_idx + block);
+	if (!bh) {
+		printk(KERN_ERR "Error reading indirect block %u\n", block);
+		return ERR_PTR(-EIO);
+	}
+
+	if (!victim->ptrs) {
+		victim->ptrs = kmalloc(sb->s_blocksize, GFP_NOFS);
+		if (!victim->ptrs) {
+			brelse(bh);
+			return ERR_PTR(-ENOMEM);
+		}
+		atomic_long_inc(&mcl->num_nodes);
+	}
+
+	list = (__le32 *)bh->b_data;
+	for (i = 0; i < WINTERFS_PTRS_PER_BLOCK(sb); i++) {
+		victim->ptrs[i] = le32_to_cpu(list[i]);
+	}
+	brelse(bh);
+	victim->block = block;
+	victim->last_used = ++mc->tick;
+
+	if (list_empty(&mc->list)) {
+		spin_lock(&mcl->lock);
+		list_add_tail(&mc->list, &mcl->caches);
+		spin_unlock(&mcl->lock);
+	}
+
+	return victim->ptrs;
+}
+
+/*
+ * Keep a cached copy of indirect block 'block' in step with count of its
+ * pointers, from idx on, being set to the run starting at start.
+ */
+void winterfs_map_cache_update(struct winterfs_map_cache *mc, u32 block, u32 idx,
+	u32 start, u32 count)
+{
+	u32 i;
+	int n;
+
+	lockdep_assert_held(&mc->lock);
+
+	for (n = 0; n < WINTERFS_MAP_CACHE_NODES; n++) {
+		if (mc->nodes[n].block != block || !mc->nodes[n].ptrs) {
+			continue;
+		}
+		for (i = 0; i < count; i++) {
+			mc->nodes[n].ptrs[idx + i] = start ? start + i : 0;
+		}
+	}
+	mc->run_len = 0;
+}
+
+// drop the cached copy of an indirect block that is being freed
+void winterfs_map_cache_forget(struct super_block *sb, struct winterfs_map_cache *mc,
+	u32 block)
+{
+	int i;
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+
+	lockdep_assert_held(&mc->lock);
+
+	for (i = 0; i < WINTERFS_MAP_CACHE_NODES; i++) {
+		if (mc->nodes[i].block == block) {
+			winterfs_map_node_drop(&sbi->map_caches, &mc->nodes[i]);
+		}
+	}
+	mc->run_len = 0;
+}
+
+static unsigned long winterfs_map_shrink_count(struct shrinker *shrink,
+	struct shrink_control *sc)
+{
+	struct winterfs_map_cache_list *mcl =
+		container_of(shrink, struct winterfs_map_cache_list, shrinker);
+
+	return atomic_long_read(&mcl->num_nodes);
+}
+
+/*
+ * Caches join the list when they first read a node, so the oldest users
+ * are dropped first. Inodes busy mapping blocks are skipped rather than
+ * waited on.
+ */
+static unsigned long winterfs_map_shrink_scan(struct shrinker *shrink,
+	struct shrink_control *sc)
+{
+	unsigned long freed = 0;
+	struct winterfs_map_cache *mc;
+	struct winterfs_map_cache *tmp;
+	struct winterfs_map_cache_list *mcl =
+		container_of(shrink, struct winterfs_map_cache_list, shrinker);
+
+	spin_lock(&mcl->lock);
+	list_for_each_entry_safe(mc, tmp, &mcl->caches, list) {
+		if (freed >= sc->nr_to_scan) {
+			break;
+		}
+		if (!mutex_trylock(&mc->lock)) {
+			continue;
+		}
+		freed += winterfs_map_cache_drop(mcl, mc);
+		list_del_init(&mc->list);
+		mutex_unlock(&mc->lock);
+	}
+	spin_unlock(&mcl->lock);
+
+	return freed;
+}
+
+int winterfs_map_cache_list_init(struct super_block *sb)
+{
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+	struct winterfs_map_cache_list *mcl = &sbi->map_caches;
+
+	spin_lock_init(&mcl->lock);
+	INIT_LIST_HEAD(&mcl->caches);
+	atomic_long_set(&mcl->num_nodes, 0);
+	mcl->shrinker.count_objects = winterfs_map_shrink_count;
+	mcl->shrinker.scan_objects = winterfs_map_shrink_scan;
+	mcl->shrinker.seeks = DEFAULT_SEEKS;
+
+	return register_shrinker(&mcl->shrinker, "winterfs-map:%s", sb->s_id);
+}
+
+void winterfs_map_cache_list_destroy(struct super_block *sb)
+{
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+	struct winterfs_map_cache_list *mcl = &sbi->map_caches;
+	struct winterfs_map_cache *mc;
+	struct winterfs_map_cache *tmp;
+
+	unregister_shrinker(&mcl->shrinker);
+
+	list_for_each_entry_safe(mc, tmp, &mcl->caches, list) {
+		winterfs_map_cache_drop(mcl, mc);
+		list_del_init(&mc->list);
+	}
+}
@@ -1,31 +1,259 @@
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/init.h>
+#include <linux/log2.h>
 #include <linux/module.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/statfs.h>
+#include <linux/workqueue.h>
 #include "winterfs.h"
 #include "winterfs_dir.h"
 #include "winterfs_ino.h"
 #include "winterfs_sb.h"
 
+// the tracepoints are defined once, here
+#define CREATE_TRACE_POINTS
+#include "winterfs_trace.h"
+
+/*
+ * Write the free counts and the mount state to the on-disk superblock.
+ * The counts are for fsck and df of an unmounted volume, and are current
+ * only if state says clean. Mounting recounts them from the bitsets.
+ */
+static void winterfs_commit_super(struct super_block *sb, u32 state, int wait)
+{
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+	struct buffer_head *sb_buf = sbi->sb_buf;
+	struct winterfs_superblock *ws = (struct winterfs_superblock *)sb_buf->b_data;
+
+	lock_buffer(sb_buf);
+	ws->free_blocks = cpu_to_le32(percpu_counter_sum_positive(&sbi->block_space.free_count));
+	ws->free_inodes = cpu_to_le32(percpu_counter_sum_positive(&sbi->inode_space.free_count));
+	ws->state = cpu_to_le32(state);
+	unlock_buffer(sb_buf);
+	mark_buffer_dirty(sb_buf);
+	if (wait) {
+		sync_dirty_buffer(sb_buf);
+	}
+}
+
+static int winterfs_sync_fs(struct super_block *sb, int wait)
+{
+	if (!sb_rdonly(sb)) {
+		winterfs_commit_super(sb, 0, wait);
+	}
+
+	return 0;
+}
+
+static int winterfs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+	s64 free_blocks;
+	struct super_block *sb = dentry->d_sb;
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+
+	// blocks promised to dirty pages are as good as used
+	free_blocks = percpu_counter_read_positive(&sbi->block_space.free_count)
+		- READ_ONCE(sbi->block_space.reserved);
+
+	buf->f_type = WINTERFS_MAGIC;
+	buf->f_bsize = sb->s_blocksize;
+	buf->f_blocks = sbi->block_space.num_bits;
+	buf->f_bfree = max_t(s64, free_blocks, 0);
+	buf->f_bavail = max_t(s64, free_blocks - sbi->reserved_blocks, 0);
+	buf->f_files = sbi->inode_space.num_bits;
+	buf->f_ffree = percpu_counter_read_positive(&sbi->inode_space.free_count);
+	buf->f_namelen = WINTERFS_FILENAME_MAX_LEN - 1;
+	buf->f_fsid = u64_to_fsid(huge_encode_dev(sb->s_bdev->bd_dev));
+
+	return 0;
+}
+
 static void winterfs_put_super(struct super_block *sb)
 {
 	struct winterfs_sb_info *sbi;
 
 	sbi = sb->s_fs_info;
+	if (!sb_rdonly(sb)) {
+		winterfs_commit_super(sb, WINTERFS_STATE_CLEAN, 1);
+	}
+	destroy_workqueue(sbi->end_io_wq);
+	winterfs_discard_destroy(sb);
+	winterfs_map_cache_list_destroy(sb);
+	winterfs_itable_destroy(sb);
+	winterfs_free_space_destroy(&sbi->inode_space);
+	winterfs_free_space_destroy(&sbi->block_space);
 	brelse(sbi->sb_buf);
 	kfree(sbi);
 }
 
+enum {
+	Opt_discard,
+	Opt_nodiscard,
+	Opt_err,
+};
+
+static const match_table_t winterfs_tokens = {
+	{ Opt_discard, "discard" },
+	{ Opt_nodiscard, "nodiscard" },
+	{ Opt_err, NULL },
+};
+
+static int winterfs_parse_options(struct super_block *sb, char *options)
+{
+	char *p;
+	substring_t args[MAX_OPT_ARGS];
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+	u32 opts = sbi->mount_opts;
+
+	while (options && (p = strsep(&options, ",")) != NULL) {
+		if (!*p) {
+			continue;
+		}
+		switch (match_token(p, winterfs_tokens, args)) {
+		case Opt_discard:
+			opts |= WINTERFS_MOUNT_DISCARD;
+			break;
+		case Opt_nodiscard:
+			opts &= ~WINTERFS_MOUNT_DISCARD;
+			break;
+		default:
+			printk(KERN_ERR "winterfs: unknown mount option \"%s\"\n", p);
+			return -EINVAL;
+		}
+	}
+
+	if ((opts & WINTERFS_MOUNT_DISCARD) && !bdev_max_discard_sectors(sb->s_bdev)) {
+		printk(KERN_WARNING "winterfs: device does not support discard, ignoring it\n");
+		opts &= ~WINTERFS_MOUNT_DISCARD;
+	}
+
+	WRITE_ONCE(sbi->mount_opts, opts);
+	return 0;
+}
+
+static int winterfs_remount(struct super_block *sb, int *flags, char *data)
+{
+	int err;
+
+	sync_filesystem(sb);
+	err = winterfs_parse_options(sb, data);
+	if (err) {
+		return err;
+	}
+
+	if (!(*flags & SB_RDONLY) == !sb_rdonly(sb)) {
+		return 0;
+	}
+	if (*flags & SB_RDONLY) {
+		// everything was just synced and nothing is written from here on
+		winterfs_commit_super(sb, WINTERFS_STATE_CLEAN, 1);
+	} else {
+		winterfs_commit_super(sb, 0, 1);
+	}
+
+	return 0;
+}
+
+static int winterfs_show_options(struct seq_file *seq, struct dentry *root)
+{
+	if (winterfs_has_mount_opt(root->d_sb, WINTERFS_MOUNT_DISCARD)) {
+		seq_puts(seq, ",discard");
+	}
+
+	return 0;
+}
+
 const static struct super_operations winterfs_super_operations = {
+	.alloc_inode = winterfs_alloc_inode,
+	.free_inode = winterfs_free_inode,
+	.evict_inode = winterfs_evict_inode,
 	.put_super = winterfs_put_super,
-	.statfs = simple_statfs,
+	.sync_fs = winterfs_sync_fs,
+	.statfs = winterfs_statfs,
+	.remount_fs = winterfs_remount,
+	.show_options = winterfs_show_options,
 	.write_inode = winterfs_write_inode
 };
 
+/*
+ * Read the superblock, which starts block 0 whatever the block size of
+ * the volume, then switch the device over to that block size and read it
+ * again. Blocks can't be larger than a page for the buffer cache.
+ */
+static int winterfs_read_super(struct super_block *sb, struct buffer_head **bh_out)
+{
+	u32 block_size = WINTERFS_BLOCK_SIZE;
+	struct buffer_head *bh;
+	struct winterfs_superblock *ws;
+
+	if (!sb_set_blocksize(sb, WINTERFS_BLOCK_SIZE)) {
+		printk(KERN_ERR "Error setting block size %u\n", WINTERFS_BLOCK_SIZE);
+		return -EINVAL;
+	}
+	bh = sb_bread(sb, WINTERFS_SUPERBLOCK_BLOCK_IDX);
+	if (!bh) {
+		printk(KERN_ERR "Error reading superblock from disk");
+		return -EIO;
+	}
+
+	ws = (struct winterfs_superblock *)bh->b_data;
+	if (be32_to_cpu(ws->magic) == WINTERFS_MAGIC
+		&& (le32_to_cpu(ws->features) & WINTERFS_FEATURE_BLOCK_SIZE)) {
+		block_size = le32_to_cpu(ws->block_size);
+	}
+	if (block_size == WINTERFS_BLOCK_SIZE) {
+		*bh_out = bh;
+		return 0;
+	}
+	brelse(bh);
+
+	if (block_size < WINTERFS_MIN_BLOCK_SIZE || block_size > WINTERFS_MAX_BLOCK_SIZE
+		|| !is_power_of_2(block_size)) {
+		printk(KERN_ERR "Unsupported winterfs block size %u\n", block_size);
+		return -EINVAL;
+	}
+	if (block_size > PAGE_SIZE) {
+		printk(KERN_ERR "Block size %u is larger than the page size %lu\n",
+			block_size, PAGE_SIZE);
+		return -EINVAL;
+	}
+	if (!sb_set_blocksize(sb, block_size)) {
+		printk(KERN_ERR "Error setting block size %u\n", block_size);
+		return -EINVAL;
+	}
+	bh = sb_bread(sb, WINTERFS_SUPERBLOCK_BLOCK_IDX);
+	if (!bh) {
+		printk(KERN_ERR "Error reading superblock from disk");
+		return -EIO;
+	}
+
+	*bh_out = bh;
+	return 0;
+}
+
+// largest file the block pointers can map, extents keep to the same limit
+static loff_t winterfs_max_file_size(struct super_block *sb)
+{
+	u64 blocks = WINTERFS_NUM_BLOCK_IDX_DIRECT
+		+ WINTERFS_NUM_BLOCK_IDX_IND1(sb)
+		+ WINTERFS_NUM_BLOCK_IDX_IND2(sb)
+		+ WINTERFS_NUM_BLOCK_IDX_IND3(sb);
+
+	// file block numbers are 32 bits
+	blocks = min_t(u64, blocks, U32_MAX);
+
+	return min_t(u64, blocks << sb->s_blocksize_bits, MAX_LFS_FILESIZE);
+}
+
 static int winterfs_fill_super(struct super_block *sb, void *data, int silent)
 {
 	int ret;
+	u32 state;
+	u32 free_blocks;
+	u32 free_inodes;
 	struct buffer_head *sb_buf;
 	struct winterfs_superblock *ws;
 	struct winterfs_sb_info *sbi;
@@ -33,16 +261,21 @@ static int winterfs_fill_super(struct super_block *sb, void *data, int silent)
 
 	sbi = kzalloc(sizeof(struct winterfs_sb_info), GFP_KERNEL);
 	if (!sbi) {
-		return ENOMEM;
+		return -ENOMEM;
 	}
 
 	spin_lock_init(&(sbi->s_lock));
 	sbi->vfs_sb = sb;
 	sb->s_fs_info = sbi;
+	winterfs_discard_init(sb);
 
-	sb_buf = sb_bread(sb, WINTERFS_SUPERBLOCK_BLOCK_IDX);
-	if (!sb_buf) {
-		printk(KERN_ERR "Error reading superblock from disk");
+	ret = winterfs_parse_options(sb, data);
+	if (ret) {
+		goto err;
+	}
+
+	ret = winterfs_read_super(sb, &sb_buf);
+	if (ret) {
 		goto err;
 	}
 
@@ -54,24 +287,134 @@ static int winterfs_fill_super(struct super_block *sb, void *data, int silent)
 	sbi->free_block_bitset_idx = le32_to_cpu(ws->free_block_bitset_idx);
 	sbi->bad_block_bitset_idx = le32_to_cpu(ws->bad_block_bitset_idx);
 	sbi->data_blocks_idx = le32_to_cpu(ws->data_blocks_idx);
+	sbi->revision = le32_to_cpu(ws->revision);
+	if (sbi->revision == 0) {
+		sbi->revision = WINTERFS_REVISION_V1;
+	}
+	sbi->features = le32_to_cpu(ws->features);
+	sbi->hash_key.key[0] = le32_to_cpu(ws->hash_key[0])
+		| (u64)le32_to_cpu(ws->hash_key[1]) << 32;
+	sbi->hash_key.key[1] = le32_to_cpu(ws->hash_key[2])
+		| (u64)le32_to_cpu(ws->hash_key[3]) << 32;
+	sbi->inode_size = WINTERFS_INODE_SIZE;
+	if (sbi->features & WINTERFS_FEATURE_LARGE_INODE) {
+		sbi->inode_size = le32_to_cpu(ws->inode_size);
+	}
+	if (sbi->features & WINTERFS_FEATURE_RESERVED) {
+		sbi->reserved_blocks = le32_to_cpu(ws->reserved_blocks);
+	}
+	state = le32_to_cpu(ws->state);
 
 	sb->s_magic 		= be32_to_cpu(ws->magic);
-	sb->s_maxbytes 		= WINTERFS_MAX_FILE_SIZE;
-	sb->s_blocksize 	= WINTERFS_BLOCK_SIZE;
-	sb->s_blocksize_bits 	= 12;
+	sb->s_maxbytes 		= winterfs_max_file_size(sb);
 	sb->s_op		= &winterfs_super_operations;
 	sb->s_time_gran		= WINTERFS_TIME_RES; // 1 sec
 	strcpy(sb->s_id, "winterfs");
 
 	if (sb->s_magic != WINTERFS_MAGIC) {
 		ret = -EINVAL;
-                goto err;
+                goto err_buf;
+	}
+
+	if (sbi->revision > WINTERFS_REVISION_CURRENT) {
+		printk(KERN_ERR "Unsupported winterfs revision %u\n", sbi->revision);
+		ret = -EINVAL;
+		goto err_buf;
+	}
+
+	if (sbi->features & ~WINTERFS_FEATURE_SUPPORTED) {
+		printk(KERN_ERR "Unsupported winterfs features 0x%x\n",
+			sbi->features & ~WINTERFS_FEATURE_SUPPORTED);
+		ret = -EINVAL;
+		goto err_buf;
+	}
+
+	if ((sbi->features & WINTERFS_FEATURE_UNWRITTEN)
+		&& sbi->revision < WINTERFS_REVISION_V2) {
+		printk(KERN_ERR "Unwritten extents need winterfs revision 2\n");
+		ret = -EINVAL;
+		goto err_buf;
+	}
+
+	// the fixed size entry blocks predate other block sizes
+	if (!(sbi->features & WINTERFS_FEATURE_DIRENT2)
+		&& sb->s_blocksize != WINTERFS_MIN_BLOCK_SIZE) {
+		printk(KERN_ERR "Block size %lu needs variable length directory entries\n",
+			sb->s_blocksize);
+		ret = -EINVAL;
+		goto err_buf;
+	}
+
+	if (sbi->inode_size < WINTERFS_INODE_SIZE || sbi->inode_size > WINTERFS_INODE_SIZE_MAX
+		|| !is_power_of_2(sbi->inode_size)) {
+		printk(KERN_ERR "Unsupported winterfs inode size %u\n", sbi->inode_size);
+		ret = -EINVAL;
+		goto err_buf;
+	}
+
+	// inline data lives in the space past the fixed fields
+	if ((sbi->features & WINTERFS_FEATURE_INLINE_DATA)
+		&& sbi->inode_size == WINTERFS_INODE_SIZE) {
+		printk(KERN_ERR "Inline data needs inodes larger than %u bytes\n",
+			WINTERFS_INODE_SIZE);
+		ret = -EINVAL;
+		goto err_buf;
+	}
+
+	// older mkfs builds sized the inode bitset by inode table blocks, so
+	// never index past the start of the block bitset
+	ret = winterfs_free_space_init(sb, &sbi->inode_space,
+		sbi->free_inode_bitset_idx,
+		min_t(u32, sbi->num_inodes,
+			(sbi->free_block_bitset_idx - sbi->free_inode_bitset_idx)
+			* WINTERFS_BITS_PER_BITSET_BLOCK(sb)));
+	if (ret) {
+		printk(KERN_ERR "Error indexing free inodes\n");
+		goto err_buf;
+	}
+
+	ret = winterfs_free_space_init(sb, &sbi->block_space,
+		sbi->free_block_bitset_idx, sbi->num_blocks - sbi->data_blocks_idx);
+	if (ret) {
+		printk(KERN_ERR "Error indexing free blocks\n");
+		goto err_inode_space;
+	}
+
+	ret = winterfs_itable_setup(sb);
+	if (ret) {
+		goto err_block_space;
+	}
+
+	ret = winterfs_map_cache_list_init(sb);
+	if (ret) {
+		goto err_itable;
+	}
+
+	// every bitset was just read to index the free space, so the counts
+	// come from there. Saved counts that disagree after a clean unmount
+	// point at a bug rather than a crash
+	free_blocks = percpu_counter_sum(&sbi->block_space.free_count);
+	free_inodes = percpu_counter_sum(&sbi->inode_space.free_count);
+	if ((state & WINTERFS_STATE_CLEAN)
+		&& (le32_to_cpu(ws->free_blocks) != free_blocks
+			|| le32_to_cpu(ws->free_inodes) != free_inodes)) {
+		printk(KERN_WARNING "winterfs: saved free counts %u/%u, bitsets say %u/%u\n",
+			le32_to_cpu(ws->free_blocks), le32_to_cpu(ws->free_inodes),
+			free_blocks, free_inodes);
+	}
+
+	// write completions must make progress under memory pressure
+	sbi->end_io_wq = alloc_workqueue("winterfs-endio/%s", WQ_MEM_RECLAIM, 0,
+		sb->s_id);
+	if (!sbi->end_io_wq) {
+		ret = -ENOMEM;
+		goto err_map_caches;
 	}
 
 	root = winterfs_iget(sb, WINTERFS_ROOT_INODE);
         if (IS_ERR(root)) {
                 ret = PTR_ERR(root);
-                goto err;
+                goto err_wq;
         }
 
 	inode_init_owner(&init_user_ns, root, NULL, S_IFDIR | 0755);
@@ -80,10 +423,28 @@ static int winterfs_fill_super(struct super_block *sb, void *data, int silent)
         if (!sb->s_root) {
                 printk(KERN_ERR "Get root inode failed\n");
                 ret = -ENOMEM;
-                goto err;
+                goto err_wq;
         }
 
+	// until put_super or a remount read-only marks it clean again, a
+	// crash leaves the volume to be checked by fsck
+	if (!sb_rdonly(sb)) {
+		winterfs_commit_super(sb, 0, 1);
+	}
+
 	return 0;
+err_wq:
+	destroy_workqueue(sbi->end_io_wq);
+err_map_caches:
+	winterfs_map_cache_list_destroy(sb);
+err_itable:
+	winterfs_itable_destroy(sb);
+err_block_space:
+	winterfs_free_space_destroy(&sbi->block_space);
+err_inode_space:
+	winterfs_free_space_destroy(&sbi->inode_space);
+err_buf:
+	brelse(sb_buf);
 err:
 	sb->s_fs_info = NULL;
 	kfree(sbi);
@@ -108,11 +469,21 @@ static int __init init_winterfs_fs(void)
 {
 	int err;
 
-	BUILD_BUG_ON(sizeof(struct winterfs_superblock) > WINTERFS_BLOCK_SIZE);
+	BUILD_BUG_ON(sizeof(struct winterfs_superblock) > WINTERFS_MIN_BLOCK_SIZE);
 	BUILD_BUG_ON(sizeof(struct winterfs_inode) != WINTERFS_INODE_SIZE);
-	BUILD_BUG_ON(sizeof(struct winterfs_dir_block) != WINTERFS_BLOCK_SIZE);
+	BUILD_BUG_ON(sizeof(struct winterfs_dir_block) != WINTERFS_MIN_BLOCK_SIZE);
+	BUILD_BUG_ON(sizeof(struct winterfs_extent_root) !=
+		sizeof(__le32) * (WINTERFS_INODE_DIRECT_BLOCKS + 3));
+
+	err = winterfs_init_inode_cache();
+	if (err) {
+		return err;
+	}
 
 	err = register_filesystem(&winterfs_fs_type);
+	if (err) {
+		winterfs_destroy_inode_cache();
+	}
 
 	return err;
 }
@@ -120,6 +491,7 @@ static int __init init_winterfs_fs(void)
 static void __exit exit_winterfs_fs(void)
 {
 	unregister_filesystem(&winterfs_fs_type);
+	winterfs_destroy_inode_cache();
 }
 
 module_init(init_winterfs_fs)
@@ -1,6 +1,9 @@
 #ifndef WINTERFS
 #define WINTERFS
 
-#define WINTERFS_BLOCK_SIZE 	4096
+// block size of a volume is set by mkfs, and kept in the superblock
+#define WINTERFS_BLOCK_SIZE 	4096 // default, & the size of the superblock's block
+#define WINTERFS_MIN_BLOCK_SIZE	4096
+#define WINTERFS_MAX_BLOCK_SIZE	65536
 
 #endif // WINTERFS
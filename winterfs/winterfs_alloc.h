@@ -0,0 +1,66 @@
+#ifndef WINTERFS_ALLOC
+#define WINTERFS_ALLOC
+
+#include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/percpu_counter.h>
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+#include "winterfs.h"
+
+// log2 of the bits one bitset block holds
+#define WINTERFS_BITSET_SHIFT(sb)	((sb)->s_blocksize_bits + 3)
+#define WINTERFS_BITS_PER_BITSET_BLOCK(sb)	(1U << WINTERFS_BITSET_SHIFT(sb))
+
+// log2 of the bits per allocation group, a quarter of a bitset block
+#define WINTERFS_GROUP_SHIFT(sb)	(WINTERFS_BITSET_SHIFT(sb) - 2)
+
+// run of free bits, linked into both trees of a winterfs_free_group
+struct winterfs_free_extent {
+	struct rb_node off_node;
+	struct rb_node size_node;
+	u32 start;
+	u32 len;
+};
+
+// one allocation group of a bitset, with its own index and lock
+struct winterfs_free_group {
+	u32 first; // first bit
+	u32 free;
+	u32 cursor; // next-fit position
+	u32 max_run; // longest free extent, read without the lock as a hint
+	struct rb_root by_off; // free extents keyed by start
+	struct rb_root by_size; // free extents keyed by (len, start)
+	struct mutex lock;
+} ____cacheline_aligned_in_smp;
+
+// in-memory index over one on-disk free bitset, built at mount time
+struct winterfs_free_space {
+	u32 bitset_idx; // first bitset block on disk
+	u32 num_bitset_blocks;
+	u32 num_bits;
+	u32 num_groups;
+	u32 bitset_shift; // WINTERFS_BITSET_SHIFT of the volume
+	u32 group_shift; // WINTERFS_GROUP_SHIFT of the volume
+	struct winterfs_free_group *groups;
+	struct percpu_counter free_count; // free bits over all groups
+	u32 reserved; // promised to delayed allocations, still counted in free
+	spinlock_t reserve_lock;
+};
+
+int winterfs_free_space_init(struct super_block *sb,
+	struct winterfs_free_space *fs, u32 bitset_idx, u32 num_bits);
+void winterfs_free_space_destroy(struct winterfs_free_space *fs);
+u32 winterfs_free_space_alloc(struct super_block *sb,
+	struct winterfs_free_space *fs, u32 goal, u32 *len, u32 *groups);
+u32 winterfs_free_space_spread_goal(struct winterfs_free_space *fs);
+void winterfs_free_space_release(struct super_block *sb,
+	struct winterfs_free_space *fs, u32 start, u32 len);
+s64 winterfs_free_space_trim(struct super_block *sb,
+	struct winterfs_free_space *fs, u32 base, u32 start, u32 end, u32 minlen);
+int winterfs_free_space_reserve(struct winterfs_free_space *fs, u32 len,
+	u32 keep);
+void winterfs_free_space_unreserve(struct winterfs_free_space *fs, u32 len);
+
+#endif // WINTERFS_ALLOC
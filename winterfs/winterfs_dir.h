@@ -7,12 +7,14 @@
 #include "winterfs_ino.h"
 
 #define WINTERFS_FILENAME_MAX_LEN	256
-#define WINTERFS_FILES_PER_DIR_BLOCK	(WINTERFS_BLOCK_SIZE / WINTERFS_FILENAME_MAX_LEN) - 1
+// the entry block format without dirent2 only exists in 4K blocks
+#define WINTERFS_FILES_PER_DIR_BLOCK	(WINTERFS_MIN_BLOCK_SIZE / WINTERFS_FILENAME_MAX_LEN) - 1
 
 struct winterfs_filename {
 	u8 name[WINTERFS_FILENAME_MAX_LEN];
 } __attribute__((packed));
 
+// entry block used without WINTERFS_FEATURE_DIRENT2
 struct winterfs_dir_block {
 	__le32 inode_list[WINTERFS_FILES_PER_DIR_BLOCK];
 	u8 pad[WINTERFS_FILENAME_MAX_LEN - (sizeof(__le32) * 
@@ -20,17 +22,103 @@ struct winterfs_dir_block {
 	struct winterfs_filename files[WINTERFS_FILES_PER_DIR_BLOCK];
 } __attribute__((packed));
 
-struct winterfs_dir_block_info {
-	u32 inode_list[WINTERFS_FILES_PER_DIR_BLOCK];
-	struct winterfs_dir_block *db;
-	struct buffer_head *bh;
+/*
+ * Entry block used with WINTERFS_FEATURE_DIRENT2, a chain of records that
+ * covers the whole block. Free space is the slack at the end of a record,
+ * and a removed entry is merged into the record before it.
+ */
+struct winterfs_dirent {
+	__le32 inode;
+	__le16 rec_len; // bytes up to the next record, see winterfs_rec_len_from_disk
+	u8 name_len;
+	u8 file_type;
+	char name[];
+} __attribute__((packed));
+
+#define WINTERFS_DIRENT_LEN(name_len)	\
+	ALIGN(sizeof(struct winterfs_dirent) + (name_len), 4)
+
+/*
+ * Records are 4-byte aligned, so the two low bits of rec_len carry bits
+ * 16 & 17 of the length. That lets a single free record span a whole
+ * 64K block, and reads the same as a plain length in smaller blocks.
+ */
+static inline u32 winterfs_rec_len_from_disk(__le16 dlen)
+{
+	u32 len = le16_to_cpu(dlen);
+
+	return (len & 0xfffc) | ((len & 3) << 16);
+}
+
+static inline __le16 winterfs_rec_len_to_disk(u32 len)
+{
+	return cpu_to_le16((len & 0xfffc) | ((len >> 16) & 3));
+}
+
+// readdir position of the entry at 'off' in file block 'block', for
+// directories not listed in hash order
+#define WINTERFS_DIR_POS(sb, block, off)	\
+	(2 + ((loff_t)(block) << (sb)->s_blocksize_bits) + (off))
+
+// directory blocks read ahead by readdir
+#define WINTERFS_DIR_READAHEAD		16
+
+// most entries a block of either format can hold
+#define WINTERFS_DIRENTS_PER_BLOCK(sb)	\
+	((sb)->s_blocksize / WINTERFS_DIRENT_LEN(1))
+
+/*
+ * Directories that outgrow one block get a hash index when the volume has
+ * WINTERFS_FEATURE_DIR_INDEX. File block 0 then holds the index root,
+ * which maps name hashes either straight to entry blocks or, one level
+ * deeper, to index nodes that do. Names are hashed with siphash under the
+ * volume's secret hash_key, so colliding names can't be made up offline.
+ * Entries with the same hash normally share an entry block, so a lookup
+ * reads a single one. When one hash fills a block anyway, the rest go to
+ * the blocks following it in the index, whose keys have WINTERFS_DX_CONT
+ * set. Hashes themselves always have that bit clear.
+ */
+#define WINTERFS_DX_MAGIC		0x5844
+#define WINTERFS_DX_MAX_LEVELS		1 // index levels below the root
+#define WINTERFS_DX_CONT		1 // key bit, the block continues the hash before it
+
+// on-disk structures
+struct winterfs_dx_header {
+	__le16 magic;
+	__le16 levels; // root only
+	__le16 count;
+	__le16 limit;
+} __attribute__((packed));
+
+struct winterfs_dx_entry {
+	__le32 hash; // lowest hash mapped by the block
+	__le32 block; // file block within the directory
+} __attribute__((packed));
+
+#define WINTERFS_DX_ENTRIES(sb)	\
+	(((sb)->s_blocksize - sizeof(struct winterfs_dx_header)) \
+	/ sizeof(struct winterfs_dx_entry))
+
+// fills a block, WINTERFS_DX_ENTRIES(sb) entries follow the header
+struct winterfs_dx_node {
+	struct winterfs_dx_header header;
+	struct winterfs_dx_entry entries[];
+} __attribute__((packed));
+
+// in-memory structures
+
+// an entry as read from a block of either format
+struct winterfs_dir_entry {
+	u32 ino; // 0 for a free record
+	u32 off; // slot, or byte offset of the record
+	u32 next; // position of the following entry
+	u8 name_len;
+	u8 file_type;
+	const char *name;
 };
 
 extern const struct file_operations winterfs_dir_operations;
 
-void winterfs_free_dir_block_info(struct winterfs_dir_block_info *wdbi, bool dirty);
-struct winterfs_filename *winterfs_dir_block_filename(
-	struct winterfs_dir_block_info *dbi, u8 idx);
 int winterfs_dir_link_inode(struct dentry *dent, struct inode *inode);
 
 #endif // WINTERFS_DIR
@@ -0,0 +1,36 @@
+#ifndef WINTERFS_DISCARD
+#define WINTERFS_DISCARD
+
+#include <linux/fs.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+#include <linux/workqueue.h>
+#include "winterfs.h"
+
+// freed ranges are batched for this long before they are discarded
+#define WINTERFS_DISCARD_DELAY		(5 * HZ)
+// pending ranges that trigger a discard without waiting out the delay
+#define WINTERFS_DISCARD_BATCH		1024
+
+// run of freed data blocks waiting to be discarded
+struct winterfs_discard_range {
+	struct list_head list;
+	u32 start;
+	u32 len;
+};
+
+// per superblock queue of freed ranges, used with the discard mount option
+struct winterfs_discard_queue {
+	spinlock_t lock;
+	struct list_head ranges;
+	u32 count;
+	struct delayed_work work;
+};
+
+void winterfs_discard_init(struct super_block *sb);
+void winterfs_discard_destroy(struct super_block *sb);
+void winterfs_discard_queue(struct super_block *sb, u32 block, u32 count);
+int winterfs_trim_fs(struct super_block *sb, struct fstrim_range *range);
+
+#endif // WINTERFS_DISCARD
@@ -0,0 +1,102 @@
+#ifndef WINTERFS_EXTENT
+#define WINTERFS_EXTENT
+
+#include <linux/fs.h>
+#include <linux/rwsem.h>
+#include <linux/types.h>
+#include "winterfs.h"
+
+#define WINTERFS_EXTENT_MAGIC		0x5745
+
+// extents held directly in the inode, before a tree is needed
+#define WINTERFS_INODE_EXTENTS		3
+// depth of the tree below the inode, enough for ~118M extents per file,
+// or ~15M with every node only half full
+#define WINTERFS_EXTENT_MAX_DEPTH	3
+#define WINTERFS_EXTENT_MAX_LEN		0x7fffffff
+// set in an extent's len when its blocks are allocated but read as zeroes
+#define WINTERFS_EXTENT_UNWRITTEN	0x80000000
+
+#define WINTERFS_EXTENTS_PER_BLOCK(sb)	\
+	(((sb)->s_blocksize - sizeof(struct winterfs_extent_header)) \
+	/ sizeof(struct winterfs_extent))
+
+// on-disk structures
+struct winterfs_extent_header {
+	__le16 magic;
+	__le16 entries;
+	__le16 max;
+	__le16 depth; // 0 when the entries are extents, else index entries
+} __attribute__((packed));
+
+struct winterfs_extent {
+	__le32 block; // first file block
+	__le32 len; // with WINTERFS_EXTENT_UNWRITTEN for preallocated blocks
+	__le32 start; // first data block
+} __attribute__((packed));
+
+struct winterfs_extent_idx {
+	__le32 block; // first file block mapped by the child node
+	__le32 child; // data block holding the child node
+	__le32 reserved;
+} __attribute__((packed));
+
+// tree root, stored in the inode in place of the block pointers
+struct winterfs_extent_root {
+	struct winterfs_extent_header header;
+	struct winterfs_extent extents[WINTERFS_INODE_EXTENTS];
+} __attribute__((packed));
+
+// in-memory structures
+struct winterfs_mem_extent {
+	u32 block;
+	u32 len;
+	u32 start;
+	bool unwritten;
+};
+
+/*
+ * Every extent of a file is kept sorted in memory, so a lookup is one
+ * binary search. The on-disk tree is a B+tree over that array: each leaf
+ * holds a run of it, and each index node a run of the level below. Nodes
+ * fill up and split independently, so a change only rewrites the nodes
+ * on its path.
+ */
+struct winterfs_extent_map {
+	struct rw_semaphore lock;
+	struct winterfs_mem_extent *ext;
+	u32 count;
+	u32 capacity;
+	u32 hint; // last extent found, sequential lookups check it first
+	u16 depth;
+	// tree blocks below the root, level 0 holds the leaves
+	u32 *nodes[WINTERFS_EXTENT_MAX_DEPTH];
+	// first entry of each node, an extent for a leaf, else a node one level down
+	u32 *first[WINTERFS_EXTENT_MAX_DEPTH];
+	u32 num_nodes[WINTERFS_EXTENT_MAX_DEPTH];
+	u32 node_capacity[WINTERFS_EXTENT_MAX_DEPTH];
+	// blocks taken ahead of a change for the nodes it splits off
+	u32 spare[WINTERFS_EXTENT_MAX_DEPTH];
+	u16 num_spare;
+};
+
+void winterfs_extent_map_init(struct winterfs_extent_map *map);
+void winterfs_extent_map_destroy(struct winterfs_extent_map *map);
+int winterfs_extent_map_load(struct inode *inode, struct winterfs_extent_map *map,
+	struct winterfs_extent_root *root);
+void winterfs_extent_map_store(struct inode *inode, struct winterfs_extent_map *map,
+	struct winterfs_extent_root *root);
+u32 winterfs_extent_lookup(struct winterfs_extent_map *map, u32 block, u32 *len,
+	bool *unwritten);
+u32 winterfs_extent_goal(struct winterfs_extent_map *map);
+int winterfs_extent_add(struct inode *inode, struct winterfs_extent_map *map,
+	u32 block, u32 start, u32 len, bool unwritten);
+int winterfs_extent_remove(struct inode *inode, struct winterfs_extent_map *map,
+	u32 block, u32 end);
+int winterfs_extent_mark_written(struct inode *inode, struct winterfs_extent_map *map,
+	u32 block, u32 end);
+int winterfs_extent_shift(struct inode *inode, struct winterfs_extent_map *map,
+	u32 block, u32 shift);
+void winterfs_extent_release_all(struct inode *inode, struct winterfs_extent_map *map);
+
+#endif // WINTERFS_EXTENT
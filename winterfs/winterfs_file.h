@@ -2,8 +2,14 @@
 #define WINTERFS_FILE
 
 #include <linux/fs.h>
+#include <linux/iomap.h>
+#include <linux/workqueue.h>
 
 extern const struct file_operations winterfs_file_operations;
 extern const struct address_space_operations winterfs_address_operations;
+extern const struct iomap_ops winterfs_iomap_ops;
+
+void winterfs_end_io_work(struct work_struct *work);
+long winterfs_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 
 #endif // WINTERFS_FILE
@@ -3,49 +3,56 @@
 
 #include <linux/types.h>
 #include <linux/fs.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
 #include "winterfs.h"
+#include "winterfs_extent.h"
+#include "winterfs_map.h"
 
 #define WINTERFS_NULL_INODE		0
 
 #define WINTERFS_DEFAULT_PERMS		0755
 
-#define WINTERFS_INODE_SIZE 		128
+#define WINTERFS_INODE_SIZE 		128 // fixed fields, & the smallest inode size
+#define WINTERFS_INODE_SIZE_MAX		1024
 #define WINTERFS_INODE_FILE 		0
 #define WINTERFS_INODE_DIR 		1
 
+// inodes whose table blocks are read ahead in one batch
+#define WINTERFS_INODE_READAHEAD	64
+
 #define WINTERFS_INODE_DIRECT_BLOCKS 	8
 
+// inode flags
+#define WINTERFS_INODE_INDEX_FL		0x0001 // directory has a hash index
+#define WINTERFS_INODE_INLINE_FL	0x0002 // data kept after the fixed fields
+
 #define WINTERFS_NUM_BLOCK_IDX_DIRECT	\
 	WINTERFS_INODE_DIRECT_BLOCKS
 
-#define WINTERFS_NUM_BLOCK_IDX_IND1	\
-	(WINTERFS_BLOCK_SIZE / 4LL) 	\
-
-#define WINTERFS_NUM_BLOCK_IDX_IND2	\
-	((WINTERFS_BLOCK_SIZE / 16LL)  	\
-	* WINTERFS_BLOCK_SIZE)
-
-#define WINTERFS_NUM_BLOCK_IDX_IND3	\
-	((WINTERFS_BLOCK_SIZE / 64LL) 	\
-	* WINTERFS_BLOCK_SIZE	 	\
-	* WINTERFS_BLOCK_SIZE)
-
-#define WINTERFS_MAX_FILE_SIZE		\
-	(WINTERFS_INODE_DIRECT_BLOCKS 	\
-	* WINTERFS_BLOCK_SIZE		\
-					\
-	+ WINTERFS_NUM_BLOCK_IDX_IND1	\
-	* WINTERFS_BLOCK_SIZE	 	\
-					\
-	+ WINTERFS_NUM_BLOCK_IDX_IND2	\
-	* WINTERFS_BLOCK_SIZE	 	\
-					\
-	+ WINTERFS_NUM_BLOCK_IDX_IND3	\
-	* WINTERFS_BLOCK_SIZE)	 	\
+// file blocks mapped below each indirect pointer of the inode
+#define WINTERFS_NUM_BLOCK_IDX_IND1(sb)	\
+	(1ULL << WINTERFS_PTR_SHIFT(sb))
+
+#define WINTERFS_NUM_BLOCK_IDX_IND2(sb)	\
+	(1ULL << (2 * WINTERFS_PTR_SHIFT(sb)))
+
+#define WINTERFS_NUM_BLOCK_IDX_IND3(sb)	\
+	(1ULL << (3 * WINTERFS_PTR_SHIFT(sb)))
+
+// delayed allocations leave 1/64th of the volume, but no more than 4096
+// blocks, for the indirect & extent blocks needed to map them, and for
+// directories
+#define WINTERFS_DELALLOC_META_RATIO	64
+#define WINTERFS_DELALLOC_META_MAX	4096
 
 #define WINTERFS_TIME_RES 		1000000 // 1 second
 
-// on-disk structure
+/*
+ * On-disk structure. Inodes larger than WINTERFS_INODE_SIZE hold the data
+ * of small files and the entries of small directories in the rest of
+ * their slot, so reading those takes nothing beyond the inode table block.
+ */
 struct winterfs_inode {
 	__le64 size; // in bytes
         __le16 mode;
@@ -57,12 +64,19 @@ struct winterfs_inode {
 	__le32 dir_block;
 	__le32 dir_block_off;
 	__le32 num_children; // only applicable for dirs
-	u8 pad[30]; // reserved for metadata
-	__le32 direct_blocks[WINTERFS_INODE_DIRECT_BLOCKS];
-	__le32 indirect_primary;
-        __le32 indirect_secondary;
-	__le32 indirect_tertiary;
-
+	__le32 flags;
+	u8 pad[26]; // reserved for metadata
+	union {
+		// revision 1
+		struct {
+			__le32 direct_blocks[WINTERFS_INODE_DIRECT_BLOCKS];
+			__le32 indirect_primary;
+			__le32 indirect_secondary;
+			__le32 indirect_tertiary;
+		} __attribute__((packed));
+		// revision 2
+		struct winterfs_extent_root extent_root;
+	};
 } __attribute__((packed));
 
 // in-memory structure
@@ -75,19 +89,63 @@ struct winterfs_inode_info {
 	u32 dir_block;
 	u32 dir_block_off;
 	u32 num_children; // only applicable for dirs
+	u32 flags;
+	u32 reserved_blocks; // delayed allocation, one per entry of delalloc
+	struct xarray delalloc; // file blocks reserved but not yet mapped
+	struct mutex alloc_lock; // guards block mapping & reservation of files
+	struct list_head end_io_list; // writes to unwritten extents, awaiting conversion
+	spinlock_t end_io_lock;
+	struct work_struct end_io_work;
+	struct winterfs_extent_map extent_map; // revision 2 only
+	struct winterfs_map_cache map_cache; // revision 1 only
+	void *inline_data; // copy of the data after the fixed fields, inline inodes only
+	struct inode vfs_inode;
 };
 
+static inline struct winterfs_inode_info *WINTERFS_I(struct inode *inode)
+{
+	return container_of(inode, struct winterfs_inode_info, vfs_inode);
+}
+
+static inline bool winterfs_inode_inline(struct inode *inode)
+{
+	return (WINTERFS_I(inode)->flags & WINTERFS_INODE_INLINE_FL) != 0;
+}
+
 extern const struct inode_operations winterfs_file_inode_operations;
 extern const struct inode_operations winterfs_dir_inode_operations;
 
 u32 winterfs_inode_num_blocks(struct inode *inode);
 u32 winterfs_get_inode_block_idx(struct inode *inode, u32 block);
-u32 winterfs_set_inode_block_idx(struct inode *inode, u32 block);
+u32 winterfs_get_inode_blocks(struct inode *inode, u32 block, u32 *count,
+	bool *unwritten);
+int winterfs_set_inode_block_idx(struct inode *inode, u32 block, u32 idx);
+int winterfs_alloc_inode_blocks(struct inode *inode, u32 block, u32 *count,
+	u32 *mapped, bool unwritten);
+int winterfs_convert_inode_blocks(struct inode *inode, u32 block, u32 end);
+int winterfs_shift_inode_blocks(struct inode *inode, u32 block, u32 shift);
+void winterfs_release_inode_blocks(struct inode *inode);
+int winterfs_truncate_inode_blocks(struct inode *inode, u32 from, u32 end);
 u32 winterfs_allocate_data_block(struct super_block *sb);
-struct inode *winterfs_new_inode(struct super_block *sb);
+u32 winterfs_allocate_data_blocks(struct super_block *sb, u32 goal, u32 *count);
+void winterfs_free_data_blocks(struct super_block *sb, u32 block, u32 count);
+int winterfs_reserve_data_blocks(struct super_block *sb, u32 count);
+void winterfs_unreserve_data_blocks(struct super_block *sb, u32 count);
+void winterfs_free_ino(struct super_block *sb, u32 ino);
+int winterfs_itable_setup(struct super_block *sb);
+void winterfs_itable_destroy(struct super_block *sb);
+u32 winterfs_inline_size(struct super_block *sb);
+struct inode *winterfs_new_inode(struct inode *dir, umode_t mode);
 struct inode *winterfs_iget (struct super_block *sb, u32 ino);
+void winterfs_inode_readahead(struct super_block *sb, const u32 *inos, u32 count);
+bool winterfs_inode_cached(struct super_block *sb, u32 ino);
 struct winterfs_inode *winterfs_get_inode(struct super_block *sb, ino_t ino, struct buffer_head **bh_out);
-int __winterfs_write_inode(struct inode *inode);
+int __winterfs_write_inode(struct inode *inode, bool sync);
 int winterfs_write_inode(struct inode *inode, struct writeback_control *wbc);
+struct inode *winterfs_alloc_inode(struct super_block *sb);
+void winterfs_free_inode(struct inode *inode);
+void winterfs_evict_inode(struct inode *inode);
+int winterfs_init_inode_cache(void);
+void winterfs_destroy_inode_cache(void);
 
 #endif // WINTERFS_INO
@@ -0,0 +1,62 @@
+#ifndef WINTERFS_MAP
+#define WINTERFS_MAP
+
+#include <linux/fs.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/shrinker.h>
+#include <linux/types.h>
+#include "winterfs.h"
+
+// log2 of the block pointers an indirect block holds
+#define WINTERFS_PTR_SHIFT(sb)		((sb)->s_blocksize_bits - 2)
+#define WINTERFS_PTRS_PER_BLOCK(sb)	(1U << WINTERFS_PTR_SHIFT(sb))
+
+// indirect blocks cached per inode, enough for a full IND3 chain and one more
+#define WINTERFS_MAP_CACHE_NODES	4
+
+// decoded copy of one indirect block
+struct winterfs_map_node {
+	u32 block; // data block of the indirect block, 0 when unused
+	u32 last_used;
+	u32 *ptrs;
+};
+
+/*
+ * Per-inode cache of the indirect chain used by the last lookups, so
+ * sequential and nearby reads of a revision 1 file resolve blocks
+ * without going through the buffer cache. The lock also serialises
+ * changes to the inode's block pointers.
+ */
+struct winterfs_map_cache {
+	struct mutex lock;
+	struct winterfs_map_node nodes[WINTERFS_MAP_CACHE_NODES];
+	u32 tick;
+	// last contiguous run found, in file and data blocks
+	u32 run_block;
+	u32 run_len;
+	u32 run_start;
+	// on the superblock's list while any node is cached
+	struct list_head list;
+};
+
+// per superblock state for the shrinker
+struct winterfs_map_cache_list {
+	spinlock_t lock;
+	struct list_head caches;
+	atomic_long_t num_nodes;
+	struct shrinker shrinker;
+};
+
+void winterfs_map_cache_init(struct winterfs_map_cache *mc);
+void winterfs_map_cache_destroy(struct super_block *sb, struct winterfs_map_cache *mc);
+u32 *winterfs_map_cache_get(struct super_block *sb, struct winterfs_map_cache *mc,
+	u32 block);
+void winterfs_map_cache_update(struct winterfs_map_cache *mc, u32 block, u32 idx,
+	u32 start, u32 count);
+void winterfs_map_cache_forget(struct super_block *sb, struct winterfs_map_cache *mc,
+	u32 block);
+int winterfs_map_cache_list_init(struct super_block *sb);
+void winterfs_map_cache_list_destroy(struct super_block *sb);
+
+#endif // WINTERFS_MAP
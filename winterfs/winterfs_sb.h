@@ -2,9 +2,13 @@
 #define WINTERFS_SB
 
 #include <linux/buffer_head.h>
+#include <linux/siphash.h>
 #include <linux/types.h>
 #include <linux/fs.h>
 #include "winterfs.h"
+#include "winterfs_alloc.h"
+#include "winterfs_discard.h"
+#include "winterfs_map.h"
 
 #define WINTERFS_MAGIC	 	0x574e4653
 
@@ -13,6 +17,32 @@
 
 #define WINTERFS_ROOT_INODE		1
 
+// older volumes leave the revision field zeroed, which reads as revision 1
+#define WINTERFS_REVISION_V1		1 // direct & indirect block pointers
+#define WINTERFS_REVISION_V2		2 // extent mapped inodes
+#define WINTERFS_REVISION_CURRENT	WINTERFS_REVISION_V2
+
+// incompatible features, all of which must be understood to mount
+#define WINTERFS_FEATURE_DIR_INDEX	0x0001 // hash indexed directories
+#define WINTERFS_FEATURE_DIRENT2	0x0002 // variable length directory entries
+#define WINTERFS_FEATURE_UNWRITTEN	0x0004 // preallocated extents, revision 2 only
+#define WINTERFS_FEATURE_LARGE_INODE	0x0008 // inode size other than 128 bytes
+#define WINTERFS_FEATURE_INLINE_DATA	0x0010 // small files & directories inside the inode
+#define WINTERFS_FEATURE_BLOCK_SIZE	0x0020 // block size other than 4096 bytes
+#define WINTERFS_FEATURE_LAZY_ITABLE	0x0040 // inode tables of unused groups left unzeroed
+#define WINTERFS_FEATURE_RESERVED	0x0080 // blocks held back for privileged users
+#define WINTERFS_FEATURE_SUPPORTED	\
+	(WINTERFS_FEATURE_DIR_INDEX | WINTERFS_FEATURE_DIRENT2 | WINTERFS_FEATURE_UNWRITTEN \
+	| WINTERFS_FEATURE_LARGE_INODE | WINTERFS_FEATURE_INLINE_DATA \
+	| WINTERFS_FEATURE_BLOCK_SIZE | WINTERFS_FEATURE_LAZY_ITABLE \
+	| WINTERFS_FEATURE_RESERVED)
+
+// mount options
+#define WINTERFS_MOUNT_DISCARD		0x0001 // pass freed blocks on to the device
+
+// superblock state flags
+#define WINTERFS_STATE_CLEAN		0x0001 // unmounted or remounted read-only cleanly, free counts current
+
 // on-disk structure
 struct winterfs_superblock {
 	__le32 magic;
@@ -22,6 +52,15 @@ struct winterfs_superblock {
 	__le32 free_block_bitset_idx;
 	__le32 bad_block_bitset_idx;
 	__le32 data_blocks_idx;
+	__le32 revision;
+	__le32 features;
+	__le32 free_blocks; // free counts as of the last commit, current while clean
+	__le32 free_inodes;
+	__le32 state;
+	__le32 inode_size; // bytes per inode table slot, with WINTERFS_FEATURE_LARGE_INODE
+	__le32 block_size; // with WINTERFS_FEATURE_BLOCK_SIZE
+	__le32 reserved_blocks; // with WINTERFS_FEATURE_RESERVED
+	__le32 hash_key[4]; // siphash key of directory name hashes, random per volume
 } __attribute__((packed));
 
 // in-memory structure
@@ -32,10 +71,48 @@ struct winterfs_sb_info {
 	u32 free_block_bitset_idx;
 	u32 bad_block_bitset_idx;
 	u32 data_blocks_idx;
+	u32 revision;
+	u32 features;
+	siphash_key_t hash_key;
+	u32 inode_size;
+	u32 reserved_blocks; // free blocks only CAP_SYS_RESOURCE may use
+	u32 mount_opts;
+
+	struct winterfs_free_space inode_space;
+	struct winterfs_free_space block_space;
+	struct winterfs_map_cache_list map_caches;
+	struct winterfs_discard_queue discards;
+
+	// lazy inode tables, inode groups whose table slots are known zeroed
+	unsigned long *itable_init;
+	struct mutex itable_lock;
+
+	struct workqueue_struct *end_io_wq; // converts unwritten extents after writes
 
 	struct super_block *vfs_sb;
 	struct buffer_head *sb_buf;
 	spinlock_t s_lock;
 };
 
+static inline bool winterfs_has_extents(struct super_block *sb)
+{
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+
+	return sbi->revision >= WINTERFS_REVISION_V2;
+}
+
+static inline bool winterfs_has_feature(struct super_block *sb, u32 feature)
+{
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+
+	return (sbi->features & feature) != 0;
+}
+
+static inline bool winterfs_has_mount_opt(struct super_block *sb, u32 opt)
+{
+	struct winterfs_sb_info *sbi = sb->s_fs_info;
+
+	return (READ_ONCE(sbi->mount_opts) & opt) != 0;
+}
+
 #endif // WINTERFS_SB
@@ -0,0 +1,257 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM winterfs
+
+// read once per event by the tracing machinery, so the guard lets
+// TRACE_HEADER_MULTI_READ through
+#if !defined(WINTERFS_TRACE) || defined(TRACE_HEADER_MULTI_READ)
+#define WINTERFS_TRACE
+
+#include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/tracepoint.h>
+#include <linux/types.h>
+
+/*
+ * Events measuring their latency take the ktime_get_ns() of their start,
+ * read only while the event is enabled. 0 means it was enabled part way,
+ * and reads as no latency.
+ */
+#define WINTERFS_TRACE_LATENCY(start)	((start) ? ktime_get_ns() - (start) : 0)
+
+// a run of file blocks mapped to data blocks, pblk 0 for a hole
+DECLARE_EVENT_CLASS(winterfs_map_class,
+	TP_PROTO(struct inode *inode, u32 lblk, u32 want, u32 pblk, u32 len, bool unwritten,
+		u64 start),
+	TP_ARGS(inode, lblk, want, pblk, len, unwritten, start),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(u32, lblk)
+		__field(u32, want)
+		__field(u32, pblk)
+		__field(u32, len)
+		__field(bool, unwritten)
+		__field(u64, latency)
+	),
+
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->lblk = lblk;
+		__entry->want = want;
+		__entry->pblk = pblk;
+		__entry->len = len;
+		__entry->unwritten = unwritten;
+		__entry->latency = WINTERFS_TRACE_LATENCY(start);
+	),
+
+	TP_printk("dev %d,%d ino %lu lblk %u want %u pblk %u len %u unwritten %d latency %llu ns",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->lblk,
+		__entry->want, __entry->pblk, __entry->len, __entry->unwritten,
+		__entry->latency)
+);
+
+DEFINE_EVENT(winterfs_map_class, winterfs_get_inode_block_idx,
+	TP_PROTO(struct inode *inode, u32 lblk, u32 want, u32 pblk, u32 len, bool unwritten,
+		u64 start),
+	TP_ARGS(inode, lblk, want, pblk, len, unwritten, start)
+);
+
+DEFINE_EVENT(winterfs_map_class, winterfs_get_inode_blocks,
+	TP_PROTO(struct inode *inode, u32 lblk, u32 want, u32 pblk, u32 len, bool unwritten,
+		u64 start),
+	TP_ARGS(inode, lblk, want, pblk, len, unwritten, start)
+);
+
+// the iomap_begin of reads, writes & writeback, in place of a get_block
+TRACE_EVENT(winterfs_iomap_begin,
+	TP_PROTO(struct inode *inode, loff_t offset, loff_t length, unsigned int flags,
+		u16 type, u64 addr, u64 mapped, int err, u64 start),
+	TP_ARGS(inode, offset, length, flags, type, addr, mapped, err, start),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(loff_t, offset)
+		__field(loff_t, length)
+		__field(unsigned int, flags)
+		__field(u16, type)
+		__field(u64, addr)
+		__field(u64, mapped)
+		__field(int, err)
+		__field(u64, latency)
+	),
+
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->offset = offset;
+		__entry->length = length;
+		__entry->flags = flags;
+		__entry->type = type;
+		__entry->addr = addr;
+		__entry->mapped = mapped;
+		__entry->err = err;
+		__entry->latency = WINTERFS_TRACE_LATENCY(start);
+	),
+
+	TP_printk("dev %d,%d ino %lu offset %lld length %lld flags 0x%x type %u addr %llu "
+		"mapped %llu err %d latency %llu ns",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->offset,
+		__entry->length, __entry->flags, __entry->type, __entry->addr, __entry->mapped,
+		__entry->err, __entry->latency)
+);
+
+/*
+ * Allocation of a run of bits from the inode or block bitset. 'groups' is
+ * how many allocation groups were searched, four to a bitset block.
+ */
+DECLARE_EVENT_CLASS(winterfs_alloc_class,
+	TP_PROTO(struct super_block *sb, u32 goal, u32 want, u32 first, u32 len, u32 groups,
+		u64 start),
+	TP_ARGS(sb, goal, want, first, len, groups, start),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u32, goal)
+		__field(u32, want)
+		__field(u32, first)
+		__field(u32, len)
+		__field(u32, groups)
+		__field(u64, latency)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->goal = goal;
+		__entry->want = want;
+		__entry->first = first;
+		__entry->len = len;
+		__entry->groups = groups;
+		__entry->latency = WINTERFS_TRACE_LATENCY(start);
+	),
+
+	TP_printk("dev %d,%d goal %u want %u first %u len %u groups %u latency %llu ns",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->goal, __entry->want,
+		__entry->first, __entry->len, __entry->groups, __entry->latency)
+);
+
+DEFINE_EVENT(winterfs_alloc_class, winterfs_alloc_blocks,
+	TP_PROTO(struct super_block *sb, u32 goal, u32 want, u32 first, u32 len, u32 groups,
+		u64 start),
+	TP_ARGS(sb, goal, want, first, len, groups, start)
+);
+
+DEFINE_EVENT(winterfs_alloc_class, winterfs_alloc_inodes,
+	TP_PROTO(struct super_block *sb, u32 goal, u32 want, u32 first, u32 len, u32 groups,
+		u64 start),
+	TP_ARGS(sb, goal, want, first, len, groups, start)
+);
+
+TRACE_EVENT(winterfs_new_inode,
+	TP_PROTO(struct inode *dir, unsigned long ino, umode_t mode, int err, u64 start),
+	TP_ARGS(dir, ino, mode, err, start),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__field(unsigned long, ino)
+		__field(umode_t, mode)
+		__field(int, err)
+		__field(u64, latency)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->ino = ino;
+		__entry->mode = mode;
+		__entry->err = err;
+		__entry->latency = WINTERFS_TRACE_LATENCY(start);
+	),
+
+	TP_printk("dev %d,%d dir %lu ino %lu mode 0%o err %d latency %llu ns",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir, __entry->ino,
+		__entry->mode, __entry->err, __entry->latency)
+);
+
+/*
+ * A name looked up in, or linked into, a directory. 'scanned' is how many
+ * directory blocks were read, index nodes included, 0 for an inline one.
+ */
+DECLARE_EVENT_CLASS(winterfs_dir_class,
+	TP_PROTO(struct inode *dir, const struct qstr *name, unsigned long ino, u32 scanned,
+		int err, u64 start),
+	TP_ARGS(dir, name, ino, scanned, err, start),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__field(unsigned long, ino)
+		__field(u32, scanned)
+		__field(int, err)
+		__field(u64, latency)
+		__string(name, name->name)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->ino = ino;
+		__entry->scanned = scanned;
+		__entry->err = err;
+		__entry->latency = WINTERFS_TRACE_LATENCY(start);
+		__assign_str(name, name->name);
+	),
+
+	TP_printk("dev %d,%d dir %lu name %s ino %lu scanned %u err %d latency %llu ns",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir, __get_str(name),
+		__entry->ino, __entry->scanned, __entry->err, __entry->latency)
+);
+
+DEFINE_EVENT(winterfs_dir_class, winterfs_lookup,
+	TP_PROTO(struct inode *dir, const struct qstr *name, unsigned long ino, u32 scanned,
+		int err, u64 start),
+	TP_ARGS(dir, name, ino, scanned, err, start)
+);
+
+DEFINE_EVENT(winterfs_dir_class, winterfs_dir_link_inode,
+	TP_PROTO(struct inode *dir, const struct qstr *name, unsigned long ino, u32 scanned,
+		int err, u64 start),
+	TP_ARGS(dir, name, ino, scanned, err, start)
+);
+
+TRACE_EVENT(winterfs_write_inode,
+	TP_PROTO(struct inode *inode, bool sync, int err, u64 start),
+	TP_ARGS(inode, sync, err, start),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(bool, sync)
+		__field(int, err)
+		__field(u64, latency)
+	),
+
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->sync = sync;
+		__entry->err = err;
+		__entry->latency = WINTERFS_TRACE_LATENCY(start);
+	),
+
+	TP_printk("dev %d,%d ino %lu sync %d err %d latency %llu ns",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->sync,
+		__entry->err, __entry->latency)
+);
+
+#endif // WINTERFS_TRACE
+
+// outside the guard, the tracing machinery includes this file by name
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE winterfs_trace
+#include <trace/define_trace.h>